@@ -19,10 +19,35 @@
 unsigned char upcase(unsigned char ulc);
 void BlockDisplay(long BlockNr, unsigned char Buffer[]);
 void fill_buffer(unsigned char buffer[], unsigned char value);
+void ShowSDStats();
+void DumpLine(unsigned int Offset, unsigned char Bytes[]);
+bool DumpSummary(long BlockNr, unsigned char Buffer[]);
+long RangeCopy(long From, long Last, long Dest);
+long RangeCompare(long From, long Last, long Other);
+long RangeFill(long From, long Last, unsigned char Value);
+void RangeProgress(long Done, int Count);
+void RangeReport(long Blocks, struct sdstats* Before);
+void CardMount();
+
+#define DUMP_FULL	0	//Every line of every block
+#define DUMP_SQUEEZE	1	//Repeated lines shown as one '*', like hexdump -C
+#define DUMP_SUMMARY	2	//As DUMP_SQUEEZE, blank and empty-chain blocks in one line
+#define DUMP_NRMODES	3
+#define DUMPHEXCOL	7	//Column of the first hex pair in DumpBuf (after the '\n')
+#define DUMPASCCOL	58	//Column of the first ASCII character
+#define DUMPLINELEN	75
+#define RANGEBATCH	2	//Blocks per buffer and command of the range copy and compare
+#define RANGEPROGRESS	256	//Blocks between two progress lines, a power of 2
+#define RANGEDIFFS	8	//Differing blocks listed by the range compare
+#define CPUMHZ		4	//6309 clock of the board, turns the cycle estimates into time
 
 
 static unsigned char BlockBuffer[512];
+static unsigned char RangeBuf[2*RANGEBATCH*512];	//Two buffers of RANGEBATCH blocks, or one batch of twice that
 unsigned char *pBootBlock = 0;
+static unsigned char DumpMode = DUMP_SQUEEZE;
+static const char HexDigits[] = "0123456789abcdef";
+static char DumpBuf[DUMPLINELEN+1] = "\n0000  00 00 00 00 00 00 00 00  00 00 00 00 00 00 00 00  |................|";
 //end global variables////////////////////////////////////////////////////////////////////
 
 long GetBlockNr();
@@ -40,33 +65,88 @@ char scratch[25];
 unsigned char Value;
 int SizeMB;
 struct csdregister CSData;
+struct scrregister SCRData;
 unsigned long CSTotalMBytes;
 unsigned long StartBlock;
+unsigned char FormatMode;
+struct s_jfsusage Usage;
+long Wrong;
+struct s_fsckstats Fsck;
+struct s_defragstats Defrag;
+char Address[5];
+unsigned int BootLoadAddr, BootExecAddr;
+long RangeFrom, RangeLast, RangeTo, RangeDone;
+struct sdstats RangeBefore;
 
 	printf ("\rSD-mon for TOM6309 SD card interface\n");
 		
 	Command='x';
 	while (Command!='Q'){
 		printf("\n\nMenu :\n====\n");
-		printf("\n B - Write @0000 to boot block");
+		printf("\n B - Boot block and boot file");
+		printf("\n C - Check file system (fsck)");
+		printf("\n D - Driver statistics");
 		printf("\n F - Format SD card with JDOS FS");
 		printf("\n I - Init");
+		printf("\n K - CRC checking on/off (CMD59)");
+		printf("\n L - List dir by path");
 		printf("\n M - Read 100 blocks...");
+		printf("\n O - Optimise (defragment)");
 		printf("\n R - Read block");
 		printf("\n S - Status / info");
+		printf("\n T - Self-test of the driver helpers");
+		printf("\n U - Verify free space counters");
+		printf("\n V - View mode for R and M");
 		printf("\n W - Write block");
+		printf("\n X - Copy, compare or fill a block range");
 		printf("\n\n Q - Quit SD-mon");
 		printf("\n\n Select:");
 		Command=upcase(waitkey());
 		printf("%c",Command);
 		switch (Command) {
 		case 'B':
-			printf("\nWrite memory to disk");
-			BlockNr=0;
-			PrepCS(CmdStructure,0,0);
-			SDStat=SDWriteBlock(CmdStructure,pBootBlock);
+			printf("\nBoot");
+			printf("\n L - Write stage-0 loader to boot block");
+			printf("\n F - Set boot file");
+			printf("\n M - Write @0000 to boot block");
+			printf("\nMode? : ");
+			Command=upcase(waitkey());
+			printf("%c",Command);
+			if (Command=='L') {
+#ifdef SDBOOTASM
+				SDStat=BootWriteStage0();
+#else
+				printf("\nStage-0 is not in this build (SDBOOTASM)");
+				break;
+#endif
+			} else if (Command=='F') {
+				printf("\nBoot file? (c:/dir/file, c: clears) ");
+				if (getline(scratch,24)<=0) break;
+				BootLoadAddr=0;
+				BootExecAddr=0;
+				if (scratch[2]!=0) {
+					printf("\nLoad address? (hex) ");
+					if (getline(Address,4)<=0) break;
+					BootLoadAddr=(unsigned int)strtol(Address,NULL,16);
+					printf("\nStart address? (hex) ");
+					if (getline(Address,4)<=0) break;
+					BootExecAddr=(unsigned int)strtol(Address,NULL,16);
+				}
+				if (jfs_setboot(scratch[0],(scratch[2]!=0) ? scratch : 0,BootLoadAddr,BootExecAddr)<0) {
+					printf("\nError %d",jfcstatus);
+				} else {
+					printf("\nBoot file set");
+				}
+				break;
+			} else if (Command=='M') {
+				PrepCS(CmdStructure,0,0);
+				SDStat=SDWriteBlock(CmdStructure,pBootBlock);
+			} else {
+				printf("\nCancelled");
+				break;
+			}
 			if (SDStat==SDRDY){
-				printf("\nBlock 0x%08lx written",BlockNr);
+				printf("\nBlock 0x%08lx written",(long)A_BOOTBLOCK);
 			} else {
 				switch (SDStat){
 				case SDWRTFAIL:
@@ -77,13 +157,59 @@ unsigned long StartBlock;
 				} //switch (SDStat...
 			} //if (SDStat==SDRDY)
 			break;
+		case 'C':
+			printf("\nRepair? (Y/N) ");
+			Command=upcase(waitkey());
+			printf("%c",Command);
+			printf("\nChecking file system...");
+			Wrong=jfs_fsck(Command=='Y',&Fsck);
+			if (Wrong<0) {
+				printf("\nFile system too large to check or not formatted.");
+				break;
+			}
+			printf("\nBlocks %l, used %l, free %l, bad %l, read %l",Fsck.blocks,Fsck.used,Fsck.free,Fsck.bad,Fsck.reads);
+			printf("\nLost %l, orphans %l, doubles %l, bad links %l",Fsck.lost,Fsck.orphans,Fsck.doubles,Fsck.badlinks);
+			printf("\nBad entries %l, bad counters %l, fixed %l",Fsck.badentries,Fsck.badcounts,Fsck.fixed);
+			if (Wrong==0) printf("\nFile system OK.");
+			break;
+		case 'D':
+			ShowSDStats();
+			printf("\n\nReset counters? : ");
+			Command=upcase(waitkey());
+			printf("%c",Command);
+			if (Command=='Y') SDStatsReset();
+			break;
 		case 'F':
 			printf("\nFormat SD");
+			printf("\n Q - Quick: SD hardware erase + free space bitmap");
+			printf("\n B - Free space bitmap, no erase");
+			printf("\n S - Stream: write and verify each block once");
+			printf("\n P - Surface scan: pattern test every block (slow)");
+			printf("\nMode? : ");
+			Command=upcase(waitkey());
+			printf("%c",Command);
+			if (Command=='S') {
+				FormatMode=FMT_STREAM;
+			} else if (Command=='P') {
+				FormatMode=FMT_SURFACE;
+			} else if (Command=='B') {
+				FormatMode=FMT_BITMAP;
+			} else if (Command=='Q') {
+				FormatMode=FMT_QUICK;
+			} else {
+				printf("\nCancelled");
+				break;
+			}
+			printf("\nMetadata journal, costs writes (Y/N)? : ");
+			Command=upcase(waitkey());
+			printf("%c",Command);
+			jfsjournal=(Command=='Y');
 			printf("\nAre you sure? : ");
 			Command=upcase(waitkey());
 			printf("%c",Command);
 			if (Command=='Y') {
-			    SDCardTotalBlocks=JDOS_erase(CSData.Csize+1);     //SDCardTotalBlocks is a global variable, this value is available elsewhere.
+				//Csize counts 512 kB units, 1024 blocks each; pass the last block number
+			    SDCardTotalBlocks=JDOS_erase((((long)CSData.Csize+1)<<10)-1,FormatMode);     //SDCardTotalBlocks is a global variable, this value is available elsewhere.
 				printf("\n\aTotal # blocks intialized: %ld",SDCardTotalBlocks);
 				break;
 			} else {
@@ -96,6 +222,8 @@ unsigned long StartBlock;
 				printf("\n\a%c[1mSD card initialised",ESC);
 				if (CardInfo.version2) printf("\nSD card V2"); else printf("\nSD card V1");
 				CSData=SDReadCSD();
+				SDSetWriteBehind(true);	//jfs_flush() and 'Q' end with SDSync()
+				CardMount();		//Cached blocks may belong to a previous card
 			} else {
 				switch (CardInfo.status){
 				case SDERR:
@@ -109,25 +237,68 @@ unsigned long StartBlock;
 				} //switch SDStat
 			} //if (CardInfo.status...
 			break; //case 'I'...
+		case 'K':
+			SDStat=SDSetCrc(!SDGetCrc());
+			if (SDStat==SDCRCERR) printf("\nCRC self-test failed, see T.");
+			else if (SDStat!=SDRDY) printf("\nCMD59 failed.");
+			if (SDGetCrc()) printf("\nCRC checking on"); else printf("\nCRC checking off");
+			break;
+		case 'L':
+			printf("\nPath? (c:/dir/dir) ");
+			if (getline(scratch,24)>0){
+				BlockNr=jfs_path(scratch);
+				if (BlockNr==0) {
+					printf("\n%s not found",scratch);
+				} else {
+					dir_list(BlockNr,false);
+				}
+			} //if getline(...
+			break;
 		case 'M': 
 			printf("\nRead 100 blocks.");
 			StartBlock=GetBlockNr();
-			for (BlockNr=StartBlock;BlockNr<StartBlock+100;BlockNr++){
-				PrepCS(CmdStructure,SDCMDReadBlock,BlockNr);
-				SDStat=SDReadBlock(CmdStructure,BlockBuffer);
-				if (SDStat==SDRDY){
+			PrepCS(CmdStructure,SDCMDReadMulti,StartBlock);
+			SDStat=SDReadStart(CmdStructure);	//One CMD18 for all 100 blocks
+			if (SDStat==SDRDY){
+				for (BlockNr=StartBlock;BlockNr<StartBlock+100;BlockNr++){
+					SDStat=SDReadNext(BlockBuffer);
+					if (SDStat!=SDRDY) break;
 					BlockDisplay(BlockNr, BlockBuffer);
-				} else {
-					switch (SDStat){
-					case SDERR:
-						printf("\n SD card not present or SD comm error.\n");
-						break;
-					case SDNRDY:
-						printf("\n SD card not ready.\n");
-					} //switch (SDStat...
-				} //if (SDStat==SDRDY)
-				if (checkkey()) BlockNr=StartBlock+100; //abort if key pressed
-			} //for (BlockNr...
+					if (checkkey()) break; //abort if key pressed
+				} //for (BlockNr...
+				SDReadStop();
+			} //if (SDStat==SDRDY)
+			if (SDStat!=SDRDY){
+				switch (SDStat){
+				case SDNOTOK:
+					printf("\n No data token for block 0x%08lx.\n",BlockNr);
+					break;
+				case SDREADFAIL:
+					printf("\n CMD18 failed.\n");
+					break;
+				default:
+					printf("\n Unknown error.\n");
+				} //switch (SDStat...
+			} //if (SDStat!=SDRDY)
+			break;
+		case 'O':
+			if (!jfs_fragstats(&Defrag)) {
+				printf("\nNo file system.");
+				break;
+			}
+			printf("\nFiles+dirs %l, fragmented %l, runs %l, free runs %l",Defrag.objects,Defrag.fragmented,Defrag.runs,Defrag.freeruns);
+			printf("\nDefragment? (Y/N) ");
+			Command=upcase(waitkey());
+			printf("%c",Command);
+			if (Command!='Y') break;
+			Wrong=jfs_defrag(0,&Defrag);
+			if (Wrong<0) {
+				printf("\nStopped, error %d. Check the file system.",jfcstatus);
+				break;
+			}
+			printf("\nMoved %l, blocks copied %l, no room for %l, passes %l",Defrag.moved,Defrag.copied,Defrag.nospace,Defrag.passes);
+			jfs_fragstats(&Defrag);
+			printf("\nFiles+dirs %l, fragmented %l, runs %l, free runs %l",Defrag.objects,Defrag.fragmented,Defrag.runs,Defrag.freeruns);
 			break;
 		case 'R':
 			BlockNr=GetBlockNr();
@@ -185,7 +356,7 @@ unsigned long StartBlock;
 				printf("Error in data");
 			} //switch CSData.TranSpeed
 			
-			CSTotalMBytes=((unsigned long)CSData.Csize+1)/2;
+			CSTotalMBytes=BlkShr(CSData.Csize+1,1);
 			printf("\nCard size : %l Mb.",CSTotalMBytes);
 			
 			if (CSData.Copy) {
@@ -201,7 +372,69 @@ unsigned long StartBlock;
 			if (CSData.TempWP) {
 				printf("\nCard is temporarily Write-Protected");
 			} 
+
+			SCRData=SDReadSCR();
+			if (SCRData.status==SDRDY) {
+				printf("\nErased blocks read as: 0x%02x",SCRData.EraseFill);
+			} else {
+				printf("\nSCR not available");
+			}
 			
+			printf("\n\nFile system (blocks):");
+			if (jfs_usage(&Usage)) {
+				printf("\nTotal     : %lu",Usage.totalblocks);
+				printf("\nUsed      : %lu",Usage.nrused);
+				printf("\nFree      : %lu (%lu kB)",Usage.nrfree,BlkShr(Usage.nrfree,1));
+				printf("\nBad       : %lu",Usage.nrbad);
+				if (Usage.alloctype==T_EMPTYHDR) printf("\nHead run  : %lu",Usage.headrun);
+			} else {
+				printf("\nNo usage counters, U counts them once");
+			}
+
+			printf("\n\nBlock cache: %d slots",JFSCACHESLOTS);
+			printf("\nHits      : %lu",jfscstats.hits);
+			printf("\nMisses    : %lu",jfscstats.misses);
+			printf("\nWritebacks: %lu",jfscstats.writebacks);
+			printf("\nSD reads  : %lu",jfscstats.devreads);
+			printf("\nSD writes : %lu",jfscstats.devwrites);
+			printf("\n\nDentry cache: %d entries",JFSDCACHESIZE);
+			printf("\nHits      : %lu",jfsdstats.hits);
+			printf("\nNeg. hits : %lu",jfsdstats.neghits);
+			printf("\nMisses    : %lu",jfsdstats.misses);
+			printf("\nDropped   : %lu",jfsdstats.invalidates);
+			printf("\n\nJournal commits    : %lu",jfsjstats.commits);
+			printf("\nBlocks logged      : %lu",jfsjstats.logged);
+			printf("\nCheckpoints        : %lu",jfsjstats.checkpoints);
+			printf("\nReplayed at mount  : %lu",jfsjstats.replayed);
+			break;
+		case 'T':
+#ifdef SDBLKASM
+			printf("\nBlock number helpers, 6309 versions...");
+#else
+			printf("\nBlock number helpers, C versions...");
+#endif
+			SDStat=BlkSelfTest(true);
+			if (SDStat==0) printf("\nOK"); else printf("\n%d wrong result(s)",SDStat);
+			printf("\nCRC7 and CRC16 kernels...");
+			if (SDCrcSelfTest(true)==0) printf("\nOK");
+			break;
+		case 'U':
+			printf("\nCounting free space, this reads every free block of an empty chain...");
+			Wrong=jfs_verifycounts(true);
+			if (Wrong<0) {
+				printf("\nFree space structure is broken.");
+			} else if (Wrong==0) {
+				printf("\nCounters OK.");
+			} else {
+				printf("\n%l counter(s) wrong or missing, corrected.",Wrong);
+			}
+			jfs_flush();
+			break;
+		case 'V':
+			DumpMode=(DumpMode+1)%DUMP_NRMODES;
+			if (DumpMode==DUMP_FULL) printf("\nView: full");
+			else if (DumpMode==DUMP_SQUEEZE) printf("\nView: skip repeated lines");
+			else printf("\nView: skip repeated lines, summarize blank blocks");
 			break;
 		case 'W':
 			BlockNr=GetBlockNr();
@@ -230,8 +463,55 @@ unsigned long StartBlock;
 */
 			} //if (BlockNr...
 			break;
+		case 'X':
+			printf("\nBlock range");
+			printf("\n C - Copy");
+			printf("\n P - Compare");
+			printf("\n F - Fill");
+			printf("\n Z - Zero");
+			printf("\nMode? : ");
+			Command=upcase(waitkey());
+			printf("%c",Command);
+			if (Command!='C' && Command!='P' && Command!='F' && Command!='Z') {
+				printf("\nCancelled");
+				break;
+			}
+			printf("\nFirst block");
+			if ((RangeFrom=GetBlockNr())<0) break;
+			printf("\nLast block");
+			if ((RangeLast=GetBlockNr())<RangeFrom) break;
+			Value=0;
+			if (Command=='C' || Command=='P') {
+				printf("\n%s block",Command=='C' ? "To" : "Compare with");
+				if ((RangeTo=GetBlockNr())<0) break;
+			} else if (Command=='F') {
+				printf("\nWhat value to fill the blocks? (dec) ");
+				if (getline(scratch,3)<=0) break;
+				Value=(unsigned char)(strtol(scratch,NULL,10))&255;
+			}
+			if (Command!='P') {
+				printf("\nOverwrite %l blocks? : ",RangeLast-RangeFrom+1);
+				if (upcase(waitkey())!='Y') {
+					printf("\nCancelled");
+					break;
+				}
+				jfs_unmount();		//Cached and journalled blocks home first
+			}
+			printf("\n");
+			SDStatsSnapshot(&RangeBefore);
+			if (Command=='C') {
+				RangeDone=RangeCopy(RangeFrom,RangeLast,RangeTo);
+			} else if (Command=='P') {
+				RangeDone=RangeCompare(RangeFrom,RangeLast,RangeTo);
+			} else {
+				RangeDone=RangeFill(RangeFrom,RangeLast,Value);
+			}
+			RangeReport(RangeDone,&RangeBefore);
+			if (Command!='P') CardMount();	//The blocks written may be cached, journalled or bad-listed
+			break;
 		case 'Q':
 			printf("\nOK, quitting...");
+			jfs_unmount();	//Nothing may stay behind in the block cache or the journal
 			exit(0);
 			break;
 		default:
@@ -247,6 +527,35 @@ unsigned char upcase(unsigned char ulc)
 	return(ulc);
 }
 
+//
+// Driver statistics page: calls, blocks, results and busy-waits per SD command.
+// Wait time is an estimate, SDPOLLCYCLES CPU cycles per poll.
+//
+void ShowSDStats()
+{
+static char* CmdNames[SDC_NRCMDS]={"Init","Read","Write","CSD","SCR","Rd strm","Wr strm","Erase"};
+struct sdstats Stats;
+struct sdcmdstat* Stat;
+unsigned char Cmd, Status;
+unsigned int Errors;
+
+	SDStatsSnapshot(&Stats);
+	printf("\n\nCommand    Calls   Blocks       OK   Errors    Waits  Max wait  kCycles");
+	for (Cmd=0;Cmd<SDC_NRCMDS;Cmd++) {
+		Stat=&Stats.cmd[Cmd];
+		Errors=0;
+		for (Status=1;Status<SDNRSTATUS;Status++) Errors+=Stat->status[Status];
+		printf("\n%-8s %7lu %8lu %8u %8u %8lu %9lu %8lu",CmdNames[Cmd],Stat->calls,Stat->blocks,
+			Stat->status[SDRDY],Errors,Stat->waitpolls,Stat->waitmax,(Stat->waitpolls/1000)*SDPOLLCYCLES);
+		for (Status=1;Status<SDNRSTATUS;Status++) {
+			if (Stat->status[Status]!=0) printf("\n         status %d: %u",Status,Stat->status[Status]);
+		}
+		if (Stat->crcretries!=0) printf("\n         CRC retries: %lu",Stat->crcretries);
+	}
+	printf("\nInit attempts: %lu",Stats.inittries);
+	if (SDGetCrc()) printf(", CRC checking on");
+}
+
 long GetBlockNr()
 {
 char cmdline[11];
@@ -267,10 +576,7 @@ void PrepCS(unsigned char CmdStructure[],unsigned char Cmd, long BlockNr)
 {
 	//The CS_ReadBlock and CS_WriteBlock get a Command Sructure with just 
 	//the block number in byte 0..3, the routines compile the correct command structure from that
-	CmdStructure[0] = (unsigned char)(BlockNr/16777216)%255;	//1st byte of block #
-	CmdStructure[1] = (unsigned char)(BlockNr/65536)%255;	//2nd byte of block #
-	CmdStructure[2] = (unsigned char)(BlockNr/256)%255;	//3rd byte of block #
-	CmdStructure[3] = (unsigned char)BlockNr%255;		//last byte of block #
+	BlkEncode(CmdStructure,BlockNr);	//byte 0..3 = block #, big-endian
 	CmdStructure[4] = 0; //CRC but not checked...
 	CmdStructure[5] = 0; //CRC but not checked...
 #ifdef DEBUG
@@ -278,27 +584,214 @@ void PrepCS(unsigned char CmdStructure[],unsigned char Cmd, long BlockNr)
 #endif
 }
 
+//
+// Hex dump of one block in the current DumpMode. Each 16-byte line is built in
+// DumpBuf and written with a single putstr(), so a block costs about 33 output
+// calls instead of the 1,100 printf calls of formatting byte by byte.
+//
 void BlockDisplay(long BlockNr, unsigned char Buffer[])
 {
-int Lines, Cols;
-unsigned char Cell;
-
-	printf("\n");
-	for (Lines=0;Lines<32;Lines++){
-		//if (Lines%8==0) printf("\n");
-		printf("\n0x%08lx %04x\t",BlockNr,16*Lines);
-		for (Cols=0;Cols<16;Cols++){
-			if ((Cols%8)==0) printf(" ");
-			printf("%02x ",Buffer[16*Lines+Cols]);
+unsigned int Offset;
+bool Starred;
+
+	if (DumpMode==DUMP_SUMMARY && DumpSummary(BlockNr,Buffer)) return;
+	printf("\n\nBlock 0x%08lx",BlockNr);
+	Starred=false;
+	for (Offset=0;Offset<512;Offset+=16){
+		//The last line is always shown, so the end of the block is visible
+		if (DumpMode!=DUMP_FULL && Offset!=0 && Offset!=496 && memcmp(Buffer+Offset,Buffer+Offset-16,16)==0) {
+			if (!Starred) putstr("\n*",2);
+			Starred=true;
+		} else {
+			DumpLine(Offset,Buffer+Offset);
+			Starred=false;
 		}
-		for (Cols=0;Cols<16;Cols++){
-			if ((Cols%8)==0) printf(" ");
-			Cell=Buffer[16*Lines+Cols];
-			if (Cell>127) Cell='.';
-			if (Cell<0x20) Cell='.';
-			printf("%c", Cell);
+	}
+}
+
+//
+// Fill in offset, hex pairs and ASCII column of DumpBuf and write it.
+// The spaces and bars of the template are never touched.
+//
+void DumpLine(unsigned int Offset, unsigned char Bytes[])
+{
+char *Hex, *Ascii;
+unsigned char Count, Cell;
+
+	DumpBuf[1]=HexDigits[(Offset>>12)&15];
+	DumpBuf[2]=HexDigits[(Offset>>8)&15];
+	DumpBuf[3]=HexDigits[(Offset>>4)&15];
+	DumpBuf[4]=HexDigits[Offset&15];
+	Hex=DumpBuf+DUMPHEXCOL;
+	Ascii=DumpBuf+DUMPASCCOL;
+	for (Count=0;Count<16;Count++){
+		if (Count==8) Hex++;		//Extra space between the two halves
+		Cell=Bytes[Count];
+		Hex[0]=HexDigits[Cell>>4];
+		Hex[1]=HexDigits[Cell&15];
+		Hex+=3;
+		if (Cell>127 || Cell<0x20) Cell='.';
+		*Ascii++=Cell;
+	}
+	putstr(DumpBuf,DUMPLINELEN);
+}
+
+//
+// One line for a block filled with a single byte value (zeroed, or erased
+// to 0xFF), or a T_EMPTYBLK whose data area is zero. Returns false if the
+// block needs a full dump.
+//
+bool DumpSummary(long BlockNr, unsigned char Buffer[])
+{
+struct s_eblock* EBlock;
+unsigned int Index;
+
+	for (Index=1;Index<512 && Buffer[Index]==Buffer[0];Index++);
+	if (Index==512) {
+		printf("\n\nBlock 0x%08lx: all 0x%02x",BlockNr,Buffer[0]);
+		return true;
+	}
+	if (Buffer[0]!=T_EMPTYBLK) return false;
+	for (Index=sizeof(struct s_eblock);Index<512 && Buffer[Index]==0;Index++);
+	if (Index<512) return false;
+	EBlock=(struct s_eblock*)Buffer;
+	printf("\n\nBlock 0x%08lx: empty, next 0x%08lx, prev 0x%08lx",BlockNr,EBlock->next_eb,EBlock->prev_eb);
+	return true;
+}
+
+//
+// Block ranges. One SD card can not read and write at the same time, so a
+// copy reads a batch of 2*RANGEBATCH blocks into both buffers with one CMD18
+// and writes it with one CMD25; a compare reads RANGEBATCH blocks of each
+// range into its own buffer; a fill writes the whole range with a single
+// CMD25 from one block. A key press stops after the current batch.
+// Progress every RANGEPROGRESS blocks. Each returns the blocks done.
+//
+long RangeCopy(long From, long Last, long Dest)
+{
+unsigned char CmdStructure[6];
+long Total, Done, Offset;
+int Count, Stat;
+bool Down;
+
+	Total=Last-From+1;
+	Down=(Dest>From && Dest<=Last);		//Overlap: copy from the end
+	Done=0;
+	Stat=SDRDY;
+	while (Done<Total) {
+		Count=(Total-Done>2*RANGEBATCH) ? 2*RANGEBATCH : (int)(Total-Done);
+		Offset=Down ? Total-Done-Count : Done;
+		PrepCS(CmdStructure,SDCMDReadMulti,From+Offset);
+		if ((Stat=SDReadBlocks(CmdStructure,RangeBuf,Count))!=SDRDY) break;
+		PrepCS(CmdStructure,SDCMDWriteMulti,Dest+Offset);
+		if ((Stat=SDWriteBlocks(CmdStructure,RangeBuf,Count))!=SDRDY) break;
+		Done+=Count;
+		RangeProgress(Done,Count);
+		if (checkkey()) break;
+	}
+	if (Stat!=SDRDY) printf("\nError %d in the batch at block 0x%08lx",Stat,From+Offset);
+	return(Done);
+}
+
+long RangeCompare(long From, long Last, long Other)
+{
+unsigned char CmdStructure[6];
+long Total, Done, Differ;
+int Count, Block, Stat;
+
+	Total=Last-From+1;
+	Done=0;
+	Differ=0;
+	Stat=SDRDY;
+	while (Done<Total) {
+		Count=(Total-Done>RANGEBATCH) ? RANGEBATCH : (int)(Total-Done);
+		PrepCS(CmdStructure,SDCMDReadMulti,From+Done);
+		if ((Stat=SDReadBlocks(CmdStructure,RangeBuf,Count))!=SDRDY) break;
+		PrepCS(CmdStructure,SDCMDReadMulti,Other+Done);
+		if ((Stat=SDReadBlocks(CmdStructure,RangeBuf+RANGEBATCH*512,Count))!=SDRDY) break;
+		for (Block=0;Block<Count;Block++) {
+			if (memcmp(RangeBuf+Block*512,RangeBuf+(RANGEBATCH+Block)*512,512)==0) continue;
+			if (Differ<RANGEDIFFS) printf("\nBlock 0x%08lx differs from 0x%08lx",From+Done+Block,Other+Done+Block);
+			Differ++;
+		}
+		Done+=Count;
+		RangeProgress(Done,Count);
+		if (checkkey()) break;
+	}
+	if (Stat!=SDRDY) printf("\nError %d in the batch at block 0x%08lx",Stat,From+Done);
+	printf("\n%l blocks differ",Differ);
+	return(Done);
+}
+
+long RangeFill(long From, long Last, unsigned char Value)
+{
+unsigned char CmdStructure[6];
+long Total, Done;
+int Stat;
+
+	Total=Last-From+1;
+	Done=0;
+	fill_buffer(BlockBuffer,Value);
+	PrepCS(CmdStructure,SDCMDWriteMulti,From);
+	if ((Stat=SDWriteStart(CmdStructure))==SDRDY) {
+		while (Done<Total) {
+			if ((Stat=SDWriteNext(BlockBuffer))!=SDRDY) break;
+			Done++;
+			RangeProgress(Done,1);
+			if (checkkey()) break;
 		}
-	}	
+		SDWriteStop();
+	}
+	if (Stat!=SDRDY) printf("\nError %d at block 0x%08lx",Stat,From+Done);
+	return(Done);
+}
+
+void RangeProgress(long Done, int Count)
+{
+	if (((unsigned int)Done&(RANGEPROGRESS-1))<(unsigned int)Count) printf("\r%08lx",Done);
+}
+
+//
+// Blocks per second of a range command. The board has no timer, so the time
+// is estimated from the driver statistics as ShowSDStats() does: commands,
+// blocks and busy-wait polls at their estimated cycles, at CPUMHZ.
+//
+void RangeReport(long Blocks, struct sdstats* Before)
+{
+struct sdstats After;
+unsigned long KCycles, Ms;
+unsigned char Cmd;
+
+	SDStatsSnapshot(&After);
+	KCycles=0;
+	for (Cmd=0;Cmd<SDC_NRCMDS;Cmd++) {
+		KCycles+=(After.cmd[Cmd].calls-Before->cmd[Cmd].calls)*SDCMDCYCLES/1000;
+		KCycles+=(After.cmd[Cmd].blocks-Before->cmd[Cmd].blocks)*(SDBLOCKCYCLES/1000);
+		KCycles+=(After.cmd[Cmd].waitpolls-Before->cmd[Cmd].waitpolls)/1000*SDPOLLCYCLES;
+	}
+	Ms=KCycles/CPUMHZ;
+	printf("\n%l blocks, about %lu kCycles",Blocks,KCycles);
+	if (Ms>0) printf(", %lu blocks/s",Ms>=100000 ? (unsigned long)Blocks/(Ms/1000) : (unsigned long)Blocks*1000/Ms);
+}
+
+//
+// Open the file system on the card as after power up: forget the cached
+// blocks, names and bad block list, then open the journal and replay it.
+// After I, and after X wrote blocks behind the file system's back.
+//
+void CardMount()
+{
+	jfs_cacheinit();
+	dcache_init();
+	forget_bad_blocks();
+	switch (jfs_mount()) {	//Replays what a crash left behind
+	case -1:
+		printf("\nNo journal");
+		break;
+	case -2:
+		printf("\n\aJournal replay failed, do not write to this card");
+		break;
+	}
 }
 
 void fill_buffer(unsigned char buffer[], unsigned char value)
@@ -324,5 +817,6 @@ INISTK	IMPORT
 
 #include "TOM6309SDcard.c"
 #include "../../Bootstrap/JFS/jfs.c"
+#include "SDboot.c"
 
 //#include <../TOM6309.c>
\ No newline at end of file
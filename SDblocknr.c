@@ -0,0 +1,191 @@
+//
+// SDblocknr.c, 32-bit block number helpers for the SD driver and JFS
+//
+// CMOC does long division, modulo and shifts in library loops, about one
+// pass per bit, while a block number only ever needs its four bytes moved,
+// a small number added, a compare or a shift by a power of two. The 6309
+// versions keep the number in Q (D:W), only with SDBLKASM defined; other
+// builds and jfsimg use plain C. BlkSelfTest() (SD-mon T, jfsimg blk) checks
+// whichever is built against results worked out by hand.
+// Included at the end of TOM6309SDcard.c, and by jfsimg.
+//
+// Estimated cycles, native mode, call overhead excluded. Counted from the
+// 6309 tables by hand; the asm has not been assembled with CMOC yet.
+//	PrepCS with / 16777216, / 65536, / 256	~3 x 1000 (32-step divide each)
+//	BlkEncode				LDX, LDQ, STQ: 18
+//	BlkAdd					LDQ, ADDW, ADCD, STQ: 21
+//	BlkShr by n				LDQ, STQ 16 + 13 per bit, 172 for n=12
+//	BlkCmp					PSHS/PULS Y, LEAX, LEAY, 2 x (LDD, CMPD, Bcc): about 42
+//
+
+//
+// Store BlockNr as the big-endian command argument in Cmd[0..3].
+//
+void BlkEncode(unsigned char Cmd[], long BlockNr)
+{
+#if defined(_CMOC_VERSION_) && defined(SDBLKASM)
+	asm
+	{
+	LDX	Cmd
+	LDQ	BlockNr		//a long is big-endian already
+	STQ	,X
+	}
+#else
+	Cmd[0]=(unsigned char)(BlockNr>>24);
+	Cmd[1]=(unsigned char)(BlockNr>>16);
+	Cmd[2]=(unsigned char)(BlockNr>>8);
+	Cmd[3]=(unsigned char)BlockNr;
+#endif
+}
+
+//
+// Block number from the big-endian bytes Cmd[0..3].
+//
+long BlkDecode(unsigned char Cmd[])
+{
+#if defined(_CMOC_VERSION_) && defined(SDBLKASM)
+long BlockNr;
+
+	asm
+	{
+	LDX	Cmd
+	LDQ	,X
+	STQ	BlockNr
+	}
+	return(BlockNr);
+#else
+	return(((long)Cmd[0]<<24)|((long)Cmd[1]<<16)|((long)Cmd[2]<<8)|Cmd[3]);
+#endif
+}
+
+//
+// BlockNr + Count, for offsets into a region or a bitmap.
+//
+long BlkAdd(long BlockNr, unsigned int Count)
+{
+#if defined(_CMOC_VERSION_) && defined(SDBLKASM)
+	asm
+	{
+	LDQ	BlockNr
+	ADDW	Count		//low word
+	ADCD	#0		//carry into the high word
+	STQ	BlockNr
+	}
+	return(BlockNr);
+#else
+	return(BlockNr+Count);
+#endif
+}
+
+//
+// BlockNr / 2^Shift for block numbers (never negative): bitmap block of a
+// block, blocks of a byte count, cluster of a block.
+//
+long BlkShr(long BlockNr, unsigned char Shift)
+{
+#if defined(_CMOC_VERSION_) && defined(SDBLKASM)
+	asm
+	{
+	LDQ	BlockNr
+	TST	Shift
+	BEQ	BlkShrEnd
+BlkShrLp	LSRD			//high word, bit 0 into carry
+	RORW			//low word, carry into bit 15
+	DEC	Shift
+	BNE	BlkShrLp
+BlkShrEnd	STQ	BlockNr
+	}
+	return(BlockNr);
+#else
+	return(BlockNr>>Shift);
+#endif
+}
+
+//
+// -1, 0 or 1 as Left is below, equal to or above Right.
+// Not A and B: in the asm those name the accumulators, not the parameters.
+//
+int BlkCmp(long Left, long Right)
+{
+#if defined(_CMOC_VERSION_) && defined(SDBLKASM)
+int Result;
+
+	asm
+	{
+	PSHS	Y
+	LEAX	Left
+	LEAY	Right
+	LDD	,X		//high words, signed
+	CMPD	,Y
+	BLT	BlkCmpLo
+	BGT	BlkCmpHi
+	LDD	2,X		//low words, unsigned
+	CMPD	2,Y
+	BLO	BlkCmpLo
+	BHI	BlkCmpHi
+	CLRD
+	BRA	BlkCmpEnd
+BlkCmpLo	LDD	#-1
+	BRA	BlkCmpEnd
+BlkCmpHi	LDD	#1
+BlkCmpEnd	PULS	Y
+	STD	Result
+	}
+	return(Result);
+#else
+	return(Left<Right ? -1 : Left>Right ? 1 : 0);
+#endif
+}
+
+//
+// Known cases: carries between the words, the sign in the high word, an
+// unsigned low word, shifts across the word boundary. Results worked out by
+// hand, not with the helpers or the C library.
+//
+static struct blkcase{
+	long		left;
+	long		right;		//BlkCmp with left
+	unsigned int	count;		//BlkAdd to left
+	unsigned char	shift;		//BlkShr of left
+	long		sum;
+	long		shifted;
+	int		order;
+	unsigned char	bytes[4];	//BlkEncode of left
+} BlkCases[]={
+	{0x00000000L,0x00000000L,0,	0,	0x00000000L,0x00000000L,0,	{0x00,0x00,0x00,0x00}},
+	{0x0000FFFFL,0x00010000L,1,	1,	0x00010000L,0x00007FFFL,-1,	{0x00,0x00,0xFF,0xFF}},
+	{0x12345678L,0x12345677L,0xFFFF,4,	0x12355677L,0x01234567L,1,	{0x12,0x34,0x56,0x78}},
+	{0x0001FFFEL,0x00018000L,2,	12,	0x00020000L,0x0000001FL,1,	{0x00,0x01,0xFF,0xFE}},
+	{0x00017FFFL,0x00018000L,0x8001,9,	0x00020000L,0x000000BFL,-1,	{0x00,0x01,0x7F,0xFF}},
+	{0x7FFFFFFEL,-1L,	1,	30,	0x7FFFFFFFL,0x00000001L,1,	{0x7F,0xFF,0xFF,0xFE}},
+	{-2L,	1L,		1,	0,	-1L,	-2L,	-1,	{0xFF,0xFF,0xFF,0xFE}},
+	{0x40000000L,0x40000000L,0x1234,16,0x40001234L,0x00004000L,0,	{0x40,0x00,0x00,0x00}}
+};
+
+//
+// Run every helper on BlkCases, return the number of wrong results.
+// With Verbose each wrong one is printed.
+//
+int BlkSelfTest(bool Verbose)
+{
+struct blkcase* Case;
+unsigned char Bytes[4];
+int Index, Wrong, Before;
+
+	Wrong=0;
+	for (Index=0;Index<(int)(sizeof(BlkCases)/sizeof(BlkCases[0]));Index++) {
+		Case=&BlkCases[Index];
+		Before=Wrong;
+		BlkEncode(Bytes,Case->left);
+		if (memcmp(Bytes,Case->bytes,4)!=0) Wrong++;
+		if (BlkAdd(Case->left,Case->count)!=Case->sum) Wrong++;
+		if (Case->left>=0) {		//Block numbers: a host long is wider, no sign to extend
+			if (BlkDecode(Case->bytes)!=Case->left) Wrong++;
+			if (BlkShr(Case->left,Case->shift)!=Case->shifted) Wrong++;
+		}
+		if (BlkCmp(Case->left,Case->right)!=Case->order) Wrong++;
+		if (BlkCmp(Case->right,Case->left)!=-Case->order) Wrong++;
+		if (Verbose && Wrong!=Before) printf("\nBlk case %d (0x%08lx): %d wrong",Index,Case->left,Wrong-Before);
+	}
+	return(Wrong);
+}
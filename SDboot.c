@@ -0,0 +1,261 @@
+//
+// SDboot.c, boot file loader for JFS cards
+//
+// The ROM runs block 0 at $0000, the block SD-mon B used to fill with a
+// copy of memory from $0000. Block 0 now holds a stage-0 loader that finds
+// the boot file by itself:
+//	1. read the partition map to BOOTMAP,
+//	2. read the partition headers to BOOTHDR until one has a boot file,
+//	3. read the boot file header (an extent file, all extents in the header)
+//	   over it,
+//	4. stream every extent with one CMD18 straight to its place in memory,
+//	   from the load address in the partition header on,
+//	5. jump to the start address.
+// Memory is written in whole blocks, so the bytes after the end of the file
+// up to the end of its last block are overwritten as well. jfs_setboot()
+// only accepts boot files that stage-0 can load this way.
+// On an error stage-0 returns to the ROM with V set.
+// The 6309 code has not been assembled or booted; it is only built with
+// SDBOOTASM defined. jfsimg boot runs the C model below on a simulated card.
+//
+// Included by SD-mon after jfs.c, and by jfsimg.
+//
+// Stage-0 cost, 6309 native mode: 3 single block reads (map, partition
+// header, file header), then per extent one CMD18 and one STOP_TRAN, and per
+// block a token wait, the ROM's SPI_ReadBlock and about 60 cycles of its own.
+// The old way, a CMD17 per block into a buffer and a 512 byte copy, costs a
+// command per block plus about 5 cycles a byte for the copy.
+//
+
+#ifdef _CMOC_VERSION_
+#ifdef SDBOOTASM
+//
+// Address and length of the stage-0 code. It is position independent and
+// never runs in place: BootWriteStage0() copies it to block 0. Its variables
+// are inside the block. The offsets used are those of struct s_partmap,
+// s_parth and s_filexh.
+//
+unsigned char* BootStage0(unsigned int* Length)
+{
+unsigned char* Start;
+unsigned int Size;
+
+	asm
+	{
+	LEAX	BS0Start,PCR
+	STX	Start
+	LDD	#BS0End-BS0Start
+	STD	Size
+	LBRA	BS0End		//Copied, not run here
+
+BS0Start	CLRA			//block A_PARTMAP
+	CLRB
+	STD	BS0Blk,PCR
+	LDD	#A_PARTMAP
+	STD	BS0Blk+2,PCR
+	LDY	#BOOTMAP
+	LBSR	BS0Read
+	LBVS	BS0Fail
+	LDX	#BOOTMAP
+	LDA	,X
+	CMPA	#T_PARTMAP
+	LBNE	BS0Fail
+	LDB	1,X		//no_parts
+	LBEQ	BS0Fail
+	LEAX	2,X		//parthdr[0]
+BS0Part	PSHS	B,X
+	LDQ	,X
+	STQ	BS0Blk,PCR
+	LDY	#BOOTHDR
+	LBSR	BS0Read
+	PULS	B,X		//leaves V as BS0Read set it
+	LBVS	BS0Fail
+	LDY	#BOOTHDR
+	LDA	,Y
+	CMPA	#T_PARTHDR
+	BNE	BS0Next
+	LDD	34,Y		//bootfile, not with LDQ: B counts the partitions
+	ORD	36,Y
+	BNE	BS0Found
+BS0Next	LEAX	4,X
+	DECB
+	BNE	BS0Part
+	LBRA	BS0Fail
+BS0Found	LDQ	34,Y
+	STQ	BS0Blk,PCR
+	LDD	42,Y		//bootload
+	STD	BS0Dest,PCR
+	LDD	44,Y		//bootexec
+	STD	BS0Exec,PCR
+	LBSR	BS0Read		//boot file header over the partition header
+	LBVS	BS0Fail
+	LDY	#BOOTHDR
+	LDA	,Y
+	CMPA	#T_FILEXHDR
+	LBNE	BS0Fail
+	LDQ	34,Y		//extlist: all extents must be in the header
+	LBNE	BS0Fail
+	LDD	48,Y		//nrextents
+	LBEQ	BS0Fail
+	LEAX	50,Y		//extent[0]
+BS0Ext	PSHS	D,X
+	LDQ	,X		//first block
+	STQ	BS0Blk,PCR
+	LDD	6,X		//# blocks, a boot file has less than 64K
+	BEQ	BS0Empty
+	LBSR	BS0Strm
+BS0Empty	PULS	D,X
+	LBVS	BS0Fail
+	LEAX	8,X
+	DECD
+	BNE	BS0Ext
+	JMP	[BS0Exec,PCR]	//boot file loaded, start it
+BS0Fail	ORCC	#$02		//V set: back to the ROM
+	RTS
+
+// Read block BS0Blk to Y with CMD17. V set on error.
+BS0Read	PSHS	U
+	LEAX	BS0Blk,PCR	//block # in 0..3, as PrepCS() leaves it
+	JSR	[SD_ReadBlock_ptr]
+	PULS	U,PC
+
+// Stream D blocks from BS0Blk on to BS0Dest with one CMD18. V set on error.
+BS0Strm	STD	BS0Cnt,PCR
+	LDA	#$52		//CMD18
+	BSR	BS0Cmd
+	BNE	BS0SErr
+BS0SBlk	LDD	#SDTOKTRIES
+	STD	BS0Try,PCR
+BS0Tok	JSR	[SPI_Read_ptr]	//wait for the data token
+	CMPA	#$FF
+	BNE	BS0STok
+	LDD	BS0Try,PCR
+	SUBD	#1
+	STD	BS0Try,PCR
+	BNE	BS0Tok
+	BRA	BS0SErr
+BS0STok	CMPA	#SDTOKSTART
+	BNE	BS0SErr
+	LDX	#SDBlockSize
+	LDY	BS0Dest,PCR	//straight to its place, no buffer
+	JSR	[SPI_ReadBlock_ptr]
+	JSR	[SPI_Read_ptr]	//CRC, not checked
+	JSR	[SPI_Read_ptr]
+	LDD	BS0Dest,PCR
+	ADDD	#SDBlockSize
+	STD	BS0Dest,PCR
+	LDD	BS0Cnt,PCR
+	SUBD	#1
+	STD	BS0Cnt,PCR
+	BNE	BS0SBlk
+	BSR	BS0Stop
+	ANDCC	#$FD		//V clear: done
+	RTS
+BS0SErr	BSR	BS0Stop
+	ORCC	#$02
+	RTS
+
+// STOP_TRAN, wait while the card is busy, deselect.
+BS0Stop	CLR	BS0Blk,PCR	//stuff bits
+	CLR	BS0Blk+1,PCR
+	CLR	BS0Blk+2,PCR
+	CLR	BS0Blk+3,PCR
+	LDA	#$4C		//CMD12
+	BSR	BS0Cmd
+BS0Busy	JSR	[SPI_Read_ptr]
+	CMPA	#$FF
+	BNE	BS0Busy
+	OIM	#IO_SDCS,IOPORT	//negate SD card select
+	RTS
+
+// Send command A with BS0Blk as argument. R1 in A, Z set if 0.
+BS0Cmd	PSHS	U
+	LEAU	BS0CmdS,PCR
+	STA	,U
+	LDQ	BS0Blk,PCR
+	STQ	1,U
+	LDA	#$01		//CRC not checked, end bit
+	STA	5,U
+	JSR	[SD_SendCmd_ptr]
+	PULS	U
+	TSTA
+	RTS
+
+BS0Blk	FDB	0,0,0		//block # for BS0Read and BS0Cmd, 6 bytes as PrepCS() makes them
+BS0CmdS	FDB	0,0,0		//command structure for SD_SendCmd
+BS0Dest	FDB	0		//next block goes here
+BS0Exec	FDB	0		//start address
+BS0Cnt	FDB	0		//blocks left in the extent
+BS0Try	FDB	0		//token polls left
+BS0End
+	}
+	*Length=Size;
+	return(Start);
+}
+
+//
+// Write the stage-0 loader to block 0. Returns SDRDY, or SDWRTFAIL if the
+// loader does not fit in a block or the write fails.
+//
+int BootWriteStage0()
+{
+unsigned char* Code;
+unsigned int Length;
+
+	Code=BootStage0(&Length);
+	if (Length>SDBlockSize) return(SDWRTFAIL);
+	fill_buffer(BlockBuffer,0);
+	memcpy(BlockBuffer,Code,Length);
+	return(rawwriteblock(A_BOOTBLOCK));
+}
+#endif
+#else
+//
+// Stage-0 in C for jfsimg boot: the same commands in the same order, with
+// the 64 kB of 6309 memory in Memory[]. A block that would pass the end of
+// Memory[] stops the load, stage-0 itself relies on jfs_setboot().
+// Returns SDRDY with the start address in *Exec, or an SD status.
+//
+int BootLoad(unsigned char Memory[], unsigned int* Exec)
+{
+unsigned char CmdStructure[6];
+struct s_partmap* Map;
+struct s_parth* Part;
+struct s_filexh* File;
+unsigned int Dest, Count, Index;
+int Stat;
+
+	Map=(struct s_partmap*)&Memory[BOOTMAP];
+	Part=(struct s_parth*)&Memory[BOOTHDR];
+	File=(struct s_filexh*)&Memory[BOOTHDR];
+	PrepCS(CmdStructure,SDCMDReadBlock,A_PARTMAP);
+	if ((Stat=SDReadBlock(CmdStructure,(unsigned char*)Map))!=SDRDY) return(Stat);
+	if (Map->blocktype!=T_PARTMAP) return(SDREADFAIL);
+	for (Index=0;Index<Map->no_parts && Index<MAXPARTS;Index++) {
+		PrepCS(CmdStructure,SDCMDReadBlock,Map->parthdr[Index]);
+		if ((Stat=SDReadBlock(CmdStructure,(unsigned char*)Part))!=SDRDY) return(Stat);
+		if (Part->blocktype==T_PARTHDR && Part->bootfile!=0) break;
+	}
+	if (Index>=Map->no_parts || Index>=MAXPARTS) return(SDREADFAIL);
+	Dest=Part->bootload;
+	*Exec=Part->bootexec;
+	PrepCS(CmdStructure,SDCMDReadBlock,Part->bootfile);
+	if ((Stat=SDReadBlock(CmdStructure,(unsigned char*)File))!=SDRDY) return(Stat);
+	if (File->blocktype!=T_FILEXHDR || File->extlist!=0 || File->nrextents==0) return(SDREADFAIL);
+	for (Index=0;Index<File->nrextents && Index<FXHMAXEXT;Index++) {
+		Count=(unsigned int)File->extent[Index].length;
+		if (Count==0) continue;
+		PrepCS(CmdStructure,SDCMDReadMulti,File->extent[Index].start);
+		if ((Stat=SDReadStart(CmdStructure))!=SDRDY) return(Stat);
+		for (;Count>0;Count--) {
+			if ((long)Dest+SDBlockSize>0x10000L) Stat=SDREADFAIL;
+			if (Stat==SDRDY) Stat=SDReadNext(&Memory[Dest]);
+			if (Stat!=SDRDY) break;
+			Dest+=SDBlockSize;
+		}
+		SDReadStop();
+		if (Stat!=SDRDY) return(Stat);
+	}
+	return(SDRDY);
+}
+#endif
@@ -0,0 +1,172 @@
+//
+// SDcrc.c, CRC7 and CRC16 for SPI mode with CRC checking on (CMD59)
+//
+// Commands end with a CRC7 over their 5 bytes, data blocks with a CRC16-CCITT
+// (polynomial $1021, start 0) over the data. A bit at a time costs about 300
+// cycles a byte in C, 150 k a block: as much as the transfer itself. With a
+// table of 256 entries one step handles a whole byte. The tables are built
+// once by SDCrcInit(), 768 bytes of RAM.
+// The 6309 CRC16 keeps the CRC in D and indexes the high and low byte tables
+// with A,Y and A,U; that offset is signed, so entry i is stored at i^$80 and
+// the registers point to the middle of the tables. Two bytes per loop swap
+// the roles of A and B instead of an EXG per byte. Host builds (jfsimg) use
+// plain C on the same tables.
+// Included at the end of TOM6309SDcard.c, and by jfsimg.
+//
+// Estimated cycles, native mode, call overhead excluded:
+//	SDCrc16Bit per byte	8 x (test, shift, EOR) in C: about 300
+//	SDCrc16 per byte	EOR ,X+ 6, EOR A,Y 5, LD A,U 5, DECW/BNE 5 per 2: 18.5
+//	SDCrc16 per block	about 9500, 150 k bit by bit
+//	SDCrc7 per command	5 table steps in C: about 250
+//
+
+static unsigned char SDCrcHi[256];	//CRC16 table high bytes, entry i at i^$80
+static unsigned char SDCrcLo[256];	//CRC16 table low bytes, entry i at i^$80
+static unsigned char SDCrc7Tab[256];	//CRC7 table, the CRC in bits 7..1
+static bool SDCrcReady;
+
+//
+// Build the tables, bit by bit once. Called by SDSetCrc().
+//
+void SDCrcInit()
+{
+unsigned int Index, Crc;
+unsigned char Bit, Crc7;
+
+	if (SDCrcReady) return;
+	for (Index=0;Index<256;Index++) {
+		Crc=Index<<8;
+		Crc7=(unsigned char)Index;
+		for (Bit=0;Bit<8;Bit++) {
+			Crc=((Crc&0x8000) ? (Crc<<1)^0x1021 : Crc<<1)&0xFFFF;
+			Crc7=(Crc7&0x80) ? (Crc7<<1)^0x12 : Crc7<<1;
+		}
+		SDCrcHi[Index^0x80]=(unsigned char)(Crc>>8);
+		SDCrcLo[Index^0x80]=(unsigned char)Crc;
+		SDCrc7Tab[Index]=Crc7;
+	}
+	SDCrcReady=true;
+}
+
+//
+// CRC7 of a command, with the end bit: the last byte to send.
+//
+unsigned char SDCrc7(unsigned char Data[], int Count)
+{
+unsigned char Crc;
+
+	Crc=0;
+	while (Count-->0) Crc=SDCrc7Tab[Crc^*Data++];
+	return(Crc|1);
+}
+
+//
+// CRC16 of Count bytes, as the card sends it after a data block.
+//
+unsigned int SDCrc16(unsigned char Data[], int Count)
+{
+unsigned int Crc;
+#ifdef _CMOC_VERSION_
+unsigned char* Hi;
+unsigned char* Lo;
+
+	Hi=SDCrcHi+128;
+	Lo=SDCrcLo+128;
+	asm
+	{
+	PSHS	X,Y,U
+	PSHSW
+	LDX	Data
+	LDW	Count
+	LDY	Hi
+	LDU	Lo		//no locals from here on
+	CLRD			//A = CRC high, B = CRC low
+	LSRW			//pairs of bytes, carry: one byte more
+	BCC	Crc16Pair
+	EORA	,X+		//table index
+	EORB	A,Y		//low ^ table high: new high
+	LDA	A,U		//table low: new low
+	EXG	A,B
+Crc16Pair	TSTW
+	BEQ	Crc16End
+Crc16Lp	EORA	,X+		//CRC in A:B
+	EORB	A,Y
+	LDA	A,U		//now in B:A
+	EORB	,X+
+	EORA	B,Y
+	LDB	B,U		//back in A:B
+	DECW
+	BNE	Crc16Lp
+Crc16End	PULSW
+	PULS	X,Y,U
+	STD	Crc
+	}
+#else
+unsigned char Index;
+
+	Crc=0;
+	while (Count-->0) {
+		Index=(unsigned char)((Crc>>8)^*Data++)^0x80;
+		Crc=(((Crc<<8)^(SDCrcHi[Index]<<8))&0xFF00)|SDCrcLo[Index];
+	}
+#endif
+	return(Crc);
+}
+
+//
+// CRC16 a bit at a time, the reference for the tables and jfsimg crc.
+//
+unsigned int SDCrc16Bit(unsigned char Data[], int Count)
+{
+unsigned int Crc;
+unsigned char Bit;
+
+	Crc=0;
+	while (Count-->0) {
+		Crc^=(unsigned int)*Data++<<8;
+		for (Bit=0;Bit<8;Bit++) Crc=((Crc&0x8000) ? (Crc<<1)^0x1021 : Crc<<1)&0xFFFF;
+	}
+	return(Crc);
+}
+
+//
+// Known CRCs: the CRC7 bytes of commands the driver sends, taken from the SD
+// specification and card traces, and the CRC16-CCITT check values. Then both
+// loop entries of SDCrc16 (odd and even counts) against SDCrc16Bit on the
+// tables themselves, so no block buffer is needed. Returns the number of
+// wrong results, with Verbose each is printed. Run by SDSetCrc() before CRC
+// checking goes on, by SD-mon T and by jfsimg crc.
+//
+static struct crc7case{
+	unsigned char	cmd[5];
+	unsigned char	crc;
+} SDCrc7Cases[]={
+	{{0x40,0x00,0x00,0x00,0x00},0x95},	//CMD0
+	{{0x48,0x00,0x00,0x01,0xAA},0x87},	//CMD8, 2.7-3.6 V, check pattern $AA
+	{{0x51,0x00,0x00,0x00,0x00},0x55},	//CMD17 block 0
+	{{0x77,0x00,0x00,0x00,0x00},0x65},	//CMD55
+	{{0x69,0x40,0x00,0x00,0x00},0x77},	//ACMD41, HCS
+	{{0x7A,0x00,0x00,0x00,0x00},0xFD}	//CMD58
+};
+
+int SDCrcSelfTest(bool Verbose)
+{
+unsigned char Index;
+unsigned char Got;
+int Wrong;
+
+	SDCrcInit();
+	Wrong=0;
+	for (Index=0;Index<sizeof(SDCrc7Cases)/sizeof(SDCrc7Cases[0]);Index++) {
+		Got=SDCrc7(SDCrc7Cases[Index].cmd,5);
+		if (Got==SDCrc7Cases[Index].crc) continue;
+		Wrong++;
+		if (Verbose) printf("\nCRC7 of $%02x: $%02x, not $%02x",SDCrc7Cases[Index].cmd[0],Got,SDCrc7Cases[Index].crc);
+	}
+	if (SDCrc16((unsigned char*)"123456789",9)!=0x31C3) Wrong++;
+	if (SDCrc16((unsigned char*)"12345678",8)!=0x9015) Wrong++;
+	if (SDCrc16(SDCrcHi,255)!=SDCrc16Bit(SDCrcHi,255)) Wrong++;
+	if (SDCrc16(SDCrcLo,256)!=SDCrc16Bit(SDCrcLo,256)) Wrong++;
+	if (Verbose && Wrong!=0) printf("\n%d wrong CRC result(s)",Wrong);
+	return(Wrong);
+}
@@ -0,0 +1,404 @@
+//
+// SPI protocol of TOM6309SDcard.c: single block commands without the ROM,
+// the CMD18/CMD25 streams, busy and token waits, data responses and CRC
+// retries. Plain C on SPIRead(), SPIWrite(), SPIReadBuf(), SPIWriteBuf(),
+// SDCommand() and SDDeselect(), so it also builds on a host: jfsimg runs it
+// against a card simulated at the byte level (jfsimg spi).
+// Uses SDWriteBehind, SDBusyPending, SDCrcOn, SDCrcWanted and SDStreamBlock
+// of the file that includes it.
+// Included at the end of TOM6309SDcard.c, and by jfsimg.
+//
+
+#include "TOM6309SDcard.h"
+
+//
+// Single block read and write on SPIReadBuf()/SPIWriteBuf(), without the ROM
+// block routines. SDReadBlock() and SDWriteBlock() use these while CRC
+// checking is on: the ROM routines send a dummy CRC and drop the one
+// received. A block with a CRC error goes again.
+//
+int SDReadBlockSPI(unsigned char CB[], unsigned char BlockBuffer[])
+{
+int ReadStat;
+unsigned char Tries;
+
+	SDSync();
+	SDStatBegin(SDC_READ);
+	SDStatBlock();
+	for (Tries=1;;Tries++) {
+		if (SDCommand(SDCMDReadBlock,CB)!=0) {
+			ReadStat=SDREADFAIL;
+		} else if (SDWaitToken()!=SDRDY) {
+			ReadStat=SDNOTOK;
+		} else {
+			ReadStat=SDReadData(BlockBuffer,SDBlockSize);
+		}
+		SDDeselect();
+		if (ReadStat!=SDCRCERR || Tries>=SDCRCTRIES) break;
+		SDStatCrcRetry();
+	}
+	return(SDStatEnd(ReadStat));
+}
+
+int SDWriteBlockSPI(unsigned char CB[],unsigned char BlockBuffer[])
+{
+int WriteStat;
+unsigned char Tries;
+
+	SDSync();
+	SDStatBegin(SDC_WRITE);
+	SDStatBlock();
+	for (Tries=1;;Tries++) {
+		if (SDCommand(SDCMDWriteBlock,CB)!=0) {
+			SDDeselect();
+			return(SDStatEnd(SDWRTFAIL));
+		}
+		SPIWrite(0xFF);			//one byte gap before the token
+		WriteStat=SDWriteData(SDTOKSTART,BlockBuffer);
+		if (WriteStat==SDRDY && SDWriteBehind) {
+			SDBusyPending=true;	//Stays selected, SDSync() polls the busy state
+			break;
+		}
+		SDWaitReady();
+		SDDeselect();
+		if (WriteStat!=SDCRCERR || Tries>=SDCRCTRIES) break;
+		SDStatCrcRetry();
+	}
+	return(SDStatEnd(WriteStat));
+}
+
+//
+// Wait until the card is no longer busy: it holds DO low while programming.
+// Replaces the ROM's SD_WaitReady so the polls can be counted.
+//
+void SDWaitReady()
+{
+unsigned long Polls;
+
+	Polls=0;
+	while (SPIRead()!=0xFF) Polls++;
+	SDStatWait(Polls);
+}
+
+//
+// Write-behind: SDWriteBlock returns as soon as the block is sent, while the
+// card is still programming it (milliseconds). The busy-wait moves to the
+// start of the next command, so the caller can prepare the next buffer
+// in the meantime. The SPI transfer itself is done, the buffer is free at once.
+//
+void SDSetWriteBehind(bool On)
+{
+	SDSync();
+	SDWriteBehind=On;
+}
+
+//
+// Wait until a block written with write-behind is programmed.
+// Every command does this first; call it before power-off or card removal.
+//
+void SDSync()
+{
+	if (SDBusyPending) {
+		SDBusyPending=false;
+		SDStatCharge(SDC_WRITE);	//The wait belongs to the write
+		SDWaitReady();
+	}
+}
+
+//
+// Wait for a data start token. Returns SDRDY, or SDNOTOK on time-out or error token.
+//
+int SDWaitToken()
+{
+int Tries;
+unsigned char Token;
+
+	for (Tries=0;Tries<SDTOKTRIES;Tries++) {
+		Token=SPIRead();
+		if (Token!=0xFF) break;
+	}
+	SDStatWait((unsigned long)Tries);
+	if (Token==SDTOKSTART) return(SDRDY);
+	return(SDNOTOK);			//time-out or data error token
+}
+
+//
+// Clock in Count data bytes and their CRC after the data token. With CRC
+// checking on returns SDCRCERR if the CRC does not match the data.
+//
+int SDReadData(unsigned char Buffer[],int Count)
+{
+unsigned int Crc;
+
+	SPIReadBuf(Buffer,Count);
+	Crc=(unsigned int)SPIRead()<<8;		//CRC, high byte first
+	Crc|=SPIRead();
+	if (SDCrcOn && Crc!=SDCrc16(Buffer,Count)) return(SDCRCERR);
+	return(SDRDY);
+}
+
+//
+// Send Token, a block and its CRC (or $FFFF with CRC checking off), then
+// read the data response: SDRDY, SDCRCERR or SDWRTFAIL. The card is busy
+// programming the block after SDRDY.
+//
+int SDWriteData(unsigned char Token,unsigned char Buffer[])
+{
+unsigned int Crc;
+unsigned char Response;
+
+	Crc=SDCrcOn ? SDCrc16(Buffer,SDBlockSize) : 0xFFFF;
+	SPIWrite(Token);
+	SPIWriteBuf(Buffer,SDBlockSize);
+	SPIWrite((unsigned char)(Crc>>8));
+	SPIWrite((unsigned char)Crc);
+	Response=SPIRead()&SDDRESPMASK;
+	if (Response==SDDRESPOK) return(SDRDY);
+	if (Response==SDDRESPCRC) return(SDCRCERR);
+	return(SDWRTFAIL);
+}
+
+//
+// CMD59 CRC_ON_OFF. With CRC checking on the card rejects commands and data
+// blocks with a wrong CRC and the driver checks the CRC of every block it
+// reads; a bad command or block goes again, up to SDCRCTRIES times. The
+// table CRCs (SDcrc.c) cost about 9500 cycles a block. SDInit() turns it on
+// again after a card reset. It is off until asked for (SD-mon K), and only
+// goes on if the CRC kernels pass their self-test: a wrong CRC7 would make
+// the card reject every command. Not yet tried on the board.
+//
+int SDSetCrc(bool On)
+{
+unsigned char Arg[4];
+int CrcStat;
+
+	SDSync();
+	if (On && SDCrcSelfTest(false)!=0) return(SDCRCERR);
+	Arg[0]=Arg[1]=Arg[2]=0;
+	Arg[3]=On ? 1 : 0;
+	CrcStat=SDRDY;
+	if (SDCommand(SDCMDCrcOnOff,Arg)&~R1IDLE) CrcStat=SDERR;
+	SDDeselect();
+	if (CrcStat==SDRDY) SDCrcOn=On;
+	SDCrcWanted=On;
+	return(CrcStat);
+}
+
+bool SDGetCrc()
+{
+	return(SDCrcOn);
+}
+
+//
+// Multi-block read stream. SDReadStart() sends one CMD18, every SDReadNext()
+// then only waits for the data token and clocks in 512 bytes + CRC.
+// In SPI mode the host drives the clock, so the caller may take as long as
+// it likes between blocks. SDReadStop() sends STOP_TRAN and deselects.
+//
+int SDReadStart(unsigned char CB[])
+{
+	SDSync();
+	SDStatBegin(SDC_READMULTI);
+	SDStreamBlock=BlkDecode(CB);
+	if (SDCommand(SDCMDReadMulti,CB)!=0) {
+		SDDeselect();
+		return(SDStatEnd(SDREADFAIL));
+	}
+	return(SDStatEnd(SDRDY));
+}
+
+//
+// A block with a CRC error ends the stream, a new CMD18 starts at that block.
+//
+int SDReadNext(unsigned char BlockBuffer[])
+{
+int ReadStat;
+unsigned char Tries;
+unsigned char CB[4];
+
+	SDStatCharge(SDC_READMULTI);
+	SDStatBlock();
+	for (Tries=1;;Tries++) {
+		if (SDWaitToken()!=SDRDY) return(SDStatEnd(SDNOTOK));
+		ReadStat=SDReadData(BlockBuffer,SDBlockSize);
+		if (ReadStat!=SDCRCERR || Tries>=SDCRCTRIES) break;
+		SDStatCrcRetry();
+		SDReadStop();
+		BlkEncode(CB,SDStreamBlock);
+		SDStatCharge(SDC_READMULTI);
+		if (SDCommand(SDCMDReadMulti,CB)!=0) {
+			SDDeselect();
+			return(SDStatEnd(SDREADFAIL));
+		}
+	}
+	if (ReadStat==SDRDY) SDStreamBlock=BlkAdd(SDStreamBlock,1);
+	return(SDStatEnd(ReadStat));
+}
+
+int SDReadStop()
+{
+unsigned char NoArg[4];
+int StopStat;
+
+	SDStatCharge(SDC_READMULTI);
+	NoArg[0]=NoArg[1]=NoArg[2]=NoArg[3]=0;
+	StopStat=SDRDY;
+	if (SDCommand(SDCMDStopTran,NoArg)&~R1IDLE) StopStat=SDERR;
+	SDWaitReady();				//STOP_TRAN has a busy response
+	SDDeselect();
+	return(StopStat);
+}
+
+//
+// Multi-block write stream. SDWriteStart() sends one CMD25, every SDWriteNext()
+// sends a data token, 512 bytes and a dummy CRC, checks the data response and
+// waits while the card programs. SDWriteStop() sends the stop token.
+//
+int SDWriteStart(unsigned char CB[])
+{
+	SDSync();
+	SDStatBegin(SDC_WRITEMULTI);
+	SDStreamBlock=BlkDecode(CB);
+	if (SDCommand(SDCMDWriteMulti,CB)!=0) {
+		SDDeselect();
+		return(SDStatEnd(SDWRTFAIL));
+	}
+	SPIWrite(0xFF);				//one byte gap before the first token
+	return(SDStatEnd(SDRDY));
+}
+
+//
+// A block with a CRC error ends the stream, a new CMD25 starts at that block.
+//
+int SDWriteNext(unsigned char BlockBuffer[])
+{
+int WriteStat;
+unsigned char Tries;
+unsigned char CB[4];
+
+	SDStatCharge(SDC_WRITEMULTI);
+	SDStatBlock();
+	for (Tries=1;;Tries++) {
+		WriteStat=SDWriteData(SDTOKMULTI,BlockBuffer);
+		SDWaitReady();			//card programs the block, or recovers
+		if (WriteStat!=SDCRCERR || Tries>=SDCRCTRIES) break;
+		SDStatCrcRetry();
+		SDWriteStop();
+		BlkEncode(CB,SDStreamBlock);
+		SDStatCharge(SDC_WRITEMULTI);
+		if (SDCommand(SDCMDWriteMulti,CB)!=0) {
+			SDDeselect();
+			return(SDStatEnd(SDWRTFAIL));
+		}
+		SPIWrite(0xFF);			//one byte gap before the first token
+	}
+	if (WriteStat==SDRDY) SDStreamBlock=BlkAdd(SDStreamBlock,1);
+	return(SDStatEnd(WriteStat));
+}
+
+int SDWriteStop()
+{
+	SDStatCharge(SDC_WRITEMULTI);
+	SPIWrite(SDTOKSTOP);
+	SPIRead();				//stuff byte
+	SDWaitReady();
+	SDDeselect();
+	return(SDRDY);
+}
+
+//
+// Read Count consecutive blocks into Buffer (Count*512 bytes) with one command.
+//
+int SDReadBlocks(unsigned char CB[],unsigned char Buffer[],int Count)
+{
+int ReadStat;
+
+	if ((ReadStat=SDReadStart(CB))!=SDRDY) return(ReadStat);
+	while (Count>0) {
+		if ((ReadStat=SDReadNext(Buffer))!=SDRDY) break;
+		Buffer+=SDBlockSize;
+		Count--;
+	}
+	SDReadStop();
+	return(ReadStat);
+}
+
+//
+// Write Count consecutive blocks from Buffer (Count*512 bytes) with one command.
+//
+int SDWriteBlocks(unsigned char CB[],unsigned char Buffer[],int Count)
+{
+int WriteStat;
+
+	if ((WriteStat=SDWriteStart(CB))!=SDRDY) return(WriteStat);
+	while (Count>0) {
+		if ((WriteStat=SDWriteNext(Buffer))!=SDRDY) break;
+		Buffer+=SDBlockSize;
+		Count--;
+	}
+	SDWriteStop();
+	return(WriteStat);
+}
+
+//
+// Erase the blocks from StartCB[0..3] up to and including EndCB[0..3] with
+// ERASE_WR_BLK_START, ERASE_WR_BLK_END and ERASE. The card erases internally;
+// afterwards the blocks read as SCR EraseFill. Large ranges keep the card
+// busy for a long time, callers should erase in chunks.
+//
+int SDEraseBlocks(unsigned char StartCB[],unsigned char EndCB[])
+{
+int EraseStat;
+
+	SDSync();
+	SDStatBegin(SDC_ERASE);
+	EraseStat=SDRDY;
+	if (SDCommand(SDCMDEraseStart,StartCB)!=0) EraseStat=SDERASEFAIL;
+	SDDeselect();
+	if (EraseStat==SDRDY) {
+		if (SDCommand(SDCMDEraseEnd,EndCB)!=0) EraseStat=SDERASEFAIL;
+		SDDeselect();
+	}
+	if (EraseStat==SDRDY) {
+		if (SDCommand(SDCMDErase,StartCB)!=0) EraseStat=SDERASEFAIL;	//argument is stuff bits
+		SDWaitReady();			//busy until the erase is done
+		SDDeselect();
+	}
+	return(SDStatEnd(EraseStat));
+}
+
+//
+// Read the SD Configuration Register with APP_CMD + SEND_SCR.
+// The 8 byte SCR comes as a data block.
+//
+struct scrregister SDReadSCR()
+{
+struct scrregister ThisCard;
+unsigned char NoArg[4];
+unsigned char SCRBuffer[8];
+
+	SDSync();
+	SDStatBegin(SDC_SCR);
+	NoArg[0]=NoArg[1]=NoArg[2]=NoArg[3]=0;
+	ThisCard.status=SDREADFAIL;
+	ThisCard.EraseFill=0x00;
+	if ((SDCommand(SDCMDAppCmd,NoArg)&~R1IDLE)==0) {
+		SDDeselect();
+		if (SDCommand(SDACMDSendSCR,NoArg)==0 && SDWaitToken()==SDRDY) {
+			ThisCard.status=SDReadData(SCRBuffer,8);
+		}
+		if (ThisCard.status==SDRDY) {
+			ThisCard.SCRStructure=SCRBuffer[0]>>4;		//bits 63..60
+			ThisCard.SDSpec=SCRBuffer[0]&0x0F;		//bits 59..56
+			if (SCRBuffer[1]&0x80) ThisCard.EraseFill=0xFF;	//bit 55: DATA_STAT_AFTER_ERASE
+			ThisCard.BusWidths=SCRBuffer[1]&0x0F;		//bits 51..48
+		}
+	}
+	SDDeselect();
+
+#ifdef DEBUG
+	printf("\nSCR data\t: %02x %02x",SCRBuffer[0],SCRBuffer[1]);
+#endif //ifdef DEBUG
+	SDStatEnd(ThisCard.status);
+	return(ThisCard);
+}
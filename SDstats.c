@@ -0,0 +1,69 @@
+//
+// Driver statistics for TOM6309SDcard.c
+// Plain C without ROM calls or asm, so it also builds on a host (see jfsimg.c).
+//
+// Every instrumented driver call starts with SDStatBegin() and passes its result
+// through SDStatEnd(). Busy-waits in between are charged to that command with
+// SDStatWait(). A stream counts one call per CMD18/CMD25 and one block and one
+// result per SDReadNext()/SDWriteNext(); single block commands may come in
+// between, so the stream calls select their command again with SDStatCharge().
+//
+
+#include "TOM6309SDcard.h"
+
+static struct sdstats SDStats;
+static unsigned char SDStatCmd;		//Command the next waits and blocks are charged to
+
+void SDStatBegin(unsigned char Cmd)
+{
+	SDStatCmd=Cmd;
+	SDStats.cmd[Cmd].calls++;
+}
+
+void SDStatCharge(unsigned char Cmd)
+{
+	SDStatCmd=Cmd;
+}
+
+int SDStatEnd(int Status)
+{
+	if (Status>=0 && Status<SDNRSTATUS) SDStats.cmd[SDStatCmd].status[Status]++;
+	return(Status);
+}
+
+void SDStatBlock()
+{
+	SDStats.cmd[SDStatCmd].blocks++;
+}
+
+void SDStatWait(unsigned long Polls)
+{
+struct sdcmdstat* Stat;
+
+	Stat=&SDStats.cmd[SDStatCmd];
+	Stat->waitpolls+=Polls;
+	if (Polls>Stat->waitmax) Stat->waitmax=Polls;
+}
+
+void SDStatInitTry()
+{
+	SDStats.inittries++;
+}
+
+void SDStatCrcRetry()
+{
+	SDStats.cmd[SDStatCmd].crcretries++;
+}
+
+//
+// Copy all counters at once, so a display shows one consistent moment.
+//
+void SDStatsSnapshot(struct sdstats* Snapshot)
+{
+	memcpy(Snapshot,&SDStats,sizeof(struct sdstats));
+}
+
+void SDStatsReset()
+{
+	memset(&SDStats,0,sizeof(struct sdstats));
+}
@@ -28,6 +28,11 @@
 
 int SDInitRemaining;
 int SDStat;
+static bool SDWriteBehind;	//Leave the card programming when SDWriteBlock returns
+static bool SDBusyPending;	//A block written with write-behind may still be programming
+static bool SDCrcOn;		//Commands carry their CRC7, data blocks a checked CRC16
+static bool SDCrcWanted;	//SDInit() turns CRC checking on again
+static long SDStreamBlock;	//Next block of the CMD18/CMD25 stream, to start over after a CRC error
 
 //
 // InitSD tries n times to initialize the SD device
@@ -40,8 +45,10 @@ int NrTriesUsed;
 
 	SDResult[0]=SDResult[1]=SDResult[2]=SDResult[3]=SDResult[4]=0;
 	SDInitRemaining=NrTries;
+	SDCrcOn=false;			//CMD0 in SD_Init turns CRC checking off
 	do {
 		SDInitRemaining--;
+		SDStatInitTry();
 		SDResult[0]=(unsigned char)SDInitRemaining;
 		CardInfo=SD_Init(SDResult);
 	} while(!(CardInfo.status==SDRDY) && SDInitRemaining>0);
@@ -53,6 +60,7 @@ int NrTriesUsed;
 	} else {
 		printf("\nDone in %d tries",NrTriesUsed);
 	}
+	if (CardInfo.status==SDRDY && SDCrcWanted && SDSetCrc(true)!=SDRDY) printf("\nNo CRC checking");
 	return(CardInfo);
 }
 
@@ -67,6 +75,8 @@ struct sdinfo ThisCard;
 int InitStat;
 int version;
 
+	SDSync();
+	SDStatBegin(SDC_INIT);
 	asm
 	{
 	PSHS	X,D		//save index register and A,B
@@ -95,7 +105,7 @@ InitDone
 	PULSW
 	PULS	X,D		//retrieve index register and A,B
 	} 
-	ThisCard.status=InitStat;
+	ThisCard.status=SDStatEnd(InitStat);
 #ifdef DEBIG
 printf("\nInitstat : %d",InitStat);
 #endif
@@ -112,6 +122,10 @@ int ReadStat;
 	printf("\n SD_ReadBlock: Cmdbuf = [%02x %02x %02x %02x %02x %02x] &blockbuf=%x ",CB[0],CB[1],CB[2],CB[3],CB[4],CB[5],BlockBuffer );
 #endif //DEBUG
 
+	if (SDCrcOn) return(SDReadBlockSPI(CB,BlockBuffer));
+	SDSync();
+	SDStatBegin(SDC_READ);
+	SDStatBlock();
 	asm
 	{
 	PSHS	D,U,X,Y		//save D,X,Y register
@@ -134,7 +148,7 @@ ReadDone
 	PULSW			//retrieve registers
 	PULS	D,U,X,Y		//retrieve registers
 	}
-	return(ReadStat);
+	return(SDStatEnd(ReadStat));
 }
 
 int SDWriteBlock(unsigned char CB[],unsigned char BlockBuffer[])
@@ -145,6 +159,10 @@ int WriteStat;
 	printf("\n SD_WriteBlock: Cmdbuf = [%02x%02x %02x%02x %02x%02x] &blockbuf=%x ",CB[0],CB[1],CB[2],CB[3],CB[4],CB[5],BlockBuffer );
 #endif //DEBUG
 
+	if (SDCrcOn) return(SDWriteBlockSPI(CB,BlockBuffer));
+	SDSync();
+	SDStatBegin(SDC_WRITE);
+	SDStatBlock();
 	asm
 	{
 	PSHS	D,U,X,Y		//save D,X,Y register
@@ -158,11 +176,16 @@ int WriteStat;
 // Error handling
 WriteFail	LDD	#SDWRTFAIL	//if a<>0: Command 17 failed
 	STD	WriteStat		//save error code in status	
-WriteDone	JSR	[SD_WaitReady_ptr]	//Wait until SD ready
+WriteDone	
 	PULSW			//retrieve registers
 	PULS	D,U,X,Y		//retrieve registers
 	}
-	return(WriteStat);
+	if (SDWriteBehind) {
+		SDBusyPending=true;		//Next command waits, the caller may work meanwhile
+	} else {
+		SDWaitReady();			//Wait until SD ready, counted
+	}
+	return(SDStatEnd(WriteStat));
 }
 
 struct csdregister SDReadCSD()
@@ -171,22 +194,23 @@ struct csdregister ThisCard;
 unsigned char CmdBuffer[6];
 unsigned int RESBUF[2];
 unsigned char CSDBuffer[16];
-unsigned long DevSize;
+unsigned char CSize[4];
 unsigned char ByteNo;
 unsigned int ResultCode;
-unsigned long p1, p2, p3;
 
 	CmdBuffer[0]=SD_SEND_CSD;	//command code
 	CmdBuffer[1]=0;
 	CmdBuffer[2]=0;
 	CmdBuffer[3]=0;
 	CmdBuffer[4]=0;
-	CmdBuffer[5]=1;		//Cmd buffer filled...
+	CmdBuffer[5]=SDCrcOn ? SDCrc7(CmdBuffer,5) : 1;	//Cmd buffer filled...
 	ResultCode=0x00;		//Preload Result code with OK...
 
 for (ByteNo=0;ByteNo<16;ByteNo++) {
 	CSDBuffer[ByteNo]=ByteNo;
 }
+	SDSync();
+	SDStatBegin(SDC_CSD);
 	asm
 	{
 	PSHS	X,Y,D		        //Save X, Y, D
@@ -210,6 +234,7 @@ GOTRSP	STA	,y+		            //save first non-negative byte
 	                       
 	PULS	X,Y,D		        //Retrieve X, Y, D 
 	}
+	SDStatEnd(ResultCode==0 ? SDRDY : SDREADFAIL);
 
 #ifdef DEBUG
 printf("\nCSD data\t: ");
@@ -222,12 +247,11 @@ for (ByteNo=0;ByteNo<16;ByteNo++) {
 	
 	ThisCard.TranSpeed=CSDBuffer[3];	    //byte 3
 
-	p1=(unsigned long)CSDBuffer[7]&63;	    //lowest 6 bits of byte 7
-	p1=p1<<16;			                    //make room for another 16 bits
-	p2=(unsigned long)CSDBuffer[8]<<8;	    //add whole byte 8
-	p3=(unsigned long)CSDBuffer[9];	        //plus byte 9
-	DevSize=p1+p2+p3;
-	ThisCard.Csize=DevSize;                 //Size of card in 512 byte blocks?
+	CSize[0]=0;
+	CSize[1]=CSDBuffer[7]&63;	            //lowest 6 bits of byte 7
+	CSize[2]=CSDBuffer[8];	                //whole byte 8
+	CSize[3]=CSDBuffer[9];	                //plus byte 9
+	ThisCard.Csize=BlkDecode(CSize);        //Size of card in 512 kB units, minus 1
 	
 	ThisCard.Copy=(CSDBuffer[14]&64); 	    //true if bit 7 is set
 	
@@ -236,4 +260,120 @@ for (ByteNo=0;ByteNo<16;ByteNo++) {
 	ThisCard.TempWP=(CSDBuffer[14]&16); 	//true if bit 5 is set
 
 	return(ThisCard);	
-}
\ No newline at end of file
+}
+
+//
+// SPI primitives for the multi-block streams.
+// The ROM jump table has no byte write, so SPIWrite() and SPIWriteBuf() drive
+// SDPORT directly: a write to the port starts the transfer, IO_SDBSY in IOPORT
+// is set while the byte is shifted out.
+//
+
+unsigned char SPIRead()
+{
+unsigned char Value;
+
+	asm
+	{
+	PSHS	X,Y,U		//ROM routine may use any register
+	JSR	[SPI_Read_ptr]	//clock in one byte
+	PULS	X,Y,U		//retrieve registers, U is our frame pointer
+	STA	Value		//save received byte
+	}
+	return(Value);
+}
+
+void SPIWrite(unsigned char Value)
+{
+	asm
+	{
+	PSHS	D
+	LDA	Value		//byte to send
+	STA	SDPORT		//start shifting it out
+SPIWBsy	LDB	IOPORT		//wait until shifted
+	BITB	#IO_SDBSY
+	BNE	SPIWBsy
+	PULS	D
+	}
+}
+
+void SPIReadBuf(unsigned char Buffer[],int Count)
+{
+	asm
+	{
+	PSHS	D,U,X,Y		//save registers
+	PSHSW
+	LDX	Count		//transfer count
+	LDY	Buffer		//buffer to receive data
+	JSR	[SPI_ReadBlock_ptr]	//transfer (X) bytes to buffer at Y
+	PULSW
+	PULS	D,U,X,Y
+	}
+}
+
+void SPIWriteBuf(unsigned char Buffer[],int Count)
+{
+	asm
+	{
+	PSHS	D,X,Y
+	LDX	Buffer		//bytes to send
+	LDY	Count		//transfer count
+SPIWBLp	LDA	,X+		//next byte
+	STA	SDPORT		//start shifting it out
+SPIWBBs	LDB	IOPORT		//wait until shifted
+	BITB	#IO_SDBSY
+	BNE	SPIWBBs
+	LEAY	-1,Y
+	BNE	SPIWBLp
+	PULS	D,X,Y
+	}
+}
+
+//
+// Send a command with the 4 byte argument in CmdBuffer[0..3].
+// Returns R1. The card stays selected. With CRC checking on a command the
+// card got with a CRC error is sent again.
+//
+unsigned char SDCommand(unsigned char Command, unsigned char CmdBuffer[])
+{
+unsigned char CmdStruct[6];
+unsigned char R1;
+unsigned char Tries;
+
+	CmdStruct[0]=0x40|Command;	//command byte
+	CmdStruct[1]=CmdBuffer[0];	//argument, block #
+	CmdStruct[2]=CmdBuffer[1];
+	CmdStruct[3]=CmdBuffer[2];
+	CmdStruct[4]=CmdBuffer[3];
+	CmdStruct[5]=SDCrcOn ? SDCrc7(CmdStruct,5) : 0x01;	//CRC only checked after CMD59, end bit
+	for (Tries=1;;Tries++) {
+		asm
+		{
+		PSHS	D,X,Y
+		LEAX	CmdStruct		//command structure
+		PSHS	U		//Preserve U!!!
+		TFR	X,U		//SD_SendCmd wants it in U
+		JSR	[SD_SendCmd_ptr]	//send command, R1 in A
+		PULS	U		//Restore U
+		STA	R1
+		PULS	D,X,Y
+		}
+		if (!(R1&R1COMCRCERR) || Tries>=SDCRCTRIES) break;
+		SDStatCrcRetry();
+		SDDeselect();
+	}
+	return(R1);
+}
+
+void SDDeselect()
+{
+	asm
+	{
+	OIM	#IO_SDCS,IOPORT	//negate SD card select
+	}
+}
+
+#include "SDspi.c"
+#include "SDstats.c"
+#include "SDblocknr.c"
+#include "SDcrc.c"
@@ -7,6 +7,17 @@
 #define _H_TOM6309SDcard
 #include <stdbool.h>
 
+// Uncomment this (or build with -DSDBLKASM) for the 6309 versions of the
+// block number helpers in SDblocknr.c. Not assembled yet: run SD-mon T on
+// the board with it before relying on it. Off, the C versions are used.
+//#define SDBLKASM
+
+// Uncomment this (or build with -DSDBOOTASM) for the stage-0 loader of
+// SDboot.c and SD-mon B L, which writes it to block 0. Not assembled or
+// booted yet: only jfsimg boot, its C model, has run. Off, block 0 is left
+// as it is and SD-mon B M still writes the old memory copy.
+//#define SDBOOTASM
+
 //Pointer table to low level routines
 
 #define SPI_ReadBlock_ptr	0xFF96
@@ -24,9 +35,18 @@
 //The named commands are command numbers used in C BuildCMDStructure
 
 const unsigned char SDCMD8[]={0x48,0x00,0x00,0x01,0xAA,0x87};
-const unsigned char SDCMD9[]={0x49,0x00,0x00,0x00,0x00,0x00};		
+const unsigned char SDCMD9[]={0x49,0x00,0x00,0x00,0x00,0xAF};
 const unsigned char SDCMDReadBlock = 17;
 const unsigned char SDCMDWriteBlock = 24;
+const unsigned char SDCMDStopTran = 12;
+const unsigned char SDCMDReadMulti = 18;
+const unsigned char SDCMDWriteMulti = 25;
+const unsigned char SDCMDEraseStart = 32;
+const unsigned char SDCMDEraseEnd = 33;
+const unsigned char SDCMDErase = 38;
+const unsigned char SDCMDAppCmd = 55;
+const unsigned char SDACMDSendSCR = 51;
+const unsigned char SDCMDCrcOnOff = 59;
 
 //R1 Error bits table
 #define R1SDBUSY		0x80
@@ -55,6 +75,9 @@ const unsigned char SDCMDWriteBlock = 24;
 #define SDTESTOK        6       //SD block readback test OK
 #define SDTESTNOK       7       //SD block readback test not OK
 #define SDREADFAIL      8       //SD block read failed
+#define SDERASEFAIL     9       //SD erase command sequence failed
+#define SDCRCERR        10      //SD CRC error, still after SDCRCTRIES transfers
+#define SDNRSTATUS      11      //Number of status codes above, for the statistics
 
 //SD command codes 
 #define	SD_SEND_CSD	    0x49	//SD Cmd 9 +$40
@@ -62,13 +85,23 @@ const unsigned char SDCMDWriteBlock = 24;
 //SD card data block size in bytes
 #define SDBlockSize     512 
 
+//SPI data tokens
+#define SDTOKSTART      0xFE    //Start of a data block (CMD17/18/24)
+#define SDTOKMULTI      0xFC    //Start of a data block in a CMD25 stream
+#define SDTOKSTOP       0xFD    //End of a CMD25 stream
+#define SDDRESPMASK     0x1F    //Data response mask after a written block
+#define SDDRESPOK       0x05    //Data accepted
+#define SDDRESPCRC      0x0B    //Data rejected, CRC error
+#define SDTOKTRIES      10000   //Polls for a data token before giving up
+#define SDCRCTRIES      3       //Transfers of a command or block with a CRC error before SDCRCERR
+
 //structures for SD card info
-typedef struct{
+typedef struct sdinfo{
 	int status;
 	bool version2;
 } sdinfo;			//basic infro from SDInit
 
-typedef struct{
+typedef struct csdregister{
 	unsigned char 	CSDStructure;
 	unsigned char	TranSpeed;
 	unsigned long 	Csize;
@@ -77,6 +110,42 @@ typedef struct{
 	bool		TempWP;
 } csdregister;
 
+typedef struct scrregister{
+	int		status;			//SDRDY if the SCR was read
+	unsigned char	SCRStructure;
+	unsigned char	SDSpec;
+	unsigned char	EraseFill;		//Contents of erased blocks: 0x00 or 0xFF (DATA_STAT_AFTER_ERASE)
+	unsigned char	BusWidths;
+} scrregister;
+
+//Driver statistics, see SDstats.c
+#define SDC_INIT        0       //SD_Init
+#define SDC_READ        1       //SDReadBlock, CMD17
+#define SDC_WRITE       2       //SDWriteBlock, CMD24
+#define SDC_CSD         3       //SDReadCSD, CMD9
+#define SDC_SCR         4       //SDReadSCR, ACMD51
+#define SDC_READMULTI   5       //Read streams, CMD18
+#define SDC_WRITEMULTI  6       //Write streams, CMD25
+#define SDC_ERASE       7       //SDEraseBlocks, CMD32/33/38
+#define SDC_NRCMDS      8
+#define SDPOLLCYCLES    60      //Estimated CPU cycles per busy-wait poll: call, ROM SPI_Read, compare
+#define SDBLOCKCYCLES   20000   //Guessed CPU cycles per 512 byte block: ROM SPI_ReadBlock, token, CRC; ROM not in this tree
+#define SDCMDCYCLES     1500    //Estimated CPU cycles per command: argument, 6 bytes out, R1
+
+typedef struct sdcmdstat{
+	unsigned long	calls;			//Commands sent
+	unsigned long	blocks;			//Data blocks transferred
+	unsigned int	status[SDNRSTATUS];	//Results by status code, [SDRDY] counts successes
+	unsigned long	waitpolls;		//Busy and token wait polls, summed
+	unsigned long	waitmax;		//Longest single wait in polls
+	unsigned long	crcretries;		//Commands and blocks sent or read again after a CRC error
+} sdcmdstat;
+
+typedef struct sdstats{
+	struct sdcmdstat cmd[SDC_NRCMDS];
+	unsigned long	inittries;		//SD_Init attempts made by SDInit
+} sdstats;
+
 //SD card related global variables
 long SDCardTotalBlocks;
 
@@ -85,6 +154,67 @@ struct sdinfo SDInit(int NrTries);					                        //try NrTries to
 struct sdinfo SD_Init(unsigned char ResultBuffer[]);                        //initialize SD-card interface
 int SDReadBlock(unsigned char CmdBuffer[],unsigned char BlockBuffer[]);     //Read block
 int SDWriteBlock(unsigned char CmdBuffer[],unsigned char BlockBuffer[]); 	//Write block
+int SDReadBlockSPI(unsigned char CmdBuffer[],unsigned char BlockBuffer[]);  //Read block without the ROM, CRC checked
+int SDWriteBlockSPI(unsigned char CmdBuffer[],unsigned char BlockBuffer[]); //Write block without the ROM, with CRC
 struct csdregister SDReadCSD();                                             //Read CSD data
+struct scrregister SDReadSCR();                                             //Read SCR data (ACMD51)
+int SDEraseBlocks(unsigned char StartCB[],unsigned char EndCB[]);           //Hardware erase of a block range
+int SDSetCrc(bool On);                                                      //CMD59: CRC checking on or off, kept over SDInit
+bool SDGetCrc();                                                            //true if CRC checking is on
+
+//multi-block streams: one CMD18/CMD25 for any number of consecutive blocks
+int SDReadStart(unsigned char CmdBuffer[]);                                 //Start CMD18 at block # in CmdBuffer[0..3]
+int SDReadNext(unsigned char BlockBuffer[]);                                //Read next block of the stream
+int SDReadStop();                                                           //End CMD18 stream with STOP_TRAN
+int SDWriteStart(unsigned char CmdBuffer[]);                                //Start CMD25 at block # in CmdBuffer[0..3]
+int SDWriteNext(unsigned char BlockBuffer[]);                               //Write next block of the stream
+int SDWriteStop();                                                          //End CMD25 stream with stop token
+int SDReadBlocks(unsigned char CmdBuffer[],unsigned char Buffer[],int Count);   //Read Count blocks into Buffer
+int SDWriteBlocks(unsigned char CmdBuffer[],unsigned char Buffer[],int Count);  //Write Count blocks from Buffer
+
+//SPI primitives used by the streams
+unsigned char SPIRead();                                                    //Clock in one byte
+void SPIWrite(unsigned char Value);                                         //Clock out one byte
+void SPIReadBuf(unsigned char Buffer[],int Count);                          //Clock in Count bytes
+void SPIWriteBuf(unsigned char Buffer[],int Count);                         //Clock out Count bytes
+unsigned char SDCommand(unsigned char Command, unsigned char CmdBuffer[]);  //Send command with arg from CmdBuffer[0..3], return R1
+void SDWaitReady();                                                         //Wait until the card is no longer busy
+void SDDeselect();                                                          //Negate SD card select
+void SDSetWriteBehind(bool On);                                             //true: SDWriteBlock does not wait for programming
+void SDSync();                                                              //Wait for a write-behind block to be programmed
+int SDWaitToken();                                                          //Wait for a data start token
+int SDReadData(unsigned char Buffer[],int Count);                           //Data and CRC after a token, SDCRCERR if wrong
+int SDWriteData(unsigned char Token,unsigned char Buffer[]);                //Token, block and CRC, then the data response
+
+//driver statistics
+void SDStatBegin(unsigned char Cmd);                                        //Count a call of Cmd, charge waits to it
+void SDStatCharge(unsigned char Cmd);                                       //Charge waits, blocks and results to Cmd
+int SDStatEnd(int Status);                                                  //Count the result, returns Status
+void SDStatBlock();                                                         //Count a transferred block
+void SDStatWait(unsigned long Polls);                                       //Count a busy-wait of Polls polls
+void SDStatInitTry();                                                       //Count an SD_Init attempt
+void SDStatCrcRetry();                                                      //Count a transfer repeated after a CRC error
+void SDStatsSnapshot(struct sdstats* Snapshot);                             //Copy all counters
+void SDStatsReset();                                                        //Zero all counters
+
+//32-bit block number helpers, see SDblocknr.c
+void BlkEncode(unsigned char Cmd[], long BlockNr);                         //Block # into Cmd[0..3], big-endian
+long BlkDecode(unsigned char Cmd[]);                                        //Block # from Cmd[0..3]
+long BlkAdd(long BlockNr, unsigned int Count);                              //BlockNr + Count
+long BlkShr(long BlockNr, unsigned char Shift);                             //BlockNr / 2^Shift
+int BlkCmp(long A, long B);                                                 //-1, 0 or 1
+int BlkSelfTest(bool Verbose);                                              //Helpers against known results, 0 if all agree
+
+//CRC7 and CRC16 tables, see SDcrc.c
+void SDCrcInit();                                                           //Build the tables
+unsigned char SDCrc7(unsigned char Data[], int Count);                      //CRC7 of a command with the end bit
+unsigned int SDCrc16(unsigned char Data[], int Count);                      //CRC16-CCITT of a data block
+unsigned int SDCrc16Bit(unsigned char Data[], int Count);                   //The same a bit at a time
+int SDCrcSelfTest(bool Verbose);                                            //Known CRCs, 0 if the kernels agree
+
+//boot loader, see SDboot.c; needs jfs.c
+unsigned char* BootStage0(unsigned int* Length);                            //Address and length of the stage-0 code
+int BootWriteStage0();                                                      //Write stage-0 to block 0
+int BootLoad(unsigned char Memory[], unsigned int* Exec);                   //Stage-0 in C, host builds only
 
 #endif //_H_TOM6309SDcard
\ No newline at end of file
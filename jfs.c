@@ -5,25 +5,78 @@
 	V0.0 (c) 2021 Jacob Beeksma.
 */
 
-#include "../../Bootstrap/JFS/jfs.h"
 #include "../../SD-card/SDMon/TOM6309SDcard.h"
+#include "../../Bootstrap/JFS/jfs.h"
 #include <stdbool.h>
 
+static struct s_cacheslot jfscache[JFSCACHESLOTS];             //The block cache, see readblock()/writeblock()
+static unsigned long jfscacheclock;                             //LRU clock, stamped into a slot on every use, never wraps in practice
+static struct s_dentry jfsdcache[JFSDCACHESIZE];               //The dentry cache, see jfs_lookup()
+static unsigned long jfsdcacheclock;                            //LRU clock for the dentry cache
+static long jfsbadblocks[JFSMAXBAD];                            //Bad block list, ascending, see is_bad_block()
+static int jfsnrbad;                                            //Nr of entries in jfsbadblocks
+static bool jfsbadloaded;                                       //jfsbadblocks holds the list of this card
+static bool jfsbaddirty;                                        //jfsbadblocks changed since it was written
+static bool jfsbadtrunc;                                        //The list on disk did not fit, nothing is allocated
+static long jfsjstart;                                          //First block of the journal region, 0 = no journal
+static unsigned int jfsjsize;                                   //Blocks in the journal region, header included
+static unsigned int jfsjhead;                                   //Position for the next transaction
+static unsigned int jfsjtail;                                   //Position of the oldest transaction not checkpointed
+static long jfsjseq;                                            //Sequence nr of the next transaction
+static long jfsjlow;                                            //Lowest home block logged since the last checkpoint
+static long jfsjhigh;                                           //Highest one, 0 if none, see jl_reuse()
+static unsigned char jfsjbuf[SDBlockSize];                      //Descriptor and checkpoint buffer, BlockBuffer may be in use
+static struct s_jfsfile jfsfiles[JFSMAXOPEN];                   //Open files, see jfs_open()
+static unsigned char fsckref[FSCKMAPBYTES];                     //jfs_fsck(): block is referenced, by the tree or a link
+static unsigned char fsckfree[FSCKMAPBYTES];                    //jfs_fsck(): block is seen (or expected) as free
+static long fscktotal;                                          //jfs_fsck(): blocks in the file system
+static long fsckbase;                                           //jfs_fsck(): first block the maps cover, jfs_defrag() moves this window
+static long fsckend;                                            //jfs_fsck(): first block past the maps, at most fscktotal
+static long fsckboot;                                           //jfs_fsck(): boot file of the partition, 0 once found in a dir
+static long fsckpos;                                            //jfs_fsck(): last block read by the scan
+static int fsckmsgs;                                            //jfs_fsck(): problems reported so far
+static bool fsckfix;                                            //jfs_fsck(): repair what is found
+static struct s_fsckstats* fsckres;                             //jfs_fsck(): results being collected
+static struct s_defragstats* dfres;                             //jfs_defrag(): results being collected
+static bool dfmove;                                             //jfs_defrag(): move fragmented objects, not only measure
+static long dfpart;                                             //jfs_defrag(): partition header of the tree being walked
+static long dfboot;                                             //jfs_defrag(): boot file of that partition, 0 once found in a dir
+
 /**
     JDOS_erase will format an SD card filesystem.
     It will first erase the boot block, abort if that fails.
     If success, it will then initialize the empty chain header.
         Test the header block first, abort if fail.
             Test the empty chain header block, abort if fail.
-                Initialize the empty chain, one block at a time.
-                ...
+                Initialize the empty chain for blocks 4..maxblocks:
+                FMT_SURFACE: pattern test every block, then append it to the chain one at a time.
+                FMT_STREAM:  write every block once with precomputed links, see ec_stream().
+                FMT_BITMAP:  no empty chain, write a free space bitmap instead, see bm_format().
+    FMT_QUICK skips all of this: the card erases itself, then only the metadata
+    blocks and the free space bitmap are written, see quick_erase().
 */
-long JDOS_erase(long maxblocks)
+long JDOS_erase(long maxblocks, unsigned char mode)
 {
 long blocknr, blockcnt;
-long newdir,newpart;
-unsigned char blocktype=T_EMPTYBLK;
 
+    blockcnt=0;
+    jfs_cacheinit();                            //Cached blocks and the journal belong to the old file system
+    dcache_init();                              //Cached names too
+    if (!load_bad_blocks() && jfsbadtrunc) {    //Blocks found bad by an earlier format stay bad
+        if (mode==FMT_QUICK || mode==FMT_BITMAP) {
+            printerr("Bad block list does not fit in RAM, use a surface or streamed format.\nAborted.");
+            return 0;
+        }
+        jfsbadtrunc=false;                      //Every block is verified, the rest are found again
+    }
+    if (mode==FMT_QUICK) {
+        if (quick_erase(maxblocks)) {
+            init_badblk_hdr();
+            blockcnt=bm_format(maxblocks);      //Erased blocks need no empty chain
+            init_rootpart();
+        }
+        return blockcnt;
+    }
 	if (!erase_test_block(A_BOOTBLOCK)) {		//erase and test boot block
 		printerr("Boot block can not be initialized.\nAborted.");
 	} else {
@@ -41,46 +94,257 @@ unsigned char blocktype=T_EMPTYBLK;
 		            printerr("Bad block header can not be initialized.\nAborted.");
         	    } else {
         	        init_badblk_hdr();
-        	        blockcnt=0;
         	        printf("\n");
-//FIXME: formatting whole device takes too long, cut down to 1024 blocks for testing
-//      	        for (blocknr=4;blocknr<=maxblocks;blocknr++) {  
-        	        for (blocknr=4;blocknr<=10;blocknr++) {       //10 = test value saves time during dev ;-)
-                        if (!erase_test_block(blocknr)) {
-                            printf("\nBlock %ld bad.\n",blocknr);
-                            add_bad_block(blocknr);
-                        } else {
-                            printf("\r%08lx",blocknr);
-                            blockcnt++;
-                            add_to_ec(blocknr);
-                        } // !erase_test         	        
-        	        } //for (blocknr... - loop to initialize empty chain
+        	        if (mode==FMT_STREAM) {
+        	            blockcnt=ec_stream(A_FIRSTDATA,maxblocks);  //Multi-block writes, header written last
+        	        } else if (mode==FMT_BITMAP) {
+        	            blockcnt=bm_format(maxblocks);              //Only the bitmap blocks are written
+        	        } else {
+        	            ec_initcounts(maxblocks+1,0,0);            //All in use, add_to_ec() counts them free
+        	            for (blocknr=A_FIRSTDATA;blocknr<=maxblocks;blocknr++) {
+                            if (is_bad_block(blocknr) || !erase_test_block(blocknr)) {
+                                printf("\nBlock %ld bad.\n",blocknr);
+                                add_bad_block(blocknr);
+                            } else {
+                                jfs_progress(blocknr);
+                                blockcnt++;
+                                add_to_ec(blocknr);
+                            } // !erase_test         	        
+                            if (checkkey()) break;      //Abort: chain so far is consistent
+        	            } //for (blocknr... - loop to initialize empty chain
+        	        }
                     //Empty Chain intialized, now finish rest of fs initialization
-        	        init_partmap();
+        	        if (blockcnt!=0) init_rootpart();          //No free blocks, or ec_stream() failed
+        	    }
+            }
+        }
+	}	
+	return blockcnt; //return nr of successfully erased blocks
+}
+
+/**
+    Create the partition map, the root dir and the root partition c:.
+    This is the last step of every format mode, the cache is flushed afterwards.
+    With jfsjournal set the journal is made last and opened after the flush, so
+    the format itself goes straight to its home blocks.
+*/
+void init_rootpart()
+{
+long newdir,newpart;
+
+    init_partmap();
 printf("\nPartmap initialized.");
-        	        newdir=createDir("/",NOATTRIB, NOPARENT);
+    newdir=createDir("/",NOATTRIB, NOPARENT);
 printf("\nCreated root dir.");
-        	        newpart=createPartition('c',"Root",NOTBOOTABLE,newdir);         //drive letter c:, not bootable yet, add root dir
+    newpart=createPartition('c',"Root",NOTBOOTABLE,newdir);         //drive letter c:, not bootable yet, add root dir
 printf("\nPartion header created, root dir added.");
-        	        addpart(newpart);               //Add partititon to partition table
-        	    }
+    addpart(newpart);                       //Add partititon to partition table
+    if (jfsjournal) jl_create();            //Journal region, registered in the partmap
+    jfs_flush();                            //Format done, write cached metadata to disk
+    jfs_mount();                            //From here on jfs_flush() commits to the journal
+}
+
+/**
+    Erase blocks 0..maxblocks with the card's own erase command, QE_CHUNK blocks
+    at a time so no single erase keeps the card busy for too long.
+    The SCR tells what an erased block reads as (DATA_STAT_AFTER_ERASE); the first
+    and the last data block are read back to check that the erase really happened.
+    Blocks 0..3 are then cleared, the format writes them next.
+    Returns false if the card can not erase, use a surface scan format instead.
+*/
+bool quick_erase(long maxblocks)
+{
+struct scrregister SCRData;
+unsigned char StartCB[6], EndCB[6];
+long chunk, chunkend, blocknr;
+
+    SCRData=SDReadSCR();
+    if (SCRData.status!=SDRDY) {
+        printerr("Can not read SCR.\nAborted.");
+        return false;
+    }
+    printf("\nErased blocks read as 0x%02x",SCRData.EraseFill);
+    for (chunk=0;chunk<=maxblocks;chunk+=QE_CHUNK) {
+        chunkend=chunk+QE_CHUNK-1;
+        if (chunkend>maxblocks) chunkend=maxblocks;
+        PrepCS(StartCB,SDCMDEraseStart,chunk);
+        PrepCS(EndCB,SDCMDEraseEnd,chunkend);
+        if (SDEraseBlocks(StartCB,EndCB)!=SDRDY) {
+            printerr("Erase failed.\nAborted.");
+            return false;
+        }
+        jfs_progress(chunkend);
+    }
+    jfs_cacheinit();                        //Nothing cached survived the erase
+    if (testblock(A_FIRSTDATA,SCRData.EraseFill)!=SDTESTOK || testblock(maxblocks,SCRData.EraseFill)!=SDTESTOK) {
+        printerr("Card did not erase.\nAborted.");
+        return false;
+    }
+    for (blocknr=A_BOOTBLOCK;blocknr<A_FIRSTDATA;blocknr++) {
+        if (fillblock(blocknr,0x00)!=SDRDY) {
+            printerr("Metadata blocks can not be written.\nAborted.");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+    Build the empty chain for blocks first..last in a single sequential pass.
+    Every block is assumed good, so its links are known up front: prev_eb is
+    blocknr-1 and next_eb is blocknr+1 (0 at either end of the range).
+    The blocks are handled in batches of EC_BATCH: the T_EMPTYBLK images are
+    written with one multi-block write, then verified with one multi-block read.
+    If the write stream breaks, the rest of the batch is written and verified
+    one block at a time; only a block that fails that is added to the bad
+    block list, and the good blocks on either side are rewritten to skip it,
+    so a bad block costs two extra writes.
+    The empty chain header is written once, at the end.
+    A key press stops the pass after the current batch; the chain is then
+    closed at the last good block and the counters cover the formatted
+    blocks only.
+    Returns the number of blocks in the chain, 0 if a good block could not be
+    relinked: the chain would lead into a bad block, so no header is written.
+*/
+long ec_stream(long first, long last)
+{
+unsigned char CmdStructure[6];
+union ech_transfer ech_t;
+long batch, batchend, blocknr, blockcnt, unwritten;
+long firstgood, prevgood, pprevgood, specprev, specnext, headrun;
+bool splice, streaming, ok;
+
+    blockcnt=0;
+    headrun=0;
+    firstgood=0;
+    prevgood=0;                                     //Last good block so far, 0 = none yet
+    pprevgood=0;                                    //Good block before prevgood, needed to rewrite it
+    splice=false;                                   //true if prevgood still points at a bad block
+    batchend=first-1;
+    for (batch=first;batch<=last;batch+=EC_BATCH) {
+        batchend=batch+EC_BATCH-1;
+        if (batchend>last) batchend=last;
+
+        PrepCS(CmdStructure,SDCMDWriteMulti,batch); //Write pass, one command for the batch
+        unwritten=batch;                            //First block the stream did not write
+        if (SDWriteStart(CmdStructure)==SDRDY) {
+            for (blocknr=batch;blocknr<=batchend;blocknr++) {
+                ec_buildempty((blocknr>first) ? blocknr-1 : 0,(blocknr<last) ? blocknr+1 : 0);
+                if (SDWriteNext(BlockBuffer)!=SDRDY) break;     //The verify pass writes the rest
             }
+            unwritten=blocknr;
+            SDWriteStop();
         }
-	return blockcnt; //return nr of successfully erased blocks
-	}	
+
+        PrepCS(CmdStructure,SDCMDReadMulti,batch);  //Verify pass, one command for the batch
+        streaming=(SDReadStart(CmdStructure)==SDRDY);
+        for (blocknr=batch;blocknr<=batchend;blocknr++) {
+            specprev=(blocknr>first) ? blocknr-1 : 0;   //Links as written
+            specnext=(blocknr<last) ? blocknr+1 : 0;
+            ok=false;
+            if (streaming) {
+                if (SDReadNext(BlockBuffer)==SDRDY) {
+                    ok=true;
+                } else {                            //Stream broken, single block reads for the rest
+                    SDReadStop();
+                    streaming=false;
+                }
+            }
+            if (!ok) ok=(rawreadblock(blocknr)==SDRDY);
+            if (ok) ok=!is_bad_block(blocknr) && ec_checkempty(specprev,specnext);
+            if (!ok && blocknr>=unwritten && !is_bad_block(blocknr)) {
+                ok=ec_writeempty(blocknr,specprev,specnext);    //Stream broke: one block at a time
+            }
+            if (ok && prevgood!=specprev) ok=ec_writeempty(blocknr,prevgood,specnext);  //Link back past bad blocks
+            if (ok) {
+                if (splice && prevgood!=0 && !ec_writeempty(prevgood,pprevgood,blocknr)) {    //Link forward past bad blocks
+                    printerr("Empty chain can not be linked past a bad block.\nAborted.");
+                    return 0;
+                }
+                splice=false;
+                if (firstgood==0) firstgood=blocknr;
+                if (blocknr==firstgood+headrun) headrun++;  //No bad block since the first good one
+                pprevgood=prevgood;
+                prevgood=blocknr;
+                blockcnt++;
+            } else {
+                printf("\nBlock %ld bad.\n",blocknr);
+                add_bad_block(blocknr);
+                splice=true;
+            }
+        }
+        if (streaming) SDReadStop();
+        jfs_progress(batchend);                     //Progress once per batch
+        if (checkkey()) break;                      //Abort: close the chain below
+    }
+    if (prevgood!=0 && (splice || batchend<last) && !ec_writeempty(prevgood,pprevgood,0)) {
+        printerr("Empty chain can not be closed.\nAborted.");
+        return 0;
+    }
+
+    fill_buffer(BlockBuffer,0);                     //Header is written exactly once
+    ech_t.buffer=&BlockBuffer[0];
+    ech_t.ecdata->blocktype=T_EMPTYHDR;
+    ech_t.ecdata->first_eb=firstgood;
+    ech_t.ecdata->last_eb=prevgood;
+    writeblock(A_EMPTYCHN);
+    ec_initcounts(batchend+1,blockcnt,headrun);     //Only the formatted range if the pass was stopped
+    return blockcnt;
+}
+
+/**
+    Build an empty block image with the given links in BlockBuffer.
+*/
+void ec_buildempty(long prev, long next)
+{
+union eb_transfer eb_t;
+
+    fill_buffer(BlockBuffer,0);
+    eb_t.buffer=&BlockBuffer[0];
+    eb_t.ebdata->blocktype=T_EMPTYBLK;
+    eb_t.ebdata->next_eb=next;
+    eb_t.ebdata->prev_eb=prev;
+}
+
+/**
+    Check that BlockBuffer holds exactly the empty block image with the given links.
+*/
+bool ec_checkempty(long prev, long next)
+{
+union eb_transfer eb_t;
+int bytenr;
+
+    eb_t.buffer=&BlockBuffer[0];
+    if (eb_t.ebdata->blocktype!=T_EMPTYBLK || eb_t.ebdata->next_eb!=next || eb_t.ebdata->prev_eb!=prev) return false;
+    for (bytenr=sizeof(struct s_eblock);bytenr<SDBlockSize;bytenr++) {
+        if (BlockBuffer[bytenr]!=0) return false;
+    }
+    return true;
+}
+
+/**
+    Write an empty block image with the given links to blocknr and read it back.
+    Returns true if the block reads back exactly as written.
+*/
+bool ec_writeempty(long blocknr, long prev, long next)
+{
+    ec_buildempty(prev,next);
+    if (rawwriteblock(blocknr)!=SDRDY) return false;
+    if (rawreadblock(blocknr)!=SDRDY) return false;
+    return ec_checkempty(prev,next);
 }
 
 bool erase_test_block(long BlockNr)
 {
 int TestStat;
 
-    if (TestStat=fillblock(BlockNr,0x0F)==SDRDY)
+    if ((TestStat=fillblock(BlockNr,0x0F))==SDRDY)
     {
         if (testblock(BlockNr,0x0F)==SDTESTOK)
         {
             if (fillblock(BlockNr,0x00)==SDRDY)
             {
-                if (TestStat=(testblock(BlockNr,0x00)==SDTESTOK))
+                if ((TestStat=testblock(BlockNr,0x00))==SDTESTOK)
                 {
                     //printf("\rBlock %ld tested OK.",BlockNr);
                     return(true);
@@ -89,28 +353,64 @@ int TestStat;
                 }
             }
         }
-    } else {
-        return (TestStat);
     }
+    return(false);
 }
 	
+/**
+    Progress line with the block being worked on, overwritten by the next.
+    Host tools set jfsquiet, their stdout is a report.
+*/
+void jfs_progress(long blocknr)
+{
+    if (!jfsquiet) printf("\r%08lx",blocknr);
+}
+
 void printerr(const char * errormessage)
 {
     printf("\n\a%s\n",errormessage);
 }
 
+/**
+    Fill a block on the SD card with Value.
+    fillblock() tests the physical medium, so it bypasses the block cache.
+*/
 int fillblock(long BlockNr, unsigned char Value)
 {
 int SDStat;
     fill_buffer(BlockBuffer,Value);
-    SDStat=writeblock(BlockNr);
+    SDStat=rawwriteblock(BlockNr);
     return SDStat;
 }
 
+/**
+    Write the contents of BlockBuffer into block BlockNr.
+    The block is stored in the block cache and marked dirty, it reaches the
+    SD card when it is evicted or at the next jfs_flush().
+    Returns SDRDY, or the status of a failed write-back that would have made room.
+*/
 int writeblock(long BlockNr)
+{
+struct s_cacheslot* slot;
+
+    if ((slot=jfs_cacheslot(BlockNr))==0) return SDStat;   //Find or make room, old contents not needed
+    memcpy(slot->data,BlockBuffer,SDBlockSize);             //BlockBuffer is global!
+    slot->dirty=true;                                       //Written back later
+    return SDRDY;
+}
+
+/**
+    Write BlockBuffer to block BlockNr on the SD card, bypassing the cache.
+    Any cached copy of the block is dropped. The journal is checkpointed first
+    if it may hold an image of it, see jl_reuse().
+*/
+int rawwriteblock(long BlockNr)
 { 
 unsigned char CmdStructure[6];
    
+    if ((SDStat=jl_reuse(BlockNr,1))!=SDRDY) return SDStat;
+    jfs_cachedrop(BlockNr);                                 //Cached copy would be stale
+    jfscstats.devwrites++;
     PrepCS(CmdStructure,SDCMDWriteBlock,BlockNr);
     SDStat=SDWriteBlock(CmdStructure,BlockBuffer);      //BlockBuffer is global!
     if (SDStat!=SDRDY){
@@ -134,7 +434,7 @@ int testblock(long blocknr,unsigned char value)
 {
 int bytenr;
     
-    SDStat=readblock(blocknr);
+    SDStat=rawreadblock(blocknr);                             //Test the medium, not the cache
     if (SDStat==SDRDY){
         for (bytenr=0;bytenr<SDBlockSize;bytenr++){
             if (BlockBuffer[bytenr]!=value) return SDTESTNOK; //Terminate with error
@@ -145,295 +445,4159 @@ int bytenr;
     return SDTESTOK;                                          //Block is OK - end.
 }
 
+/**
+    Read block (blocknr) into the global BlockBuffer.
+    The block is served from the block cache if present, otherwise it is read
+    from the SD card into a cache slot first.
+*/
 int readblock(long blocknr)
 {
+struct s_cacheslot* slot;
+
+    if ((slot=jfs_cacheread(blocknr))==0) return SDStat;   //Read failed, SDStat has the reason
+    memcpy(BlockBuffer,slot->data,SDBlockSize);             //Beware: the blockbuffer is a global variable!
+    return SDRDY;
+}
+
+/**
+    Return the cache slot holding blocknr, reading it from the SD card if needed.
+    Returns 0 if the block could not be read.
+    The slot data may be used and modified in place (set slot->dirty) until
+    the next call into the cache.
+*/
+struct s_cacheslot* jfs_cacheread(long blocknr)
+{
+unsigned char CmdStructure[6];
+struct s_cacheslot* slot;
+
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {
+        if (slot->valid && slot->blocknr==blocknr) {        //Cache hit
+            jfscstats.hits++;
+            slot->lastuse=++jfscacheclock;
+            return slot;
+        }
+    }
+    jfscstats.misses++;                                     //Cache miss, go to the card
+    if ((slot=jfs_cacheslot(blocknr))==0) return 0;        //No room, SDStat has the reason
+    jfscstats.devreads++;
+    PrepCS(CmdStructure,SDCMDReadBlock,blocknr);
+    SDStat=SDReadBlock(CmdStructure,slot->data);            //Read straight into the cache slot
+    if (SDStat!=SDRDY) {
+        slot->valid=false;                                  //Do not cache a failed read
+        return 0;
+    }
+    return slot;
+}
+
+/**
+    Read block (blocknr) from the SD card into BlockBuffer, bypassing the cache.
+    Used by testblock() to verify the medium itself.
+*/
+int rawreadblock(long blocknr)
+{
 unsigned char CmdStructure[6];
 int SDStat;
 
+    jfscstats.devreads++;
     PrepCS(CmdStructure,SDCMDReadBlock,blocknr);
     SDStat=SDReadBlock(CmdStructure,BlockBuffer);           //Beware: the blockbuffer is a global variable!
     return SDStat;                                          //but assembler routine needs the address
 }
 
-/** 
-    Initialize the partition Map
-    At this stage the partmap is empty, the first entry is added when the root partition is created
+/**
+    Return the cache slot for blocknr.
+    If the block is not cached the least recently used slot is taken, preferring
+    slots that do not hold the fixed metadata blocks 0..3. A dirty victim is
+    written back first. With a journal, dirty slots are taken only after clean
+    and logged ones, and all dirty blocks are then committed together, so the
+    victim goes home as part of a complete transaction.
+    The returned slot is valid, clean and holds blocknr, its data must be
+    filled by the caller. Returns 0 if the victim could not be written back,
+    it then stays cached and dirty, SDStat has the reason.
 */
-void init_partmap()
+struct s_cacheslot* jfs_cacheslot(long blocknr)
 {
-union pm_transfer pm_t;
+struct s_cacheslot* slot;
+struct s_cacheslot* victim;
+struct s_cacheslot* metavictim;
+struct s_cacheslot* dirtyvictim;
+unsigned char CmdStructure[6];
 
-    pm_t.buffer=&BlockBuffer[0];            //Link pm_t.buffer to physical address of BlockBuffer
-    pm_t.pmdata->blocktype=T_PARTHDR;       //Define block as Bad Block Header
-    pm_t.pmdata->no_parts=0;                //No partitions yet
-    pm_t.pmdata->parthdr[0]=0;              //Indicates no (more) partitions
-    writeblock(A_PARTMAP);                  //Write the data to appropriate block
+    victim=0;
+    metavictim=0;
+    dirtyvictim=0;
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {
+        if (slot->valid && slot->blocknr==blocknr) {        //Already cached
+            slot->lastuse=++jfscacheclock;
+            return slot;
+        }
+        if (!slot->valid) {                                 //Free slot beats anything
+            victim=slot;
+            metavictim=slot;
+        } else if (slot->blocknr<JFSMETABLOCKS) {           //Metadata: only evicted if nothing else
+            if (metavictim==0 || (metavictim->valid && slot->lastuse<metavictim->lastuse)) metavictim=slot;
+        } else if (slot->dirty && jfsjstart!=0) {           //Costs a commit: after clean and logged blocks
+            if (dirtyvictim==0 || slot->lastuse<dirtyvictim->lastuse) dirtyvictim=slot;
+        } else {
+            if (victim==0 || (victim->valid && slot->lastuse<victim->lastuse)) victim=slot;
+        }
+    }
+    if (victim==0) victim=dirtyvictim;
+    if (victim==0) victim=metavictim;                       //All slots hold metadata
+    if (victim->valid && victim->dirty && jfsjstart!=0 && (SDStat=jl_commit())!=SDRDY) return 0;
+    if (victim->valid && (victim->dirty || victim->logged)) {   //Write back before reuse
+        jfscstats.writebacks++;
+        jfscstats.devwrites++;
+        PrepCS(CmdStructure,SDCMDWriteBlock,victim->blocknr);
+        SDStat=SDWriteBlock(CmdStructure,victim->data);
+        if (SDStat!=SDRDY) {                                //Keep it, a later flush may succeed
+            printf("\n Write error on block 0x%08lx.\n",victim->blocknr);
+            return 0;
+        }
+    }
+    victim->valid=true;
+    victim->dirty=false;
+    victim->logged=false;
+    victim->blocknr=blocknr;
+    victim->lastuse=++jfscacheclock;
+    return victim;
 }
 
 /**
-    Initialize bad block header. 
-    At this point it is empty because the disk is not formatted yet.
+    Write all dirty blocks in the cache back to the SD card.
+    Call this at the end of every filesystem operation that must be on disk.
+    With a journal the dirty blocks are committed as one transaction, they
+    reach their home blocks later, see jl_commit().
+    Returns SDRDY, or the status of the last failed write.
 */
-void init_badblk_hdr()
+int jfs_flush()
 {
-union bbh_transfer bbh_t;
+struct s_cacheslot* slot;
+unsigned char CmdStructure[6];
+int FlushStat;
 
-    bbh_t.buffer=&BlockBuffer[0];           //Link pm_t.buffer to physical address of BlockBuffer
-    bbh_t.bbhdata->blocktype=T_BADBLKHDR;   //Define block as Bad Block Header
-    bbh_t.bbhdata->extb_block=0;            //No extension blocks yet
-    bbh_t.bbhdata->nrbadblocks=0;           //No bad blocks yet
-    bbh_t.bbhdata->badblock[0]=0;           //Indicates end of list
-    writeblock(A_BADBLKHDR);                //Write the data to appropriate block
-} 
+    FlushStat=SDRDY;
+    flush_bad_blocks();                         //Into the cache first, written below
+    if (jfsjstart!=0) {
+        FlushStat=jl_commit();
+        SDSync();
+        return FlushStat;
+    }
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {
+        if (slot->valid && slot->dirty) {
+            jfscstats.writebacks++;
+            jfscstats.devwrites++;
+            PrepCS(CmdStructure,SDCMDWriteBlock,slot->blocknr);
+            SDStat=SDWriteBlock(CmdStructure,slot->data);
+            if (SDStat==SDRDY) {
+                slot->dirty=false;
+            } else {
+                printf("\n Write error on block 0x%08lx.\n",slot->blocknr);
+                FlushStat=SDStat;
+            }
+        }
+    }
+    SDSync();                                   //Last write-behind block programmed too
+    return FlushStat;
+}
 
 /**
-    Add a bad block to the bad block list. 
-    First determine where 
+    Empty the block cache without writing anything back.
+    Use after (re)initialising the SD card, the cached blocks may belong to another card.
+    The journal is closed too, jfs_mount() opens the one of the new card.
 */
-void add_bad_block(long blocknr)
+void jfs_cacheinit()
 {
-union bbh_transfer bbh_t;
-union bbx_transfer bbx_t;
-long currentbblock;
-char bbindex;
-long nrbadblocks;
-
-    currentbblock=A_BADBLKHDR;                      //start by looking in the bad block header
-    bbh_t.buffer=&BlockBuffer[0];                   //Link bbh_t.buffer to physical address of BlockBuffer
-    readblock(currentbblock);                       //read data from the Bad Block Header/Extension 
-    nrbadblocks=bbh_t.bbhdata->nrbadblocks;         //Remember the total # bad block known
-    while (bbh_t.bbhdata->extb_block != 0){         //There is a next Bad Block List block
-        currentbblock=bbh_t.bbhdata->extb_block;    //Determine which is the next block
-        readblock(currentbblock);                   //Read new data from the new block
-    }                                               //---At this point we have the data drom the last Bad Block List block
-    bbindex=(char)nrbadblocks%MAXBBLOCKS;           //index of the last stored bad block in this block
-    bbh_t.bbhdata->badblock[bbindex+1]=blocknr;     //Add the number of the bad block to the list
-    writeblock(currentbblock);                      //write modified data back
-    
-    // now update total # of bad blocks in BB Header
-    
-    readblock(A_BADBLKHDR);                         //Read the bad block header
-    bbh_t.bbhdata->nrbadblocks=nrbadblocks+1;       //Set the new value
-    writeblock(A_BADBLKHDR);                        //Write back updated Bad Block Header
-printf("\n0x%08lx is a bad block, %ld total bad blocks", blocknr, bbh_t.bbhdata->nrbadblocks);
+struct s_cacheslot* slot;
+
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {
+        slot->valid=false;
+        slot->dirty=false;
+        slot->logged=false;
+    }
+    jfscacheclock=0;
+    jfsjstart=0;
+    jfsjhead=jfsjtail=0;
+    jfsjlow=jfsjhigh=0;
 }
 
 /**
-    Add te new block to the empty chain.
-    Blocks are appended to the end of the empty chain
+    Forget the cached copy of blocknr, if any. A dirty copy is discarded.
 */
-void add_to_ec(long newblock)
+void jfs_cachedrop(long blocknr)
 {
-//blockbuffer is statical/global defined
-long prevlastblock;
+struct s_cacheslot* slot;
 
-    prevlastblock=GetLastECBlockNr();               //Get block number of last block in Empty Chain
-    if (prevlastblock==0) {                         //Then this is the first empty block in chain
-        init_ec_header(newblock);                   //New block is attached to EC Header
-    } else {
-        UpdateLastECBlock(prevlastblock,newblock);  //New block is attached to last block of EC
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {
+        if (slot->valid && slot->blocknr==blocknr) slot->valid=false;
     }
-    UpdateCurrentBlock(prevlastblock,newblock);     //Add Blocktype and address of previous empty block
-    UpdateECHeader(newblock);                       //Write new last block into EC Header
 }
 
-long GetLastECBlockNr()                             //Get block number of last block in Empty Chain
+/**
+    Return the cache slot holding blocknr, or 0 if it is not cached.
+    No I/O and no LRU update, for checking blocks that were read past the cache.
+*/
+struct s_cacheslot* jfs_cachefind(long blocknr)
 {
-union ech_transfer ech_t ;                          //blockbuffer is static/global defined
+struct s_cacheslot* slot;
 
-    readblock(A_EMPTYCHN);                          //Read the EC Header block
-    ech_t.buffer=&BlockBuffer[0];                   //pointer to first byte of buffer
-    return ech_t.ecdata->last_eb;
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {
+        if (slot->valid && slot->blocknr==blocknr) return slot;
+    }
+    return 0;
 }
 
 /**
-    Initialises the Empty Chain Header. This is done after the first empty block is initialized. 
-    Its address is added as both the first and the last empty block in the chain.
-    lastEBlock will be modified ater by UpdateECHeader().
+    Metadata journal.
+    A jfs_flush() writes all dirty cache blocks as one transaction into the
+    journal region: a T_JRNLDESC with the home address and checksum of every
+    block, then the block images, all in one CMD25 stream. The blocks stay in
+    the cache as "logged" and go home when they are evicted or when the
+    journal is full and jl_checkpoint() empties it. After a crash jfs_mount()
+    replays every complete transaction, a torn one fails its checksums and
+    ends the replay. A multi-block update is thereby all or nothing, as long
+    as it fits in the cache: a dirty block that must be evicted first commits
+    the blocks dirty at that moment.
+    The journal costs I/O: every committed block is written twice, and the
+    metadata blocks 0..3 go into nearly every transaction. With 6 cache slots
+    jfsimg bench writes about 2.8 times as many blocks as without it, so the
+    format only makes one if jfsjournal is set. A card that has one is always
+    replayed and used.
 */
-void init_ec_header(long firstEBlock)
+
+/**
+    Open the file system on a freshly initialised card: find the journal
+    through the partition map and replay what was committed but not
+    checkpointed. Call after jfs_cacheinit(), before metadata is read.
+    Returns the nr of transactions replayed, -1 if the card has no journal,
+    -2 if the replay failed: the journal is closed again and the card must
+    not be written, the next jfs_mount() tries the same replay.
+*/
+int jfs_mount()
 {
-union ech_transfer ech_t ;
+union pm_transfer pm_t;
+union jh_transfer jh_t;
+long start;
+unsigned int size;
+int replayed;
 
-    
-    ech_t.buffer=&BlockBuffer[0];           //Link ech_t buffer to physical address of BlockBuffer
-    ech_t.ecdata->blocktype=T_EMPTYHDR;     //Set block type to Empty Chain Header
-    ech_t.ecdata->first_eb=firstEBlock;     //Set link to first empty block in chain
-    ech_t.ecdata->last_eb=firstEBlock;      //is also last empty block 
-    writeblock(A_EMPTYCHN);                 //empty chain header initialized with first empty block
+    jfsjstart=0;
+    pm_t.buffer=jfsjbuf;
+    if (jl_rawread(A_PARTMAP)!=SDRDY || pm_t.pmdata->blocktype!=T_PARTMAP || pm_t.pmdata->journal<A_FIRSTDATA) return -1;
+    start=pm_t.pmdata->journal;
+    size=pm_t.pmdata->journalblks;
+    jh_t.buffer=jfsjbuf;
+    if (jl_rawread(start)!=SDRDY || jh_t.jhdata->blocktype!=T_JRNLHDR || jh_t.jhdata->nrblocks!=(long)size ||
+        jh_t.jhdata->tail==0 || jh_t.jhdata->tail>=size) return -1;    //Partmaps of old formats have no journal fields
+    jfsjstart=start;
+    jfsjsize=size;
+    jfsjhead=jfsjtail=jh_t.jhdata->tail;
+    jfsjlow=jfsjhigh=0;
+    jfsjseq=jh_t.jhdata->tailseq;
+    if ((replayed=jl_replay())<0) jfsjstart=0;
+    return replayed;
 }
 
 /**
-    In order to add a new block to the empty chain, the previous last block is linked.
-    The 0 indicating it was the (former) last block in the chain is replaced by
-    the block number of the new last block in the Empty Chain
+    Commit and checkpoint: everything is home and the journal is empty.
+    Call before the card is removed or the program ends.
 */
-void UpdateLastECBlock(long prevlastblock,long newblock)
+int jfs_unmount()
 {
-union eb_transfer eb_t ;
+int UnmountStat;
 
-    readblock(prevlastblock);               //read old contents of previous last block
-    eb_t.buffer=&BlockBuffer[0];            //et_t.buffer is now a pointer to the start of BlockBuffer
-    eb_t.ebdata->next_eb=newblock;          //modify content: (add new last block in the chain)
-    writeblock(prevlastblock);              //write back previous last block
+    UnmountStat=jfs_flush();
+    if (UnmountStat==SDRDY && jfsjtail!=jfsjhead) UnmountStat=jl_checkpoint();
+    return UnmountStat;
 }
 
 /**
-    A new block is linked into the empty chain.
-    since it is the last block in the chain, next_eb is set to 0
-    prev_eb is the backlink to the previous block in the chain.
+    Make the journal region: JLBLOCKS consecutive blocks from the allocator,
+    cleared so no descriptor of an earlier format can be replayed, with the
+    header in the first block. The region is entered in the partition map,
+    jfs_mount() opens it. Without room the disk works without a journal.
 */
-void UpdateCurrentBlock(long prevlastblock, long newblock)
+void jl_create()
 {
-union eb_transfer eb_t ;
+union pm_transfer pm_t;
+unsigned char CmdStructure[6];
+long start;
+unsigned int index;
 
-    eb_t.buffer=&BlockBuffer[0];            //Link eb_t buffer to physical address of BlockBuffer
-    eb_t.ebdata->blocktype=T_EMPTYBLK;      //Initialize the empty block data structure
-    eb_t.ebdata->next_eb=0;                 //Is now the last block in chain
-    eb_t.ebdata->prev_eb=prevlastblock;     //Link back to previous block in chain. 
-    writeblock(newblock);                   //write initialized new block in chain
+    if ((start=getblocks(JLBLOCKS))==0) {
+        printerr("No room for the journal.");
+        return;
+    }
+    fill_buffer(jfsjbuf,0);
+    PrepCS(CmdStructure,SDCMDWriteMulti,start+1);
+    if (SDWriteStart(CmdStructure)==SDRDY) {
+        for (index=1;index<JLBLOCKS;index++) SDWriteNext(jfsjbuf);
+        SDWriteStop();
+    }
+    jfscstats.devwrites+=JLBLOCKS-1;
+    jfsjstart=start;                        //Only for jl_writehdr(), closed again below
+    jfsjsize=JLBLOCKS;
+    jfsjhead=jfsjtail=1;
+    jfsjlow=jfsjhigh=0;
+    jfsjseq=1;
+    if (jl_writehdr(1)!=SDRDY) {            //Not entered in the partmap, the disk works without
+        jfsjstart=0;
+        printerr("Journal header can not be written.");
+        return;
+    }
+    jfsjstart=0;
+    readblock(A_PARTMAP);
+    pm_t.buffer=&BlockBuffer[0];
+    pm_t.pmdata->journal=start;
+    pm_t.pmdata->journalblks=JLBLOCKS;
+    writeblock(A_PARTMAP);
+printf("\nJournal at block 0x%08lx, %d blocks", start, JLBLOCKS);
 }
 
-void UpdateECHeader(long newblock)
+/**
+    Write every dirty cache block to the journal as one transaction and
+    mark them logged. Nothing is written home here.
+    Returns SDRDY, or the failing status; the blocks then stay dirty.
+*/
+int jl_commit()
 {
-union ech_transfer ech_t ;
+struct s_cacheslot* slot;
+union jd_transfer jd_t;
+unsigned char CmdStructure[6];
+unsigned int count, pos;
+int CommitStat;
 
-    readblock(A_EMPTYCHN);                  //Read current content of empty chain block header    
-    ech_t.buffer=&BlockBuffer[0];           //Link ech_t buffer to physical address of BlockBuffer   
-    ech_t.ecdata->last_eb=newblock;         //Modify EBHeader data structure with new last block  
-    writeblock(A_EMPTYCHN);                 //Empty chain header initialized with first empty block
+    count=0;
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {
+        if (slot->valid && slot->dirty) count++;
+    }
+    if (count==0) return SDRDY;
+    if ((pos=jl_place(count+1))==0) return SDStat;     //May checkpoint, so before the descriptor is built
+    fill_buffer(jfsjbuf,0);
+    jd_t.buffer=jfsjbuf;
+    jd_t.jddata->blocktype=T_JRNLDESC;
+    jd_t.jddata->seq=jfsjseq;
+    jd_t.jddata->count=count;
+    count=0;
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {
+        if (slot->valid && slot->dirty) {
+            jd_t.jddata->entry[count].home=slot->blocknr;
+            jd_t.jddata->entry[count].sum=jl_sum(slot->data);
+            count++;
+        }
+    }
+    jfscstats.devwrites+=count+1;
+    PrepCS(CmdStructure,SDCMDWriteMulti,BlkAdd(jfsjstart,pos));
+    if ((CommitStat=SDWriteStart(CmdStructure))!=SDRDY) return CommitStat;
+    CommitStat=SDWriteNext(jfsjbuf);
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS] && CommitStat==SDRDY;slot++) {
+        if (slot->valid && slot->dirty) CommitStat=SDWriteNext(slot->data);
+    }
+    if (SDWriteStop()!=SDRDY && CommitStat==SDRDY) CommitStat=SDWRTFAIL;
+    if (CommitStat!=SDRDY) {
+        printf("\n Journal write error at block 0x%08lx.\n",BlkAdd(jfsjstart,pos));
+        return CommitStat;
+    }
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {
+        if (slot->valid && slot->dirty) {
+            slot->dirty=false;
+            slot->logged=true;
+            slot->jpos=++pos;               //Images follow the descriptor in slot order
+            if (jfsjhigh==0 || slot->blocknr<jfsjlow) jfsjlow=slot->blocknr;
+            if (slot->blocknr>jfsjhigh) jfsjhigh=slot->blocknr;
+        }
+    }
+    jfsjhead=pos+1;
+    jfsjseq++;
+    jfsjstats.commits++;
+    jfsjstats.logged+=count;
+    return SDRDY;
 }
 
 /**
-    Get an empty block from the empty chain.
-    Empty blocks are taken from the start of the chain.
+    Position for a transaction of (count) blocks. A transaction is never split
+    over the end of the region, it starts at position 1 instead. If it would
+    overwrite a transaction that is not checkpointed, the journal is
+    checkpointed first. Returns 0 if that checkpoint failed, SDStat has the
+    reason.
 */
-long getblock()
+unsigned int jl_place(unsigned int count)
 {
-union ech_transfer ech_t;
-long emptyblock;
+unsigned int pos;
+bool full;
 
-    readblock(A_EMPTYCHN);                  //Read current content of empty chain block header    
-    ech_t.buffer=&BlockBuffer[0];           //Link ech_t buffer to physical address of BlockBuffer  
-    emptyblock=ech_t.ecdata->first_eb;      //Read address of first available empty block
-printf("\nFirst empty block available is 0x%08lx.",emptyblock);
-    if (emptyblock!=0) {                    //Empty block available
-        eb_unlink(emptyblock);              //Remove it from the empty chain
-        return(emptyblock);                 //Return the block address
-    } else {                                //No empty block available
-        return(0);
+    pos=jfsjhead;
+    if (pos+count>jfsjsize) pos=1;          //Wrap, the rest of the region stays unused
+    full=false;
+    if (jfsjtail<jfsjhead) {                //Live: tail..head
+        full=(pos<jfsjhead && pos+count>jfsjtail);
+    } else if (jfsjtail>jfsjhead) {         //Live: tail..end and 1..head
+        full=(pos<jfsjhead || pos+count>jfsjtail);
     }
+    if (full && (SDStat=jl_checkpoint())!=SDRDY) return 0;
+    return pos;
 }
 
 /**
-    Remove a block from the empty chain
-    blocknr must be a valid block number from the empty chain.
-    The predecessor and successor are derived from the empty block itself. 
+    Write the logged blocks home, then move the journal tail up to the head.
+    A block changed again since it was logged gets its logged image from the
+    journal: the new contents are not committed yet.
+    Returns SDRDY, or the status of the first failed read or write. The tail
+    and the header are then left alone, the journal still holds every image
+    and a later checkpoint or a replay at mount writes them home.
 */
-void eb_unlink(long blocknr)
+int jl_checkpoint()
 {
-union eb_transfer eb_t;                     //Empty block data structure
-union ech_transfer ech_t;                   //Empty chain header structure
-long pred,succ;                             //Predecessor and successor blocks
-    
-    readblock(blocknr);                     //Get the specified empty block
-    eb_t.buffer=&BlockBuffer[0];            //Map eb_t onto the data block
-    succ=eb_t.ebdata->next_eb;              //Retrieve block address of successor
-    pred=eb_t.ebdata->prev_eb;              //Retrieve block address of predecessor
-printf("\neb_unlink block 0x%08lx, pred= 0x%08lx, succ= 0x%08lx",blocknr,pred,succ);
-    if (succ==0) {                           //This was the last empty block in the chain
-        UpdateECHeader(pred);               //Record predecessor as last block in empty chain
-    } else {                                //If not, the successor must be updated
-        readblock(succ);                    //Get the data (eb_t.buffer ASSUMED to be already OK)
-        eb_t.ebdata->prev_eb=pred;          //Backlink to the predecessor of the removed block
-        writeblock(succ);                   //Successor block updated
-    }                               //So far the successor part.
-    if (pred==0){                           //blocknr was the first in the empty chain
+struct s_cacheslot* slot;
+int CheckStat;
+
+    if (jfsjstart==0) return SDRDY;
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {
+        if (slot->valid && slot->logged) {
+            if (!slot->dirty) {
+                CheckStat=jl_rawwrite(slot->blocknr,slot->data);
+            } else if ((CheckStat=jl_rawread(BlkAdd(jfsjstart,slot->jpos)))==SDRDY) {
+                CheckStat=jl_rawwrite(slot->blocknr,jfsjbuf);
+            }
+            if (CheckStat!=SDRDY) return CheckStat;
+            slot->logged=false;
+        }
+    }
+    SDSync();                               //Home blocks programmed before the tail moves
+    if (jfsjhead>=jfsjsize) jfsjhead=1;     //Last transaction ended the region, the header only takes 1..size-1
+    if ((CheckStat=jl_writehdr(jfsjhead))!=SDRDY) return CheckStat;
+    jfsjtail=jfsjhead;
+    jfsjlow=jfsjhigh=0;
+    jfsjstats.checkpoints++;
+    return SDRDY;
+}
+
+/**
+    Make blocks start..start+count-1 safe to write past the cache and the
+    journal: a replay must not put an older image of one of them back. The
+    journal is only checkpointed if a block in that range was logged since
+    the last checkpoint, so data written into fresh free space does not
+    empty the journal every time.
+    Returns SDRDY, or the status of the failed checkpoint.
+*/
+int jl_reuse(long start, long count)
+{
+    if (jfsjtail==jfsjhead || jfsjhigh==0) return SDRDY;
+    if (BlkAdd(start,count)<=jfsjlow || start>jfsjhigh) return SDRDY;
+    return jl_checkpoint();
+}
+
+/**
+    Replay the transactions from the tail on, as long as they are complete and
+    numbered in sequence. A transaction that did not fit before the end of the
+    region is at position 1. jl_validtxn() leaves the first JFSCACHESLOTS
+    images in the cache slots, which are empty at mount; only larger
+    transactions, from a build with a bigger cache, are read twice.
+    If a block can not be read or written home the header is left alone, so
+    the next jfs_mount() replays the same transactions again.
+    Uses BlockBuffer, only call from jfs_mount().
+    Returns the nr of transactions replayed, or -2 on a read or write error.
+*/
+int jl_replay()
+{
+union jd_transfer jd_t;
+struct s_cacheslot* slot;
+unsigned char CmdStructure[6];
+unsigned char* image;
+unsigned int pos, index, count;
+int replayed;
+
+    for (slot=&jfscache[0];slot<&jfscache[JFSCACHESLOTS];slot++) {    //The images are read into the slots
+        slot->valid=false;
+        slot->dirty=false;
+        slot->logged=false;
+    }
+    replayed=0;
+    pos=jfsjtail;
+    jd_t.buffer=jfsjbuf;
+    for (;;) {
+        if (!jl_validtxn(pos,jfsjseq)) {
+            if (pos==1 || !jl_validtxn(1,jfsjseq)) break;
+            pos=1;
+        }
+        count=jd_t.jddata->count;           //jfsjbuf still has the descriptor
+        for (index=0;index<count;index++) {
+            if (index<JFSCACHESLOTS) {
+                image=jfscache[index].data;
+            } else {
+                image=BlockBuffer;
+                jfscstats.devreads++;
+                PrepCS(CmdStructure,SDCMDReadBlock,BlkAdd(jfsjstart,pos+1+index));
+                if (SDReadBlock(CmdStructure,image)!=SDRDY || jl_sum(image)!=jd_t.jddata->entry[index].sum) return -2;
+            }
+            if (jl_rawwrite(jd_t.jddata->entry[index].home,image)!=SDRDY) return -2;
+        }
+        pos+=count+1;
+        jfsjseq++;
+        replayed++;
+    }
+    if (replayed!=0) {
+        SDSync();
+        if (pos>=jfsjsize) pos=1;
+        if (jl_writehdr(pos)!=SDRDY) return -2;
+        jfsjhead=jfsjtail=pos;
+printf("\nJournal: %d transaction(s) replayed", replayed);
+    }
+    jfsjstats.replayed+=replayed;
+    return replayed;
+}
+
+/**
+    Check the transaction at pos: a T_JRNLDESC with sequence nr seq whose
+    images all match their checksums. Leaves the descriptor in jfsjbuf, the
+    first JFSCACHESLOTS images in the data of the cache slots for
+    jl_replay() and the others, one after the other, in BlockBuffer.
+*/
+bool jl_validtxn(unsigned int pos, long seq)
+{
+union jd_transfer jd_t;
+unsigned char CmdStructure[6];
+unsigned char* image;
+unsigned int index;
+
+    jd_t.buffer=jfsjbuf;
+    if (jl_rawread(BlkAdd(jfsjstart,pos))!=SDRDY || jd_t.jddata->blocktype!=T_JRNLDESC || jd_t.jddata->seq!=seq ||
+        jd_t.jddata->count==0 || jd_t.jddata->count>JLMAXDESC || pos+1+jd_t.jddata->count>jfsjsize) return false;
+    for (index=0;index<jd_t.jddata->count;index++) {
+        image=(index<JFSCACHESLOTS) ? jfscache[index].data : BlockBuffer;
+        jfscstats.devreads++;
+        PrepCS(CmdStructure,SDCMDReadBlock,BlkAdd(jfsjstart,pos+1+index));
+        if (SDReadBlock(CmdStructure,image)!=SDRDY || jl_sum(image)!=jd_t.jddata->entry[index].sum) return false;
+    }
+    return true;
+}
+
+/**
+    Write the journal header: the new tail and the sequence nr expected there.
+    Returns the status of the write.
+*/
+int jl_writehdr(unsigned int tail)
+{
+union jh_transfer jh_t;
+
+    fill_buffer(jfsjbuf,0);
+    jh_t.buffer=jfsjbuf;
+    jh_t.jhdata->blocktype=T_JRNLHDR;
+    jh_t.jhdata->nrblocks=jfsjsize;
+    jh_t.jhdata->tailseq=jfsjseq;
+    jh_t.jhdata->tail=tail;
+    return jl_rawwrite(jfsjstart,jfsjbuf);
+}
+
+/**
+    Checksum of a block image: rotate left, add the next byte.
+*/
+jfs_uint jl_sum(unsigned char* data)
+{
+jfs_uint sum;
+int count;
+
+    sum=0;
+    for (count=0;count<SDBlockSize;count++) sum=(jfs_uint)(((sum<<1)|(sum>>15))+data[count]);
+    return sum;
+}
+
+/**
+    Read blocknr into jfsjbuf, bypassing the cache.
+*/
+int jl_rawread(long blocknr)
+{
+unsigned char CmdStructure[6];
+
+    jfscstats.devreads++;
+    PrepCS(CmdStructure,SDCMDReadBlock,blocknr);
+    return SDReadBlock(CmdStructure,jfsjbuf);
+}
+
+/**
+    Write data to blocknr, bypassing the cache and the journal.
+*/
+int jl_rawwrite(long blocknr, unsigned char* data)
+{
+unsigned char CmdStructure[6];
+int WriteStat;
+
+    jfscstats.devwrites++;
+    PrepCS(CmdStructure,SDCMDWriteBlock,blocknr);
+    if ((WriteStat=SDWriteBlock(CmdStructure,data))!=SDRDY) printf("\n Write error on block 0x%08lx.\n",blocknr);
+    return WriteStat;
+}
+
+/** 
+    Initialize the partition Map
+    At this stage the partmap is empty, the first entry is added when the root partition is created
+*/
+void init_partmap()
+{
+union pm_transfer pm_t;
+
+    pm_t.buffer=&BlockBuffer[0];            //Link pm_t.buffer to physical address of BlockBuffer
+    pm_t.pmdata->blocktype=T_PARTMAP;       //Define block as Partition Map
+    pm_t.pmdata->no_parts=0;                //No partitions yet
+    pm_t.pmdata->parthdr[0]=0;              //Indicates no (more) partitions
+    pm_t.pmdata->journal=0;                 //No journal yet, see jl_create()
+    pm_t.pmdata->journalblks=0;
+    writeblock(A_PARTMAP);                  //Write the data to appropriate block
+}
+
+/**
+    Initialize bad block header. 
+    The list on disk starts empty; blocks already in the RAM list, found bad by an
+    earlier format, are written to it by the next flush_bad_blocks().
+*/
+void init_badblk_hdr()
+{
+union bbh_transfer bbh_t;
+
+    fill_buffer(BlockBuffer,0);
+    bbh_t.buffer=&BlockBuffer[0];           //Link pm_t.buffer to physical address of BlockBuffer
+    bbh_t.bbhdata->blocktype=T_BADBLKHDR;   //Define block as Bad Block Header
+    bbh_t.bbhdata->extb_block=0;            //No extension blocks yet
+    bbh_t.bbhdata->nrbadblocks=0;           //No bad blocks yet
+    writeblock(A_BADBLKHDR);                //Write the data to appropriate block
+    if (!jfsbadloaded) jfsnrbad=0;
+    jfsbadloaded=true;
+    jfsbaddirty=(jfsnrbad!=0);
+} 
+
+/**
+    Add a bad block to the bad block list. 
+    Only the RAM list changes, flush_bad_blocks() writes it to disk in one go;
+    jfs_flush() does that, so a format with many bad blocks costs no extra I/O per block.
+*/
+void add_bad_block(long blocknr)
+{
+union ech_transfer ech_t;
+struct s_cacheslot* hdr;
+
+    if (is_bad_block(blocknr)) return;      //Already known, also loads the list
+    if (!bb_insert(blocknr)) {
+        printerr("Bad block list full.");
+        return;
+    }
+    if ((hdr=jfs_cacheread(A_EMPTYCHN))!=0 && hdr->data[0]==T_EMPTYHDR) {
+        ech_t.buffer=hdr->data;
+        if (ech_t.ecdata->flags&ECF_COUNTED) {  //The block was counted as in use
+            ech_t.ecdata->nrused-=1;
+            hdr->dirty=true;
+        }
+    }
+    jfsbaddirty=true;
+printf("\n0x%08lx is a bad block, %d total bad blocks", blocknr, jfsnrbad);
+}
+
+/**
+    Insert blocknr in the RAM bad block list, keeping it ascending.
+    Returns false if the list is full.
+*/
+bool bb_insert(long blocknr)
+{
+int index, move;
+
+    index=bb_find(blocknr);
+    if (index<jfsnrbad && jfsbadblocks[index]==blocknr) return true;
+    if (jfsnrbad>=JFSMAXBAD) return false;
+    for (move=jfsnrbad;move>index;move--) jfsbadblocks[move]=jfsbadblocks[move-1];
+    jfsbadblocks[index]=blocknr;
+    jfsnrbad++;
+    return true;
+}
+
+/**
+    Index of the first entry in the RAM bad block list that is >= blocknr (binary search).
+*/
+int bb_find(long blocknr)
+{
+int low, high, mid;
+
+    low=0;
+    high=jfsnrbad;
+    while (low<high) {
+        mid=(low+high)>>1;
+        if (BlkCmp(jfsbadblocks[mid],blocknr)<0) low=mid+1; else high=mid;
+    }
+    return low;
+}
+
+/**
+    Check blocknr against the bad block list. The list is read from disk on
+    first use, after that this costs no I/O.
+*/
+bool is_bad_block(long blocknr)
+{
+    return is_bad_range(blocknr,1);
+}
+
+/**
+    True if any block of the run of (count) blocks from blocknr on is bad.
+*/
+bool is_bad_range(long blocknr, long count)
+{
+int index;
+
+    if (!jfsbadloaded) load_bad_blocks();
+    index=bb_find(blocknr);
+    return (index<jfsnrbad && jfsbadblocks[index]<blocknr+count);
+}
+
+/**
+    Read the bad block list (header and extension blocks) into RAM.
+    A block 3 that is no bad block header, as on an unformatted card, gives an empty list.
+    Returns false in that case, or with jfcstatus E_JFC_BADLIST if the list has more
+    than JFSMAXBAD entries: a bad block could then be handed out, so getblocks()
+    refuses to allocate until the card is formatted again.
+*/
+bool load_bad_blocks()
+{
+union bbh_transfer bbh_t;
+union bbx_transfer bbx_t;
+long total, nread, blocknr;
+int index;
+
+    jfsnrbad=0;
+    jfsbadloaded=true;
+    jfsbaddirty=false;
+    jfsbadtrunc=false;
+    bbh_t.buffer=&BlockBuffer[0];
+    bbx_t.buffer=&BlockBuffer[0];
+    if (readblock(A_BADBLKHDR)!=SDRDY || BlockBuffer[0]!=T_BADBLKHDR) return false;
+    total=bbh_t.bbhdata->nrbadblocks;
+    nread=0;
+    for (;;) {
+        for (index=0;index<MAXBBLOCKS && nread<total;index++,nread++) {
+            blocknr=bbx_t.bbxdata->badblock[index];
+            if (blocknr!=0 && !bb_insert(blocknr)) jfsbadtrunc=true;   //Lists written before sorting may be in any order
+        }
+        if (nread>=total || (blocknr=bbx_t.bbxdata->extb_block)==0) break;
+        if (readblock(blocknr)!=SDRDY || BlockBuffer[0]!=T_BADBLKEXT) break;
+    }
+    if (jfsbadtrunc) {
+        jfcstatus=E_JFC_BADLIST;
+        printerr("Bad block list does not fit in RAM, no blocks are allocated.");
+        return false;
+    }
+    return true;
+}
+
+/**
+    Write the RAM bad block list to disk: 125 entries in the header, 125 in each
+    extension block. Missing extension blocks are allocated; existing ones are reused.
+    Returns false if an extension block can not be had or written; the entries that
+    did not fit stay in RAM and are retried by the next flush.
+*/
+bool flush_bad_blocks()
+{
+union bbh_transfer bbh_t;
+union bbx_transfer bbx_t;
+long current, prev, next;
+int index, count, entry;
+bool fresh;
+
+    if (!jfsbaddirty) return true;
+    bbh_t.buffer=&BlockBuffer[0];
+    bbx_t.buffer=&BlockBuffer[0];
+    prev=0;
+    current=A_BADBLKHDR;
+    fresh=false;
+    index=0;
+    for (;;) {
+        next=0;                                 //Existing link onwards, if any
+        if (!fresh && readblock(current)==SDRDY && BlockBuffer[0]==((current==A_BADBLKHDR) ? T_BADBLKHDR : T_BADBLKEXT)) {
+            next=bbx_t.bbxdata->extb_block;     //Same offset in header and extension
+        }
+        count=jfsnrbad-index;
+        if (count>MAXBBLOCKS) count=MAXBBLOCKS;
+        fresh=false;
+        if (index+count<jfsnrbad && next==0) {
+            if ((next=getblock())==0) jfcstatus=E_JFC_DISKFULL;
+            fresh=true;
+        }
+        fill_buffer(BlockBuffer,0);
+        if (current==A_BADBLKHDR) {
+            bbh_t.bbhdata->blocktype=T_BADBLKHDR;
+            bbh_t.bbhdata->nrbadblocks=jfsnrbad;
+        } else {
+            bbx_t.bbxdata->blocktype=T_BADBLKEXT;
+            bbx_t.bbxdata->prevbblock=prev;
+        }
+        bbx_t.bbxdata->extb_block=next;
+        for (entry=0;entry<count;entry++) bbx_t.bbxdata->badblock[entry]=jfsbadblocks[index++];
+        if (writeblock(current)!=SDRDY) return false;
+        if (index>=jfsnrbad) break;
+        if (next==0) return false;              //No extension block, rest stays in RAM
+        prev=current;
+        current=next;
+    }
+    jfsbaddirty=false;
+    return true;
+}
+
+/**
+    Forget the RAM bad block list, it is read again on next use.
+    Use after (re)initialising the SD card; a format keeps the list on purpose.
+*/
+void forget_bad_blocks()
+{
+    jfsbadloaded=false;
+    jfsnrbad=0;
+    jfsbaddirty=false;
+    jfsbadtrunc=false;
+}
+
+/**
+    Add te new block to the empty chain.
+    Blocks are appended to the end of the empty chain
+*/
+void add_to_ec(long newblock)
+{
+//blockbuffer is statical/global defined
+long prevlastblock;
+
+    prevlastblock=GetLastECBlockNr();               //Get block number of last block in Empty Chain
+    if (prevlastblock==0) {                         //Then this is the first empty block in chain
+        init_ec_header(newblock);                   //New block is attached to EC Header
+    } else {
+        UpdateLastECBlock(prevlastblock,newblock);  //New block is attached to last block of EC
+    }
+    UpdateCurrentBlock(prevlastblock,newblock);     //Add Blocktype and address of previous empty block
+    UpdateECHeader(newblock);                       //Write new last block into EC Header
+    ec_countfree(newblock);
+}
+
+long GetLastECBlockNr()                             //Get block number of last block in Empty Chain
+{
+union ech_transfer ech_t ;                          //blockbuffer is static/global defined
+
+    readblock(A_EMPTYCHN);                          //Read the EC Header block
+    ech_t.buffer=&BlockBuffer[0];                   //pointer to first byte of buffer
+    return ech_t.ecdata->last_eb;
+}
+
+/**
+    Initialises the Empty Chain Header. This is done after the first empty block is initialized. 
+    Its address is added as both the first and the last empty block in the chain.
+    lastEBlock will be modified ater by UpdateECHeader().
+*/
+void init_ec_header(long firstEBlock)
+{
+union ech_transfer ech_t ;
+
+    
+    ech_t.buffer=&BlockBuffer[0];           //Link ech_t buffer to physical address of BlockBuffer
+    ech_t.ecdata->blocktype=T_EMPTYHDR;     //Set block type to Empty Chain Header
+    ech_t.ecdata->first_eb=firstEBlock;     //Set link to first empty block in chain
+    ech_t.ecdata->last_eb=firstEBlock;      //is also last empty block 
+    writeblock(A_EMPTYCHN);                 //empty chain header initialized with first empty block
+}
+
+/**
+    In order to add a new block to the empty chain, the previous last block is linked.
+    The 0 indicating it was the (former) last block in the chain is replaced by
+    the block number of the new last block in the Empty Chain
+*/
+void UpdateLastECBlock(long prevlastblock,long newblock)
+{
+union eb_transfer eb_t ;
+
+    readblock(prevlastblock);               //read old contents of previous last block
+    eb_t.buffer=&BlockBuffer[0];            //et_t.buffer is now a pointer to the start of BlockBuffer
+    eb_t.ebdata->next_eb=newblock;          //modify content: (add new last block in the chain)
+    writeblock(prevlastblock);              //write back previous last block
+}
+
+/**
+    A new block is linked into the empty chain.
+    since it is the last block in the chain, next_eb is set to 0
+    prev_eb is the backlink to the previous block in the chain.
+*/
+void UpdateCurrentBlock(long prevlastblock, long newblock)
+{
+union eb_transfer eb_t ;
+
+    eb_t.buffer=&BlockBuffer[0];            //Link eb_t buffer to physical address of BlockBuffer
+    eb_t.ebdata->blocktype=T_EMPTYBLK;      //Initialize the empty block data structure
+    eb_t.ebdata->next_eb=0;                 //Is now the last block in chain
+    eb_t.ebdata->prev_eb=prevlastblock;     //Link back to previous block in chain. 
+    writeblock(newblock);                   //write initialized new block in chain
+}
+
+void UpdateECHeader(long newblock)
+{
+union ech_transfer ech_t ;
+
+    readblock(A_EMPTYCHN);                  //Read current content of empty chain block header    
+    ech_t.buffer=&BlockBuffer[0];           //Link ech_t buffer to physical address of BlockBuffer   
+    ech_t.ecdata->last_eb=newblock;         //Modify EBHeader data structure with new last block  
+    writeblock(A_EMPTYCHN);                 //Empty chain header initialized with first empty block
+}
+
+/**
+    Get a free block from whichever allocator the disk was formatted with.
+    This is the allocation interface for the rest of jfs.c.
+    Returns the block number, or 0 if the disk is full.
+*/
+long getblock()
+{
+    return getblocks(1);
+}
+
+/**
+    Get a run of (count) physically consecutive free blocks.
+    Returns the first block of the run, or 0 if no such run is available.
+    With the empty chain only a run at the head of the chain can be found,
+    callers should fall back to smaller runs or single blocks.
+    Nothing is handed out while the bad block list is not all in RAM.
+*/
+long getblocks(long count)
+{
+    if (!jfsbadloaded) load_bad_blocks();
+    if (jfsbadtrunc) {
+        jfcstatus=E_JFC_BADLIST;
+        return 0;
+    }
+    if (jfs_alloctype()==T_BITMAPHDR) return bm_alloc(count);
+    if (count==1) return ec_getblock();
+    return ec_getrun(count);
+}
+
+/**
+    Return a block to the free pool of whichever allocator the disk uses.
+*/
+void freeblock(long blocknr)
+{
+    if (is_bad_block(blocknr)) return;          //Bad blocks never go back to free space
+    if (jfs_alloctype()==T_BITMAPHDR) {
+        bm_free(blocknr,1);
+    } else {
+        add_to_ec(blocknr);
+    }
+}
+
+/**
+    Return a run of (count) blocks from (blocknr) on to the free pool.
+*/
+void freeblocks(long blocknr, long count)
+{
+    if (is_bad_range(blocknr,count)) {          //Rare: one at a time, freeblock() skips the bad ones
+        for (;count>0;count--) freeblock(blocknr++);
+    } else if (jfs_alloctype()==T_BITMAPHDR) {
+        bm_free(blocknr,count);
+    } else {
+        for (;count>0;count--) add_to_ec(blocknr++);
+    }
+}
+
+/**
+    Give back a run of (count) blocks got from getblocks() that has not been
+    written since. The empty chain takes it back at its head as a whole.
+*/
+void ungetblocks(long blocknr, long count)
+{
+    if (jfs_alloctype()==T_BITMAPHDR) {
+        bm_free(blocknr,count);
+    } else {
+        ec_putrun(blocknr,count);
+    }
+}
+
+/**
+    Return the type of free space administration on the disk:
+    T_EMPTYHDR for the linked empty chain, T_BITMAPHDR for the bitmap.
+    Block 1 is metadata, so this is normally a cache hit.
+*/
+unsigned char jfs_alloctype()
+{
+struct s_cacheslot* slot;
+
+    if ((slot=jfs_cacheread(A_EMPTYCHN))==0) return T_EMPTYHDR;
+    return slot->data[0];
+}
+
+/**
+    Get an empty block from the empty chain.
+    Empty blocks are taken from the start of the chain.
+*/
+long ec_getblock()
+{
+union ech_transfer ech_t;
+long emptyblock;
+
+    readblock(A_EMPTYCHN);                  //Read current content of empty chain block header    
+    ech_t.buffer=&BlockBuffer[0];           //Link ech_t buffer to physical address of BlockBuffer  
+    emptyblock=ech_t.ecdata->first_eb;      //Read address of first available empty block
+#ifdef DEBUG
+printf("\nFirst empty block available is 0x%08lx.",emptyblock);
+#endif
+    if (emptyblock!=0) {                    //Empty block available
+        eb_unlink(emptyblock);              //Remove it from the empty chain
+        return(emptyblock);                 //Return the block address
+    } else {                                //No empty block available
+        return(0);
+    }
+}
+
+/**
+    Check that blocknr is in the empty chain: a T_EMPTYBLK whose neighbours,
+    or the chain header at the ends, link to it. The type byte alone is not
+    enough, extent data blocks have no header and may start with any byte.
+    While an ec_sort() is not finished the free blocks from sortnext on keep
+    their old links to each other, they are refused until their pass comes.
+    Uses the BlockBuffer.
+*/
+bool ec_inchain(long blocknr)
+{
+union ech_transfer ech_t;
+union eb_transfer eb_t;
+struct s_cacheslot* hdr;
+long pred, succ;
+
+    if ((hdr=jfs_cacheread(A_EMPTYCHN))==0) return false;
+    ech_t.buffer=hdr->data;
+    if ((ech_t.ecdata->flags&ECF_SORTING) && blocknr>=ech_t.ecdata->sortnext) return false;
+    ech_t.buffer=&BlockBuffer[0];
+    eb_t.buffer=&BlockBuffer[0];
+    if (readblock(blocknr)!=SDRDY || eb_t.ebdata->blocktype!=T_EMPTYBLK) return false;
+    pred=eb_t.ebdata->prev_eb;
+    succ=eb_t.ebdata->next_eb;
+    if (pred==0) {
+        if (readblock(A_EMPTYCHN)!=SDRDY || ech_t.ecdata->first_eb!=blocknr) return false;
+    } else {
+        if (readblock(pred)!=SDRDY || eb_t.ebdata->blocktype!=T_EMPTYBLK || eb_t.ebdata->next_eb!=blocknr) return false;
+    }
+    if (succ==0) return (readblock(A_EMPTYCHN)==SDRDY && ech_t.ecdata->last_eb==blocknr);
+    return (readblock(succ)==SDRDY && eb_t.ebdata->blocktype==T_EMPTYBLK && eb_t.ebdata->prev_eb==blocknr);
+}
+
+/**
+    Get a run of (count) consecutive blocks from the head of the empty chain.
+    The run must also be in chain order, every block linking to the next one
+    on the card. It then leaves the chain as a whole: the header and the
+    successor of its last block are updated, whatever its length. The counted
+    head run is known to be in order, past it the links are followed with one
+    read per block. A freshly formatted chain is in ascending order, so this
+    mostly succeeds.
+*/
+long ec_getrun(long count)
+{
+union ech_transfer ech_t;
+union eb_transfer eb_t;
+long first, last, succ, known, sortnext;
+
+    readblock(A_EMPTYCHN);
+    ech_t.buffer=&BlockBuffer[0];
+    eb_t.buffer=&BlockBuffer[0];
+    first=ech_t.ecdata->first_eb;
+    if (first==0) return 0;                 //Chain is empty
+    known=1;
+    if ((ech_t.ecdata->flags&ECF_COUNTED) && ech_t.ecdata->headrun>1) known=ech_t.ecdata->headrun;
+    sortnext=(ech_t.ecdata->flags&ECF_SORTING) ? ech_t.ecdata->sortnext : 0;
+    for (last=first+((known<count) ? known : count)-1;last<first+count-1;last++) {   //Known ones need no read
+        if ((sortnext!=0 && last+1>=sortnext) || readblock(last)!=SDRDY || eb_t.ebdata->blocktype!=T_EMPTYBLK ||
+            eb_t.ebdata->next_eb!=last+1) break;
+    }
+    if (last<first+count-1) {
+        readblock(A_EMPTYCHN);
+        if ((ech_t.ecdata->flags&ECF_COUNTED) && last-first+1>ech_t.ecdata->headrun) {
+            ech_t.ecdata->headrun=last-first+1;     //Remember how far the run was found in order
+            writeblock(A_EMPTYCHN);
+        }
+        return 0;
+    }
+    readblock(last);
+    succ=eb_t.ebdata->next_eb;
+    if (succ!=0) {
+        readblock(succ);
+        eb_t.ebdata->prev_eb=0;             //succ is the new head
+        writeblock(succ);
+    }
+    readblock(A_EMPTYCHN);
+    ech_t.ecdata->first_eb=succ;
+    if (succ==0) ech_t.ecdata->last_eb=0;
+    if (ech_t.ecdata->flags&ECF_COUNTED) {
+        ech_t.ecdata->nrfree-=count;
+        ech_t.ecdata->nrused+=count;
+        if (succ==0) {
+            ech_t.ecdata->headrun=0;
+        } else if (known>count) {
+            ech_t.ecdata->headrun=known-count;  //The rest of the run starts at succ
+        } else {
+            ech_t.ecdata->headrun=1;
+        }
+    }
+    writeblock(A_EMPTYCHN);
+    return first;
+}
+
+/**
+    Put a run taken by ec_getrun() back at the head of the chain, or (count)
+    blocks from the end of it. The blocks must not have been written since:
+    they still link to each other, so only the ends of the run, the old head
+    and the header are updated, whatever its length.
+*/
+void ec_putrun(long first, long count)
+{
+union ech_transfer ech_t;
+union eb_transfer eb_t;
+long last, oldfirst, headrun;
+
+    ech_t.buffer=&BlockBuffer[0];
+    eb_t.buffer=&BlockBuffer[0];
+    last=first+count-1;
+    readblock(A_EMPTYCHN);
+    oldfirst=ech_t.ecdata->first_eb;
+    headrun=ech_t.ecdata->headrun;
+    readblock(first);
+    eb_t.ebdata->prev_eb=0;
+    if (count==1) eb_t.ebdata->next_eb=oldfirst;
+    writeblock(first);
+    if (count>1) {
+        readblock(last);
+        eb_t.ebdata->next_eb=oldfirst;
+        writeblock(last);
+    }
+    if (oldfirst!=0) {
+        readblock(oldfirst);
+        eb_t.ebdata->prev_eb=last;
+        writeblock(oldfirst);
+    }
+    readblock(A_EMPTYCHN);
+    ech_t.ecdata->first_eb=first;
+    if (oldfirst==0) ech_t.ecdata->last_eb=last;
+    if (ech_t.ecdata->flags&ECF_COUNTED) {
+        ech_t.ecdata->nrfree+=count;
+        ech_t.ecdata->nrused-=count;
+        ech_t.ecdata->headrun=(oldfirst!=0 && oldfirst==last+1) ? count+headrun : count;
+    }
+    writeblock(A_EMPTYCHN);
+}
+
+/**
+    Remove a block from the empty chain
+    blocknr must be a valid block number from the empty chain.
+    The predecessor and successor are derived from the empty block itself. 
+*/
+void eb_unlink(long blocknr)
+{
+union eb_transfer eb_t;                     //Empty block data structure
+long pred,succ;                             //Predecessor and successor blocks
+    
+    readblock(blocknr);                     //Get the specified empty block
+    eb_t.buffer=&BlockBuffer[0];            //Map eb_t onto the data block
+    succ=eb_t.ebdata->next_eb;              //Retrieve block address of successor
+    pred=eb_t.ebdata->prev_eb;              //Retrieve block address of predecessor
+#ifdef DEBUG
+printf("\neb_unlink block 0x%08lx, pred= 0x%08lx, succ= 0x%08lx",blocknr,pred,succ);
+#endif
+    if (succ==0) {                           //This was the last empty block in the chain
+        UpdateECHeader(pred);               //Record predecessor as last block in empty chain
+    } else {                                //If not, the successor must be updated
+        readblock(succ);                    //Get the data (eb_t.buffer ASSUMED to be already OK)
+        eb_t.ebdata->prev_eb=pred;          //Backlink to the predecessor of the removed block
+        writeblock(succ);                   //Successor block updated
+    }                               //So far the successor part.
+    if (pred==0){                           //blocknr was the first in the empty chain
+#ifdef DEBUG
 printf("\neb_unlink: was first eb in chain, setting start of ec to 0x%08lx.", succ);
+#endif
         ec_modfirst(succ);                  //Register succ as new first empty block in the empty chian
     } else {                                //blocknr was not the first empty block
         readblock(pred);                    //Get the pred block
         eb_t.ebdata->next_eb=succ;          //Register the successor of blocknr as the new successor of pred
         writeblock(pred);                   //Update pred block
     }                                       //Bookkeeping done!
+    ec_counttaken(blocknr,succ,pred==0);
+}
+
+/**
+    Add blocknr as the first empty block in the empty chain
+*/
+void ec_modfirst(long blocknr)
+{
+union ech_transfer ech_t ;
+
+    readblock(A_EMPTYCHN);                  //Read current content of empty chain block header    
+    ech_t.buffer=&BlockBuffer[0];           //Link ech_t buffer to physical address of BlockBuffer   
+    ech_t.ecdata->first_eb=blocknr;         //Modify EBHeader data structure with new last block  
+    writeblock(A_EMPTYCHN);                 //Empty chain header initialized with first empty block
+}
+
+/**
+    Empty chain counters.
+    The chain header keeps the number of free and used blocks and the length
+    of the run of free blocks that starts at first_eb, so the usage of a disk
+    is known without walking the chain. add_to_ec(), eb_unlink() and
+    add_bad_block() keep them up to date, in the same transaction as the
+    chain links. A chain formatted before the counters has no ECF_COUNTED,
+    jfs_verifycounts(true) counts it once and sets them.
+    headrun counts the blocks from first_eb on that are next to each other
+    on the card and in the chain, each linking to the one after it; only the
+    last may link elsewhere. ec_getrun() takes such a run without reading it.
+    It is a lower bound: a longer run may exist but is not known.
+*/
+
+/**
+    Set the counters for a chain of (nrfree) blocks in a file system of
+    (totalblocks) blocks, and keep them from now on.
+*/
+void ec_initcounts(long totalblocks, long nrfree, long headrun)
+{
+union ech_transfer ech_t;
+
+    if (!jfsbadloaded) load_bad_blocks();   //Uses the BlockBuffer
+    readblock(A_EMPTYCHN);
+    ech_t.buffer=&BlockBuffer[0];
+    ech_t.ecdata->flags|=ECF_COUNTED;
+    ech_t.ecdata->totalblocks=totalblocks;
+    ech_t.ecdata->nrfree=nrfree;
+    ech_t.ecdata->nrused=totalblocks-nrfree-jfsnrbad;
+    ech_t.ecdata->headrun=headrun;
+    writeblock(A_EMPTYCHN);
+}
+
+/**
+    Count newblock, just appended to the chain by add_to_ec(), as free.
+    It lengthens the head run if that was the whole chain and newblock is
+    the next block on the card.
+*/
+void ec_countfree(long newblock)
+{
+union ech_transfer ech_t;
+struct s_cacheslot* hdr;
+
+    if ((hdr=jfs_cacheread(A_EMPTYCHN))==0) return;
+    ech_t.buffer=hdr->data;
+    if (!(ech_t.ecdata->flags&ECF_COUNTED)) return;
+    if (ech_t.ecdata->nrfree==0) {
+        ech_t.ecdata->headrun=1;            //Chain was empty, newblock is first_eb
+    } else if (ech_t.ecdata->nrfree==ech_t.ecdata->headrun && newblock==ech_t.ecdata->first_eb+ech_t.ecdata->headrun) {
+        ech_t.ecdata->headrun+=1;           //The run was the whole chain, its last block now links to newblock
+    }
+    ech_t.ecdata->nrfree+=1;
+    ech_t.ecdata->nrused-=1;
+    hdr->dirty=true;
+}
+
+/**
+    Count blocknr, just unlinked by eb_unlink(), as used. succ was its
+    successor in the chain, wasfirst tells if it was first_eb.
+*/
+void ec_counttaken(long blocknr, long succ, bool wasfirst)
+{
+union ech_transfer ech_t;
+struct s_cacheslot* hdr;
+long first, headrun;
+
+    if ((hdr=jfs_cacheread(A_EMPTYCHN))==0) return;
+    ech_t.buffer=hdr->data;
+    if (!(ech_t.ecdata->flags&ECF_COUNTED)) return;
+    first=ech_t.ecdata->first_eb;
+    headrun=ech_t.ecdata->headrun;
+    if (wasfirst) {                         //The run now starts at succ, if that is the next block
+        headrun=(succ==BlkAdd(blocknr,1) && headrun>1) ? headrun-1 : 1;
+    } else if (blocknr>first && blocknr<first+headrun) {
+        headrun=blocknr-first;              //Taken from the middle: the run ends before it
+    }
+    ech_t.ecdata->nrfree-=1;
+    ech_t.ecdata->nrused+=1;
+    if (ech_t.ecdata->nrfree==0) headrun=0;
+    ech_t.ecdata->headrun=headrun;
+    hdr->dirty=true;
+}
+
+/**
+    Fill in the usage of the file system from the allocator and bad block
+    headers: no block of free space is read.
+    Returns false if the disk has an empty chain without counters.
+*/
+bool jfs_usage(struct s_jfsusage* usage)
+{
+union ech_transfer ech_t;
+union bmh_transfer bmh_t;
+struct s_cacheslot* hdr;
+
+    if (!jfsbadloaded) load_bad_blocks();
+    if ((hdr=jfs_cacheread(A_EMPTYCHN))==0) return false;
+    usage->alloctype=hdr->data[0];
+    usage->nrbad=jfsnrbad;
+    if (usage->alloctype==T_BITMAPHDR) {
+        bmh_t.buffer=hdr->data;
+        usage->totalblocks=bmh_t.bmhdata->totalblocks;
+        usage->nrfree=bmh_t.bmhdata->nrfree;
+        usage->nrused=usage->totalblocks-usage->nrfree-usage->nrbad;
+        usage->headrun=0;
+        return true;
+    }
+    ech_t.buffer=hdr->data;
+    if (!(ech_t.ecdata->flags&ECF_COUNTED)) return false;
+    usage->totalblocks=ech_t.ecdata->totalblocks;
+    usage->nrfree=ech_t.ecdata->nrfree;
+    usage->nrused=ech_t.ecdata->nrused;
+    usage->headrun=ech_t.ecdata->headrun;
+    return true;
+}
+
+/**
+    Count the free space the slow way and cross-check the counters.
+    Empty chain: the chain is walked from first_eb, every block must be a
+    T_EMPTYBLK that links back to its predecessor and the last one must be
+    last_eb; nrfree, nrused and headrun are checked. Bitmap: the clear bits
+    are counted and checked against nrfree.
+    Wrong counters are corrected if (fix); a chain without counters gets them.
+    Returns the nr of wrong (or missing) counters, -1 if the free space
+    structure itself is broken.
+*/
+long jfs_verifycounts(bool fix)
+{
+union ech_transfer ech_t;
+union bmh_transfer bmh_t;
+union eb_transfer eb_t;
+long total, first, last, blocknr, prev, nrfree, run, storedfree, storedused, storedrun, wrong;
+unsigned char bits, bitnr;
+bool counted;
+
+    if (!jfsbadloaded) load_bad_blocks();
+    if (readblock(A_EMPTYCHN)!=SDRDY) return -1;
+    wrong=0;
+    if (BlockBuffer[0]==T_BITMAPHDR) {
+        bmh_t.buffer=&BlockBuffer[0];
+        total=bmh_t.bmhdata->totalblocks;
+        first=bmh_t.bmhdata->firstbmblock;
+        storedfree=bmh_t.bmhdata->nrfree;
+        nrfree=0;
+        for (blocknr=0;blocknr<total;blocknr+=8) {
+            if (((unsigned int)blocknr&(BMBITSPERBLK-1))==0 &&
+                readblock(BlkAdd(first,(unsigned int)BlkShr(blocknr,BMBITSHIFT)))!=SDRDY) return -1;
+            bits=BlockBuffer[((unsigned int)blocknr>>3)&(SDBlockSize-1)];
+            if (bits==0xFF) continue;
+            for (bitnr=0;bitnr<8 && blocknr+bitnr<total;bitnr++) {
+                if (!(bits&(0x80>>bitnr))) nrfree++;
+            }
+        }
+        if (nrfree!=storedfree) {
+            wrong++;
+            if (fix) {
+                readblock(A_EMPTYCHN);
+                bmh_t.bmhdata->nrfree=nrfree;
+                writeblock(A_EMPTYCHN);
+            }
+        }
+        return wrong;
+    }
+    ech_t.buffer=&BlockBuffer[0];
+    counted=(ech_t.ecdata->flags&ECF_COUNTED)!=0;
+    total=counted ? ech_t.ecdata->totalblocks : SDCardTotalBlocks;
+    storedfree=ech_t.ecdata->nrfree;
+    storedused=ech_t.ecdata->nrused;
+    storedrun=ech_t.ecdata->headrun;
+    first=ech_t.ecdata->first_eb;
+    last=ech_t.ecdata->last_eb;
+    eb_t.buffer=&BlockBuffer[0];
+    nrfree=0;
+    run=0;
+    prev=0;
+    for (blocknr=first;blocknr!=0;blocknr=eb_t.ebdata->next_eb) {
+        if (nrfree>=total || readblock(blocknr)!=SDRDY || eb_t.ebdata->blocktype!=T_EMPTYBLK ||
+            eb_t.ebdata->prev_eb!=prev) return -1;
+        if (blocknr==first+run && run==nrfree) run++;   //Next on the card and in the chain
+        prev=blocknr;
+        nrfree++;
+    }
+    if (prev!=last) return -1;
+    if (!counted) {
+        wrong=3;
+    } else {
+        if (storedfree!=nrfree) wrong++;
+        if (storedused!=total-nrfree-jfsnrbad) wrong++;
+        if (storedrun>run) wrong++;         //Less than the real run is allowed
+    }
+    if (fix && (wrong>0 || storedrun<run)) ec_initcounts(total,nrfree,run);
+    return wrong;
+}
+
+/**
+    Format the free space administration as a bitmap for blocks 0..maxblocks.
+    The bitmap blocks start at A_FIRSTDATA, one bit per block, 1 = in use.
+    Blocks 0..3, the bitmap itself and bits past maxblocks are marked in use.
+    Only the bitmap blocks and the header are written, data blocks are untouched.
+    Returns the number of free blocks.
+*/
+long bm_format(long maxblocks)
+{
+union bmh_transfer bmh_t;
+long totalblocks, nrbmblocks, firstfree;
+long bmblock, bitnr, blocknr, nrbad;
+int index;
+
+    totalblocks=maxblocks+1;
+    nrbmblocks=BlkShr(totalblocks+BMBITSPERBLK-1,BMBITSHIFT);
+    firstfree=A_FIRSTDATA+nrbmblocks;       //Everything below is in use
+    for (bmblock=0;bmblock<nrbmblocks;bmblock++) {
+        fill_buffer(BlockBuffer,0);
+        blocknr=bmblock<<BMBITSHIFT;                            //First block covered by this bitmap block
+        if (blocknr<firstfree || blocknr+BMBITSPERBLK>totalblocks) {    //Only the first and last have bits set
+            for (bitnr=0;bitnr<BMBITSPERBLK;bitnr++) {
+                if (blocknr+bitnr<firstfree || blocknr+bitnr>=totalblocks) BlockBuffer[(unsigned int)bitnr>>3]|=0x80>>((unsigned char)bitnr&7);
+            }
+        }
+        rawwriteblock(A_FIRSTDATA+bmblock);
+        if ((bmblock&0x0F)==0) jfs_progress(bmblock<<BMBITSHIFT);
+    }
+
+    nrbad=0;                                //Known bad blocks are marked in use below
+    for (index=0;index<jfsnrbad;index++) {
+        if (jfsbadblocks[index]>=firstfree && jfsbadblocks[index]<totalblocks) nrbad++;
+    }
+
+    fill_buffer(BlockBuffer,0);
+    bmh_t.buffer=&BlockBuffer[0];
+    bmh_t.bmhdata->blocktype=T_BITMAPHDR;
+    bmh_t.bmhdata->totalblocks=totalblocks;
+    bmh_t.bmhdata->firstbmblock=A_FIRSTDATA;
+    bmh_t.bmhdata->nrbmblocks=nrbmblocks;
+    bmh_t.bmhdata->nexthint=firstfree;
+    bmh_t.bmhdata->nrfree=totalblocks-firstfree-nrbad;
+    writeblock(A_EMPTYCHN);
+    for (index=0;index<jfsnrbad;index++) {
+        if (jfsbadblocks[index]>=firstfree && jfsbadblocks[index]<totalblocks) bm_mark(jfsbadblocks[index],1,true);
+    }
+    return (totalblocks-firstfree-nrbad);
+}
+
+/**
+    Allocate (count) consecutive free blocks from the bitmap.
+    The search starts at the next-free hint and wraps around once.
+    Returns the first block of the run, or 0 if there is no such run.
+    Whole 0x00 and 0xFF bytes are skipped 8 blocks at a time, and the bitmap
+    block is looked at in place in the cache, so a typical allocation costs
+    no SD card I/O at all.
+*/
+long bm_alloc(long count)
+{
+union bmh_transfer bmh_t;
+struct s_cacheslot* hdr;
+struct s_cacheslot* bm;
+long totalblocks, firstbm, blocknr, runstart, runlen, scanned;
+unsigned char bits;
+
+    if ((hdr=jfs_cacheread(A_EMPTYCHN))==0) return 0;
+    bmh_t.buffer=hdr->data;
+    if (bmh_t.bmhdata->nrfree<count || count<1) return 0;
+    totalblocks=bmh_t.bmhdata->totalblocks;
+    firstbm=bmh_t.bmhdata->firstbmblock;
+    blocknr=bmh_t.bmhdata->nexthint;
+    if (blocknr>=totalblocks) blocknr=0;
+    runstart=blocknr;
+    runlen=0;
+    bm=0;
+    for (scanned=0;scanned<totalblocks;) {
+        if (bm==0 || ((unsigned int)blocknr&(BMBITSPERBLK-1))==0) {    //Bitmap block changes every 4096 blocks
+            if ((bm=jfs_cacheread(BlkAdd(firstbm,(unsigned int)BlkShr(blocknr,BMBITSHIFT))))==0) return 0;
+        }
+        bits=bm->data[((unsigned int)blocknr>>3)&(SDBlockSize-1)];
+        if (((unsigned char)blocknr&7)==0 && bits==0x00 && blocknr+8<=totalblocks && runlen+8<count) {
+            runlen+=8;                      //Eight free blocks at once
+            blocknr+=8;
+            scanned+=8;
+        } else if (((unsigned char)blocknr&7)==0 && bits==0xFF) {
+            runlen=0;                       //Eight used blocks at once
+            blocknr+=8;
+            scanned+=8;
+            runstart=blocknr;
+        } else {
+            if (bits&(0x80>>((unsigned char)blocknr&7))) {
+                runlen=0;
+                runstart=blocknr+1;
+            } else {
+                runlen++;
+            }
+            blocknr++;
+            scanned++;
+        }
+        if (runlen>=count) break;           //Found it
+        if (blocknr>=totalblocks) {         //Wrap around, a run can not wrap
+            blocknr=0;
+            runstart=0;
+            runlen=0;
+        }
+    }
+    if (runlen<count) return 0;
+    bm_mark(runstart,count,true);
+    if ((hdr=jfs_cacheread(A_EMPTYCHN))==0) return 0;
+    bmh_t.buffer=hdr->data;
+    bmh_t.bmhdata->nrfree-=count;
+    bmh_t.bmhdata->nexthint=runstart+count;
+    hdr->dirty=true;
+    return runstart;
+}
+
+/**
+    Return (count) blocks starting at blocknr to the bitmap.
+*/
+void bm_free(long blocknr, long count)
+{
+union bmh_transfer bmh_t;
+struct s_cacheslot* hdr;
+
+    bm_mark(blocknr,count,false);
+    if ((hdr=jfs_cacheread(A_EMPTYCHN))==0) return;
+    bmh_t.buffer=hdr->data;
+    bmh_t.bmhdata->nrfree+=count;
+    if (blocknr<bmh_t.bmhdata->nexthint) bmh_t.bmhdata->nexthint=blocknr;   //Keep allocations low on the disk
+    hdr->dirty=true;
+}
+
+/**
+    Set (inuse true) or clear the bitmap bits for count blocks from blocknr on.
+*/
+void bm_mark(long blocknr, long count, bool inuse)
+{
+union bmh_transfer bmh_t;
+struct s_cacheslot* bm;
+long firstbm, lastblock;
+unsigned char mask;
+
+    if ((bm=jfs_cacheread(A_EMPTYCHN))==0) return;
+    bmh_t.buffer=bm->data;
+    firstbm=bmh_t.bmhdata->firstbmblock;
+    lastblock=blocknr+count;
+    bm=0;
+    for (;blocknr<lastblock;blocknr++) {
+        if (bm==0 || ((unsigned int)blocknr&(BMBITSPERBLK-1))==0) {    //Bitmap block changes every 4096 blocks
+            if ((bm=jfs_cacheread(BlkAdd(firstbm,(unsigned int)BlkShr(blocknr,BMBITSHIFT))))==0) return;
+            bm->dirty=true;
+        }
+        mask=0x80>>((unsigned char)blocknr&7);
+        if (inuse) {
+            bm->data[((unsigned int)blocknr>>3)&(SDBlockSize-1)]|=mask;
+        } else {
+            bm->data[((unsigned int)blocknr>>3)&(SDBlockSize-1)]&=~mask;
+        }
+    }
+}
+
+/**
+    True if the bitmap bit of blocknr is clear, false if set or unreadable.
+*/
+bool bm_isfree(long blocknr)
+{
+union bmh_transfer bmh_t;
+struct s_cacheslot* bm;
+
+    if ((bm=jfs_cacheread(A_EMPTYCHN))==0) return false;
+    bmh_t.buffer=bm->data;
+    if ((bm=jfs_cacheread(BlkAdd(bmh_t.bmhdata->firstbmblock,(unsigned int)BlkShr(blocknr,BMBITSHIFT))))==0) return false;
+    return (bm->data[((unsigned int)blocknr>>3)&(SDBlockSize-1)]&(0x80>>((unsigned char)blocknr&7)))==0;
+}
+
+/**
+    Create a new directory with specified name and attributes under parentdir
+    createDir returns the block address of the new dir structure, 
+    it must be added to the parent dir separately
+*/
+long createDir(char* dirname, unsigned char attribs, long parentdir)
+{
+union dh_transfer dh_t;
+long diraddress;
+
+   if ((diraddress=getblock())!=0){             //non-zero means a block has been made available, 0 means no block
+        dcache_invalidate(diraddress);          //Block may have been a dir before
+        fill_buffer(BlockBuffer,0);             //Unused entries must be 0
+        dh_t.buffer=&BlockBuffer[0];            //Link dh_t buffer to physical address of BlockBuffer
+        dh_t.dhdata->blocktype=T_DIRHDR;        //Blocktype directory header or 0xD0
+        dh_t.dhdata->attibutes=attribs;         //Assign the specified attribs
+        strcpy(dh_t.dhdata->dirname,dirname);   //Specify directory name
+        dh_t.dhdata->parentdir=parentdir;       //Specify where to create the dir
+        dh_t.dhdata->dirext=0;                  //No extension block yet
+        dh_t.dhdata->entry[0].block=0;          //No files yet
+        writeblock(diraddress);                 //Write partition header to disk 
+printf("\nCreated dir %s at block 0x%08lx", dirname, diraddress);
+        return (diraddress);                    //Return the address of the new partition header
+    } else {                                    //no block available
+        jfcstatus=E_JFC_NOBLOCKFORDIR;          //Signal could not find an empty block for the dir
+        return (0);
+    }
+}
+
+/**
+    Create a partition. The partition header is created on disk, but not yet entered in the partition table
+    Create the / dir before calling createPartition(), and pass its dir header block as parameter
+*/
+long createPartition(char driveletter, char* partname, long bootfile, long rootdir)
+{
+union ph_transfer ph_t;
+long ph_address;
+
+    if ((ph_address=getblock())!=0){        //non-zero means a block has been made available, 0 means no block
+        ph_t.buffer=&BlockBuffer[0];            //Link ph_t buffer to physical address of BlockBuffer
+        ph_t.phdata->blocktype=T_PARTHDR;       //Block type is T_PARTHDR of 0xA0
+        ph_t.phdata->driveletter=driveletter;   //assign the give drive letter
+        strcpy(ph_t.phdata->volname, partname); //copy partition name into data structure
+        ph_t.phdata->bootfile=bootfile;         //copy block address of boot file (or 0 if none)
+        ph_t.phdata->rootdir=rootdir;           //copy block address of root dir (must be created in advance)
+        ph_t.phdata->bootload=0;                //set with jfs_setboot()
+        ph_t.phdata->bootexec=0;
+        writeblock(ph_address);             //Write partition header to disk
+printf("\nCreated partition %s with drive letter %c at block 0x%08lx", partname, driveletter, ph_address);
+        return (ph_address);                //Return the address of the new partition header
+    } else {                                //no block available
+printf("\nFailed to allocate block for partition header.");
+        return (0);
+    }
+}
+
+int addpart(long newpart)
+{
+union pm_transfer pm_t;                     
+
+    readblock(A_PARTMAP);                   //Read the partition map raw data
+    pm_t.buffer=&BlockBuffer[0];            //Map the partmap structure onto the data
+    if (pm_t.pmdata->no_parts>=MAXPARTS) {  //Max number of partitions reached
+        jfcstatus=E_JFC_PARTMAPFULL;        //Message that partition map is full
+        return (0);                         //Return error code
+    } else {                                //Ready to add it
+        pm_t.pmdata->parthdr[pm_t.pmdata->no_parts]=newpart;    //Add the address of the new partition header
+        pm_t.pmdata->no_parts++;            //Increase the number of defined partitions          
+        writeblock(A_PARTMAP);              //Write back the updated partition map
+        dcache_invalidate(A_PARTMAP);       //A cached miss on the new drive letter would hide it
+        return (pm_t.pmdata->no_parts);     //Return the new number of partitions
+    }
+}
+
+/**
+    Get a run of up to (want) consecutive free blocks, as long as the allocator can give.
+    The run asked for is halved until it fits, so a fragmented disk still gives single blocks.
+    Returns the first block and sets *got to the run length, or returns 0 if the disk is full.
+*/
+long getextent(long want, long* got)
+{
+long start;
+
+    if (want>FXMAXRUN) want=FXMAXRUN;
+    while (want>0) {
+        if ((start=getblocks(want))!=0) {
+            *got=want;
+            return start;
+        }
+        want>>=1;
+    }
+    *got=0;
+    return 0;
+}
+
+/**
+    Create an extent file and allocate blocks for (size) bytes of data.
+    The data blocks are handed out as extents, so the file is as contiguous as the
+    allocator allows. The data itself is not written.
+    createFile returns the block address of the file header, 
+    it must be added to the parent dir separately
+*/
+long createFile(char* filename, unsigned char attribs, long size)
+{
+union fxh_transfer fxh_t;
+long fileheader, remaining, start, got;
+
+    if ((fileheader=getblock())==0) {           //0 means no block
+        jfcstatus=E_JFC_NOBLOCKFORFILE;
+        return (0);
+    }
+    fill_buffer(BlockBuffer,0);
+    fxh_t.buffer=&BlockBuffer[0];
+    fxh_t.fxhdata->blocktype=T_FILEXHDR;
+    fxh_t.fxhdata->attributes=attribs;
+    strcpy(fxh_t.fxhdata->filename,filename);
+    fxh_t.fxhdata->extlist=0;                   //No overflow block yet
+    fxh_t.fxhdata->filesize=size;
+    fxh_t.fxhdata->nrextents=0;                 //No data blocks yet
+    writeblock(fileheader);
+
+    remaining=BlkShr(size+SDBlockSize-1,9);     //Data blocks needed
+    while (remaining>0) {
+        if ((start=getextent(remaining,&got))==0 || !file_addextent(fileheader,start,got)) {
+            if (got!=0) freeblocks(start,got);  //Not recorded in the file, give back now
+            freefile(fileheader);               //Give back what was allocated so far
+            jfcstatus=E_JFC_DISKFULL;
+            return (0);
+        }
+        remaining-=got;
+    }
+printf("\nCreated file %s at block 0x%08lx", filename, fileheader);
+    return (fileheader);
+}
+
+/**
+    Append the run of (length) blocks at (start) to the extent list of a file.
+    A run that continues the last extent just makes that extent longer.
+    When the header is full the run goes to an overflow block, which is
+    allocated when needed. Returns false if no overflow block is available.
+*/
+bool file_addextent(long fileheader, long start, long length)
+{
+union fxh_transfer fxh_t;
+union fxl_transfer fxl_t;
+struct s_extent* last;
+long listblock, nextlist, newlist;
+unsigned int nrext;
+
+    fxh_t.buffer=&BlockBuffer[0];
+    fxl_t.buffer=&BlockBuffer[0];
+    readblock(fileheader);
+    listblock=fileheader;
+    nextlist=fxh_t.fxhdata->extlist;
+    nrext=fxh_t.fxhdata->nrextents;
+    last=&fxh_t.fxhdata->extent[nrext-1];
+    while (nextlist!=0) {                       //Find the last extent list block
+        listblock=nextlist;
+        readblock(listblock);
+        nextlist=fxl_t.fxldata->nextblock;
+        nrext=fxl_t.fxldata->nrextents;
+        last=&fxl_t.fxldata->extent[nrext-1];
+    }
+    if (nrext>0 && last->start+last->length==start) {
+        last->length+=length;                   //Contiguous: grow the last extent
+    } else if (listblock==fileheader && nrext<FXHMAXEXT) {
+        fxh_t.fxhdata->extent[nrext].start=start;
+        fxh_t.fxhdata->extent[nrext].length=length;
+        fxh_t.fxhdata->nrextents++;
+    } else if (listblock!=fileheader && nrext<FXLMAXEXT) {
+        fxl_t.fxldata->extent[nrext].start=start;
+        fxl_t.fxldata->extent[nrext].length=length;
+        fxl_t.fxldata->nrextents++;
+    } else {                                    //Full, start a new overflow block
+        if ((newlist=getblock())==0) return false;
+        readblock(listblock);                   //getblock() used the BlockBuffer
+        if (listblock==fileheader) {
+            fxh_t.fxhdata->extlist=newlist;
+        } else {
+            fxl_t.fxldata->nextblock=newlist;
+        }
+        writeblock(listblock);
+        fill_buffer(BlockBuffer,0);
+        fxl_t.fxldata->blocktype=T_FILEXLST;
+        fxl_t.fxldata->prevblock=listblock;
+        fxl_t.fxldata->nextblock=0;
+        fxl_t.fxldata->nrextents=1;
+        fxl_t.fxldata->extent[0].start=start;
+        fxl_t.fxldata->extent[0].length=length;
+        listblock=newlist;
+    }
+    writeblock(listblock);
+    return true;
+}
+
+/**
+    Find the block that holds byte (offset) of a file and the position of that
+    byte within the block (*blockoffset).
+    Extent files (T_FILEXHDR) need the header and at most one overflow block for
+    files of up to 119 extents. Chained files (T_FILEHDR) are still readable,
+    but every block before the offset has to be read.
+    Returns 0 if offset is past the end of the file or fileheader is not a file.
+*/
+long file_bmap(long fileheader, long offset, int* blockoffset)
+{
+union fxh_transfer fxh_t;
+union fxl_transfer fxl_t;
+union fh_transfer fh_t;
+union fe_transfer fe_t;
+struct s_extent* ext;
+long lblock, blocknr;
+unsigned int nrext, extnr;
+
+    fxh_t.buffer=&BlockBuffer[0];
+    fxl_t.buffer=&BlockBuffer[0];
+    fh_t.buffer=&BlockBuffer[0];
+    fe_t.buffer=&BlockBuffer[0];
+    if (readblock(fileheader)!=SDRDY) return 0;
+    if (BlockBuffer[0]==T_FILEHDR) {            //Chained file: walk the chain
+        if (offset>=fh_t.fhdata->filesize) return 0;
+        if (offset<FHMAXBYTES) {
+            *blockoffset=SDBlockSize-FHMAXBYTES+(int)offset;
+            return fileheader;
+        }
+        offset-=FHMAXBYTES;
+        blocknr=fh_t.fhdata->nextblock;
+        while (blocknr!=0) {
+            if (offset<FEMAXBYTES) {
+                *blockoffset=SDBlockSize-FEMAXBYTES+(int)offset;
+                return blocknr;
+            }
+            offset-=FEMAXBYTES;
+            if (readblock(blocknr)!=SDRDY) return 0;
+            blocknr=fe_t.fedata->nextblock;
+        }
+        return 0;
+    }
+    if (BlockBuffer[0]!=T_FILEXHDR) return 0;
+    if (offset>=fxh_t.fxhdata->filesize) return 0;
+    lblock=BlkShr(offset,9);                    //Logical block in the file
+    *blockoffset=(int)offset&(SDBlockSize-1);
+    nrext=fxh_t.fxhdata->nrextents;
+    ext=&fxh_t.fxhdata->extent[0];
+    blocknr=fxh_t.fxhdata->extlist;
+    for (;;) {
+        for (extnr=0;extnr<nrext;extnr++,ext++) {
+            if (lblock<ext->length) return ext->start+lblock;
+            lblock-=ext->length;
+        }
+        if (blocknr==0 || readblock(blocknr)!=SDRDY) return 0;
+        nrext=fxl_t.fxldata->nrextents;         //Continue in the overflow block
+        ext=&fxl_t.fxldata->extent[0];
+        blocknr=fxl_t.fxldata->nextblock;
+    }
+}
+
+/**
+    Return every block of a file to the allocator: the data blocks, the extent
+    list overflow blocks or chain blocks, and the header itself.
+    The file must be removed from its directory separately.
+*/
+void freefile(long fileheader)
+{
+union fxh_transfer fxh_t;
+union fxl_transfer fxl_t;
+union fh_transfer fh_t;
+union fe_transfer fe_t;
+struct s_extent ext;
+long listblock, nextlist, blocknr;
+unsigned int nrext, extnr;
+
+    fxh_t.buffer=&BlockBuffer[0];
+    fxl_t.buffer=&BlockBuffer[0];
+    fh_t.buffer=&BlockBuffer[0];
+    fe_t.buffer=&BlockBuffer[0];
+    if (readblock(fileheader)!=SDRDY) return;
+    if (BlockBuffer[0]==T_FILEHDR) {            //Chained file: free the chain
+        blocknr=fh_t.fhdata->nextblock;
+        while (blocknr!=0) {
+            readblock(blocknr);
+            nextlist=fe_t.fedata->nextblock;
+            freeblock(blocknr);
+            blocknr=nextlist;
+        }
+    } else if (BlockBuffer[0]==T_FILEXHDR) {    //Extent file: free every extent, then the lists
+        listblock=fileheader;
+        extnr=0;
+        while (listblock!=0) {
+            readblock(listblock);               //freeblocks() uses the BlockBuffer, reread
+            if (listblock==fileheader) {
+                nrext=fxh_t.fxhdata->nrextents;
+                nextlist=fxh_t.fxhdata->extlist;
+                if (extnr<nrext) ext=fxh_t.fxhdata->extent[extnr];
+            } else {
+                nrext=fxl_t.fxldata->nrextents;
+                nextlist=fxl_t.fxldata->nextblock;
+                if (extnr<nrext) ext=fxl_t.fxldata->extent[extnr];
+            }
+            if (extnr<nrext) {
+                freeblocks(ext.start,ext.length);
+                extnr++;
+            } else {                            //This list block done, on to the next
+                if (listblock!=fileheader) freeblock(listblock);
+                listblock=nextlist;
+                extnr=0;
+            }
+        }
+    }
+    freeblock(fileheader);
+}
+
+/**
+    Take (count) blocks off the end of the last extent of a file, for blocks
+    that were allocated ahead and not used. The blocks themselves are not
+    freed here. An overflow block left without extents is unlinked and freed.
+*/
+void file_trim(long fileheader, long count)
+{
+union fxh_transfer fxh_t;
+union fxl_transfer fxl_t;
+struct s_extent* last;
+long listblock, nextlist, prevlist;
+unsigned int nrext;
+
+    fxh_t.buffer=&BlockBuffer[0];
+    fxl_t.buffer=&BlockBuffer[0];
+    readblock(fileheader);
+    listblock=fileheader;
+    nextlist=fxh_t.fxhdata->extlist;
+    nrext=fxh_t.fxhdata->nrextents;
+    while (nextlist!=0) {                       //Find the last extent list block
+        listblock=nextlist;
+        readblock(listblock);
+        nextlist=fxl_t.fxldata->nextblock;
+        nrext=fxl_t.fxldata->nrextents;
+    }
+    if (nrext==0) return;
+    last=(listblock==fileheader) ? &fxh_t.fxhdata->extent[nrext-1] : &fxl_t.fxldata->extent[nrext-1];
+    if (last->length>count) {
+        last->length-=count;
+    } else if (listblock==fileheader) {         //Whole extent unused
+        fxh_t.fxhdata->nrextents--;
+    } else if (nrext>1) {
+        fxl_t.fxldata->nrextents--;
+    } else {                                    //Last extent of the overflow block: drop the block
+        prevlist=fxl_t.fxldata->prevblock;
+        readblock(prevlist);
+        if (prevlist==fileheader) {
+            fxh_t.fxhdata->extlist=0;
+        } else {
+            fxl_t.fxldata->nextblock=0;
+        }
+        writeblock(prevlist);
+        freeblock(listblock);
+        return;
+    }
+    writeblock(listblock);
+}
+
+/**
+    Sequential file reading.
+    jfs_open() hands out a handle with a read-ahead window of JFSRABLOCKS
+    blocks, jfs_read() copies from the window and refills it when it runs dry.
+    File data goes past the block cache, so reading a file does not push the
+    metadata out; a data block that is in the cache is newer than the card
+    and is taken from there.
+    Extent files: the addresses are known up front, every extent is read with
+    one CMD18 per window.
+    Chained files: the address of the next block is only known once the
+    current block is in. Its link is looked at right away: while the links
+    go to block+1 the CMD18 stream simply continues, at the first jump it is
+    stopped. After a jump the next block is read with a single CMD17 until a
+    consecutive link is seen again, so a fragmented chain costs no more
+    commands than reading it block by block.
+*/
+
+/**
+    Open the file with header block (fileheader) for reading.
+    Returns a handle for jfs_read(), or -1 with jfcstatus set.
+*/
+int jfs_open(long fileheader)
+{
+union fh_transfer fh_t;
+union fxh_transfer fxh_t;
+struct s_cacheslot* hdr;
+struct s_jfsfile* file;
+int handle;
+
+    for (handle=0;handle<JFSMAXOPEN && jfsfiles[handle].open;handle++);
+    if (handle==JFSMAXOPEN) {
+        jfcstatus=E_JFC_TOOMANYOPEN;
+        return -1;
+    }
+    if ((hdr=jfs_cacheread(fileheader))==0) {
+        jfcstatus=E_JFC_READERR;
+        return -1;
+    }
+    file=&jfsfiles[handle];
+    file->type=hdr->data[0];
+    file->header=fileheader;
+    file->writing=false;
+    file->pos=0;
+    file->bufnr=0;
+    file->bufoffset=0;
+    if (file->type==T_FILEHDR) {                //Chained file: the header holds the first bytes
+        fh_t.buffer=hdr->data;
+        file->size=fh_t.fhdata->filesize;
+        file->next=fh_t.fhdata->nextblock;
+        file->consecutive=(file->next==BlkAdd(fileheader,1));
+        memcpy(file->buf[0],hdr->data,SDBlockSize);
+        file->nrbuf=1;
+    } else if (file->type==T_FILEXHDR) {        //Extent file: data from the first extent on
+        fxh_t.buffer=hdr->data;
+        file->size=fxh_t.fxhdata->filesize;
+        file->left=BlkShr(file->size+SDBlockSize-1,9);
+        file->extblock=fileheader;
+        file->extnr=0;
+        file->extleft=0;                        //Taken by ra_nextextent() on the first fill
+        file->next=0;
+        file->nrbuf=0;
+    } else {
+        jfcstatus=E_JFC_NOTAFILE;
+        return -1;
+    }
+    file->open=true;
+    return handle;
+}
+
+/**
+    Read up to (count) bytes from an open file into buffer.
+    Returns the nr of bytes read, 0 at the end of the file, or -1 with
+    jfcstatus set if nothing could be read.
+*/
+int jfs_read(int handle, unsigned char* buffer, int count)
+{
+struct s_jfsfile* file;
+unsigned char* data;
+int start, length, done;
+
+    if (handle<0 || handle>=JFSMAXOPEN || !jfsfiles[handle].open || jfsfiles[handle].writing) {
+        jfcstatus=E_JFC_BADHANDLE;
+        return -1;
+    }
+    file=&jfsfiles[handle];
+    done=0;
+    while (done<count && file->pos<file->size) {
+        if (file->bufnr>=file->nrbuf && !ra_fill(file)) return done>0 ? done : -1;
+        data=file->buf[file->bufnr];
+        start=0;                                //Extent file: the whole block is data
+        if (file->type==T_FILEHDR) start=(data[0]==T_FILEHDR) ? SDBlockSize-FHMAXBYTES : SDBlockSize-FEMAXBYTES;
+        length=SDBlockSize-start-file->bufoffset;
+        if (length>count-done) length=count-done;
+        if (length>file->size-file->pos) length=(int)(file->size-file->pos);
+        memcpy(buffer+done,data+start+file->bufoffset,length);
+        done+=length;
+        file->pos+=length;
+        file->bufoffset+=length;
+        if (file->bufoffset==SDBlockSize-start) {   //Block used up
+            file->bufnr++;
+            file->bufoffset=0;
+        }
+    }
+    return done;
+}
+
+/**
+    File writing with delayed allocation.
+    jfs_create() makes the header and the dir entry, but no data blocks.
+    jfs_write() only fills the window; when it is full, wr_flush() asks the
+    allocator for one run covering the pending blocks and the rest of the
+    reservation, or, without a reservation, as many blocks as the file has
+    so far. Two files written side by side thus do not take turns at the
+    head of the free space, and the allocator is asked once per run instead
+    of once per block. The run is only reserved: a window goes into the
+    extent list once it is written, and jfs_close() writes the last partial
+    block, gives the unwritten end of the run back with ungetblocks() and
+    sets the file size. Blocks reserved by a file that is open at a crash
+    are neither in the file nor free, the next fsck finds them lost.
+    Data goes to the card with one CMD25 per window, past the block cache.
+*/
+
+/**
+    Create an extent file (name) in dir and open it for writing.
+    (reserve) is the expected size in bytes, 0 if not known; data blocks are
+    allocated in runs of that size. With a bitmap the free space is checked
+    against it up front.
+    Returns a handle for jfs_write(), or -1 with jfcstatus set.
+*/
+int jfs_create(long dir, char* name, unsigned char attribs, long reserve)
+{
+union bmh_transfer bmh_t;
+struct s_jfsfile* file;
+long fileheader;
+int handle;
+
+    for (handle=0;handle<JFSMAXOPEN && jfsfiles[handle].open;handle++);
+    if (handle==JFSMAXOPEN) {
+        jfcstatus=E_JFC_TOOMANYOPEN;
+        return -1;
+    }
+    file=&jfsfiles[handle];
+    file->left=BlkShr(reserve+SDBlockSize-1,9);
+    if (jfs_alloctype()==T_BITMAPHDR) {
+        readblock(A_EMPTYCHN);
+        bmh_t.buffer=&BlockBuffer[0];
+        if (bmh_t.bmhdata->nrfree<file->left+1) {
+            jfcstatus=E_JFC_DISKFULL;
+            return -1;
+        }
+    }
+    if ((fileheader=createFile(name,attribs,0))==0) return -1;
+    if (!dir_addentry(dir,fileheader,name,T_FILEXHDR,attribs)) {
+        freefile(fileheader);
+        return -1;
+    }
+    file->type=T_FILEXHDR;
+    file->header=fileheader;
+    file->writing=true;
+    file->size=0;
+    file->pos=0;
+    file->next=0;
+    file->extleft=0;
+    file->nrbuf=0;
+    file->bufoffset=0;
+    file->open=true;
+    return handle;
+}
+
+/**
+    Write (count) bytes from buffer to a file opened by jfs_create().
+    Returns (count), or -1 with jfcstatus set if a full window could not be
+    written; the bytes before that window are on disk.
+*/
+int jfs_write(int handle, unsigned char* buffer, int count)
+{
+struct s_jfsfile* file;
+int length, done;
+
+    if (handle<0 || handle>=JFSMAXOPEN || !jfsfiles[handle].open || !jfsfiles[handle].writing) {
+        jfcstatus=E_JFC_BADHANDLE;
+        return -1;
+    }
+    file=&jfsfiles[handle];
+    done=0;
+    while (done<count) {
+        length=SDBlockSize-file->bufoffset;
+        if (length>count-done) length=count-done;
+        memcpy(&file->buf[file->nrbuf][file->bufoffset],buffer+done,length);
+        done+=length;
+        file->pos+=length;
+        file->bufoffset+=length;
+        if (file->bufoffset==SDBlockSize) {     //Block full
+            file->nrbuf++;
+            file->bufoffset=0;
+            if (file->nrbuf==JFSRABLOCKS && !wr_flush(file)) return -1;
+        }
+    }
+    return done;
+}
+
+/**
+    Release a handle. A file opened by jfs_create() is completed first: the
+    last block is written, unused allocated blocks are given back and the
+    file size is set. Returns false if the data could not all be written,
+    the file then holds what was.
+*/
+bool jfs_close(int handle)
+{
+union fxh_transfer fxh_t;
+struct s_jfsfile* file;
+bool ok;
+
+    if (handle<0 || handle>=JFSMAXOPEN || !jfsfiles[handle].open) return false;
+    file=&jfsfiles[handle];
+    file->open=false;
+    if (!file->writing) return true;
+    ok=true;
+    if (file->bufoffset>0) {                    //Partial last block, zero filled
+        memset(&file->buf[file->nrbuf][file->bufoffset],0,SDBlockSize-file->bufoffset);
+        file->nrbuf++;
+        file->bufoffset=0;
+    }
+    if (file->nrbuf>0) ok=wr_flush(file);
+    if (file->extleft>0) ungetblocks(file->next,file->extleft);    //Reserved, not written
+    readblock(file->header);
+    fxh_t.buffer=&BlockBuffer[0];
+    fxh_t.fxhdata->filesize=(file->pos<file->size) ? file->pos : file->size;
+    writeblock(file->header);
+    if (jfs_flush()!=SDRDY) ok=false;
+    return ok;
+}
+
+/**
+    Allocate blocks for, and write, the (file->nrbuf) blocks in the window of
+    a file opened by jfs_create(). Returns false with jfcstatus set if the
+    disk is full or a write failed.
+*/
+bool wr_flush(struct s_jfsfile* file)
+{
+unsigned char CmdStructure[6];
+long want, start, got;
+int index, count, done;
+
+    index=0;
+    while (index<file->nrbuf) {
+        if (file->extleft==0) {                 //Run used up, allocate the next one
+            want=file->nrbuf-index;
+            if (want<file->left) want=file->left;   //The rest of the reservation
+            if (want<BlkShr(file->size,9)) want=BlkShr(file->size,9);   //No reservation: double the file
+            if ((start=getextent(want,&got))==0) {
+                jfcstatus=E_JFC_DISKFULL;
+                return false;
+            }
+            file->next=start;
+            file->extleft=got;
+            file->left=(file->left>got) ? file->left-got : 0;
+        }
+        count=file->nrbuf-index;
+        if (count>file->extleft) count=(int)file->extleft;
+        if (jl_reuse(file->next,count)!=SDRDY) {
+            jfcstatus=E_JFC_WRITEERR;
+            return false;
+        }
+        for (done=0;done<count;done++) jfs_cachedrop(BlkAdd(file->next,done));
+        jfscstats.devwrites+=count;
+        PrepCS(CmdStructure,SDCMDWriteBlock,file->next);
+        if (count==1) {
+            SDStat=SDWriteBlock(CmdStructure,file->buf[index]);
+        } else if ((SDStat=SDWriteStart(CmdStructure))==SDRDY) {
+            for (done=0;done<count && SDStat==SDRDY;done++) SDStat=SDWriteNext(file->buf[index+done]);
+            SDWriteStop();
+        }
+        if (SDStat!=SDRDY || !file_addextent(file->header,file->next,count)) {
+            if (SDStat==SDRDY) {
+                jfcstatus=E_JFC_DISKFULL;       //No block for the extent list
+            } else {
+                jfcstatus=E_JFC_WRITEERR;
+            }
+            freeblocks(file->next,count);       //Written or not, no longer linked empty blocks
+            file->next=BlkAdd(file->next,count);
+            file->extleft-=count;
+            return false;
+        }
+        file->next=BlkAdd(file->next,count);
+        file->extleft-=count;
+        file->size+=(long)count<<9;
+        index+=count;
+    }
+    file->nrbuf=0;
+    return true;
+}
+
+/**
+    Refill the read-ahead window of an open file.
+    Returns false with jfcstatus set if not a single block could be read.
+*/
+bool ra_fill(struct s_jfsfile* file)
+{
+    file->nrbuf=0;
+    file->bufnr=0;
+    file->bufoffset=0;
+    if (file->type==T_FILEHDR) {
+        ra_readchain(file);
+    } else {
+        ra_readextents(file);
+    }
+    if (file->nrbuf==0) {                       //Read error, or the file ends before its size
+        jfcstatus=E_JFC_READERR;
+        return false;
+    }
+    return true;
+}
+
+/**
+    Fill the window from a chained file, following the links from file->next.
+    A CMD18 stream is started when the last link was consecutive and two or
+    more blocks fit, it runs as long as the links stay consecutive.
+*/
+void ra_readchain(struct s_jfsfile* file)
+{
+union fe_transfer fe_t;
+struct s_cacheslot* slot;
+unsigned char CmdStructure[6];
+unsigned char* data;
+bool streaming;
+long blocknr;
+
+    streaming=false;
+    while (file->nrbuf<JFSRABLOCKS && file->next!=0) {
+        blocknr=file->next;
+        data=file->buf[file->nrbuf];
+        jfscstats.devreads++;
+        if (streaming) {
+            SDStat=SDReadNext(data);
+        } else {
+            PrepCS(CmdStructure,SDCMDReadBlock,blocknr);
+            if (file->consecutive && file->nrbuf+1<JFSRABLOCKS) {
+                SDStat=SDReadStart(CmdStructure);
+                streaming=(SDStat==SDRDY);
+                if (streaming) SDStat=SDReadNext(data);
+            } else {
+                SDStat=SDReadBlock(CmdStructure,data);
+            }
+        }
+        if (SDStat!=SDRDY) break;
+        if ((slot=jfs_cachefind(blocknr))!=0) memcpy(data,slot->data,SDBlockSize);
+        fe_t.buffer=data;
+        if (fe_t.fedata->blocktype!=T_FILEEXT) break;   //Broken chain
+        file->next=fe_t.fedata->nextblock;
+        file->consecutive=(file->next==BlkAdd(blocknr,1));
+        file->nrbuf++;
+        if (streaming && (!file->consecutive || file->nrbuf==JFSRABLOCKS)) {
+            SDReadStop();                       //Jump in the chain or window full
+            streaming=false;
+        }
+    }
+    if (streaming) SDReadStop();
+}
+
+/**
+    Fill the window from an extent file: the rest of the current extent, up
+    to the window size, with one command, then the next extent if room is left.
+*/
+void ra_readextents(struct s_jfsfile* file)
+{
+struct s_cacheslot* slot;
+unsigned char CmdStructure[6];
+int count, index;
+
+    while (file->nrbuf<JFSRABLOCKS && file->left>0) {
+        while (file->extleft==0) {
+            if (!ra_nextextent(file)) return;
+        }
+        count=JFSRABLOCKS-file->nrbuf;
+        if (count>file->extleft) count=(int)file->extleft;
+        if (count>file->left) count=(int)file->left;
+        jfscstats.devreads+=count;
+        PrepCS(CmdStructure,SDCMDReadBlock,file->next);
+        if (count==1) {
+            SDStat=SDReadBlock(CmdStructure,file->buf[file->nrbuf]);
+        } else if ((SDStat=SDReadStart(CmdStructure))==SDRDY) {
+            for (index=0;index<count && SDStat==SDRDY;index++) SDStat=SDReadNext(file->buf[file->nrbuf+index]);
+            SDReadStop();
+        }
+        if (SDStat!=SDRDY) return;
+        for (index=0;index<count;index++) {
+            if ((slot=jfs_cachefind(BlkAdd(file->next,index)))!=0) memcpy(file->buf[file->nrbuf+index],slot->data,SDBlockSize);
+        }
+        file->nrbuf+=count;
+        file->next=BlkAdd(file->next,count);
+        file->extleft-=count;
+        file->left-=count;
+    }
+}
+
+/**
+    Make the next extent of an extent file current, going on to the next
+    extent list block when this one is used up. False at the end of the list.
+*/
+bool ra_nextextent(struct s_jfsfile* file)
+{
+union fxh_transfer fxh_t;
+union fxl_transfer fxl_t;
+struct s_cacheslot* list;
+struct s_extent* ext;
+unsigned int nrext;
+long nextlist;
+
+    while (file->extblock!=0) {
+        if ((list=jfs_cacheread(file->extblock))==0) return false;
+        if (list->data[0]==T_FILEXHDR) {
+            fxh_t.buffer=list->data;
+            nrext=fxh_t.fxhdata->nrextents;
+            ext=&fxh_t.fxhdata->extent[0];
+            nextlist=fxh_t.fxhdata->extlist;
+        } else {
+            fxl_t.buffer=list->data;
+            nrext=fxl_t.fxldata->nrextents;
+            ext=&fxl_t.fxldata->extent[0];
+            nextlist=fxl_t.fxldata->nextblock;
+        }
+        if (file->extnr<nrext) {
+            file->next=ext[file->extnr].start;
+            file->extleft=ext[file->extnr].length;
+            file->extnr++;
+            return true;
+        }
+        file->extblock=nextlist;                //This list block used up
+        file->extnr=0;
+    }
+    return false;
+}
+
+/**
+    16 bit hash of a name, stored in the directory entry.
+    Shift-and-add keeps it cheap on the 6309: no multiplications.
+*/
+unsigned int jfs_namehash(char* name)
+{
+unsigned int hash;
+int count;
+
+    hash=0;
+    for (count=0;count<32 && *name!=0;count++) {
+        hash=((hash<<5)+hash)^(unsigned char)*name++;     //hash*33 xor char
+    }
+    return hash&0xFFFF;                         //16 bits, also where an int is wider
+}
+
+/**
+    Read dir block (dirblock) of dir, the header or an extension, into BlockBuffer.
+    Returns its entry array, the number of entries the block holds in *nrents and
+    the next dir block (0 if none) in *nextblock. Returns 0 on a read error.
+*/
+struct s_dirent* dir_block(long dir, long dirblock, int* nrents, long* nextblock)
+{
+union dh_transfer dh_t;
+union dx_transfer dx_t;
+
+    dh_t.buffer=&BlockBuffer[0];
+    dx_t.buffer=&BlockBuffer[0];
+    if (readblock(dirblock)!=SDRDY) return 0;
+    if (dirblock==dir) {
+        *nrents=DHMAXENTS;
+        *nextblock=dh_t.dhdata->dirext;
+        return &dh_t.dhdata->entry[0];
+    }
+    *nrents=DXMAXENTS;
+    *nextblock=dx_t.dxdata->nextdblock;
+    return &dx_t.dxdata->entry[0];
+}
+
+/**
+    Add an entry for the header at (block) to dir. Name, type and attributes
+    are copied into the entry, so lookups only need the header if the hash matches.
+    A new extension block is allocated when the dir is full.
+    Returns false if dir is 0 or no block is available for the extension.
+*/
+bool dir_addentry(long dir, long block, char* name, unsigned char type, unsigned char attribs)
+{
+union dh_transfer dh_t;
+union dx_transfer dx_t;
+struct s_dirent* entries;
+long dirblock, lastblock, nextblock, newext;
+int index, nrents;
+
+    dcache_invalidate(dir);                     //Cached misses in dir may become hits
+    dh_t.buffer=&BlockBuffer[0];
+    dx_t.buffer=&BlockBuffer[0];
+    if (dir==0) {
+        jfcstatus=E_JFC_NODIR;
+        return false;
+    }
+    dirblock=dir;
+    lastblock=dir;
+    index=0;
+    while (dirblock!=0) {                       //Find the first free entry
+        if ((entries=dir_block(dir,dirblock,&nrents,&nextblock))==0) return false;
+        for (index=0;index<nrents && entries[index].block!=0;index++);
+        if (index<nrents) break;
+        lastblock=dirblock;
+        dirblock=nextblock;
+    }
+    if (dirblock==0) {                          //Dir full, add an extension block
+        if ((newext=getblock())==0) {
+            jfcstatus=E_JFC_DIRFULL;
+            return false;
+        }
+        readblock(lastblock);                   //Link it after the last dir block
+        if (lastblock==dir) {
+            dh_t.dhdata->dirext=newext;
+        } else {
+            dx_t.dxdata->nextdblock=newext;
+        }
+        writeblock(lastblock);
+        fill_buffer(BlockBuffer,0);
+        dx_t.dxdata->blocktype=T_DIREXT;
+        dx_t.dxdata->prevdblock=lastblock;
+        dx_t.dxdata->nextdblock=0;
+        dirblock=newext;
+        entries=&dx_t.dxdata->entry[0];
+        index=0;
+    }
+    entries[index].block=block;                 //The next entry is still 0, so the list stays terminated
+    entries[index].hash=jfs_namehash(name);
+    entries[index].type=type;
+    entries[index].attributes=attribs;
+    writeblock(dirblock);
+    return true;
+}
+
+/**
+    Remove the entry for (block) from dir.
+    The last entry of the dir is moved into its place, so the list stays without holes.
+    Returns false if block is not in dir.
+*/
+bool dir_delentry(long dir, long block)
+{
+struct s_dirent* entries;
+struct s_dirent last;
+long dirblock, nextblock, foundblock, lastblock;
+int index, nrents, foundindex, lastindex;
+
+    dcache_invalidate(dir);                     //Cached hits in dir may become misses
+    foundblock=0;
+    lastblock=0;
+    dirblock=dir;
+    while (dirblock!=0) {                       //Find the entry and the last entry in use
+        if ((entries=dir_block(dir,dirblock,&nrents,&nextblock))==0) return false;
+        for (index=0;index<nrents && entries[index].block!=0;index++) {
+            if (entries[index].block==block) {
+                foundblock=dirblock;
+                foundindex=index;
+            }
+            lastblock=dirblock;
+            lastindex=index;
+        }
+        if (index<nrents) break;                //End of list in this block
+        dirblock=nextblock;
+    }
+    if (foundblock==0) return false;
+    entries=dir_block(dir,lastblock,&nrents,&nextblock);
+    last=entries[lastindex];
+    entries[lastindex].block=0;                 //Terminates the list now
+    writeblock(lastblock);
+    if (foundblock!=lastblock || foundindex!=lastindex) {
+        entries=dir_block(dir,foundblock,&nrents,&nextblock);
+        entries[foundindex]=last;               //Fill the hole
+        writeblock(foundblock);
+    }
+    return true;
+}
+
+/**
+    Find (name) in dir. Only the header blocks of entries with the same name hash
+    are read to compare the full name; file and dir headers both hold the name at byte 2.
+    Returns the header block of the entry, or 0 if not found.
+*/
+long dir_lookup(long dir, char* name)
+{
+struct s_dirent* entries;
+unsigned int hash;
+long dirblock, nextblock, candidate;
+int index, nrents;
+
+    hash=jfs_namehash(name);
+    dirblock=dir;
+    while (dirblock!=0) {
+        if ((entries=dir_block(dir,dirblock,&nrents,&nextblock))==0) return 0;
+        for (index=0;index<nrents;index++) {
+            if (entries[index].block==0) return 0;      //End of list
+            if (entries[index].hash==hash) {
+                candidate=entries[index].block;
+                if (readblock(candidate)==SDRDY && strncmp((char*)&BlockBuffer[2],name,32)==0) return candidate;
+                dir_block(dir,dirblock,&nrents,&nextblock);  //Candidate header replaced the dir block
+            }
+        }
+        dirblock=nextblock;
+    }
+    return 0;
+}
+
+/**
+    List the entries of dir: type, attributes and name.
+    Hidden entries are skipped unless showhidden, without reading their headers.
+*/
+void dir_list(long dir, bool showhidden)
+{
+struct s_dirent* entries;
+struct s_dirent current;
+long dirblock, nextblock;
+int index, nrents;
+char name[33];
+
+    name[32]=0;
+    dirblock=dir;
+    while (dirblock!=0) {
+        if ((entries=dir_block(dir,dirblock,&nrents,&nextblock))==0) return;
+        for (index=0;index<nrents;index++) {
+            if (entries[index].block==0) return;        //End of list
+            if ((entries[index].attributes&AT_HIDDEN) && !showhidden) continue;
+            current=entries[index];
+            if (readblock(current.block)==SDRDY) {
+                memcpy(name,&BlockBuffer[2],32);    //Not terminated at full length, name[32] is
+                printf("\n%c%c %08lx %s",(current.type==T_DIRHDR || current.type==T_DIRLINK) ? 'd' : '-',
+                    (current.attributes&AT_WRITEABLE) ? 'w' : '-',(long)current.block,name);
+            }
+            dir_block(dir,dirblock,&nrents,&nextblock); //Header replaced the dir block
+        }
+        dirblock=nextblock;
+    }
+}
+
+/**
+    Look up (name) in dir through the dentry cache.
+    Hits and known misses cost no block reads; otherwise dir_lookup() reads the
+    dir and the answer, also a miss, is remembered in the least recently used slot.
+    Returns the header block of name, or 0 if it does not exist.
+*/
+long jfs_lookup(long dir, char* name)
+{
+struct s_dentry* dentry;
+struct s_dentry* victim;
+unsigned int hash;
+long child;
+int length;
+
+    hash=jfs_namehash(name);
+    victim=&jfsdcache[0];
+    for (dentry=&jfsdcache[0];dentry<&jfsdcache[JFSDCACHESIZE];dentry++) {
+        if (dentry->parent==dir && dentry->hash==hash && strncmp(dentry->name,name,32)==0) {
+            dentry->lastuse=++jfsdcacheclock;
+            if (dentry->child==0) {
+                jfsdstats.neghits++;
+            } else {
+                jfsdstats.hits++;
+            }
+            return dentry->child;
+        }
+        if (victim->parent!=0 && (dentry->parent==0 || dentry->lastuse<victim->lastuse)) victim=dentry;
+    }
+    jfsdstats.misses++;
+    child=(dir==A_PARTMAP) ? part_lookup(name[0]) : dir_lookup(dir,name);
+    victim->parent=dir;
+    victim->child=child;
+    victim->hash=hash;
+    victim->lastuse=++jfsdcacheclock;
+    length=strlen(name);
+    if (length>32) length=32;
+    memcpy(victim->name,name,length);           //Not terminated if 32 chars long
+    if (length<32) victim->name[length]=0;
+    return child;
+}
+
+/**
+    Resolve a path like "c:/src/lib/x.asm" to the header block of its last part.
+    Without a drive letter JFSDEFDRIVE is used. The drive letter is looked up as a
+    name in the partition map block, so it is cached like any other name.
+    Returns 0 if any part of the path does not exist.
+*/
+long jfs_path(char* path)
+{
+char part[33];
+char drive[2];
+long block;
+int length;
+
+    drive[1]=0;
+    if (path[0]!=0 && path[1]==':') {
+        drive[0]=path[0];
+        path+=2;
+    } else {
+        drive[0]=JFSDEFDRIVE;
+    }
+    if ((block=jfs_lookup(A_PARTMAP,drive))==0) return 0;      //Root dir of the partition
+    while (*path!=0) {
+        while (*path=='/') path++;              //Skip separators
+        for (length=0;*path!=0 && *path!='/';path++) {
+            if (length<32) part[length++]=*path;
+        }
+        part[length]=0;
+        if (length==0) break;                   //Trailing '/'
+        if ((block=jfs_lookup(block,part))==0) return 0;
+    }
+    return block;
+}
+
+/**
+    Find the partition with (driveletter) in the partition map.
+    Returns the block address of its root dir, or 0 if there is no such partition.
+*/
+long part_lookup(char driveletter)
+{
+union pm_transfer pm_t;
+union ph_transfer ph_t;
+long parthdr[MAXPARTS];
+unsigned char partnr, nrparts;
+
+    pm_t.buffer=&BlockBuffer[0];
+    ph_t.buffer=&BlockBuffer[0];
+    if (readblock(A_PARTMAP)!=SDRDY) return 0;
+    nrparts=pm_t.pmdata->no_parts;
+    if (nrparts>MAXPARTS) nrparts=MAXPARTS;
+    for (partnr=0;partnr<nrparts;partnr++) parthdr[partnr]=pm_t.pmdata->parthdr[partnr];
+    for (partnr=0;partnr<nrparts;partnr++) {
+        if (readblock(parthdr[partnr])==SDRDY && ph_t.phdata->driveletter==driveletter) return ph_t.phdata->rootdir;
+    }
+    return 0;
+}
+
+/**
+    Make the file at path the boot file of the partition with driveletter,
+    loaded at load and started at exec by the stage-0 loader in block 0.
+    path 0 or "" makes the partition not bootable. Stage-0 streams every
+    extent straight to memory, so the boot file must be an extent file with
+    all its extents in the header, loaded from BOOTLOADMIN on, and its last
+    block must end at BOOTLOADEND or below; exec must be in the file.
+    Returns the boot file header block, 0 if made not bootable, -1 with
+    jfcstatus set.
+*/
+long jfs_setboot(char driveletter, char* path, unsigned int load, unsigned int exec)
+{
+union pm_transfer pm_t;
+union ph_transfer ph_t;
+union fxh_transfer fxh_t;
+long parthdr[MAXPARTS];
+long header, blocks, size;
+unsigned int extnr;
+unsigned char partnr, nrparts;
+
+    pm_t.buffer=&BlockBuffer[0];
+    ph_t.buffer=&BlockBuffer[0];
+    fxh_t.buffer=&BlockBuffer[0];
+    header=0;
+    if (path!=0 && path[0]!=0) {
+        if ((header=jfs_path(path))==0 || readblock(header)!=SDRDY || BlockBuffer[0]!=T_FILEXHDR) {
+            jfcstatus=E_JFC_NOTAFILE;
+            return -1;
+        }
+        blocks=0;
+        for (extnr=0;extnr<fxh_t.fxhdata->nrextents && extnr<FXHMAXEXT;extnr++) blocks+=fxh_t.fxhdata->extent[extnr].length;
+        size=fxh_t.fxhdata->filesize;
+        if (fxh_t.fxhdata->extlist!=0 || size==0 || load<BOOTLOADMIN || blocks>(BOOTLOADEND-BOOTLOADMIN)/SDBlockSize ||
+            (long)load+blocks*SDBlockSize>BOOTLOADEND || exec<load || (long)exec>=(long)load+size) {
+            jfcstatus=E_JFC_BOOTFILE;
+            return -1;
+        }
+    }
+    nrparts=0;
+    if (readblock(A_PARTMAP)==SDRDY) nrparts=pm_t.pmdata->no_parts;
+    if (nrparts>MAXPARTS) nrparts=MAXPARTS;
+    for (partnr=0;partnr<nrparts;partnr++) parthdr[partnr]=pm_t.pmdata->parthdr[partnr];
+    for (partnr=0;partnr<nrparts;partnr++) {
+        if (readblock(parthdr[partnr])==SDRDY && ph_t.phdata->driveletter==driveletter) {
+            ph_t.phdata->bootfile=header;
+            ph_t.phdata->bootload=(header!=0) ? load : 0;
+            ph_t.phdata->bootexec=(header!=0) ? exec : 0;
+            writeblock(parthdr[partnr]);
+            jfs_unmount();                      //Home at once: stage-0 does not replay the journal
+            return header;
+        }
+    }
+    jfcstatus=E_JFC_NOPART;
+    return -1;
+}
+
+/**
+    Empty the dentry cache, e.g. after a format or a card change.
+*/
+void dcache_init()
+{
+struct s_dentry* dentry;
+
+    for (dentry=&jfsdcache[0];dentry<&jfsdcache[JFSDCACHESIZE];dentry++) dentry->parent=0;
+    jfsdcacheclock=0;
+}
+
+/**
+    Drop every cached name looked up in dir. Called whenever dir changes.
+*/
+void dcache_invalidate(long dir)
+{
+struct s_dentry* dentry;
+
+    for (dentry=&jfsdcache[0];dentry<&jfsdcache[JFSDCACHESIZE];dentry++) {
+        if (dentry->parent==dir) {
+            dentry->parent=0;
+            jfsdstats.invalidates++;
+        }
+    }
+}
+
+
+/**
+    File system check.
+    jfs_fsck() never follows the empty chain block by block, it works in two
+    passes that read every block at most once:
+    1.  fsck_badlist() and fsck_tree() mark every block the file system uses
+        in fsckref: blocks 0..3, the journal, the bitmap, the bad block list
+        and all partitions, dirs and files, extent data included. Only the
+        metadata is read, through the cache. Blocks used twice, back links
+        that do not match and dir entries that point at the wrong block are
+        found here.
+    2.  Empty chain: fsck_chain() reads the blocks the tree does not use, in
+        ascending order with multi-block reads, and checks the T_EMPTYBLK
+        links against each other with the two bitmaps:
+            fsckref fsckfree    not read yet        read
+            1       0           used                used
+            1       1           linked to           free, linked to
+            0       1           -                   free, nothing links to it (yet)
+            0       0           nothing known       neither used nor free: lost
+        Every next_eb claims its target, see fsck_claim(). The prev_eb links
+        are checked by adding up fsck_linksum() of all next_eb links and of
+        all prev_eb links: the sums only match if every pair agrees.
+        Bitmap: fsck_bitmap() compares the bitmap with fsckref, no free block
+        is read.
+    Two bitmaps of FSCKMAPBYTES bound the size of a file system that can be
+    checked. A ring of empty blocks that link to each other consistently,
+    apart from the chain, is not found.
+*/
+
+/**
+    Check the file system and, if (fix), repair it: bad dir entries are
+    removed, back links set, broken chains cut at the last good block, the
+    bad block list rewritten, lost and unlinked blocks returned to free space
+    and the free space counters set. A broken empty chain is written anew.
+    Everything is flushed home first, the scan reads the card itself.
+    Returns the number of problems found, -1 with jfcstatus set if the file
+    system can not be checked.
+*/
+long jfs_fsck(bool fix, struct s_fsckstats* result)
+{
+union ech_transfer ech_t;
+union bmh_transfer bmh_t;
+long firstbm, nrbm;
+unsigned char alloctype;
+
+    jfs_flush();
+    if (jfsjtail!=jfsjhead && jl_checkpoint()!=SDRDY) {
+        jfcstatus=E_JFC_WRITEERR;
+        return -1;
+    }
+    if (!jfsbadloaded) load_bad_blocks();
+    if (readblock(A_EMPTYCHN)!=SDRDY) return -1;
+    alloctype=BlockBuffer[0];
+    ech_t.buffer=&BlockBuffer[0];
+    bmh_t.buffer=&BlockBuffer[0];
+    firstbm=0;
+    nrbm=0;
+    if (alloctype==T_BITMAPHDR) {
+        fscktotal=bmh_t.bmhdata->totalblocks;
+        firstbm=bmh_t.bmhdata->firstbmblock;
+        nrbm=bmh_t.bmhdata->nrbmblocks;
+    } else {
+        fscktotal=(ech_t.ecdata->flags&ECF_COUNTED) ? ech_t.ecdata->totalblocks : SDCardTotalBlocks;
+    }
+    if ((alloctype!=T_BITMAPHDR && alloctype!=T_EMPTYHDR) || fscktotal<=A_FIRSTDATA || fscktotal>FSCKMAXBLOCKS) {
+        jfcstatus=E_JFC_FSCKSIZE;
+        return -1;
+    }
+    memset(result,0,sizeof(struct s_fsckstats));
+    memset(fsckref,0,FSCKMAPBYTES);
+    memset(fsckfree,0,FSCKMAPBYTES);
+    fsckres=result;
+    fsckfix=fix;
+    fsckmsgs=0;
+    fsckpos=0;
+    fsckbase=0;
+    fsckend=fscktotal;
+    result->blocks=fscktotal;
+
+    fsck_use(A_BOOTBLOCK,A_FIRSTDATA);
+    if (nrbm!=0) fsck_use(firstbm,nrbm);
+    fsck_badlist();
+    fsck_tree();
+    if (alloctype==T_BITMAPHDR) {
+        fsck_bitmap();
+    } else {
+        fsck_chain();
+    }
+    result->used-=result->bad;
+    if (fix) jfs_flush();
+    return result->lost+result->orphans+result->doubles+result->badlinks+result->badentries+result->badcounts;
+}
+
+/**
+    Count a problem in *counter and print it, up to FSCKMAXMSG of them.
+*/
+void fsck_report(long* counter, const char* what, long blocknr)
+{
+    (*counter)++;
+    if (fsckmsgs<FSCKMAXMSG) {
+        printf("\n%s 0x%08lx",what,blocknr);
+    } else if (fsckmsgs==FSCKMAXMSG) {
+        printf("\nMore problems, only counted.");
+    }
+    fsckmsgs++;
+}
+
+/**
+    The bit of blocknr in fsckref or fsckfree. blocknr must be in the window
+    fsckbase..fsckend-1, which is the whole file system for jfs_fsck().
+*/
+bool fsck_bit(unsigned char* map, long blocknr)
+{
+    return (map[(unsigned int)(blocknr-fsckbase)>>3]&(0x80>>((unsigned char)blocknr&7)))!=0;
+}
+
+/**
+    Set (on true) or clear the bit of blocknr in fsckref or fsckfree.
+*/
+void fsck_setbit(unsigned char* map, long blocknr, bool on)
+{
+    if (on) {
+        map[(unsigned int)(blocknr-fsckbase)>>3]|=0x80>>((unsigned char)blocknr&7);
+    } else {
+        map[(unsigned int)(blocknr-fsckbase)>>3]&=~(0x80>>((unsigned char)blocknr&7));
+    }
+}
+
+/**
+    True if blocknr is used by the tree: referenced, and not a free block a link points at.
+*/
+bool fsck_isused(long blocknr)
+{
+    return fsck_bit(fsckref,blocknr) && !fsck_bit(fsckfree,blocknr);
+}
+
+/**
+    The first block from blocknr on that the tree does not use, 0 if there is
+    none before the end of the window.
+*/
+long fsck_nextfree(long blocknr)
+{
+    for (;blocknr<fsckend;blocknr++) {
+        if (!fsck_isused(blocknr)) return blocknr;
+    }
+    return 0;
+}
+
+/**
+    Mark (count) blocks from blocknr on as used. Only the part inside the
+    window is marked, and only there a block used twice can be seen.
+    Returns false, after reporting it, if a block is outside the file system
+    or used already: the caller must not follow what is in it.
+*/
+bool fsck_use(long blocknr, long count)
+{
+long last;
+bool ok;
+
+    if (count<1 || blocknr<0 || blocknr+count>fscktotal) {
+        fsck_report(&fsckres->badlinks,"Reference outside the file system:",blocknr);
+        return false;
+    }
+    ok=true;
+    last=blocknr+count;
+    if (last>fsckend) last=fsckend;
+    if (blocknr<fsckbase) blocknr=fsckbase;
+    for (;blocknr<last;blocknr++) {
+        if (fsck_bit(fsckref,blocknr)) {
+            if (ok) fsck_report(&fsckres->doubles,"Block used twice:",blocknr);    //Once per run
+            ok=false;
+        } else {
+            fsck_setbit(fsckref,blocknr,true);
+            fsckres->used++;
+        }
+    }
+    return ok;
+}
+
+/**
+    Check the bad block list: the header, the back links of the extension
+    blocks and the entries, which must lie inside the file system. The list
+    blocks and the listed blocks are marked used. A damaged list is cut at
+    the last good block and written again from the RAM list, without the
+    entries that are out of range.
+*/
+void fsck_badlist()
+{
+union bbh_transfer bbh_t;
+union bbx_transfer bbx_t;
+long total, nread, blocknr, current, next;
+int index, kept;
+bool damaged;
+
+    bbh_t.buffer=&BlockBuffer[0];
+    bbx_t.buffer=&BlockBuffer[0];
+    if (readblock(A_BADBLKHDR)!=SDRDY || BlockBuffer[0]!=T_BADBLKHDR) {
+        fsck_report(&fsckres->badlinks,"No bad block list header at",A_BADBLKHDR);
+        if (fsckfix) {
+            init_badblk_hdr();
+            fsckres->fixed++;
+        }
+        return;
+    }
+    total=bbh_t.bbhdata->nrbadblocks;
+    nread=0;
+    current=A_BADBLKHDR;
+    damaged=false;
+    for (;;) {
+        for (index=0;index<MAXBBLOCKS && nread<total;index++,nread++) {
+            blocknr=bbx_t.bbxdata->badblock[index];
+            if (blocknr<A_FIRSTDATA || blocknr>=fscktotal) {
+                fsck_report(&fsckres->badlinks,"Bad block list entry out of range:",blocknr);
+                damaged=true;
+            } else if (fsck_use(blocknr,1)) {
+                fsckres->bad++;
+            }
+        }
+        if (nread>=total || (next=bbx_t.bbxdata->extb_block)==0) break;
+        if (next<A_FIRSTDATA || next>=fscktotal || readblock(next)!=SDRDY || BlockBuffer[0]!=T_BADBLKEXT ||
+            bbx_t.bbxdata->prevbblock!=current || !fsck_use(next,1)) {
+            fsck_report(&fsckres->badlinks,"Broken bad block list link in",current);
+            if (fsckfix && readblock(current)==SDRDY) {
+                bbx_t.bbxdata->extb_block=0;    //Same offset in header and extension
+                writeblock(current);
+            }
+            damaged=true;
+            break;
+        }
+        current=next;
+    }
+    if (damaged && fsckfix) {
+        forget_bad_blocks();
+        load_bad_blocks();                      //Sorted, what is left of the list on disk
+        for (index=0,kept=0;index<jfsnrbad;index++) {
+            if (jfsbadblocks[index]>=A_FIRSTDATA && jfsbadblocks[index]<fscktotal) jfsbadblocks[kept++]=jfsbadblocks[index];
+        }
+        jfsnrbad=kept;
+        jfsbaddirty=true;                       //Written by the jfs_flush() at the end
+        fsckres->fixed++;
+    }
+}
+
+/**
+    Mark everything reachable from the partition map used: the journal, the
+    partition headers, and per partition its root dir tree and boot file.
+*/
+void fsck_tree()
+{
+union pm_transfer pm_t;
+union ph_transfer ph_t;
+long parthdr[MAXPARTS];
+long rootdir, bootfile;
+unsigned char partnr, nrparts;
+
+    pm_t.buffer=&BlockBuffer[0];
+    ph_t.buffer=&BlockBuffer[0];
+    if (readblock(A_PARTMAP)!=SDRDY || BlockBuffer[0]!=T_PARTMAP) {
+        fsck_report(&fsckres->badlinks,"No partition map at",A_PARTMAP);
+        return;
+    }
+    if (pm_t.pmdata->journal!=0) fsck_use(pm_t.pmdata->journal,pm_t.pmdata->journalblks);
+    nrparts=pm_t.pmdata->no_parts;
+    if (nrparts>MAXPARTS) {
+        fsck_report(&fsckres->badlinks,"Too many partitions in",A_PARTMAP);
+        nrparts=MAXPARTS;
+    }
+    for (partnr=0;partnr<nrparts;partnr++) parthdr[partnr]=pm_t.pmdata->parthdr[partnr];
+    for (partnr=0;partnr<nrparts;partnr++) {
+        if (!fsck_use(parthdr[partnr],1)) continue;
+        if (readblock(parthdr[partnr])!=SDRDY || BlockBuffer[0]!=T_PARTHDR) {
+            fsck_report(&fsckres->badentries,"No partition header at",parthdr[partnr]);
+            continue;
+        }
+        rootdir=ph_t.phdata->rootdir;
+        bootfile=ph_t.phdata->bootfile;
+        fsckboot=bootfile;
+        if (rootdir<A_FIRSTDATA || rootdir>=fscktotal || readblock(rootdir)!=SDRDY || BlockBuffer[0]!=T_DIRHDR) {
+            fsck_report(&fsckres->badentries,"No root dir in partition",parthdr[partnr]);
+        } else if (fsck_use(rootdir,1)) {
+            fsck_dir(rootdir,NOPARENT,0);
+        }
+        if (fsckboot!=0 && bootfile>=A_FIRSTDATA && bootfile<fscktotal &&
+            (bootfile<fsckbase || bootfile>=fsckend || !fsck_bit(fsckref,bootfile))) {
+            fsck_use(bootfile,1);               //Not in a dir, the partition is its only reference
+            fsck_file(bootfile);
+        }
+    }
+}
+
+/**
+    Check dir, already marked used, and everything below it. The extension
+    blocks must link back, every entry must point at a header of the type in
+    the entry and carry the hash of its name. A bad entry is removed and a
+    broken extension link cut if fixing.
+*/
+void fsck_dir(long dir, long parent, unsigned char depth)
+{
+union dh_transfer dh_t;
+union dx_transfer dx_t;
+struct s_dirent* entries;
+struct s_dirent entry;
+long dirblock, nextblock;
+unsigned int hash;
+int index, nrents;
+
+    dh_t.buffer=&BlockBuffer[0];
+    dx_t.buffer=&BlockBuffer[0];
+    if (depth>=FSCKMAXDEPTH) {
+        fsck_report(&fsckres->badlinks,"Dirs nested too deep at",dir);
+        return;
+    }
+    if (readblock(dir)!=SDRDY) return;
+    if (dh_t.dhdata->parentdir!=parent) {
+        fsck_report(&fsckres->badlinks,"Wrong parent in dir",dir);
+        if (fsckfix) {
+            dh_t.dhdata->parentdir=parent;
+            writeblock(dir);
+            fsckres->fixed++;
+        }
+    }
+    dirblock=dir;
+    while (dirblock!=0) {
+        for (index=0;;index++) {
+            if ((entries=dir_block(dir,dirblock,&nrents,&nextblock))==0) return;  //Again after every child
+            if (index>=nrents) break;
+            entry=entries[index];
+            if (entry.block==0) return;         //End of list
+            if (entry.block<A_FIRSTDATA || entry.block>=fscktotal || readblock(entry.block)!=SDRDY || BlockBuffer[0]!=entry.type ||
+                (entry.type!=T_DIRHDR && entry.type!=T_DIRLINK && entry.type!=T_FILEHDR && entry.type!=T_FILEXHDR)) {
+                fsck_report(&fsckres->badentries,"Dir entry points at no header:",entry.block);
+                if (fsckfix && dir_delentry(dir,entry.block)) {
+                    fsckres->fixed++;
+                    index--;                    //The last entry moved into this one
+                }
+                continue;
+            }
+            if ((hash=jfs_namehash((char*)&BlockBuffer[2]))!=entry.hash) {
+                fsck_report(&fsckres->badentries,"Wrong name hash in dir entry for",entry.block);
+                if (fsckfix) {
+                    entries=dir_block(dir,dirblock,&nrents,&nextblock);
+                    entries[index].hash=hash;
+                    writeblock(dirblock);
+                    dcache_invalidate(dir);
+                    fsckres->fixed++;
+                }
+            }
+            if (entry.block==fsckboot) fsckboot=0;
+            if (!fsck_use(entry.block,1)) continue;     //Used twice, not followed again
+            if (entry.type==T_DIRHDR) {
+                fsck_dir(entry.block,dir,depth+1);
+            } else if (entry.type!=T_DIRLINK) {
+                fsck_file(entry.block);
+            }
+        }
+        if (nextblock==0) break;
+        if (nextblock<A_FIRSTDATA || nextblock>=fscktotal || readblock(nextblock)!=SDRDY || BlockBuffer[0]!=T_DIREXT ||
+            dx_t.dxdata->prevdblock!=dirblock || !fsck_use(nextblock,1)) {
+            fsck_report(&fsckres->badlinks,"Broken dir extension link in",dirblock);
+            if (fsckfix) {
+                dir_block(dir,dirblock,&nrents,&nextblock);
+                if (dirblock==dir) {
+                    dh_t.dhdata->dirext=0;
+                } else {
+                    dx_t.dxdata->nextdblock=0;
+                }
+                writeblock(dirblock);
+                dcache_invalidate(dir);
+                fsckres->fixed++;
+            }
+            break;
+        }
+        dirblock=nextblock;
+    }
+}
+
+/**
+    Mark the blocks of the file at header used: the chain blocks of a chained
+    file, which must link back, or the extents and extent list blocks of an
+    extent file, which must cover the file size. A wrong back link is set, a
+    broken chain cut at the last good block, if fixing.
+*/
+void fsck_file(long header)
+{
+union fh_transfer fh_t;
+union fe_transfer fe_t;
+union fxh_transfer fxh_t;
+union fxl_transfer fxl_t;
+struct s_extent ext;
+long blocknr, prev, next, listblock, blocks;
+unsigned int nrext, maxext, extnr;
+
+    fh_t.buffer=&BlockBuffer[0];
+    fe_t.buffer=&BlockBuffer[0];
+    fxh_t.buffer=&BlockBuffer[0];
+    fxl_t.buffer=&BlockBuffer[0];
+    if (readblock(header)!=SDRDY) return;
+    if (BlockBuffer[0]==T_FILEHDR) {
+        prev=header;
+        blocknr=fh_t.fhdata->nextblock;
+        while (blocknr!=0) {
+            if (blocknr<A_FIRSTDATA || blocknr>=fscktotal || readblock(blocknr)!=SDRDY || BlockBuffer[0]!=T_FILEEXT) {
+                fsck_report(&fsckres->badlinks,"Broken file chain after",prev);
+                if (fsckfix && readblock(prev)==SDRDY) {
+                    if (prev==header) {
+                        fh_t.fhdata->nextblock=0;
+                    } else {
+                        fe_t.fedata->nextblock=0;
+                    }
+                    writeblock(prev);
+                    fsckres->fixed++;
+                }
+                break;
+            }
+            if (fe_t.fedata->prevblock!=prev) {
+                fsck_report(&fsckres->badlinks,"Wrong back link in file block",blocknr);
+                if (fsckfix) {
+                    fe_t.fedata->prevblock=prev;
+                    writeblock(blocknr);
+                    fsckres->fixed++;
+                }
+            }
+            next=fe_t.fedata->nextblock;
+            if (!fsck_use(blocknr,1)) break;    //Another file, or a loop
+            prev=blocknr;
+            blocknr=next;
+        }
+    } else if (BlockBuffer[0]==T_FILEXHDR) {
+        blocks=0;
+        listblock=header;
+        for (;;) {
+            if (listblock==header) {
+                nrext=fxh_t.fxhdata->nrextents;
+                next=fxh_t.fxhdata->extlist;
+                maxext=FXHMAXEXT;
+            } else {
+                nrext=fxl_t.fxldata->nrextents;
+                next=fxl_t.fxldata->nextblock;
+                maxext=FXLMAXEXT;
+            }
+            if (nrext>maxext) {
+                fsck_report(&fsckres->badlinks,"Too many extents in",listblock);
+                nrext=maxext;
+            }
+            for (extnr=0;extnr<nrext;extnr++) {     //fsck_use() leaves the BlockBuffer alone
+                ext=(listblock==header) ? fxh_t.fxhdata->extent[extnr] : fxl_t.fxldata->extent[extnr];
+                if (fsck_use(ext.start,ext.length)) blocks+=ext.length;
+            }
+            if (next==0) break;
+            if (next<A_FIRSTDATA || next>=fscktotal || readblock(next)!=SDRDY || BlockBuffer[0]!=T_FILEXLST ||
+                fxl_t.fxldata->prevblock!=listblock || !fsck_use(next,1)) {
+                fsck_report(&fsckres->badlinks,"Broken extent list link in",listblock);
+                if (fsckfix && readblock(listblock)==SDRDY) {
+                    if (listblock==header) {
+                        fxh_t.fxhdata->extlist=0;
+                    } else {
+                        fxl_t.fxldata->nextblock=0;
+                    }
+                    writeblock(listblock);
+                    fsckres->fixed++;
+                }
+                break;
+            }
+            listblock=next;
+        }
+        if (readblock(header)==SDRDY && fxh_t.fxhdata->filesize>(blocks<<9)) {
+            fsck_report(&fsckres->badlinks,"File size beyond the extents of",header);
+            if (fsckfix) {
+                fxh_t.fxhdata->filesize=blocks<<9;
+                writeblock(header);
+                fsckres->fixed++;
+            }
+        }
+    }
 }
 
 /**
-    Add blocknr as the first empty block in the empty chain
+    Check the empty chain in one ascending pass over the blocks the tree does
+    not use, EC_BATCH blocks per multi-block read. Afterwards the header and
+    its counters are checked. If fixing, a chain with broken links is written
+    anew by fsck_relink(); otherwise lost and unlinked blocks are appended to
+    it, or the chain is written anew if there are more than EC_BATCH. While
+    an ec_sort() is not finished, the free blocks from sortnext on still have
+    their old links: they are neither checked nor reported, and fixing
+    finishes the sort with fsck_relink().
 */
-void ec_modfirst(long blocknr)
+void fsck_chain()
 {
-union ech_transfer ech_t ;
+unsigned char CmdStructure[6];
+union ech_transfer ech_t;
+union eb_transfer eb_t;
+long first, last, blocknr, count, index, next, prev, linked, run, runnext, storedfree, storedused, storedrun, errors, sortnext;
+unsigned long sumnext, sumprev;
+bool streaming, ok, headok, tailok, counted;
 
-    readblock(A_EMPTYCHN);                  //Read current content of empty chain block header    
-    ech_t.buffer=&BlockBuffer[0];           //Link ech_t buffer to physical address of BlockBuffer   
-    ech_t.ecdata->first_eb=blocknr;         //Modify EBHeader data structure with new last block  
-    writeblock(A_EMPTYCHN);                 //Empty chain header initialized with first empty block
+    readblock(A_EMPTYCHN);
+    ech_t.buffer=&BlockBuffer[0];
+    first=ech_t.ecdata->first_eb;
+    last=ech_t.ecdata->last_eb;
+    counted=(ech_t.ecdata->flags&ECF_COUNTED)!=0;
+    storedfree=ech_t.ecdata->nrfree;
+    storedused=ech_t.ecdata->nrused;
+    storedrun=ech_t.ecdata->headrun;
+    sortnext=(ech_t.ecdata->flags&ECF_SORTING) ? ech_t.ecdata->sortnext : fscktotal;
+    if (sortnext<fscktotal) printf("\nEmpty chain sort not finished, free blocks from 0x%08lx on are not linked",sortnext);
+    errors=fsckres->badlinks+fsckres->doubles;
+    headok=(first==0 && last==0);
+    tailok=headok;
+    sumnext=0;
+    sumprev=0;
+    run=0;
+    runnext=first;
+    fsckpos=A_FIRSTDATA-1;                      //Nothing read yet
+    if (first!=0) fsck_claim(first);            //The header links to first_eb
+    eb_t.buffer=&BlockBuffer[0];
+    for (blocknr=A_FIRSTDATA;blocknr<fscktotal;) {
+        if (fsck_isused(blocknr)) {             //The tree accounts for it, not read
+            blocknr++;
+            continue;
+        }
+        for (count=1;count<EC_BATCH && blocknr+count<fscktotal && !fsck_isused(blocknr+count);count++);
+        PrepCS(CmdStructure,SDCMDReadMulti,blocknr);
+        streaming=(count>1 && SDReadStart(CmdStructure)==SDRDY);
+        for (index=0;index<count;index++,blocknr++) {
+            ok=false;
+            if (streaming) {
+                if (SDReadNext(BlockBuffer)==SDRDY) {
+                    jfscstats.devreads++;
+                    ok=true;
+                } else {                        //Stream broken, single block reads for the rest
+                    SDReadStop();
+                    streaming=false;
+                }
+            }
+            if (!ok) ok=(rawreadblock(blocknr)==SDRDY);
+            fsckres->reads++;
+            fsckpos=blocknr;
+            if (ok && eb_t.ebdata->blocktype==T_EMPTYBLK && blocknr>=sortnext) {
+                fsck_setbit(fsckfree,blocknr,true); //Not sorted yet, old links
+            } else if (ok && eb_t.ebdata->blocktype==T_EMPTYBLK) {
+                next=eb_t.ebdata->next_eb;
+                prev=eb_t.ebdata->prev_eb;
+                fsck_setbit(fsckfree,blocknr,true);
+                if (blocknr==first) headok=(prev==0);
+                if (blocknr==last) tailok=(next==0);
+                if (blocknr==runnext) {         //Head run: next on the card and in the chain
+                    run++;
+                    runnext=(next==blocknr+1) ? next : 0;
+                }
+                if (prev!=0) sumprev+=fsck_linksum(prev,blocknr);
+                if (next!=0) {
+                    sumnext+=fsck_linksum(blocknr,next);
+                    fsck_claim(next);
+                }
+            } else {
+                if (fsck_bit(fsckref,blocknr)) {
+                    fsck_report(&fsckres->badlinks,"Empty chain links to a block that is not empty:",blocknr);
+                    fsck_setbit(fsckref,blocknr,false);
+                    fsck_setbit(fsckfree,blocknr,false);
+                }
+                fsck_report(&fsckres->lost,"Lost block:",blocknr);
+            }
+        }
+        if (streaming) SDReadStop();
+        if (((unsigned int)blocknr&0xFFF)<count) jfs_progress(blocknr-1);  //Progress every 4096 blocks or so
+    }
+
+    linked=0;
+    for (blocknr=A_FIRSTDATA;blocknr<fscktotal;blocknr++) {
+        if (!fsck_bit(fsckfree,blocknr)) continue;
+        if (fsck_bit(fsckref,blocknr)) {
+            linked++;
+        } else if (blocknr<sortnext) {
+            fsck_report(&fsckres->orphans,"Empty block not in the chain:",blocknr);
+        }
+    }
+    fsckres->free=linked;
+    if (!headok) fsck_report(&fsckres->badlinks,"Empty chain does not start at first_eb",first);
+    if (!tailok) fsck_report(&fsckres->badlinks,"Empty chain does not end at last_eb",last);
+    if (sumnext!=sumprev) fsck_report(&fsckres->badlinks,"Empty chain prev_eb and next_eb links differ, header",A_EMPTYCHN);
+    if (fsckres->badlinks+fsckres->doubles!=errors) {
+        if (fsckfix) fsck_relink();
+        return;
+    }
+
+    if (!counted || storedfree!=linked || storedused!=fscktotal-linked-jfsnrbad || storedrun>run) {
+        fsck_report(&fsckres->badcounts,"Free space counters wrong, header",A_EMPTYCHN);
+        if (fsckfix) ec_initcounts(fscktotal,linked,run);
+    }
+    if (!fsckfix) return;
+    if (fsckres->lost+fsckres->orphans>EC_BATCH || sortnext<fscktotal) {
+        fsck_relink();
+        return;
+    }
+    for (blocknr=A_FIRSTDATA;blocknr<fscktotal;blocknr++) {
+        if (!fsck_bit(fsckref,blocknr)) {       //Lost or not linked
+            add_to_ec(blocknr);
+            fsckres->free++;
+        }
+    }
+    fsckres->fixed+=fsckres->lost+fsckres->orphans+fsckres->badcounts;
 }
 
 /**
-    Create a new directory with specified name and attributes under parentdir
-    createDir returns the block address of the new dir structure, 
-    it must be added to the parent dir separately
+    Record a next_eb link to blocknr, see the table above jfs_fsck().
 */
-long createDir(char* dirname, unsigned char attribs, long parentdir)
+void fsck_claim(long blocknr)
+{
+    if (blocknr<A_FIRSTDATA || blocknr>=fscktotal) {
+        fsck_report(&fsckres->badlinks,"Empty chain links outside the file system:",blocknr);
+    } else if (fsck_bit(fsckref,blocknr)) {
+        if (fsck_bit(fsckfree,blocknr)) {
+            fsck_report(&fsckres->doubles,"Two empty chain links to",blocknr);
+        } else {
+            fsck_report(&fsckres->doubles,"Empty chain links to a used block:",blocknr);
+        }
+    } else if (fsck_bit(fsckfree,blocknr)) {
+        fsck_setbit(fsckref,blocknr,true);      //Read already and free, linked to now
+    } else if (blocknr<=fsckpos) {
+        fsck_report(&fsckres->badlinks,"Empty chain links to a block that is not empty:",blocknr);
+    } else {
+        fsck_setbit(fsckref,blocknr,true);      //Not read yet, it must turn out free
+        fsck_setbit(fsckfree,blocknr,true);
+    }
+}
+
+/**
+    Checksum term of the link from -> to. Mixed with multiplications, so the
+    sum over all links only matches if every next_eb has its prev_eb.
+*/
+unsigned long fsck_linksum(long from, long to)
+{
+    return (((unsigned long)from*0x9E3779B1UL)^(unsigned long)to)*0x85EBCA6BUL;
+}
+
+/**
+    Write a new empty chain over every block from A_FIRSTDATA on that the
+    tree does not use, in ascending order. Lost and unlinked blocks are
+    included, an unfinished jfs_defrag() sort is finished this way too.
+    Header and counters last. Nothing is written if the journal can not be
+    checkpointed first, the chain then stays reported as broken.
+*/
+void fsck_relink()
+{
+union ech_transfer ech_t;
+long first, last, nrfree, headrun;
+
+    if (jfsjtail!=jfsjhead && jl_checkpoint()!=SDRDY) return;  //A replay must not overwrite the new links
+    nrfree=0;
+    headrun=0;
+    first=fsck_nextfree(A_FIRSTDATA);
+    last=ec_linkwindow(0,&nrfree,&headrun);
+    readblock(A_EMPTYCHN);
+    ech_t.buffer=&BlockBuffer[0];
+    ech_t.ecdata->first_eb=first;
+    ech_t.ecdata->last_eb=last;
+    ech_t.ecdata->flags&=~ECF_SORTING;
+    writeblock(A_EMPTYCHN);
+    ec_initcounts(fscktotal,nrfree,headrun);
+    fsckres->free=nrfree;
+    fsckres->fixed++;
+}
+
+/**
+    Write the blocks of the window fsckbase..fsckend-1 that the tree does not
+    use as empty blocks, ascending, the first one linked back to prev and the
+    last one ending the chain. As in ec_stream() the links are known up
+    front, so each run of free blocks goes out with one multi-block write.
+    prev itself is not touched. *nrfree is increased by the blocks written,
+    *headrun set to the first run if *nrfree was 0.
+    Returns the last block written, prev if the window has no free block.
+*/
+long ec_linkwindow(long prev, long* nrfree, long* headrun)
+{
+unsigned char CmdStructure[6];
+long blocknr, start, runend, next;
+bool streaming;
+
+    start=fsck_nextfree(fsckbase<A_FIRSTDATA ? A_FIRSTDATA : fsckbase);
+    while (start!=0) {
+        for (runend=start;runend+1<fsckend && !fsck_isused(runend+1);runend++);
+        next=fsck_nextfree(runend+1);
+        if (*nrfree==0) *headrun=runend-start+1;
+        PrepCS(CmdStructure,SDCMDWriteMulti,start);
+        streaming=(SDWriteStart(CmdStructure)==SDRDY);
+        for (blocknr=start;blocknr<=runend;blocknr++) {
+            ec_buildempty((blocknr==start) ? prev : blocknr-1,(blocknr==runend) ? next : blocknr+1);
+            if (streaming) {
+                jfs_cachedrop(blocknr);
+                jfscstats.devwrites++;
+                if (SDWriteNext(BlockBuffer)!=SDRDY) {
+                    SDWriteStop();
+                    streaming=false;
+                    rawwriteblock(blocknr);
+                }
+            } else {
+                rawwriteblock(blocknr);
+            }
+            (*nrfree)++;
+        }
+        if (streaming) SDWriteStop();
+        prev=runend;
+        start=next;
+    }
+    return prev;
+}
+
+/**
+    Compare the free space bitmap with the blocks the tree uses. A used block
+    that is marked free is the dangerous case, it would be handed out again;
+    a marked block nothing uses is lost. Both are set right if fixing, and
+    nrfree is checked against the clear bits.
+*/
+void fsck_bitmap()
+{
+union bmh_transfer bmh_t;
+struct s_cacheslot* bm;
+long firstbm, blocknr, nrfree;
+unsigned char mask;
+bool marked, used;
+
+    readblock(A_EMPTYCHN);
+    bmh_t.buffer=&BlockBuffer[0];
+    firstbm=bmh_t.bmhdata->firstbmblock;
+    nrfree=0;
+    bm=0;
+    for (blocknr=0;blocknr<fscktotal;blocknr++) {
+        if (bm==0 || ((unsigned int)blocknr&(BMBITSPERBLK-1))==0) {    //Bitmap block changes every 4096 blocks
+            if ((bm=jfs_cacheread(BlkAdd(firstbm,(unsigned int)BlkShr(blocknr,BMBITSHIFT))))==0) return;
+        }
+        mask=0x80>>((unsigned char)blocknr&7);
+        marked=(bm->data[((unsigned int)blocknr>>3)&(SDBlockSize-1)]&mask)!=0;
+        used=fsck_bit(fsckref,blocknr);
+        if (used && !marked) {
+            fsck_report(&fsckres->doubles,"Used block marked free in the bitmap:",blocknr);
+        } else if (!used && marked) {
+            fsck_report(&fsckres->lost,"Lost block:",blocknr);
+        }
+        if (fsckfix && used!=marked) {
+            bm->data[((unsigned int)blocknr>>3)&(SDBlockSize-1)]^=mask;
+            bm->dirty=true;
+            marked=used;
+            fsckres->fixed++;
+        }
+        if (!marked) nrfree++;
+    }
+    fsckres->free=nrfree;
+    readblock(A_EMPTYCHN);
+    if (bmh_t.bmhdata->nrfree!=nrfree) {
+        fsck_report(&fsckres->badcounts,"Free space counter wrong, header",A_EMPTYCHN);
+        if (fsckfix) {
+            bmh_t.bmhdata->nrfree=nrfree;
+            writeblock(A_EMPTYCHN);
+            fsckres->fixed++;
+        }
+    }
+}
+
+
+/**
+    Defragmenter.
+    jfs_defrag() runs with all files closed and works in two phases:
+    1.  Every file and dir whose blocks are not one run of consecutive blocks
+        is copied to the lowest free run that holds it: the header and chain
+        blocks of a chained file or the header and extensions of a dir, in
+        chain order, or the data of an extent file, which then has a single
+        extent. The reference to a moved header is set to the new block (dir
+        entry, rootdir or bootfile of the partition), as are the parentdir of
+        the dirs in a moved dir and the back links in the copies, then the
+        old blocks are freed. An object is moved in its own transactions: a
+        run that is cut off leaves at most some lost blocks, and the next run
+        goes on with what is still fragmented.
+    2.  The empty chain is written anew in ascending order, see ec_sort().
+    Free runs are found in fsckref, filled by df_mark() with fsck_tree() for
+    a window of FSCKMAXBLOCKS blocks at a time. A card larger than a window
+    takes a tree walk per window, the memory used stays the same. The marking
+    checks the tree as well: nothing is moved on a file system with broken
+    links or dir entries.
+    Dir links (T_DIRLINK) are not followed, one that points at a moved dir
+    keeps the old block.
+*/
+
+/**
+    Measure how contiguous the file system is: the files and dirs, the blocks
+    they use and the runs these are in, the free blocks and their runs. The
+    free runs of an empty chain are counted in chain order, which reads every
+    block of the chain. Nothing is changed.
+    Returns false if the disk has no file system.
+*/
+bool jfs_fragstats(struct s_defragstats* result)
+{
+    memset(result,0,sizeof(struct s_defragstats));
+    jfs_flush();
+    if ((fscktotal=df_total())==0) return false;
+    dfres=result;
+    dfmove=false;
+    df_tree();
+    result->freeruns=df_freeruns(&result->freeblocks);
+    return true;
+}
+
+/**
+    Defragment the file system, see above. (passes) limits the window passes
+    of the chain sort in this call, 0 for no limit, the next call goes on
+    where it stopped. Fragmented objects are not moved while a sort is not
+    finished: the free blocks it has not reached yet are out of the chain.
+    result gets the objects moved, the blocks copied, the fragmented objects
+    no free run was found for in the last window and the passes made; use
+    jfs_fragstats() to measure.
+    Returns 0 when done, 1 if the sort is not finished, -1 with jfcstatus
+    set on an error.
+*/
+long jfs_defrag(long passes, struct s_defragstats* result)
+{
+union ech_transfer ech_t;
+long start;
+int handle;
+bool sorting;
+
+    for (handle=0;handle<JFSMAXOPEN;handle++) {
+        if (jfsfiles[handle].open) {
+            jfcstatus=E_JFC_FILESOPEN;
+            return -1;
+        }
+    }
+    memset(result,0,sizeof(struct s_defragstats));
+    jfs_flush();
+    if (jfsjtail!=jfsjhead && jl_checkpoint()!=SDRDY) {     //Data is copied with raw reads, everything home first
+        jfcstatus=E_JFC_WRITEERR;
+        return -1;
+    }
+    if (!jfsbadloaded) load_bad_blocks();
+    if ((fscktotal=df_total())==0) {
+        jfcstatus=E_JFC_FSCKSIZE;
+        return -1;
+    }
+    ech_t.buffer=&BlockBuffer[0];
+    sorting=(BlockBuffer[0]==T_EMPTYHDR && (ech_t.ecdata->flags&ECF_SORTING)!=0);
+    dfres=result;
+    dfmove=true;
+    for (start=0;start<fscktotal && !sorting;start+=FSCKMAXBLOCKS) {
+        if (df_mark(start)!=0) {
+            jfcstatus=E_JFC_DAMAGED;
+            return -1;
+        }
+        result->nospace=0;                      //What the last window can not take counts
+        df_tree();
+        result->passes++;
+    }
+    if (jfs_alloctype()==T_BITMAPHDR) return 0;
+    return ec_sort(passes);
+}
+
+/**
+    Blocks in the file system from the bitmap or empty chain header, also for
+    a chain formatted before the counters. 0 if block 1 is neither header;
+    the header is left in BlockBuffer.
+*/
+long df_total()
+{
+union ech_transfer ech_t;
+union bmh_transfer bmh_t;
+
+    if (readblock(A_EMPTYCHN)!=SDRDY) return 0;
+    ech_t.buffer=&BlockBuffer[0];
+    bmh_t.buffer=&BlockBuffer[0];
+    if (BlockBuffer[0]==T_BITMAPHDR) return bmh_t.bmhdata->totalblocks;
+    if (BlockBuffer[0]!=T_EMPTYHDR) return 0;
+    return (ech_t.ecdata->flags&ECF_COUNTED) ? ech_t.ecdata->totalblocks : SDCardTotalBlocks;
+}
+
+/**
+    Clear the fsck maps for the window of at most FSCKMAXBLOCKS blocks from
+    start on and mark in fsckref what the file system uses there, the way
+    jfs_fsck() does. Problems are printed by fsck_report() and counted; lost
+    blocks are not seen here.
+    Returns the number of problems.
+*/
+long df_mark(long start)
+{
+union bmh_transfer bmh_t;
+struct s_fsckstats check;
+long firstbm, nrbm;
+
+    bmh_t.buffer=&BlockBuffer[0];
+    firstbm=0;
+    nrbm=0;
+    if (readblock(A_EMPTYCHN)==SDRDY && BlockBuffer[0]==T_BITMAPHDR) {
+        firstbm=bmh_t.bmhdata->firstbmblock;
+        nrbm=bmh_t.bmhdata->nrbmblocks;
+    }
+    memset(&check,0,sizeof(struct s_fsckstats));
+    memset(fsckref,0,FSCKMAPBYTES);
+    memset(fsckfree,0,FSCKMAPBYTES);
+    fsckres=&check;
+    fsckfix=false;
+    fsckmsgs=0;
+    fsckbase=start;
+    fsckend=(fscktotal-start>FSCKMAXBLOCKS) ? start+FSCKMAXBLOCKS : fscktotal;
+    fsck_use(A_BOOTBLOCK,A_FIRSTDATA);
+    if (nrbm!=0) fsck_use(firstbm,nrbm);
+    fsck_badlist();
+    fsck_tree();
+    fsckres=0;
+    return check.badlinks+check.doubles+check.badentries;
+}
+
+/**
+    Walk every partition: the root dir and everything below it, and a boot
+    file that is in no dir.
+*/
+void df_tree()
+{
+union pm_transfer pm_t;
+union ph_transfer ph_t;
+long parthdr[MAXPARTS];
+long rootdir;
+unsigned char partnr, nrparts;
+
+    pm_t.buffer=&BlockBuffer[0];
+    ph_t.buffer=&BlockBuffer[0];
+    if (readblock(A_PARTMAP)!=SDRDY || BlockBuffer[0]!=T_PARTMAP) return;
+    nrparts=pm_t.pmdata->no_parts;
+    if (nrparts>MAXPARTS) nrparts=MAXPARTS;
+    for (partnr=0;partnr<nrparts;partnr++) parthdr[partnr]=pm_t.pmdata->parthdr[partnr];
+    for (partnr=0;partnr<nrparts;partnr++) {
+        dfpart=parthdr[partnr];
+        if (readblock(dfpart)!=SDRDY || BlockBuffer[0]!=T_PARTHDR) continue;
+        rootdir=ph_t.phdata->rootdir;
+        dfboot=ph_t.phdata->bootfile;
+        if (rootdir!=0) df_dir(df_visit(rootdir,T_DIRHDR,0,0),0);
+        if (dfboot!=0 && readblock(dfboot)==SDRDY) df_visit(dfboot,BlockBuffer[0],0,0);
+    }
+}
+
+/**
+    Measure, and with dfmove defragment, every file and dir in dir and below.
+    A dir is moved before its entries are walked, they are walked where they
+    end up.
+*/
+void df_dir(long dir, unsigned char depth)
+{
+struct s_dirent* entries;
+struct s_dirent entry;
+long dirblock, nextblock;
+int index, nrents;
+
+    if (depth>=FSCKMAXDEPTH || readblock(dir)!=SDRDY || BlockBuffer[0]!=T_DIRHDR) return;
+    dirblock=dir;
+    while (dirblock!=0) {
+        for (index=0;;index++) {
+            if ((entries=dir_block(dir,dirblock,&nrents,&nextblock))==0) return;  //Again after every child
+            if (index>=nrents) break;
+            entry=entries[index];
+            if (entry.block==0) return;         //End of list
+            if (entry.block==dfboot) dfboot=0;
+            if (entry.type==T_DIRHDR) {
+                df_dir(df_visit(entry.block,entry.type,dirblock,index),depth+1);
+            } else if (entry.type==T_FILEHDR || entry.type==T_FILEXHDR) {
+                df_visit(entry.block,entry.type,dirblock,index);
+            }
+        }
+        dirblock=nextblock;
+    }
+}
+
+/**
+    Measure one file or dir into dfres, or with dfmove move it to a
+    consecutive run if it is fragmented. dirblock and index locate its dir
+    entry, dirblock 0 means the partition header refers to it.
+    Returns the header block of the object, moved or not.
+*/
+long df_visit(long header, unsigned char type, long dirblock, int index)
+{
+long blocks, runs, moved;
+
+    if ((runs=df_object(header,type,&blocks))==0) return header;
+    if (!dfmove) {
+        dfres->objects++;
+        dfres->blocks+=blocks;
+        dfres->runs+=runs;
+        if (runs>1) dfres->fragmented++;
+        return header;
+    }
+    if (runs==1) return header;
+    if ((moved=df_move(header,type,blocks,dirblock,index))==0) {
+        dfres->nospace++;
+        return header;
+    }
+    return moved;
+}
+
+/**
+    Count the runs of consecutive blocks a file or dir is in: header and chain
+    blocks of a chained file, header and extensions of a dir, or the extents
+    of an extent file, where adjacent extents are one run and an empty file
+    is one run too. *blocks gets the number of blocks counted.
+    Returns 0 if header is not a file or dir of the given type.
+*/
+long df_object(long header, unsigned char type, long* blocks)
 {
 union dh_transfer dh_t;
-long diraddress;
+union dx_transfer dx_t;
+union fh_transfer fh_t;
+union fe_transfer fe_t;
+union fxh_transfer fxh_t;
+union fxl_transfer fxl_t;
+struct s_extent ext;
+long runs, blocknr, next, end;
+unsigned int nrext, extnr;
 
-   if ((diraddress=getblock())!=0){             //non-zero means a block has been made available, 0 means no block
-        dh_t.buffer=&BlockBuffer[0];            //Link dh_t buffer to physical address of BlockBuffer
-        dh_t.dhdata->blocktype=T_DIRHDR;        //Blocktype directory header or 0xD0
-        dh_t.dhdata->attibutes=attribs;         //Assign the specified attribs
-        strcpy(dh_t.dhdata->dirname,dirname);   //Specify directory name
-        dh_t.dhdata->parentdir=parentdir;       //Specify where to create the dir
-        dh_t.dhdata->dirext=0;                  //No extension block yet
-        dh_t.dhdata->file[0]=0;                 //No files yet
-        writeblock(diraddress);                 //Write partition header to disk 
-printf("\nCreated dir %s at block 0x%08lx", dirname, diraddress);
-        return (diraddress);                    //Return the address of the new partition header
-    } else {                                    //no block available
-        jfcstatus=E_JFC_NOBLOCKFORDIR;          //Signal could not find an empty block for the dir
-        return (0);
+    dh_t.buffer=&BlockBuffer[0];
+    dx_t.buffer=&BlockBuffer[0];
+    fh_t.buffer=&BlockBuffer[0];
+    fe_t.buffer=&BlockBuffer[0];
+    fxh_t.buffer=&BlockBuffer[0];
+    fxl_t.buffer=&BlockBuffer[0];
+    if (readblock(header)!=SDRDY || BlockBuffer[0]!=type) return 0;
+    if (type==T_DIRHDR || type==T_FILEHDR) {
+        runs=1;
+        *blocks=1;
+        blocknr=header;
+        next=(type==T_DIRHDR) ? dh_t.dhdata->dirext : fh_t.fhdata->nextblock;
+        while (next!=0 && *blocks<fscktotal) {
+            if (readblock(next)!=SDRDY || BlockBuffer[0]!=((type==T_DIRHDR) ? T_DIREXT : T_FILEEXT)) break;
+            if (next!=blocknr+1) runs++;
+            blocknr=next;
+            next=(type==T_DIRHDR) ? dx_t.dxdata->nextdblock : fe_t.fedata->nextblock;
+            (*blocks)++;
+        }
+        return runs;
+    }
+    if (type!=T_FILEXHDR) return 0;
+    runs=0;
+    *blocks=0;
+    end=0;
+    blocknr=header;
+    for (;;) {
+        if (blocknr==header) {
+            nrext=fxh_t.fxhdata->nrextents;
+            next=fxh_t.fxhdata->extlist;
+            if (nrext>FXHMAXEXT) nrext=FXHMAXEXT;
+        } else {
+            nrext=fxl_t.fxldata->nrextents;
+            next=fxl_t.fxldata->nextblock;
+            if (nrext>FXLMAXEXT) nrext=FXLMAXEXT;
+        }
+        for (extnr=0;extnr<nrext;extnr++) {
+            ext=(blocknr==header) ? fxh_t.fxhdata->extent[extnr] : fxl_t.fxldata->extent[extnr];
+            if (ext.length<=0) continue;
+            if (ext.start!=end) runs++;     //Not adjacent to the extent before it
+            end=ext.start+ext.length;
+            *blocks+=ext.length;
+        }
+        if (next==0 || readblock(next)!=SDRDY || BlockBuffer[0]!=T_FILEXLST) break;
+        blocknr=next;
     }
+    return (runs==0) ? 1 : runs;
 }
 
 /**
-    Create a partition. The partition header is created on disk, but not yet entered in the partition table
-    Create the / dir before calling createPartition(), and pass its dir header block as parameter
+    Move a fragmented object of (blocks) blocks to the lowest free run of the
+    window that holds it. The run is taken and committed first, then the
+    copies are written past the cache; the reference and, for a dir, the
+    parentdir of its subdirs are set in one transaction before the old
+    blocks are freed. An extent file keeps its header, it gets the run as
+    its only extent.
+    dirblock and index locate the dir entry, see df_setref().
+    Returns the header block afterwards, 0 if no free run was found.
 */
-long createPartition(char driveletter, char* partname, long bootfile, long rootdir)
+long df_move(long header, unsigned char type, long blocks, long dirblock, int index)
+{
+union dh_transfer dh_t;
+union dx_transfer dx_t;
+union fh_transfer fh_t;
+union fe_transfer fe_t;
+union fxh_transfer fxh_t;
+union fxl_transfer fxl_t;
+struct s_dirent* entries;
+struct s_extent ext, first;
+long start, dest, count, blocknr, next, listblock;
+unsigned int nrext, extnr;
+int nrents, entrynr;
+
+    dh_t.buffer=&BlockBuffer[0];
+    dx_t.buffer=&BlockBuffer[0];
+    fh_t.buffer=&BlockBuffer[0];
+    fe_t.buffer=&BlockBuffer[0];
+    fxh_t.buffer=&BlockBuffer[0];
+    fxl_t.buffer=&BlockBuffer[0];
+    while ((start=df_findrun(blocks))!=0 && !df_take(start,blocks));
+    if (start==0) return 0;
+    jfs_flush();                                //Out of free space before anything is written to it
+    dfres->moved++;
+    dfres->copied+=blocks;
+    if (type==T_FILEXHDR) {
+        dest=start;
+        listblock=header;
+        extnr=0;
+        while (listblock!=0) {                  //Same walk as freefile()
+            readblock(listblock);               //The copy uses the BlockBuffer, reread
+            if (listblock==header) {
+                nrext=fxh_t.fxhdata->nrextents;
+                next=fxh_t.fxhdata->extlist;
+                if (extnr<nrext) ext=fxh_t.fxhdata->extent[extnr];
+            } else {
+                nrext=fxl_t.fxldata->nrextents;
+                next=fxl_t.fxldata->nextblock;
+                if (extnr<nrext) ext=fxl_t.fxldata->extent[extnr];
+            }
+            if (extnr<nrext) {
+                for (blocknr=ext.start;blocknr<ext.start+ext.length;blocknr++) {
+                    rawreadblock(blocknr);      //Data blocks are never in the cache or the journal
+                    rawwriteblock(dest++);
+                }
+                extnr++;
+            } else {
+                listblock=next;
+                extnr=0;
+            }
+        }
+        readblock(header);
+        first=fxh_t.fxhdata->extent[0];
+        nrext=fxh_t.fxhdata->nrextents;
+        listblock=fxh_t.fxhdata->extlist;
+        fxh_t.fxhdata->extent[0].start=start;
+        fxh_t.fxhdata->extent[0].length=blocks;
+        fxh_t.fxhdata->nrextents=1;             //The old extents past the first stay in the block until freed
+        fxh_t.fxhdata->extlist=0;
+        writeblock(header);
+        jfs_flush();
+        df_release(first.start,first.length);
+        for (extnr=1;extnr<nrext;extnr++) {
+            readblock(header);
+            ext=fxh_t.fxhdata->extent[extnr];
+            df_release(ext.start,ext.length);
+        }
+        while (listblock!=0) {
+            readblock(listblock);
+            nrext=fxl_t.fxldata->nrextents;
+            next=fxl_t.fxldata->nextblock;
+            for (extnr=0;extnr<nrext;extnr++) {
+                readblock(listblock);
+                ext=fxl_t.fxldata->extent[extnr];
+                df_release(ext.start,ext.length);
+            }
+            df_release(listblock,1);
+            listblock=next;
+        }
+        jfs_flush();
+        return header;
+    }
+
+    blocknr=header;
+    for (dest=start;dest<start+blocks;dest++) { //Copy in chain order, links set to the run
+        readblock(blocknr);
+        if (dest==start && type==T_DIRHDR) {
+            next=dh_t.dhdata->dirext;
+            dh_t.dhdata->dirext=(blocks>1) ? dest+1 : 0;
+        } else if (dest==start) {
+            next=fh_t.fhdata->nextblock;
+            fh_t.fhdata->nextblock=(blocks>1) ? dest+1 : 0;
+        } else if (type==T_DIRHDR) {
+            next=dx_t.dxdata->nextdblock;
+            dx_t.dxdata->prevdblock=dest-1;
+            dx_t.dxdata->nextdblock=(dest+1<start+blocks) ? dest+1 : 0;
+        } else {
+            next=fe_t.fedata->nextblock;
+            fe_t.fedata->prevblock=dest-1;
+            fe_t.fedata->nextblock=(dest+1<start+blocks) ? dest+1 : 0;
+        }
+        rawwriteblock(dest);
+        blocknr=next;
+    }
+    if (type==T_DIRHDR) {                       //Subdirs and links name the dir as their parent
+        for (listblock=start;listblock!=0;listblock=next) {
+            for (entrynr=0;(entries=dir_block(start,listblock,&nrents,&next))!=0 && entrynr<nrents;entrynr++) {
+                if (entries[entrynr].block==0) break;
+                if (entries[entrynr].type!=T_DIRHDR && entries[entrynr].type!=T_DIRLINK) continue;
+                blocknr=entries[entrynr].block;
+                if (readblock(blocknr)==SDRDY && (BlockBuffer[0]==T_DIRHDR || BlockBuffer[0]==T_DIRLINK)) {
+                    dh_t.dhdata->parentdir=start;
+                    writeblock(blocknr);
+                }
+            }
+            if (entries==0 || entrynr<nrents) next=0;   //End of list or read error
+        }
+    }
+    df_setref(dirblock,index,header,start,type);
+    jfs_flush();
+    blocknr=header;
+    for (count=0;count<blocks && blocknr!=0;count++) {
+        readblock(blocknr);
+        if (count==0) {
+            next=(type==T_DIRHDR) ? dh_t.dhdata->dirext : fh_t.fhdata->nextblock;
+        } else {
+            next=(type==T_DIRHDR) ? dx_t.dxdata->nextdblock : fe_t.fedata->nextblock;
+        }
+        df_release(blocknr,1);
+        blocknr=next;
+    }
+    jfs_flush();
+    return start;
+}
+
+/**
+    The lowest run of (count) blocks in the window that fsckref has as not
+    used, 0 if there is none. Whole used bytes are passed 8 blocks at a time.
+*/
+long df_findrun(long count)
+{
+long blocknr, run;
+
+    run=0;
+    for (blocknr=(fsckbase<A_FIRSTDATA) ? A_FIRSTDATA : fsckbase;blocknr<fsckend;blocknr++) {
+        if (((unsigned char)blocknr&7)==0 && blocknr+8<=fsckend && fsckref[(unsigned int)(blocknr-fsckbase)>>3]==0xFF) {
+            run=0;
+            blocknr+=7;
+        } else if (fsck_bit(fsckref,blocknr)) {
+            run=0;
+        } else if (++run>=count) {
+            return blocknr-count+1;
+        }
+    }
+    return 0;
+}
+
+/**
+    Take the run of (count) blocks from start on out of free space and mark
+    it used in fsckref. Every block must really be free: a clear bitmap bit,
+    or an empty block that passes ec_inchain(). A block that
+    is not, lost or changed since the tree walk, is marked used in fsckref
+    so df_findrun() passes it, and nothing is taken.
+    Returns true if the run was taken.
+*/
+bool df_take(long start, long count)
+{
+union bmh_transfer bmh_t;
+struct s_cacheslot* hdr;
+long blocknr;
+bool bitmap, isfree;
+
+    bitmap=(jfs_alloctype()==T_BITMAPHDR);
+    for (blocknr=start;blocknr<start+count;blocknr++) {
+        if (bitmap) {
+            isfree=bm_isfree(blocknr);
+        } else {
+            isfree=ec_inchain(blocknr);
+        }
+        if (!isfree) {
+            fsck_setbit(fsckref,blocknr,true);
+            return false;
+        }
+    }
+    if (bitmap) {
+        bm_mark(start,count,true);
+        if ((hdr=jfs_cacheread(A_EMPTYCHN))!=0) {
+            bmh_t.buffer=hdr->data;
+            bmh_t.bmhdata->nrfree-=count;
+            hdr->dirty=true;
+        }
+    } else {
+        for (blocknr=start;blocknr<start+count;blocknr++) eb_unlink(blocknr);
+    }
+    for (blocknr=start;blocknr<start+count;blocknr++) fsck_setbit(fsckref,blocknr,true);
+    return true;
+}
+
+/**
+    Return (count) blocks from start on to free space and clear them in
+    fsckref as far as they are in the window. Bad blocks stay marked.
+*/
+void df_release(long start, long count)
+{
+    freeblocks(start,count);
+    for (;count>0;count--,start++) {
+        if (start>=fsckbase && start<fsckend && !is_bad_block(start)) fsck_setbit(fsckref,start,false);
+    }
+}
+
+/**
+    Point the reference to a header that moved from oldheader to newheader at
+    the new block: entry (index) of dir block dirblock, or for dirblock 0 the
+    rootdir of the partition being walked. The bootfile of the partition
+    follows a moved boot file either way. The dentry cache is emptied.
+*/
+void df_setref(long dirblock, int index, long oldheader, long newheader, unsigned char type)
 {
+union dh_transfer dh_t;
+union dx_transfer dx_t;
 union ph_transfer ph_t;
-long ph_address;
+bool changed;
 
-    if ((ph_address=getblock())!=0){        //non-zero means a block has been made available, 0 means no block
-        ph_t.buffer=&BlockBuffer[0];            //Link ph_t buffer to physical address of BlockBuffer
-        ph_t.phdata->blocktype=T_PARTHDR;       //Block type is T_PARTHDR of 0xA0
-        ph_t.phdata->driveletter=driveletter;   //assign the give drive letter
-        strcpy(ph_t.phdata->volname, partname); //copy partition name into data structure
-        ph_t.phdata->bootfile=bootfile;         //copy block address of boot file (or 0 if none)
-        ph_t.phdata->rootdir=rootdir;           //copy block address of root dir (must be created in advance)
-        writeblock(ph_address);             //Write partition header to disk
-printf("\nCreated partition %s with drive letter %c at block 0x%08lx", partname, driveletter, ph_address);
-        return (ph_address);                //Return the address of the new partition header
-    } else {                                //no block available
-printf("\nFailed to allocate block for partition header.");
-        return (0);
+    dh_t.buffer=&BlockBuffer[0];
+    dx_t.buffer=&BlockBuffer[0];
+    ph_t.buffer=&BlockBuffer[0];
+    if (dirblock!=0 && readblock(dirblock)==SDRDY) {
+        if (BlockBuffer[0]==T_DIRHDR) {
+            dh_t.dhdata->entry[index].block=newheader;
+        } else {
+            dx_t.dxdata->entry[index].block=newheader;
+        }
+        writeblock(dirblock);
+    }
+    if (readblock(dfpart)==SDRDY) {
+        changed=false;
+        if (dirblock==0 && type==T_DIRHDR && ph_t.phdata->rootdir==oldheader) {
+            ph_t.phdata->rootdir=newheader;
+            changed=true;
+        }
+        if (ph_t.phdata->bootfile==oldheader) {
+            ph_t.phdata->bootfile=newheader;
+            changed=true;
+        }
+        if (changed) writeblock(dfpart);
     }
+    dcache_init();
 }
 
-int addpart(long newpart)
+/**
+    Count the free blocks into *freeblocks and return the number of runs of
+    consecutive blocks they are in. For an empty chain the runs are counted
+    in chain order, as getblocks() meets them: every chain block is read.
+*/
+long df_freeruns(long* freeblocks)
 {
-union pm_transfer pm_t;                     
+union ech_transfer ech_t;
+union bmh_transfer bmh_t;
+union eb_transfer eb_t;
+struct s_cacheslot* bm;
+long blocknr, prev, runs, firstbm;
+bool isfree, wasfree;
 
-    readblock(A_PARTMAP);                   //Read the partition map raw data
-    pm_t.buffer=&BlockBuffer[0];            //Map the partmap structure onto the data
-    if (pm_t.pmdata->no_parts>=MAXPARTS) {  //Max number of partitions reached
-        jfcstatus=E_JFC_PARTMAPFULL         //Message that partition map is full
-        return (0);                         //Return error code
-    } else {                                //Ready to add it
-        pm_t.pmdata->parthdr[pm_t.pmdata->no_parts]=newpart;    //Add the address of the new partition header
-        pm_t.pmdata->no_parts++;            //Increase the number of defined partitions          
+    ech_t.buffer=&BlockBuffer[0];
+    bmh_t.buffer=&BlockBuffer[0];
+    eb_t.buffer=&BlockBuffer[0];
+    *freeblocks=0;
+    runs=0;
+    if (readblock(A_EMPTYCHN)!=SDRDY) return 0;
+    if (BlockBuffer[0]==T_BITMAPHDR) {
+        firstbm=bmh_t.bmhdata->firstbmblock;
+        wasfree=false;
+        bm=0;
+        for (blocknr=0;blocknr<fscktotal;blocknr++) {
+            if (bm==0 || ((unsigned int)blocknr&(BMBITSPERBLK-1))==0) {    //Bitmap block changes every 4096 blocks
+                if ((bm=jfs_cacheread(BlkAdd(firstbm,(unsigned int)BlkShr(blocknr,BMBITSHIFT))))==0) return runs;
+            }
+            isfree=(bm->data[((unsigned int)blocknr>>3)&(SDBlockSize-1)]&(0x80>>((unsigned char)blocknr&7)))==0;
+            if (isfree) {
+                (*freeblocks)++;
+                if (!wasfree) runs++;
+            }
+            wasfree=isfree;
+        }
+        return runs;
+    }
+    prev=0;
+    for (blocknr=ech_t.ecdata->first_eb;blocknr!=0 && *freeblocks<fscktotal;blocknr=eb_t.ebdata->next_eb) {
+        if (readblock(blocknr)!=SDRDY || eb_t.ebdata->blocktype!=T_EMPTYBLK) break;
+        if (blocknr!=prev+1) runs++;
+        prev=blocknr;
+        (*freeblocks)++;
+    }
+    return runs;
+}
+
+/**
+    Write the empty chain anew in ascending block order, a window of
+    FSCKMAXBLOCKS blocks per pass: df_mark() maps what the tree uses, the
+    rest of the window is linked after the chain so far by ec_linkwindow(),
+    lost blocks included, and the link from the window before, the header
+    and the counters are one transaction. Between passes the chain holds the
+    windows done, the free blocks from sortnext on are out of it until their
+    pass comes. After (passes) passes, 0 for no limit, the sort stops; the
+    next call goes on at sortnext, or starts again from the first window if
+    a block was freed onto the chain in between.
+    Returns 0 when the chain is sorted, 1 if not finished, -1 on damage.
+*/
+long ec_sort(long passes)
+{
+union ech_transfer ech_t;
+union eb_transfer eb_t;
+long start, prev, first, last, nrfree, headrun, done;
+
+    ech_t.buffer=&BlockBuffer[0];
+    eb_t.buffer=&BlockBuffer[0];
+    readblock(A_EMPTYCHN);
+    if ((ech_t.ecdata->flags&ECF_SORTING) && ech_t.ecdata->last_eb==ech_t.ecdata->sorttail) {
+        start=ech_t.ecdata->sortnext;           //Go on where the last call stopped
+        prev=ech_t.ecdata->sorttail;
+        nrfree=ech_t.ecdata->nrfree;
+        headrun=ech_t.ecdata->headrun;
+    } else {
+        start=0;
+        prev=0;
+        nrfree=0;
+        headrun=0;
+    }
+    for (done=0;start<fscktotal;done++) {
+        if (passes!=0 && done>=passes) return 1;
+        if (df_mark(start)!=0) {
+            jfcstatus=E_JFC_DAMAGED;
+            return -1;
+        }
+        if (jfsjtail!=jfsjhead && jl_checkpoint()!=SDRDY) {     //A replay must not overwrite the new links
+            jfcstatus=E_JFC_WRITEERR;
+            return -1;
+        }
+        first=fsck_nextfree((start<A_FIRSTDATA) ? A_FIRSTDATA : start);
+        last=ec_linkwindow(prev,&nrfree,&headrun);
+        if (first!=0 && prev!=0) {
+            readblock(prev);
+            eb_t.ebdata->next_eb=first;
+            writeblock(prev);
+        }
+        readblock(A_EMPTYCHN);
+        if (prev==0) ech_t.ecdata->first_eb=first;
+        ech_t.ecdata->last_eb=last;
+        ech_t.ecdata->flags|=ECF_SORTING;
+        ech_t.ecdata->sortnext=fsckend;
+        ech_t.ecdata->sorttail=last;
+        writeblock(A_EMPTYCHN);
+        ec_initcounts(fscktotal,nrfree,headrun);
+        jfs_flush();
+        jfs_progress(fsckend-1);                    //Progress once per window
+        dfres->passes++;
+        prev=last;
+        start=fsckend;
     }
-}
\ No newline at end of file
+    readblock(A_EMPTYCHN);
+    ech_t.ecdata->flags&=~ECF_SORTING;
+    writeblock(A_EMPTYCHN);
+    jfs_flush();
+    return 0;
+}
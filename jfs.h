@@ -18,26 +18,51 @@
 #define T_EMPTYBLK	0x01	//Empty block
 			//	1 byte:		0x01 = Empty block
 			//	4 bytes:	Address of next empty block in chain (0 if none)
+			//	4 bytes:	Address of previous empty block in chain (0 if none)
+#define T_BITMAPHDR	0x02	//Free space bitmap header, replaces T_EMPTYHDR at block 1
+			//	1 byte:		0x02 = Free space bitmap header
+			//	4 bytes:	# blocks covered by the bitmap (last block + 1)
+			//	4 bytes:	Address of first bitmap block
+			//	4 bytes:	# bitmap blocks
+			//	4 bytes:	Next-free hint, block to start searching at
+			//	4 bytes:	# free blocks
+			//	The bitmap blocks have no type byte: 4096 bits per block,
+			//	bit 7 of byte 0 is the first block, 1 = in use.
 #define T_PARTMAP	0x10	//Partition map block
 			//	1 byte:		0x01 = Partition map
 			//	1 byte:		#of partitions
 			//	[Groups of 4 bytes]: Address of partition header (0 after last partition)
+			//	After MAXPARTS groups:
+			//	4 bytes:	Address of the journal region (0 if none)
+			//	2 bytes:	# blocks in the journal region
+#define T_JRNLHDR	0x4A	//Journal header, first block of the journal region
+			//	1 byte:		0x4A = Journal header
+			//	4 bytes:	# blocks in the journal region, header included
+			//	4 bytes:	Sequence nr of the oldest transaction not checkpointed
+			//	2 bytes:	Position of that transaction in the region
+#define T_JRNLDESC	0x4B	//Journal transaction descriptor, the logged block images follow it
+			//	1 byte:		0x4B = Journal descriptor
+			//	4 bytes:	Sequence nr of the transaction
+			//	2 bytes:	# logged blocks
+			// [84 groups of 6 bytes]:	4 bytes home address, 2 bytes jl_sum() of the image
 #define T_PARTHDR	0xA0	//Partition header
 			//	1 byte:		0xA0 = Partition header
 			//	1 byte:		Assigned drive letter
 			//	32 bytes:	Volume name
 			//	4 bytes:	Address of boot file (0 if not bootable)
 			//  4 bytes:    Address of root dir header		
+			//	2 bytes:	Load address of the boot file
+			//	2 bytes:	Start address of the boot file
 #define T_BADBLKHDR	0xB0	//Bad blocks header
 			//	1 byte: 	0xB0 = Bad block list header
 			//	4 bytes:	#bad blocks in list
 			//	4 bytes:	Address of extension block (0 if none)
-			// [125 groups of 4 bytes]:	Addresses of bad blocks (0 after last bad block)
+			// [125 groups of 4 bytes]:	Addresses of bad blocks, ascending, header first then extensions
 #define T_BADBLKEXT	0xBE	//Bad blocks extension block
 			//	1 byte:		0xBE = Bad block list extension
-			//	5 bytes:	Address of previous extension block
-			//	5 bytes:	Address of next extension block (0 if none)
-			// [125 groups of 4 bytes]:	Addresses of bad blocks (0 after last bad block)
+			//	4 bytes:	Address of previous extension block (or header)
+			//	4 bytes:	Address of next extension block (0 if none)
+			// [125 groups of 4 bytes]:	Addresses of bad blocks, ascending
 #define T_DIRHDR	0xD0	//Directory header block
 			//	1 byte:		0xD0
 			//	1 byte:		Directory attributes
@@ -47,7 +72,11 @@
 			//  4 bytes:    Address of extension block (0 if none)
 			//	3 bytes:	Last write date (6 char BCD)
 			//	3 bytes:	Last write time (6 char BCD)
-			// [116 groups of 4 bytes]:	Addresses of file headers (0 after last file)
+			// [58 groups of 8 bytes]:	Directory entries (block 0 after last entry):
+			//		4 bytes:	Address of file or dir header
+			//		2 bytes:	Hash of the entry name, see jfs_namehash()
+			//		1 byte:		Entry block type (T_DIRHDR, T_FILEHDR, ...)
+			//		1 byte:		Entry attributes
 #define T_DIRLINK	0xD1	//Virtual directory (link)
             //  1 byte:     0xD1
 			//	1 byte:		Directory attributes
@@ -59,7 +88,7 @@
 			//	1 byte:		0xDE
 			//  4 bytes:    Address (block #) of previous dir block
 			//  4 bytes:    Addres of next extension block (0 if no more)
-			// [126 groups of 4 bytes]:	Addresses of file headers (0 after last file)
+			// [62 groups of 8 bytes]:	Directory entries (block 0 after last entry)
 #define T_FILEHDR	0xF0	//File header block
 			//	1 byte: 	0xF0
 			//	1 byte:		File attributes
@@ -75,26 +104,121 @@
 			//	4 bytes:	Address of previous block in file chain
 			//	4 bytes:	Address of next block in file chain (0 if none)
 			// (max 503) bytes:		File data
+#define T_FILEXHDR	0xF2	//Extent file header block
+			//	1 byte: 	0xF2
+			//	1 byte:		File attributes
+			//	32 bytes:	File name
+			//	4 bytes:	Address of extent list overflow block (0 if none)
+			//	3 bytes:	Last write date (6 char BCD)
+			//	3 bytes:	Last write time (6 char BCD)
+			//	4 bytes:	File size (data only)
+			//	2 bytes:	# extents used in this block
+			// [57 groups of 8 bytes]:	Extents: 4 bytes first block, 4 bytes # blocks
+			//	File data is in the extents, 512 bytes per block, no block headers.
+#define T_FILEXLST	0xF3	//Extent list overflow block
+			//	1 byte: 	0xF3
+			//	4 bytes:	Address of previous extent list block (file header for the first)
+			//	4 bytes:	Address of next extent list overflow block (0 if none)
+			//	2 bytes:	# extents used in this block
+			// [62 groups of 8 bytes]:	Extents: 4 bytes first block, 4 bytes # blocks
 
 // Predefined block numbers
 #define A_BOOTBLOCK	0	//Boot block address
 #define A_EMPTYCHN	1	//Empty block chain address
 #define A_PARTMAP	2	//Partition map address
 #define A_BADBLKHDR	3	//Bad block header address
+#define A_FIRSTDATA	4	//First block available for the empty chain
+
+// Format modes for JDOS_erase()
+#define FMT_SURFACE 0   /**Pattern test every block, then add it to the empty chain*/
+#define FMT_STREAM  1   /**Write every empty block once, links computed up front*/
+#define FMT_BITMAP  2   /**Free space bitmap instead of the empty chain*/
+#define FMT_QUICK   3   /**SD hardware erase, then bitmap and metadata only*/
+#define ECF_COUNTED 0x01    /**s_emptyhdr.flags: free/used/run counters are kept*/
+#define ECF_SORTING 0x02    /**s_emptyhdr.flags: jfs_defrag() is rebuilding the chain, see sortnext*/
+#define QE_CHUNK    0x10000L    /**Blocks per hardware erase command (32 MB)*/
+
+// Free space bitmap constants
+#define BMBITSPERBLK    4096    /**Blocks covered by one bitmap block*/
+#define BMBITSHIFT      12      /**log2(BMBITSPERBLK)*/
 
 // File system related constants
 #define MAXPARTS    10  /**Max # of partitions on a volume*/
 #define MAXBBLOCKS  125 /**Nr of bad blocks that fit into a BBHeader of BBExt block*/
-#define DHMAXFILES  116 /**Max # of file entries in directory header*/
-#define DEMAXFILES  126 /**Max # of file entries in directory extension*/
-#define FHMAXBYTES  465 /**Max # of bytes in file header*/
+#define DHMAXENTS   58  /**Max # of entries in directory header*/
+#define DXMAXENTS   62  /**Max # of entries in directory extension*/
+#define FHMAXBYTES  464 /**Max # of bytes in file header*/
 #define FEMAXBYTES  503 /**Max # of bytes in file extension*/
+#define FXHMAXEXT   57  /**Max # of extents in extent file header*/
+#define FXLMAXEXT   62  /**Max # of extents in extent list overflow block*/
+#define FXMAXRUN    256 /**Largest extent asked from the allocator in one go*/
+
+// Static RAM on the 6309, about 17 kB in SD-mon with the sizes below:
+//  block cache 6 x 525 = 3150, open files 2 x 2086 = 4172, fsck maps
+//  2 x 2048 = 4096, bad block list 1000, dentry cache 16 x 46 = 736,
+//  journal buffer 512; the driver's CRC tables 768, SD-mon's BlockBuffer 512
+//  and RangeBuf 2048. Code and stack share the rest below $E000, so a size
+//  raised here must come off another.
+
+// Block cache constants
+#define JFSCACHESLOTS   6   /**Nr of 512 byte blocks held in the block cache*/
+#define JFSMETABLOCKS   4   /**Blocks 0..3 are fixed metadata, preferably kept resident*/
+#define EC_BATCH        32  /**Blocks per multi-block write/verify in ec_stream()*/
+#define JFSMAXBAD       250 /**Bad blocks held in RAM, see is_bad_block(): 1 kB, header + 1 extension*/
+
+// Journal constants
+#define JLBLOCKS        64  /**Blocks in the journal region made by the format, header included*/
+#define JLMAXDESC       84  /**Logged blocks one descriptor can describe*/
+
+// Dentry cache constants
+#define JFSDCACHESIZE   16  /**Nr of (dir, name) -> block entries, 46 bytes each*/
+#define JFSDEFDRIVE     'c' /**Drive used for paths without a drive letter*/
+
+/* File read handles */
+#define JFSMAXOPEN      2   /**Files open at the same time, see jfs_open() and jfs_create()*/
+#define JFSRABLOCKS     4   /**Read-ahead or write-behind window per open file, in blocks*/
+
+// File system check constants
+#ifdef _CMOC_VERSION_
+#define FSCKMAXBLOCKS   16384L  /**Largest file system jfs_fsck() checks (8 MB)*/
+#define FSCKMAPBYTES    2048    /**Bytes per fsck bitmap, one bit per block*/
+#else
+#define FSCKMAXBLOCKS   4194304L    /**Host: 2 GB images*/
+#define FSCKMAPBYTES    524288
+#endif
+#define FSCKMAXDEPTH    16  /**Deepest dir nesting jfs_fsck() follows*/
+#define FSCKMAXMSG      20  /**Problems printed by jfs_fsck(), the rest are only counted*/
 
 // Constants for partitions and directories
 #define NOATTRIB    0   //Specifies no dir attributes
+#define AT_WRITEABLE 0x01   //Attribute bits for dirs and files
+#define AT_HIDDEN   0x02
+#define AT_LINK     0x04
+#define AT_EXEC     0x08
+#define AT_SYSTEM   0x10
 #define NOPARENT    0   //No parent dir
 #define NOTBOOTABLE 0   //Partition is not bootable
 
+// Boot loader constants, see SDboot.c. The ROM runs block 0 at $0000.
+#define BOOTMAP     0x0200  /**Stage-0 reads the partition map here*/
+#define BOOTHDR     0x0400  /**and the partition and boot file headers here*/
+#define BOOTLOADMIN 0x0600  /**Lowest load address of a boot file*/
+#define BOOTLOADEND 0xE000  /**The last boot file block must end here or below: I/O and ROM above*/
+
+// On-disk types. Block structures are big-endian with 32 bit block numbers and
+// 16 bit counts, the native CMOC layout. Host tools (jfsimg) get the same layout
+// from fixed size types and gcc's scalar_storage_order.
+#ifdef _CMOC_VERSION_
+typedef long            jfs_long;
+typedef unsigned int    jfs_uint;
+#define JFS_ONDISK
+#else
+#include <stdint.h>
+typedef int32_t         jfs_long;
+typedef uint16_t        jfs_uint;
+#define JFS_ONDISK      __attribute__((packed, scalar_storage_order("big-endian")))
+#endif
+
 // Data structures
 
 /**
@@ -104,46 +228,95 @@
 struct s_partmap {
     unsigned char blocktype;
     unsigned char no_parts;
-    long parthdr[MAXPARTS];
-};
+    jfs_long parthdr[MAXPARTS];
+    jfs_long journal;                           //First block of the journal region or 0 if none
+    jfs_uint journalblks;                       //Number of blocks in the journal region
+} JFS_ONDISK;
 
 /**
     Data structure for empty chain header
 */
 struct s_emptyhdr {                             
     unsigned char   blocktype;                  //T_EMPTYHDR or 0x00
-    long            first_eb;                   //Address of first known empty block or 0 if none
-    long            last_eb;                    //Address of last known empty block or 0 if none
-};	
+    jfs_long        first_eb;                   //Address of first known empty block or 0 if none
+    jfs_long        last_eb;                    //Address of last known empty block or 0 if none
+    unsigned char   flags;                      //ECF_COUNTED if the counters below are kept
+    jfs_long        totalblocks;                //Blocks 0..totalblocks-1 belong to the file system
+    jfs_long        nrfree;                     //Blocks in the empty chain
+    jfs_long        nrused;                     //Blocks in use, metadata included: total - free - bad
+    jfs_long        headrun;                    //Blocks from first_eb on known to follow each other on the card and in the chain
+    jfs_long        sortnext;                   //ECF_SORTING: free blocks from here on are not linked yet
+    jfs_long        sorttail;                   //ECF_SORTING: last_eb when the sort stopped
+} JFS_ONDISK;
+
+/**
+    Data structure for free space bitmap header
+*/
+struct s_bitmaph {
+    unsigned char   blocktype;                  //T_BITMAPHDR or 0x02
+    jfs_long        totalblocks;                //Number of blocks covered by the bitmap
+    jfs_long        firstbmblock;               //Address of the first bitmap block
+    jfs_long        nrbmblocks;                 //Number of bitmap blocks
+    jfs_long        nexthint;                   //Block to start the next free block search at
+    jfs_long        nrfree;                     //Number of free blocks
+} JFS_ONDISK;
 
 /**
     Data structure for empty block
 */
 struct s_eblock {
     unsigned char   blocktype;                  //T_EMPTYBLK or 0x01
-    long            next_eb;                    //Address of next empty block in chain or 0 if none
-    long            prev_eb;                    //Address of previous empty block in chain or 0 if none
-};
+    jfs_long        next_eb;                    //Address of next empty block in chain or 0 if none
+    jfs_long        prev_eb;                    //Address of previous empty block in chain or 0 if none
+} JFS_ONDISK;
 
 /**
     Data structure for bad block header
 */
 struct s_bblockh {                              /** Bad block list header block */
     unsigned char   blocktype;                  //T_BADBLKHDR or 0xB0
-    long            nrbadblocks;                //Number of known bad blocks listed in header + ext blocks
-    long            extb_block;                 //Address of extension block for Bad Block List or 0 if none
-    long            badblock[MAXBBLOCKS];       //Array of adresses of bad blocks
-};
+    jfs_long        nrbadblocks;                //Number of known bad blocks listed in header + ext blocks
+    jfs_long        extb_block;                 //Address of extension block for Bad Block List or 0 if none
+    jfs_long        badblock[MAXBBLOCKS];       //Array of adresses of bad blocks
+} JFS_ONDISK;
 
 /**
     Data structure for bad block extension
 */
 struct s_bblockx {                              /** Bad block list extension block */
     unsigned char   blocktype;                  //T_BADBLKEXT or 0xB1
-    long            prevbblock;                 //Previous Bad Block list block
-    long            extb_block;                 //Address of extension block for Bad Block List or 0 if none
-    long            badblock[MAXBBLOCKS];       //array of adresses of bad blocks
-};
+    jfs_long        prevbblock;                 //Previous Bad Block list block
+    jfs_long        extb_block;                 //Address of extension block for Bad Block List or 0 if none
+    jfs_long        badblock[MAXBBLOCKS];       //array of adresses of bad blocks
+} JFS_ONDISK;
+
+/**
+    Data structure for journal header
+*/
+struct s_jrnlhdr {
+    unsigned char   blocktype;                  //T_JRNLHDR or 0x4A
+    jfs_long        nrblocks;                   //Blocks in the journal region, this header included
+    jfs_long        tailseq;                    //Sequence nr of the oldest transaction not checkpointed
+    jfs_uint        tail;                       //Its position in the region, 1..nrblocks-1
+} JFS_ONDISK;
+
+/**
+    Data structure for one logged block in a journal descriptor
+*/
+struct s_jrnlent {
+    jfs_long        home;                       //Block the image belongs to
+    jfs_uint        sum;                        //jl_sum() of the image, a torn transaction fails it
+} JFS_ONDISK;
+
+/**
+    Data structure for journal descriptor. The images follow it in the same order.
+*/
+struct s_jrnldesc {
+    unsigned char   blocktype;                  //T_JRNLDESC or 0x4B
+    jfs_long        seq;                        //Sequence nr, one higher than the previous transaction
+    jfs_uint        count;                      //Number of logged blocks
+    struct s_jrnlent entry[JLMAXDESC];          //Home address and checksum per image
+} JFS_ONDISK;
 
 /**
     Data structure for partition header
@@ -152,9 +325,22 @@ struct s_parth {                                /** Partition header block struc
     unsigned char   blocktype;                  //T_PARTHDR or 0xA0
     char            driveletter;                //Drive letter if assigned, else 0
     char            volname[32];                //Volume name string max 32 chars
-    long            bootfile;                   //Adress of fileheader block for boot file, or 0 if none
-    long            rootdir;                    //Address of root directory header block
-};
+    jfs_long        bootfile;                   //Adress of fileheader block for boot file, or 0 if none
+    jfs_long        rootdir;                    //Address of root directory header block
+    jfs_uint        bootload;                   //Load address of the boot file, see jfs_setboot()
+    jfs_uint        bootexec;                   //Start address of the boot file
+} JFS_ONDISK;
+
+/**
+    Data structure for one directory entry.
+    Name hash, type and attributes let lookups and listings skip header blocks.
+*/
+struct s_dirent {
+    jfs_long        block;                      //Address of file or dir header, 0 after last entry
+    jfs_uint        hash;                       //jfs_namehash() of the entry name
+    unsigned char   type;                       //Block type of the header: T_DIRHDR, T_FILEHDR, T_FILEXHDR...
+    unsigned char   attributes;                 //Attributes of the entry
+} JFS_ONDISK;
 
 /**
     Data structure for directory header
@@ -163,22 +349,80 @@ struct s_dirh {                                 /** Directory header block struc
     unsigned char   blocktype;                  //T_DIRHDR or 0xD0
     unsigned char   attibutes;                  //Directory attributes
     char            dirname[32];                //Directory name
-    long            parentdir;                  //Address of parent dir or 0 if none
-    long            dirext;                     //Address of extension block or 0 if none  
-    char            moddate[6];                 //Date of last change
-    char            modtime[6];                 //Time of last change
-    long            file[DHMAXFILES];           //The first 116 files in dir (0 after last used)
-};
+    jfs_long        parentdir;                  //Address of parent dir or 0 if none
+    jfs_long        dirext;                     //Address of extension block or 0 if none  
+    char            moddate[3];                 //Date of last change
+    char            modtime[3];                 //Time of last change
+    struct s_dirent entry[DHMAXENTS];           //The first 58 entries in dir (block 0 after last used)
+} JFS_ONDISK;
 
 /**
     Data structure for directory extension
 */
 struct s_dirx {                                 /** Directory extension block structure */
     unsigned char   blocktype;                  //T_DIREXT or 0xDE
-    long            prevdblock;                 //Address of previous dir block
-    long            nextdblock;                 //Address of next extension block or 0 if none  
-    long            file[DXMAXFILES];           //Additional 126 files in dir (0 after last used)
-};
+    jfs_long        prevdblock;                 //Address of previous dir block
+    jfs_long        nextdblock;                 //Address of next extension block or 0 if none  
+    struct s_dirent entry[DXMAXENTS];           //Additional 62 entries in dir (block 0 after last used)
+} JFS_ONDISK;
+
+/**
+    Data structure for chained file header
+*/
+struct s_fileh {                                /** File header block structure */
+    unsigned char   blocktype;                  //T_FILEHDR or 0xF0
+    unsigned char   attributes;                 //File attributes
+    char            filename[32];               //File name
+    jfs_long        nextblock;                  //Address of next block in file chain or 0 if none
+    char            moddate[3];                 //Date of last change
+    char            modtime[3];                 //Time of last change
+    jfs_long        filesize;                   //File size, data only
+    unsigned char   data[FHMAXBYTES];           //First bytes of the file
+} JFS_ONDISK;
+
+/**
+    Data structure for chained file extension
+*/
+struct s_filex {                                /** File extension block structure */
+    unsigned char   blocktype;                  //T_FILEEXT or 0xFE
+    jfs_long        prevblock;                  //Address of previous block in file chain
+    jfs_long        nextblock;                  //Address of next block in file chain or 0 if none
+    unsigned char   data[FEMAXBYTES];           //Next bytes of the file
+} JFS_ONDISK;
+
+/**
+    Data structure for one extent: a run of consecutive data blocks
+*/
+struct s_extent {
+    jfs_long        start;                      //First block of the run
+    jfs_long        length;                     //Number of blocks in the run
+} JFS_ONDISK;
+
+/**
+    Data structure for extent file header
+*/
+struct s_filexh {                               /** Extent file header block structure */
+    unsigned char   blocktype;                  //T_FILEXHDR or 0xF2
+    unsigned char   attributes;                 //File attributes
+    char            filename[32];               //File name
+    jfs_long        extlist;                    //Address of extent list overflow block or 0 if none
+    char            moddate[3];                 //Date of last change
+    char            modtime[3];                 //Time of last change
+    jfs_long        filesize;                   //File size, data only
+    jfs_uint        nrextents;                  //Number of extents used in this block
+    struct s_extent extent[FXHMAXEXT];          //The first 57 extents of the file
+} JFS_ONDISK;
+
+/**
+    Data structure for extent list overflow block
+*/
+struct s_filexl {                               /** Extent list overflow block structure */
+    unsigned char   blocktype;                  //T_FILEXLST or 0xF3
+    jfs_long        prevblock;                  //Previous extent list block, file header for the first
+    jfs_long        nextblock;                  //Next extent list overflow block or 0 if none
+    jfs_uint        nrextents;                  //Number of extents used in this block
+    struct s_extent extent[FXLMAXEXT];          //Next 62 extents of the file
+} JFS_ONDISK;
 
 /** union used to map empty chain header structure onto raw disk block */
 union ech_transfer {
@@ -186,6 +430,12 @@ union ech_transfer {
     unsigned char* buffer;
 };
 
+/** union used to map free space bitmap header structure onto raw disk block */
+union bmh_transfer {
+    struct s_bitmaph* bmhdata;
+    unsigned char* buffer;
+};
+
 /*Union used to map empty block data structure onto raw disk block*/
 union eb_transfer {
     struct s_eblock* ebdata;
@@ -198,6 +448,18 @@ union pm_transfer {
     unsigned char* buffer;
 };
 
+/** Union used to map journal header structure onto raw disk block*/
+union jh_transfer {
+    struct s_jrnlhdr *  jhdata;
+    unsigned char * buffer;
+};
+
+/** Union used to map journal descriptor structure onto raw disk block*/
+union jd_transfer {
+    struct s_jrnldesc * jddata;
+    unsigned char * buffer;
+};
+
 /** Union used to map bad block header data structure onto raw disk block*/
 union bbh_transfer {
     struct s_bblockh *  bbhdata;
@@ -222,25 +484,210 @@ union dh_transfer {
     unsigned char * buffer;
 };
 					
+/**Union used to map chained file header structure onto raw disk block*/
+union fh_transfer {
+    struct s_fileh * fhdata;
+    unsigned char * buffer;
+};
+
+/**Union used to map chained file extension structure onto raw disk block*/
+union fe_transfer {
+    struct s_filex * fedata;
+    unsigned char * buffer;
+};
+
+/**Union used to map extent file header structure onto raw disk block*/
+union fxh_transfer {
+    struct s_filexh * fxhdata;
+    unsigned char * buffer;
+};
+
+/**Union used to map extent list overflow structure onto raw disk block*/
+union fxl_transfer {
+    struct s_filexl * fxldata;
+    unsigned char * buffer;
+};
+
 /**Union used to map directory extension structure onto raw disk block*/
 union dx_transfer {
-    struct s_dirx * dhdata;
+    struct s_dirx * dxdata;
     unsigned char * buffer;
 };
+
+/**
+    Data structure for one slot in the block cache
+*/
+struct s_cacheslot {
+    bool            valid;                      //true if the slot holds a block
+    bool            dirty;                      //true if the slot must be written back to disk
+    bool            logged;                     //true if committed to the journal but not yet written home
+    unsigned int    jpos;                       //Position of the logged image in the journal region
+    long            blocknr;                    //Block number held in this slot
+    unsigned long   lastuse;                    //LRU stamp, higher is more recently used
+    unsigned char   data[SDBlockSize];          //Block contents
+};
+
+/**
+    Data structure for one dentry cache entry: (parent dir, name) -> header block.
+    child 0 is a negative entry: the name is known not to exist in parent.
+*/
+struct s_dentry {
+    long            parent;                     //Dir block the name was looked up in, 0 = unused slot
+    long            child;                      //Header block of the name, 0 if not found
+    unsigned int    hash;                       //jfs_namehash() of name, compared first
+    unsigned long   lastuse;                    //LRU stamp
+    char            name[32];                   //Name, not terminated if 32 chars long
+};
+
+/**
+    Data structure for one open file, see jfs_open() and jfs_create().
+    Reading, the window holds the next blocks of the file, read ahead in as
+    few SD commands as the layout allows. Writing, it collects data that has
+    no blocks allocated yet.
+*/
+struct s_jfsfile {
+    bool            open;                       //true if the handle is in use
+    bool            writing;                    //true if opened by jfs_create()
+    unsigned char   type;                       //T_FILEHDR or T_FILEXHDR
+    long            header;                     //File header block
+    long            size;                       //File size, writing: bytes on disk so far
+    long            pos;                        //Bytes returned or written so far
+    long            next;                       //Next block to fetch or write, 0 if none
+    long            left;                       //Reading: blocks not fetched, writing: reserved blocks not allocated
+    bool            consecutive;                //Chained file: the last link was block+1
+    long            extblock;                   //Extent file: extent list block of the current extent
+    unsigned int    extnr;                      //Index of the next extent in that block
+    long            extleft;                    //Blocks of the current extent (writing: allocated run) from next on
+    unsigned char   nrbuf;                      //Blocks in the window, writing: full blocks
+    unsigned char   bufnr;                      //Window block being returned
+    int             bufoffset;                  //Next byte in that block, writing: bytes in block nrbuf
+    unsigned char   buf[JFSRABLOCKS][SDBlockSize];  //The read-ahead window
+};
+
+/**
+    File system usage, see jfs_usage()
+*/
+struct s_jfsusage {
+    unsigned char   alloctype;                  //T_EMPTYHDR or T_BITMAPHDR
+    long            totalblocks;                //Blocks in the file system
+    long            nrfree;                     //Free blocks
+    long            nrused;                     //Blocks in use, metadata included
+    long            nrbad;                      //Blocks on the bad block list
+    long            headrun;                    //Empty chain: consecutive free blocks at its head, 0 for a bitmap
+};
+
+/**
+    File system check results, see jfs_fsck()
+*/
+struct s_fsckstats {
+    long            blocks;                     //Blocks in the file system
+    long            used;                       //Blocks in use, metadata included
+    long            free;                       //Free blocks, empty chain: linked into the chain
+    long            bad;                        //Blocks on the bad block list
+    long            reads;                      //Blocks read by the sequential pass
+    long            lost;                       //Blocks neither used nor free
+    long            orphans;                    //Empty blocks no link points at
+    long            doubles;                    //Blocks used twice, or used and free
+    long            badlinks;                   //Broken next/prev links and references
+    long            badentries;                 //Dir entries that do not match a header
+    long            badcounts;                  //Wrong or missing free space counters
+    long            fixed;                      //Repairs made
+};
+
+/**
+    Contiguity of the file system, see jfs_fragstats(), and the work done by jfs_defrag()
+*/
+struct s_defragstats {
+    long            objects;                    //Files and dirs
+    long            blocks;                     //Blocks of their chains, dir blocks and extents
+    long            fragmented;                 //Objects that are not one run of consecutive blocks
+    long            runs;                       //Runs the objects are in, one per object at best
+    long            freeblocks;                 //Free blocks
+    long            freeruns;                   //Runs of consecutive blocks in the empty chain or bitmap
+    long            moved;                      //Objects jfs_defrag() moved to a consecutive run
+    long            copied;                     //Blocks it copied
+    long            nospace;                    //Fragmented objects no free run was found for
+    long            passes;                     //Window passes, each one tree walk
+};
+
+/**
+    Dentry cache statistics
+*/
+struct s_dcachestats {
+    unsigned long   hits;                       //Lookups answered with a block number
+    unsigned long   neghits;                    //Lookups answered with "does not exist"
+    unsigned long   misses;                     //Lookups that had to read the dir
+    unsigned long   invalidates;                //Entries dropped because a dir changed
+};
+
+/**
+    Journal statistics
+*/
+struct s_jrnlstats {
+    unsigned long   commits;                    //Transactions written by jl_commit()
+    unsigned long   logged;                     //Block images written to the journal
+    unsigned long   checkpoints;                //Times the journal was emptied by jl_checkpoint()
+    unsigned long   replayed;                   //Transactions replayed by jfs_mount()
+};
+
+/**
+    Block cache statistics
+*/
+struct s_cachestats {
+    unsigned long   hits;                       //readblock()/writeblock() served from the cache
+    unsigned long   misses;                     //readblock() that had to go to the SD card
+    unsigned long   writebacks;                 //dirty blocks written to the SD card
+    unsigned long   devreads;                   //Total block reads sent to the SD card
+    unsigned long   devwrites;                  //Total block writes sent to the SD card
+};
 					
 // Function prototypes
 
-long JDOS_erase(long maxblocks);		                        //erase whole disk, create empty chain
+long JDOS_erase(long maxblocks, unsigned char mode);            //erase whole disk, create empty chain
+long ec_stream(long first, long last);                          //build empty chain for first..last in one pass
+bool quick_erase(long maxblocks);                               //hardware erase of the whole card
+void init_rootpart();                                           //create partition map, root dir and root partition
+bool ec_writeempty(long blocknr, long prev, long next);         //write and verify an empty block image
+void ec_buildempty(long prev, long next);                       //build an empty block image in BlockBuffer
+bool ec_checkempty(long prev, long next);                       //check BlockBuffer against an empty block image
 bool erase_test_block(long BlockNr);                            //erase block, then test
 void printerr(const char * errormmessage);                      //print error message with bell and newlines
+void jfs_progress(long blocknr);                                //\r and the block nr, unless jfsquiet
 int fillblock(long BlockNr, unsigned char Value);               //fill block with value
-int writeblock(long blocknr);                                   //write the contents of the buffer into block BlockNr
+int writeblock(long blocknr);                                   //write the contents of the buffer into block BlockNr (cached)
 int testblock(long BlockNr, unsigned char Value);               //test if block is filled with value
-int readblock(long blocknr);                                    //read block (blocknr) into global blockbuffer
+int readblock(long blocknr);                                    //read block (blocknr) into global blockbuffer (cached)
+int rawreadblock(long blocknr);                                 //read block from SD card into blockbuffer, bypass the cache
+int rawwriteblock(long blocknr);                                //write blockbuffer to SD card, bypass the cache
+int jfs_flush();                                                //write all dirty cache blocks back to the SD card
+void jfs_cacheinit();                                           //empty the block cache without writing back (card change)
+void jfs_cachedrop(long blocknr);                               //forget a cached copy of blocknr
+struct s_cacheslot* jfs_cacheslot(long blocknr);                //get a cache slot for blocknr, evicting the LRU block if needed
+struct s_cacheslot* jfs_cacheread(long blocknr);                //get the cache slot holding blocknr, read it if needed
 void init_ec_header(long firstEBlock);                          //initialise empty chain header block
 void init_partmap();                                            //initialise the partition map block
 void init_badblk_hdr();                                         //initialise the bad block header block
 void add_bad_block(long blocknr);                               //add block that failed to initialise to bad block list
+bool bb_insert(long blocknr);                                   //Add blocknr to the RAM bad block list, false if full
+int bb_find(long blocknr);                                      //Index of the first RAM bad block >= blocknr
+bool is_bad_block(long blocknr);                                //true if blocknr is on the bad block list, no I/O
+bool is_bad_range(long blocknr, long count);                    //true if any of count blocks from blocknr on is bad
+bool load_bad_blocks();                                         //Read the bad block list into RAM
+bool flush_bad_blocks();                                        //Write the RAM bad block list to disk if changed
+void forget_bad_blocks();                                       //Drop the RAM bad block list, e.g. after a card change
+int jfs_mount();                                                //Open the journal and replay it, after jfs_cacheinit()
+int jfs_unmount();                                              //Flush and checkpoint, everything home
+void jl_create();                                               //Make the journal region at the end of a format
+int jl_commit();                                                //Write all dirty cache blocks to the journal as one transaction
+int jl_checkpoint();                                            //Write logged blocks home and empty the journal
+int jl_reuse(long start, long count);                           //Checkpoint if the journal may hold an image of these blocks
+int jl_replay();                                                //Apply committed transactions after a crash
+unsigned int jl_place(unsigned int count);                      //Journal position for a transaction of (count) blocks
+bool jl_validtxn(unsigned int pos, long seq);                   //true if a complete transaction (seq) is at pos
+int jl_writehdr(unsigned int tail);                             //Write the journal header with a new tail
+jfs_uint jl_sum(unsigned char* data);                           //16 bit checksum of a block image
+int jl_rawread(long blocknr);                                   //Read a block into the journal buffer, bypass the cache
+int jl_rawwrite(long blocknr, unsigned char* data);             //Write a block to the SD card, bypass the cache
 void add_to_ec(long blocknr);                                   //append block to empty chain
 long GetLastECBlockNr();                                        //Get block number of last block in Empty Chain
 void UpdateLastECBlock(long prevlastblock,long newblock);       //Add pointer to new block in last block of EC
@@ -249,15 +696,115 @@ void UpdateECHeader(long newblock);                             //Write new last
 long createDir(char* dirname, unsigned char attribs, long parentdir);                   //create a directory with name, attribs, parent dir
 long createPartition(char driveletter, char* partname, long bootfile, long rootdir);    //Create a partition with drive letter, bootable flag, root dir
 int addpart(long newpart);                                      //Add newly created partition to partmap return # of partitions, or 0 if error
-long getblock();                                                //Get an empty block from empty chain, or 0 if none available
+long getblock();                                                //Get a free block from the allocator, or 0 if none available
+long getblocks(long count);                                     //Get (count) consecutive free blocks, first block or 0
+void freeblock(long blocknr);                                   //Return a block to the allocator
+void freeblocks(long blocknr, long count);                      //Return a run of blocks to the allocator
+void ungetblocks(long blocknr, long count);                     //Give back an unwritten run from getblocks()
+unsigned char jfs_alloctype();                                  //T_EMPTYHDR or T_BITMAPHDR
+long ec_getblock();                                             //Get an empty block from empty chain, or 0 if none available
+bool ec_inchain(long blocknr);                                  //Is (blocknr) linked into the empty chain
+long ec_getrun(long count);                                     //Get (count) consecutive blocks from the head of the empty chain
+void ec_putrun(long first, long count);                         //Put an unwritten run back at the head of the empty chain
+long bm_format(long maxblocks);                                 //Write an empty free space bitmap, returns # free blocks
+long bm_alloc(long count);                                      //Allocate (count) consecutive blocks from the bitmap
+void bm_free(long blocknr, long count);                         //Return (count) blocks to the bitmap
+void bm_mark(long blocknr, long count, bool inuse);             //Set or clear bitmap bits
+bool bm_isfree(long blocknr);                                   //true if the bitmap bit of blocknr is clear
 void eb_unlink(long blocknr);                                   //Remove (blocknr) from empty chain
 void ec_modfirst(long blocknr);                                 //Register blocknr as first eb in empty chain
+void ec_initcounts(long totalblocks, long nrfree, long headrun);   //Start keeping the empty chain counters
+void ec_countfree(long newblock);                               //Counters for a block added to the empty chain
+void ec_counttaken(long blocknr, long succ, bool wasfirst);     //Counters for a block taken from the empty chain
+bool jfs_usage(struct s_jfsusage* usage);                       //Free/used/bad counts from the headers, false if not kept
+long jfs_verifycounts(bool fix);                                //Recount free space, returns the nr of wrong counters or -1
+long jfs_fsck(bool fix, struct s_fsckstats* result);            //Check (and repair) the file system, returns the nr of problems or -1
+void fsck_report(long* counter, const char* what, long blocknr);    //Count a problem, print the first FSCKMAXMSG
+bool fsck_bit(unsigned char* map, long blocknr);                //Bit of blocknr in an fsck bitmap
+void fsck_setbit(unsigned char* map, long blocknr, bool on);    //Set or clear the bit of blocknr
+bool fsck_isused(long blocknr);                                 //true if the tree uses blocknr
+long fsck_nextfree(long blocknr);                               //First block from blocknr on the tree does not use, 0 if none
+bool fsck_use(long blocknr, long count);                        //Mark (count) blocks used, false if outside or used already
+void fsck_badlist();                                            //Check the bad block list, mark its blocks used
+void fsck_tree();                                               //Mark everything reachable from the partition map used
+void fsck_dir(long dir, long parent, unsigned char depth);      //Check a dir, its entries and everything below it
+void fsck_file(long header);                                    //Mark the blocks of a file used, check its links
+void fsck_chain();                                              //Check the empty chain in one sequential pass
+void fsck_claim(long blocknr);                                  //Record an empty chain link to blocknr
+unsigned long fsck_linksum(long from, long to);                 //Checksum term of a link, next_eb and prev_eb must add up the same
+void fsck_relink();                                             //Write a new empty chain over all blocks not in use
+void fsck_bitmap();                                             //Check the free space bitmap against the tree
+long ec_linkwindow(long prev, long* nrfree, long* headrun);     //Link the free blocks of the fsck window after prev, returns the new tail
+bool jfs_fragstats(struct s_defragstats* result);               //Measure how contiguous files, dirs and free space are
+long jfs_defrag(long passes, struct s_defragstats* result);     //Move fragmented objects, sort the empty chain; 0 done, 1 call again, -1 error
+long df_total();                                                //Blocks in the file system from the allocator header, 0 if not formatted
+long df_mark(long start);                                       //Map the blocks the tree uses in the window from start on, returns the nr of problems
+void df_tree();                                                 //Measure (and defragment) every partition
+void df_dir(long dir, unsigned char depth);                     //Measure (and defragment) the entries of dir and below
+long df_visit(long header, unsigned char type, long dirblock, int index);  //Measure (and move) one object, returns its header block
+long df_object(long header, unsigned char type, long* blocks);  //Nr of runs a file or dir is in, its blocks in *blocks, 0 if not readable
+long df_move(long header, unsigned char type, long blocks, long dirblock, int index);   //Move an object to a consecutive run, its new header or 0
+long df_findrun(long count);                                    //Lowest run of (count) free blocks in the window, 0 if none
+bool df_take(long start, long count);                           //Take a run found by df_findrun() from free space
+void df_release(long start, long count);                        //Return (count) blocks to free space and to the window map
+void df_setref(long dirblock, int index, long oldheader, long newheader, unsigned char type);  //Point the reference to a moved header at its new block
+long df_freeruns(long* freeblocks);                             //Runs of consecutive free blocks, in chain order
+long ec_sort(long passes);                                      //Rebuild the empty chain ascending, 0 done, 1 not finished, -1 error
+unsigned int jfs_namehash(char* name);                          //16 bit hash of a file or dir name
+struct s_dirent* dir_block(long dir, long dirblock, int* nrents, long* nextblock);   //Read one block of a dir, returns its entries
+bool dir_addentry(long dir, long block, char* name, unsigned char type, unsigned char attribs);  //Add entry to a dir
+bool dir_delentry(long dir, long block);                        //Remove the entry for (block) from a dir
+long dir_lookup(long dir, char* name);                          //Find a name in a dir, returns its header block or 0
+void dir_list(long dir, bool showhidden);                       //List the entries of a dir
+long jfs_lookup(long dir, char* name);                          //dir_lookup() through the dentry cache
+long jfs_path(char* path);                                      //Resolve "c:/dir/name" to a header block, 0 if not found
+long part_lookup(char driveletter);                             //Root dir of the partition with driveletter, 0 if none
+long jfs_setboot(char driveletter, char* path, unsigned int load, unsigned int exec);  //Set or clear the boot file of a partition
+void dcache_init();                                             //Empty the dentry cache
+void dcache_invalidate(long dir);                               //Drop cached names of dir
+long getextent(long want, long* got);                           //Get the largest run of up to (want) free blocks
+long createFile(char* filename, unsigned char attribs, long size);  //Create an extent file with (size) bytes allocated
+bool file_addextent(long fileheader, long start, long length);  //Append a run of blocks to an extent file
+long file_bmap(long fileheader, long offset, int* blockoffset); //Block holding byte (offset) of a chained or extent file
+void freefile(long fileheader);                                 //Return all blocks of a file to the allocator
+int jfs_open(long fileheader);                                  //Open a chained or extent file for reading, handle or -1
+int jfs_read(int handle, unsigned char* buffer, int count);     //Read up to (count) bytes, returns bytes read, 0 at end, -1 on error
+int jfs_create(long dir, char* name, unsigned char attribs, long reserve);  //Create an extent file for writing, handle or -1
+int jfs_write(int handle, unsigned char* buffer, int count);    //Write (count) bytes, returns bytes taken or -1
+bool jfs_close(int handle);                                     //Release a handle, a written file is completed on disk
+bool wr_flush(struct s_jfsfile* file);                          //Allocate and write the blocks in the window of a written file
+void file_trim(long fileheader, long count);                    //Take (count) blocks off the end of the last extent
+struct s_cacheslot* jfs_cachefind(long blocknr);                //Cache slot holding blocknr, 0 if not cached, no I/O
+bool ra_fill(struct s_jfsfile* file);                           //Refill the read-ahead window of an open file
+void ra_readchain(struct s_jfsfile* file);                      //Fill the window from a chained file
+void ra_readextents(struct s_jfsfile* file);                    //Fill the window from an extent file
+bool ra_nextextent(struct s_jfsfile* file);                     //Move to the next extent of an extent file
 
 //Global variables for jfc
 unsigned char jfcstatus;                                        //Global variable to pass error codes
+struct s_cachestats jfscstats;                                  //Block cache hit/miss/writeback counters
+struct s_dcachestats jfsdstats;                                 //Dentry cache hit/miss counters
+struct s_jrnlstats jfsjstats;                                   //Journal commit/checkpoint counters
+bool jfsquiet;                                                  //No progress lines, see jfs_progress()
+bool jfsjournal;                                                //JDOS_erase() makes a journal, see jl_create()
 
 //jfc status and error codes
-#define E_JFC_OK            0;                                  //0 = OK
-#define E_JFC_PARTMAPFULL   100;                                //Partition map full, no more new partitions
-#define E_JFC_NOBLOCKFORDIR 101;                                //Dir creation failed - no free disk block
+#define E_JFC_OK            0                                   //0 = OK
+#define E_JFC_PARTMAPFULL   100                                 //Partition map full, no more new partitions
+#define E_JFC_NOBLOCKFORDIR 101                                 //Dir creation failed - no free disk block
+#define E_JFC_NOBLOCKFORFILE 102                                //File creation failed - no free disk block
+#define E_JFC_DISKFULL      103                                 //Not enough free blocks for the file data
+#define E_JFC_DIRFULL       104                                 //No free block for a directory extension
+#define E_JFC_NOTAFILE      105                                 //Block is no file header
+#define E_JFC_TOOMANYOPEN   106                                 //All JFSMAXOPEN handles in use
+#define E_JFC_BADHANDLE     107                                 //Handle is not open
+#define E_JFC_READERR       108                                 //File data could not be read, or the chain is broken
+#define E_JFC_WRITEERR      109                                 //File data could not be written
+#define E_JFC_FSCKSIZE      110                                 //File system larger than FSCKMAXBLOCKS, or no file system
+#define E_JFC_FILESOPEN     111                                 //jfs_defrag() needs all files closed
+#define E_JFC_DAMAGED       112                                 //jfs_defrag() found damage, run jfs_fsck() first
+#define E_JFC_NOPART        113                                 //No partition with that drive letter
+#define E_JFC_BOOTFILE      114                                 //Not a boot file stage-0 can load: extents, size or addresses
+#define E_JFC_NODIR         115                                 //No directory to add the entry to (dir block 0)
+#define E_JFC_BADLIST       116                                 //Bad block list longer than JFSMAXBAD, nothing is allocated
 #endif //_H_JFSH
\ No newline at end of file
@@ -0,0 +1,2260 @@
+//
+// jfsimg, prepare JFS SD card images on a Linux/Unix host
+//
+// jfs.c is compiled unchanged on top of a driver that reads and writes blocks
+// in an image file, so images are byte for byte what the TOM6309 writes. The
+// image can then be put on a card with dd.
+//
+// Build: gcc -O2 -o jfsimg jfsimg.c
+//
+// Usage: jfsimg mkfs  <image> <size>[K|M|G] [-b] [-j]
+//                                                    format, -b: bitmap instead of empty chain,
+//                                                    -j: with a metadata journal
+//        jfsimg mkpart <image> <letter> <volname>    add a partition with an empty root dir
+//        jfsimg mkdir <image> <path>                 c:/dir/newdir
+//        jfsimg ls    <image> [path]                 list a dir, default c:
+//        jfsimg df    <image> [-v]                   usage from the counters, -v: count and check
+//        jfsimg fsck  <image> [-f]                   check the file system, -f: repair
+//        jfsimg defrag <image> [-p passes]           move fragmented files and dirs to consecutive
+//                                                    blocks, sort the empty chain, report before and
+//                                                    after; -p: chain sort passes this run, default all
+//        jfsimg put   <image> <hostfile> <path>      import a file
+//        jfsimg get   <image> <path> <hostfile>      export a file
+//        jfsimg bench <image> <size> <parts> <dirs> <bad> [-b] [-j] [-w] [-p us] [-c factor]
+//                                                    format and fill a scratch image, report
+//                                                    block I/O per jfs.c call as CSV on stdout
+//                                                    -w: write-behind, -p: simulated programming
+//                                                    time per write, -c: 6309/host CPU time ratio
+//        jfsimg crash <image> <size> [-b] [-n]       cut the power after 1, 2, 3... writes of a
+//                                                    mkpart + mkdir, replay, check consistency
+//                                                    -n: without the journal
+//        jfsimg rabench <image> <size> <kbytes> [-f percent] [-p us] [-c factor]
+//                                                    write a chained and an extent file, read
+//                                                    them block by block and with jfs_read(),
+//                                                    report simulated time as CSV on stdout
+//                                                    -f: links that are not block+1, default 0
+//        jfsimg wrbench <image> <size> <files> [-b] [-j]
+//                                                    write and delete files two at a time, with a
+//                                                    block per getblock() and with jfs_write(),
+//                                                    report extents and block I/O as CSV
+//        jfsimg boot  <image> [<path> <load> <exec>] set the boot file, load and start address in
+//                                                    hex, c: clears; load it as stage-0 does and
+//                                                    with a CMD17 per block, report simulated time
+//                                                    as CSV on stdout; boot from e: after mkpart d
+//                                                    and e to check that stage-0 skips partitions
+//                                                    without a boot file
+//        jfsimg crc                                  check the SD CRC7/CRC16 tables against reference
+//                                                    vectors, time them per block as CSV
+//        jfsimg blk                                  check the block number helpers (SDblocknr.c) against
+//                                                    results worked out by hand, as CSV
+//        jfsimg spi                                  run the SPI protocol of the driver (SDspi.c) on a
+//                                                    card simulated byte by byte, compare the bytes on
+//                                                    the wire of CMD17/CMD24 per block and of
+//                                                    CMD18/CMD25 streams, and the CRC retries, as CSV
+//        jfsimg cache <image> <size>                 format a scratch image, check block cache eviction,
+//                                                    LRU order across 65536 uses and failed write-backs,
+//                                                    with and without the journal, and a streamed format
+//                                                    with a broken CMD25 or stopped by a key, as CSV
+//
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include "TOM6309SDcard.h"
+#include "../../Bootstrap/JFS/jfs.h"
+
+//Operations measured by bench
+#define B_ERASE		0
+#define B_CREATEDIR	1
+#define B_CREATEPART	2
+#define B_ADDPART	3
+#define B_ADDENTRY	4
+#define B_GETBLOCK	5
+#define B_ADDBAD	6
+#define B_ADDTOEC	7
+#define B_FREEBLOCK	8
+#define B_FLUSH		9
+#define B_NROPS		10
+#define BENCHTOUCHMAX	4096		//Touched blocks remembered per call, more clears the whole map
+#define BENCHGETBLOCKS	64			//Blocks taken and given back by the bench
+#define SIMXFERUS	4000		//Simulated time to move one block over SPI, us
+#define SIMCPUFACTOR	2000		//Default 6309 time per host time for the code between SD calls
+#define SIMCMDUS	600			//Simulated time for a command: 6 bytes out, R1, access time, us
+#define SIMRAPROGUS	1500		//Default programming time for rabench, only the reads are timed
+
+//Block I/O of one jfs.c call, summed over all calls of that function
+struct s_benchop {
+	const char*	name;
+	long		calls;
+	long		reads;
+	long		writes;
+	long		distinct;		//Different blocks read or written per call, summed
+	long		maxreads;		//Worst single call
+	long		maxwrites;
+};
+
+//global variables////////////////////////////////////////////////////////////////////////
+static unsigned char BlockBuffer[512];
+int SDStat;
+FILE* Image;				//The image file, stands in for the SD card
+long ImageBlocks;			//Size of the image in blocks
+long StreamBlock;			//Next block of a CMD18/CMD25 stream
+long* BadBlocks;			//Blocks that do not keep what is written, for bench
+int NrBadBlocks;
+bool Benching;				//Count driver I/O
+long CrashAfter;			//Writes that reach the image before the power fails, 0 = no crash
+long CrashWrites;			//Writes seen since the crash test started its work
+bool WriteFails;			//Every write fails with SDWRTFAIL, for the cache check
+long StreamFailAt;			//A CMD25 stream fails once at this block, 0 = never
+int KeyAfter;				//checkkey() sees a key on this call, 0 = never
+bool SimWriteBehind;		//SDSetWriteBehind() state
+double SimProgUs;			//Simulated programming time per written block, 0 = no timing
+double SimCpuFactor=SIMCPUFACTOR;
+double SimNow;				//Simulated time, us
+double SimBusyUntil;		//Card programming ends at this time
+double SimWaitUs;			//Time spent waiting for the card
+struct timespec SimHost;	//Host time when the last SD call returned
+//end global variables////////////////////////////////////////////////////////////////////
+
+void fill_buffer(unsigned char buffer[], unsigned char value);
+void PrepCS(unsigned char CmdStructure[],unsigned char Cmd, long BlockNr);
+long CmdBlock(unsigned char CmdStructure[]);
+int ImageRead(long BlockNr, unsigned char Buffer[]);
+int ImageWrite(long BlockNr, unsigned char Buffer[]);
+bool OpenImage(char* name, long blocks);
+char* SplitPath(char* path, char* parent);
+int DoMkfs(char* size, bool bitmap);
+int DoMkpart(char letter, char* volname);
+int DoMkdir(char* path);
+int DoLs(char* path);
+int DoDf(bool verify);
+int DoFsck(bool fix);
+int DoDefrag(long passes);
+void DefragReport(char* when, struct s_defragstats* stats);
+int DoPut(char* hostfile, char* path);
+int DoGet(char* path, char* hostfile);
+int DoBench(char* size, int parts, int dirs, int bad, bool bitmap);
+int DoCrash(char* size, bool bitmap, bool nojournal);
+int DoRaBench(char* size, long kbytes, int frag);
+long RaMakeChain(char* name, long size, int frag);
+long RaMakeExtents(char* name, long size);
+void RaRead(FILE* report, char* file, long fileheader, bool naive, unsigned long expect);
+unsigned char RaByte(long offset);
+int DoWrBench(char* size, int files, bool bitmap);
+void WrRun(FILE* report, bool delayed, int files, bool bitmap);
+long WrExtents(long fileheader, long* blocks);
+int DoBoot(char* path, char* load, char* exec);
+int BootNaive(unsigned char Memory[], unsigned int* Exec);
+int DoBlk();
+int DoCrc();
+int CrcCheck(char* name, unsigned int expect, unsigned int got);
+int DoSpi();
+unsigned char WireXfer(unsigned char Mosi);
+void WireTake(unsigned char Mosi);
+void WireCommand();
+void WireSendBlock();
+void WireWritten();
+void WireQueue(unsigned char Value, int Count);
+void WireReset(bool clearcard);
+int DoCache(char* size);
+int CacheRun(FILE* report, bool journal);
+int FormatRun(FILE* report);
+int CacheCheck(FILE* report, char* name, bool journal, bool ok);
+long JournalTail();
+void CacheFill(long blocknr);
+void CrashRemount();
+const char* CrashCheck(bool* haspart, bool* hasdir);
+const char* CrashFreeMap(unsigned char* freemap);
+bool CrashIsFree(unsigned char* freemap, long blocknr);
+void SimEnter();
+void SimLeave();
+void SimSync();
+void SimCommand();
+long ParseSize(char* size);
+unsigned long BenchRandom();
+void BenchStart();
+void BenchStop(int op);
+void BenchTouch(long BlockNr);
+bool IsBadBlock(long BlockNr);
+void Usage();
+
+int main(int argc, char* argv[])
+{
+int Result, Arg, Frag;
+bool Bitmap, NoJournal;
+
+	jfsquiet=true;				//stdout carries the reports, no progress lines in them
+	if (argc==2 && strcmp(argv[1],"blk")==0) return DoBlk();
+	if (argc==2 && strcmp(argv[1],"crc")==0) return DoCrc();
+	if (argc==2 && strcmp(argv[1],"spi")==0) return DoSpi();
+	if (argc<3) Usage();
+	if (strcmp(argv[1],"bench")==0 && argc>=7) {
+		if (!OpenImage(argv[2],1)) return 1;
+		Bitmap=false;
+		for (Arg=7;Arg<argc;Arg++) {
+			if (strcmp(argv[Arg],"-b")==0) {
+				Bitmap=true;
+			} else if (strcmp(argv[Arg],"-j")==0) {
+				jfsjournal=true;
+			} else if (strcmp(argv[Arg],"-w")==0) {
+				SDSetWriteBehind(true);
+			} else if (strcmp(argv[Arg],"-p")==0 && Arg+1<argc) {
+				SimProgUs=atof(argv[++Arg]);
+			} else if (strcmp(argv[Arg],"-c")==0 && Arg+1<argc) {
+				SimCpuFactor=atof(argv[++Arg]);
+			} else {
+				Usage();
+			}
+		}
+		Result=DoBench(argv[3],atoi(argv[4]),atoi(argv[5]),atoi(argv[6]),Bitmap);
+	} else if (strcmp(argv[1],"crash")==0 && argc>=4) {
+		if (!OpenImage(argv[2],1)) return 1;
+		Bitmap=false;
+		NoJournal=false;
+		for (Arg=4;Arg<argc;Arg++) {
+			if (strcmp(argv[Arg],"-b")==0) {
+				Bitmap=true;
+			} else if (strcmp(argv[Arg],"-n")==0) {
+				NoJournal=true;
+			} else {
+				Usage();
+			}
+		}
+		jfsjournal=!NoJournal;
+		Result=DoCrash(argv[3],Bitmap,NoJournal);
+	} else if (strcmp(argv[1],"rabench")==0 && argc>=5) {
+		if (!OpenImage(argv[2],1)) return 1;
+		Frag=0;
+		SimProgUs=SIMRAPROGUS;
+		for (Arg=5;Arg<argc;Arg++) {
+			if (strcmp(argv[Arg],"-f")==0 && Arg+1<argc) {
+				Frag=atoi(argv[++Arg]);
+			} else if (strcmp(argv[Arg],"-p")==0 && Arg+1<argc) {
+				SimProgUs=atof(argv[++Arg]);
+			} else if (strcmp(argv[Arg],"-c")==0 && Arg+1<argc) {
+				SimCpuFactor=atof(argv[++Arg]);
+			} else {
+				Usage();
+			}
+		}
+		Result=DoRaBench(argv[3],atol(argv[4]),Frag);
+	} else if (strcmp(argv[1],"wrbench")==0 && argc>=5) {
+		if (!OpenImage(argv[2],1)) return 1;
+		Bitmap=false;
+		for (Arg=5;Arg<argc;Arg++) {
+			if (strcmp(argv[Arg],"-b")==0) {
+				Bitmap=true;
+			} else if (strcmp(argv[Arg],"-j")==0) {
+				jfsjournal=true;
+			} else {
+				Usage();
+			}
+		}
+		Result=DoWrBench(argv[3],atoi(argv[4]),Bitmap);
+	} else if (strcmp(argv[1],"cache")==0 && argc==4) {
+		if (!OpenImage(argv[2],1)) return 1;
+		jfsjournal=true;			//Checked with and without it
+		Result=DoCache(argv[3]);
+	} else if (strcmp(argv[1],"mkfs")==0 && argc>=4) {
+		if (!OpenImage(argv[2],1)) return 1;
+		Bitmap=false;
+		for (Arg=4;Arg<argc;Arg++) {
+			if (strcmp(argv[Arg],"-b")==0) {
+				Bitmap=true;
+			} else if (strcmp(argv[Arg],"-j")==0) {
+				jfsjournal=true;
+			} else {
+				Usage();
+			}
+		}
+		Result=DoMkfs(argv[3],Bitmap);
+	} else {
+		if (!OpenImage(argv[2],0)) return 1;
+		if (jfs_mount()==-2) {		//Replay what an interrupted run left in the journal
+			fprintf(stderr,"jfsimg: journal replay failed, run again to retry it\n");
+			fclose(Image);
+			return 1;
+		}
+		if (strcmp(argv[1],"mkpart")==0 && argc==5) {
+			Result=DoMkpart(argv[3][0],argv[4]);
+		} else if (strcmp(argv[1],"mkdir")==0 && argc==4) {
+			Result=DoMkdir(argv[3]);
+		} else if (strcmp(argv[1],"ls")==0) {
+			Result=DoLs(argc>3 ? argv[3] : "c:");
+		} else if (strcmp(argv[1],"df")==0) {
+			Result=DoDf(argc>3 && strcmp(argv[3],"-v")==0);
+		} else if (strcmp(argv[1],"fsck")==0) {
+			Result=DoFsck(argc>3 && strcmp(argv[3],"-f")==0);
+		} else if (strcmp(argv[1],"defrag")==0 && (argc==3 || (argc==5 && strcmp(argv[3],"-p")==0))) {
+			Result=DoDefrag(argc==5 ? atol(argv[4]) : 0);
+		} else if (strcmp(argv[1],"put")==0 && argc==5) {
+			Result=DoPut(argv[3],argv[4]);
+		} else if (strcmp(argv[1],"get")==0 && argc==5) {
+			Result=DoGet(argv[3],argv[4]);
+		} else if (strcmp(argv[1],"boot")==0 && (argc==3 || argc==4 || argc==6)) {
+			Result=DoBoot(argc>3 ? argv[3] : 0,argc==6 ? argv[4] : 0,argc==6 ? argv[5] : 0);
+		} else {
+			Usage();
+		}
+	}
+	if (jfs_unmount()!=SDRDY) Result=1;	//Nothing may stay behind in the block cache or the journal
+	fclose(Image);
+	printf("\n");
+	return Result;
+}
+
+void Usage()
+{
+	fprintf(stderr,"usage: jfsimg mkfs  <image> <size>[K|M|G] [-b] [-j]\n");
+	fprintf(stderr,"       jfsimg mkpart <image> <letter> <volname>\n");
+	fprintf(stderr,"       jfsimg mkdir <image> <path>\n");
+	fprintf(stderr,"       jfsimg ls    <image> [path]\n");
+	fprintf(stderr,"       jfsimg df    <image> [-v]\n");
+	fprintf(stderr,"       jfsimg fsck  <image> [-f]\n");
+	fprintf(stderr,"       jfsimg defrag <image> [-p passes]\n");
+	fprintf(stderr,"       jfsimg put   <image> <hostfile> <path>\n");
+	fprintf(stderr,"       jfsimg get   <image> <path> <hostfile>\n");
+	fprintf(stderr,"       jfsimg bench <image> <size> <parts> <dirs> <bad> [-b] [-j] [-w] [-p us] [-c factor]\n");
+	fprintf(stderr,"       jfsimg crash <image> <size> [-b] [-n]\n");
+	fprintf(stderr,"       jfsimg rabench <image> <size> <kbytes> [-f percent] [-p us] [-c factor]\n");
+	fprintf(stderr,"       jfsimg wrbench <image> <size> <files> [-b] [-j]\n");
+	fprintf(stderr,"       jfsimg boot  <image> [<path> <load> <exec>]\n");
+	fprintf(stderr,"       jfsimg blk\n");
+	fprintf(stderr,"       jfsimg crc\n");
+	fprintf(stderr,"       jfsimg spi\n");
+	fprintf(stderr,"       jfsimg cache <image> <size>\n");
+	exit(2);
+}
+
+//
+// Commands
+//
+
+int DoMkfs(char* size, bool bitmap)
+{
+	ImageBlocks=ParseSize(size);
+	if (ImageBlocks<=A_FIRSTDATA+BMBITSPERBLK/8) {
+		fprintf(stderr,"jfsimg: image too small\n");
+		return 1;
+	}
+	if (ftruncate(fileno(Image),(off_t)ImageBlocks*SDBlockSize)!=0) {
+		perror("jfsimg");
+		return 1;
+	}
+	SDCardTotalBlocks=JDOS_erase(ImageBlocks-1,bitmap ? FMT_BITMAP : FMT_STREAM);
+	printf("\nTotal # blocks intialized: %ld",SDCardTotalBlocks);
+	return SDCardTotalBlocks!=0 ? 0 : 1;
+}
+
+int DoMkpart(char letter, char* volname)
+{
+long RootDir, PartHdr;
+
+	if (part_lookup(letter)!=0) {
+		fprintf(stderr,"jfsimg: drive %c: exists\n",letter);
+		return 1;
+	}
+	if ((RootDir=createDir("/",NOATTRIB,NOPARENT))==0 ||
+	    (PartHdr=createPartition(letter,volname,NOTBOOTABLE,RootDir))==0 ||
+	    addpart(PartHdr)==0) {
+		fprintf(stderr,"jfsimg: can not create partition (%d)\n",jfcstatus);
+		return 1;
+	}
+	return 0;
+}
+
+int DoMkdir(char* path)
+{
+char Parent[256];
+char* Name;
+long ParentDir, NewDir;
+
+	Name=SplitPath(path,Parent);
+	if ((ParentDir=jfs_path(Parent))==0) {
+		fprintf(stderr,"jfsimg: %s not found\n",Parent);
+		return 1;
+	}
+	if (jfs_lookup(ParentDir,Name)!=0) {
+		fprintf(stderr,"jfsimg: %s exists\n",path);
+		return 1;
+	}
+	if ((NewDir=createDir(Name,AT_WRITEABLE,ParentDir))==0 ||
+	    !dir_addentry(ParentDir,NewDir,Name,T_DIRHDR,AT_WRITEABLE)) {
+		fprintf(stderr,"jfsimg: can not create %s (%d)\n",path,jfcstatus);
+		return 1;
+	}
+	return 0;
+}
+
+int DoLs(char* path)
+{
+long Dir;
+
+	if ((Dir=jfs_path(path))==0) {
+		fprintf(stderr,"jfsimg: %s not found\n",path);
+		return 1;
+	}
+	dir_list(Dir,true);
+	return 0;
+}
+
+int DoDf(bool verify)
+{
+struct s_jfsusage Usage;
+long Wrong;
+
+	if (verify) {
+		Wrong=jfs_verifycounts(false);
+		if (Wrong<0) {
+			fprintf(stderr,"jfsimg: free space structure broken\n");
+			return 1;
+		}
+		printf("%ld counter(s) wrong or missing\n",Wrong);
+		if (Wrong!=0) return 1;
+	}
+	if (!jfs_usage(&Usage)) {
+		fprintf(stderr,"jfsimg: no usage counters, df -v counts the chain\n");
+		return 1;
+	}
+	printf("%s blocks=%ld used=%ld free=%ld bad=%ld",Usage.alloctype==T_BITMAPHDR ? "bitmap" : "chain",
+		Usage.totalblocks,Usage.nrused,Usage.nrfree,Usage.nrbad);
+	if (Usage.alloctype==T_EMPTYHDR) printf(" headrun=%ld",Usage.headrun);
+	return 0;
+}
+
+int DoFsck(bool fix)
+{
+struct s_fsckstats Fsck;
+long Problems;
+
+	if ((Problems=jfs_fsck(fix,&Fsck))<0) {
+		fprintf(stderr,"jfsimg: can not check this image (%d)\n",jfcstatus);
+		return 1;
+	}
+	printf("\nblocks=%ld used=%ld free=%ld bad=%ld read=%ld",Fsck.blocks,Fsck.used,Fsck.free,Fsck.bad,Fsck.reads);
+	printf("\nlost=%ld orphans=%ld doubles=%ld badlinks=%ld badentries=%ld badcounts=%ld fixed=%ld",
+		Fsck.lost,Fsck.orphans,Fsck.doubles,Fsck.badlinks,Fsck.badentries,Fsck.badcounts,Fsck.fixed);
+	return Problems!=0;
+}
+
+int DoDefrag(long passes)
+{
+struct s_defragstats Stats;
+struct s_fsckstats Fsck;
+long Result;
+
+	if (!jfs_fragstats(&Stats)) {
+		fprintf(stderr,"jfsimg: no file system on this image\n");
+		return 1;
+	}
+	DefragReport("before",&Stats);
+	if ((Result=jfs_defrag(passes,&Stats))<0) {
+		fprintf(stderr,"\njfsimg: defrag stopped (%d)\n",jfcstatus);
+		return 1;
+	}
+	printf("\nmoved=%ld copied=%ld nospace=%ld passes=%ld%s",Stats.moved,Stats.copied,Stats.nospace,Stats.passes,
+		Result==1 ? ", chain sort not finished, run again" : "");
+	jfs_fragstats(&Stats);
+	DefragReport("after",&Stats);
+	if (jfs_fsck(false,&Fsck)<0) {
+		printf("\nnot checked (%d)",jfcstatus);	//Larger than jfs_fsck() maps
+		return 0;
+	}
+	if (Fsck.doubles+Fsck.badlinks+Fsck.badentries+Fsck.badcounts!=0) {
+		fprintf(stderr,"\njfsimg: check after defrag failed, doubles=%ld badlinks=%ld badentries=%ld badcounts=%ld\n",
+			Fsck.doubles,Fsck.badlinks,Fsck.badentries,Fsck.badcounts);
+		return 1;
+	}
+	printf("\ncheck ok, lost=%ld",Fsck.lost);	//Lost blocks are older, the chain sort takes them in
+	return 0;
+}
+
+void DefragReport(char* when, struct s_defragstats* stats)
+{
+	printf("\n%-6s objects=%ld blocks=%ld fragmented=%ld runs=%ld free=%ld freeruns=%ld",when,
+		stats->objects,stats->blocks,stats->fragmented,stats->runs,stats->freeblocks,stats->freeruns);
+}
+
+int DoPut(char* hostfile, char* path)
+{
+FILE* Host;
+char Parent[256];
+char* Name;
+unsigned char Data[4096];
+long ParentDir, Size;
+int Handle, Count;
+bool Ok;
+
+	Name=SplitPath(path,Parent);
+	if ((ParentDir=jfs_path(Parent))==0) {
+		fprintf(stderr,"jfsimg: %s not found\n",Parent);
+		return 1;
+	}
+	if (jfs_lookup(ParentDir,Name)!=0) {
+		fprintf(stderr,"jfsimg: %s exists\n",path);
+		return 1;
+	}
+	if ((Host=fopen(hostfile,"rb"))==NULL) {
+		perror(hostfile);
+		return 1;
+	}
+	fseeko(Host,0,SEEK_END);
+	Size=(long)ftello(Host);
+	rewind(Host);
+	if ((Handle=jfs_create(ParentDir,Name,AT_WRITEABLE,Size))<0) {
+		fprintf(stderr,"jfsimg: no room for %s (%d)\n",path,jfcstatus);
+		fclose(Host);
+		return 1;
+	}
+	Ok=true;
+	while (Ok && (Count=(int)fread(Data,1,sizeof(Data),Host))>0) Ok=(jfs_write(Handle,Data,Count)==Count);
+	if (!jfs_close(Handle)) Ok=false;
+	fclose(Host);
+	if (!Ok) {
+		fprintf(stderr,"jfsimg: can not write %s\n",path);
+		return 1;
+	}
+	return 0;
+}
+
+int DoGet(char* path, char* hostfile)
+{
+FILE* Host;
+unsigned char Data[4096];
+long FileHdr;
+int Handle, Count;
+
+	if ((FileHdr=jfs_path(path))==0 || (Handle=jfs_open(FileHdr))<0) {
+		fprintf(stderr,"jfsimg: %s not found\n",path);
+		return 1;
+	}
+	if ((Host=fopen(hostfile,"wb"))==NULL) {
+		perror(hostfile);
+		jfs_close(Handle);
+		return 1;
+	}
+	while ((Count=jfs_read(Handle,Data,sizeof(Data)))>0) fwrite(Data,1,Count,Host);
+	jfs_close(Handle);
+	fclose(Host);
+	if (Count<0) {
+		fprintf(stderr,"jfsimg: read error in %s\n",path);
+		return 1;
+	}
+	return 0;
+}
+
+//
+// Benchmark
+//
+// The workload only depends on its parameters, so two builds of jfs.c can be
+// compared on the CSV alone. Reads and writes are SD card commands as seen by
+// the driver, so they include block cache effects: a writeback of an evicted
+// block counts for the call that caused the eviction.
+//
+
+struct s_benchop BenchOps[B_NROPS]={
+	{"JDOS_erase",      0,0,0,0,0,0},
+	{"createDir",       0,0,0,0,0,0},
+	{"createPartition", 0,0,0,0,0,0},
+	{"addpart",         0,0,0,0,0,0},
+	{"dir_addentry",    0,0,0,0,0,0},
+	{"getblock",        0,0,0,0,0,0},
+	{"add_bad_block",   0,0,0,0,0,0},
+	{"add_to_ec",       0,0,0,0,0,0},
+	{"freeblock",       0,0,0,0,0,0},
+	{"jfs_flush",       0,0,0,0,0,0}
+};
+unsigned long BenchSeed=1;
+long BenchReads, BenchWrites, BenchDistinct;
+unsigned char* Touched;		//Bitmap of blocks touched by the current call
+long TouchList[BENCHTOUCHMAX];
+long NrTouched;
+
+int DoBench(char* size, int parts, int dirs, int bad, bool bitmap)
+{
+FILE* Report;
+long* Dirs;
+long Blocks[BENCHGETBLOCKS];
+struct sdstats DriverStats;
+long RootDir, PartHdr, Total[3];
+int NrDirs, Index, Op;
+char Name[33];
+
+	ImageBlocks=ParseSize(size);
+	if (ImageBlocks<=A_FIRSTDATA+BMBITSPERBLK/8 || ftruncate(fileno(Image),0)!=0 ||	//Nothing left of an earlier run
+	    ftruncate(fileno(Image),(off_t)ImageBlocks*SDBlockSize)!=0) {
+		fprintf(stderr,"jfsimg: can not size image\n");
+		return 1;
+	}
+	if (parts<1) parts=1;
+	if (parts>MAXPARTS) parts=MAXPARTS;
+	if (bad>JFSMAXBAD-BENCHGETBLOCKS) bad=JFSMAXBAD-BENCHGETBLOCKS;
+	if (bad>BENCHGETBLOCKS) bad=BENCHGETBLOCKS;
+	Report=fdopen(dup(fileno(stdout)),"w");	//jfs.c talks on stdout, only the report goes there
+	freopen("/dev/null","w",stdout);
+	Touched=calloc((ImageBlocks+7)/8,1);
+	Dirs=malloc(sizeof(long)*(parts+dirs));
+	BadBlocks=malloc(sizeof(long)*(bad+1));
+
+	NrBadBlocks=0;						//Factory defects, found by the format
+	if (!bitmap) {
+		while (NrBadBlocks<bad) BadBlocks[NrBadBlocks++]=A_FIRSTDATA+16+(long)(BenchRandom()%(ImageBlocks-A_FIRSTDATA-16));
+	}
+	Benching=true;
+	SimLeave();
+	BenchStart(); SDCardTotalBlocks=JDOS_erase(ImageBlocks-1,bitmap ? FMT_BITMAP : FMT_STREAM); BenchStop(B_ERASE);
+
+	Dirs[0]=part_lookup('c');
+	for (NrDirs=1;NrDirs<parts;NrDirs++) {		//Partition d:, e:...
+		BenchStart(); RootDir=createDir("/",NOATTRIB,NOPARENT); BenchStop(B_CREATEDIR);
+		BenchStart(); PartHdr=createPartition('c'+NrDirs,"Bench",NOTBOOTABLE,RootDir); BenchStop(B_CREATEPART);
+		BenchStart(); addpart(PartHdr); BenchStop(B_ADDPART);
+		Dirs[NrDirs]=RootDir;
+	}
+	for (Index=0;Index<dirs;Index++) {			//Dirs under a random earlier dir
+		sprintf(Name,"dir%04d",Index);
+		RootDir=Dirs[BenchRandom()%NrDirs];
+		BenchStart(); Dirs[NrDirs]=createDir(Name,AT_WRITEABLE,RootDir); BenchStop(B_CREATEDIR);
+		if (Dirs[NrDirs]==0) break;
+		BenchStart(); dir_addentry(RootDir,Dirs[NrDirs],Name,T_DIRHDR,AT_WRITEABLE); BenchStop(B_ADDENTRY);
+		NrDirs++;
+	}
+	for (Index=0;Index<BENCHGETBLOCKS;Index++) {
+		BenchStart(); Blocks[Index]=getblock(); BenchStop(B_GETBLOCK);
+	}
+	for (Index=0;Index<bad;Index++) {			//Grown defects in blocks just taken
+		BenchStart(); add_bad_block(Blocks[Index]); BenchStop(B_ADDBAD);
+	}
+	for (Index=bad;Index<BENCHGETBLOCKS;Index++) {
+		if (Blocks[Index]==0) continue;
+		if (bitmap) {
+			BenchStart(); freeblock(Blocks[Index]); BenchStop(B_FREEBLOCK);
+		} else {
+			BenchStart(); add_to_ec(Blocks[Index]); BenchStop(B_ADDTOEC);
+		}
+	}
+	BenchStart(); jfs_flush(); BenchStop(B_FLUSH);
+	Benching=false;
+
+	fprintf(Report,"# jfsimg bench blocks=%ld mode=%s journal=%s parts=%d dirs=%d bad=%d formatted=%ld\n",
+		ImageBlocks,bitmap ? "bitmap" : "chain",jfsjournal ? "yes" : "no",parts,NrDirs-parts,bad,SDCardTotalBlocks);
+	if (SimProgUs>0) {
+		fprintf(Report,"# sim prog_us=%.0f xfer_us=%d cpu_factor=%.0f writebehind=%d time_ms=%.1f busywait_ms=%.1f\n",
+			SimProgUs,SIMXFERUS,SimCpuFactor,SimWriteBehind,SimNow/1000,SimWaitUs/1000);
+	}
+	fprintf(Report,"op,calls,reads,writes,distinct,maxreads,maxwrites\n");
+	Total[0]=Total[1]=Total[2]=0;
+	for (Op=0;Op<B_NROPS;Op++) {
+		if (BenchOps[Op].calls==0) continue;
+		fprintf(Report,"%s,%ld,%ld,%ld,%ld,%ld,%ld\n",BenchOps[Op].name,BenchOps[Op].calls,BenchOps[Op].reads,
+			BenchOps[Op].writes,BenchOps[Op].distinct,BenchOps[Op].maxreads,BenchOps[Op].maxwrites);
+		Total[0]+=BenchOps[Op].reads;
+		Total[1]+=BenchOps[Op].writes;
+		Total[2]+=BenchOps[Op].distinct;
+	}
+	fprintf(Report,"total,,%ld,%ld,%ld,,\n",Total[0],Total[1],Total[2]);
+	SDStatsSnapshot(&DriverStats);				//Driver view of the same run, as comments
+	for (Op=0;Op<SDC_NRCMDS;Op++) {
+		if (DriverStats.cmd[Op].calls==0) continue;
+		fprintf(Report,"# sd cmd=%d calls=%lu blocks=%lu ok=%u\n",Op,DriverStats.cmd[Op].calls,
+			DriverStats.cmd[Op].blocks,DriverStats.cmd[Op].status[SDRDY]);
+	}
+	fclose(Report);
+	free(Dirs);
+	free(Touched);
+	return 0;
+}
+
+// Deterministic pseudo random numbers, the same on every host.
+unsigned long BenchRandom()
+{
+	BenchSeed=(BenchSeed*1103515245UL+12345UL)&0xFFFFFFFFUL;
+	return BenchSeed>>8;
+}
+
+void BenchStart()
+{
+long Index;
+
+	if (NrTouched>BENCHTOUCHMAX) {
+		memset(Touched,0,(ImageBlocks+7)/8);
+	} else {
+		for (Index=0;Index<NrTouched;Index++) Touched[TouchList[Index]>>3]=0;
+	}
+	NrTouched=0;
+	BenchReads=BenchWrites=BenchDistinct=0;
+}
+
+void BenchStop(int op)
+{
+struct s_benchop* Op;
+
+	Op=&BenchOps[op];
+	Op->calls++;
+	Op->reads+=BenchReads;
+	Op->writes+=BenchWrites;
+	Op->distinct+=BenchDistinct;
+	if (BenchReads>Op->maxreads) Op->maxreads=BenchReads;
+	if (BenchWrites>Op->maxwrites) Op->maxwrites=BenchWrites;
+}
+
+void BenchTouch(long BlockNr)
+{
+	if (Touched[BlockNr>>3]&(1<<(BlockNr&7))) return;
+	Touched[BlockNr>>3]|=1<<(BlockNr&7);
+	if (NrTouched<BENCHTOUCHMAX) TouchList[NrTouched]=BlockNr;
+	NrTouched++;
+	BenchDistinct++;
+}
+
+//
+// Card timing for bench -p. Time between SD calls is host CPU time scaled by
+// SimCpuFactor, every block transfer takes SIMXFERUS, and a written block
+// keeps the card busy for SimProgUs. A command that finds the card busy
+// waits, which is where write-behind saves time.
+//
+void SimEnter()
+{
+struct timespec Now;
+
+	if (SimProgUs<=0 || !Benching) return;
+	clock_gettime(CLOCK_MONOTONIC,&Now);
+	SimNow+=((Now.tv_sec-SimHost.tv_sec)*1e6+(Now.tv_nsec-SimHost.tv_nsec)/1e3)*SimCpuFactor;
+}
+
+void SimLeave()
+{
+	if (SimProgUs>0) clock_gettime(CLOCK_MONOTONIC,&SimHost);
+}
+
+void SimSync()
+{
+	SimEnter();
+	if (SimNow<SimBusyUntil) {
+		SimWaitUs+=SimBusyUntil-SimNow;
+		SimNow=SimBusyUntil;
+	}
+	SimLeave();
+}
+
+// Every command costs SIMCMDUS on top of its data transfer.
+void SimCommand()
+{
+	if (SimProgUs>0 && Benching) SimNow+=SIMCMDUS;
+}
+
+bool IsBadBlock(long BlockNr)
+{
+int Index;
+
+	for (Index=0;Index<NrBadBlocks;Index++) {
+		if (BadBlocks[Index]==BlockNr) return true;
+	}
+	return false;
+}
+
+//
+// Crash test
+//
+// The image is formatted once and kept in memory. For every crash point the
+// image is restored, a mkpart and a mkdir are run with only the first
+// CrashAfter writes reaching the image, then the card is mounted again as
+// after a power cycle and checked. The run ends with the first crash point
+// the work survives completely. One CSV line per crash point on stdout.
+//
+
+int DoCrash(char* size, bool bitmap, bool nojournal)
+{
+FILE* Report;
+unsigned char* Base;
+const char* Verdict;
+bool HasPart, HasDir, Done;
+long Point, Consistent, Corrupt;
+
+	ImageBlocks=ParseSize(size);
+	if (ImageBlocks<=A_FIRSTDATA+JLBLOCKS+BMBITSPERBLK/8 || ftruncate(fileno(Image),0)!=0 ||
+	    ftruncate(fileno(Image),(off_t)ImageBlocks*SDBlockSize)!=0) {
+		fprintf(stderr,"jfsimg: can not size image\n");
+		return 1;
+	}
+	Report=fdopen(dup(fileno(stdout)),"w");	//jfs.c talks on stdout, only the report goes there
+	freopen("/dev/null","w",stdout);
+	SDCardTotalBlocks=JDOS_erase(ImageBlocks-1,bitmap ? FMT_BITMAP : FMT_STREAM);	//With a journal unless -n
+	jfs_unmount();
+	Base=malloc((size_t)ImageBlocks*SDBlockSize);
+	fseeko(Image,0,SEEK_SET);
+	if (Base==NULL || fread(Base,SDBlockSize,ImageBlocks,Image)!=(size_t)ImageBlocks) {
+		fprintf(stderr,"jfsimg: can not read image\n");
+		return 1;
+	}
+
+	fprintf(Report,"writes,d:,c:/crash,verdict\n");
+	Consistent=Corrupt=0;
+	Done=false;
+	for (Point=1;!Done;Point++) {
+		fseeko(Image,0,SEEK_SET);
+		fwrite(Base,SDBlockSize,ImageBlocks,Image);
+		CrashRemount();
+		CrashAfter=Point;
+		CrashWrites=0;
+		DoMkpart('d',"Crash");
+		DoMkdir("c:/crash");
+		jfs_unmount();
+		Done=CrashWrites<=CrashAfter;		//Everything reached the image
+		CrashAfter=0;
+		CrashRemount();					//Power back: replay
+		Verdict=CrashCheck(&HasPart,&HasDir);
+		fprintf(Report,"%ld,%s,%s,%s\n",Point,HasPart ? "yes" : "no",HasDir ? "yes" : "no",Verdict==NULL ? "ok" : Verdict);
+		if (Verdict==NULL) Consistent++; else Corrupt++;
+	}
+	fprintf(Report,"# jfsimg crash blocks=%ld mode=%s journal=%s points=%ld consistent=%ld corrupt=%ld\n",
+		ImageBlocks,bitmap ? "bitmap" : "chain",nojournal ? "no" : "yes",Point-1,Consistent,Corrupt);
+	fclose(Report);
+	free(Base);
+	return Corrupt!=0;
+}
+
+// Power cycle: the cache, the dentry cache and the journal state are RAM.
+void CrashRemount()
+{
+	jfs_cacheinit();
+	dcache_init();
+	forget_bad_blocks();
+	jfs_mount();
+}
+
+// Every partition header and root dir in the partmap, and c:/crash if it
+// exists, must be intact and allocated; the free space structure must be
+// sound and jfs_fsck() must find no damage. Returns what is wrong, or NULL.
+const char* CrashCheck(bool* haspart, bool* hasdir)
+{
+struct s_fsckstats Fsck;
+unsigned char* FreeMap;
+const char* Verdict;
+struct s_partmap PartMap;
+long PartHdr, RootDir, Dir;
+int Part;
+
+	*haspart=*hasdir=false;
+	FreeMap=calloc((ImageBlocks+7)/8,1);
+	if ((Verdict=CrashFreeMap(FreeMap))!=NULL) {
+		free(FreeMap);
+		return Verdict;
+	}
+	readblock(A_PARTMAP);
+	memcpy(&PartMap,BlockBuffer,sizeof(PartMap));
+	for (Part=0;Part<PartMap.no_parts && Part<MAXPARTS && Verdict==NULL;Part++) {
+		PartHdr=PartMap.parthdr[Part];
+		if (PartHdr<A_FIRSTDATA || PartHdr>=ImageBlocks || readblock(PartHdr)!=SDRDY ||
+		    BlockBuffer[0]!=T_PARTHDR || CrashIsFree(FreeMap,PartHdr)) {
+			Verdict="partition header lost";
+			break;
+		}
+		if (((struct s_parth*)BlockBuffer)->driveletter=='d') *haspart=true;
+		RootDir=((struct s_parth*)BlockBuffer)->rootdir;
+		if (RootDir<A_FIRSTDATA || RootDir>=ImageBlocks || readblock(RootDir)!=SDRDY ||
+		    BlockBuffer[0]!=T_DIRHDR || CrashIsFree(FreeMap,RootDir)) Verdict="root dir lost";
+	}
+	if (Verdict==NULL && jfs_verifycounts(false)!=0) Verdict="free space counters wrong";
+	if (Verdict==NULL && (jfs_fsck(false,&Fsck)<0 || Fsck.doubles+Fsck.badlinks+Fsck.badentries!=0)) {
+		Verdict="fsck finds damage";	//Lost blocks are not: a crash between two transactions leaks them
+	}
+	if (Verdict==NULL && (Dir=jfs_path("c:/crash"))!=0) {
+		*hasdir=true;
+		if (readblock(Dir)!=SDRDY || BlockBuffer[0]!=T_DIRHDR || CrashIsFree(FreeMap,Dir)) Verdict="c:/crash lost";
+	}
+	free(FreeMap);
+	return Verdict;
+}
+
+// Set a bit per free block: the empty chain is walked and must be linked
+// both ways and end at last_eb; a bitmap must agree with its free count.
+const char* CrashFreeMap(unsigned char* freemap)
+{
+struct s_emptyhdr* EHdr;
+struct s_bitmaph* BHdr;
+struct s_eblock* EBlock;
+long BlockNr, Prev, Last, Count, NrFree, BmBlock;
+
+	if (readblock(A_EMPTYCHN)!=SDRDY) return "allocator header unreadable";
+	if (BlockBuffer[0]==T_BITMAPHDR) {
+		BHdr=(struct s_bitmaph*)BlockBuffer;
+		BmBlock=BHdr->firstbmblock;
+		Count=BHdr->totalblocks;
+		NrFree=BHdr->nrfree;
+		if (Count>ImageBlocks) return "bitmap header damaged";
+		for (BlockNr=0;BlockNr<Count;BlockNr++) {
+			if ((BlockNr&(BMBITSPERBLK-1))==0 && readblock(BmBlock+(BlockNr>>BMBITSHIFT))!=SDRDY) return "bitmap unreadable";
+			if ((BlockBuffer[(BlockNr&(BMBITSPERBLK-1))>>3]&(0x80>>(BlockNr&7)))==0) {
+				freemap[BlockNr>>3]|=1<<(BlockNr&7);
+				NrFree--;
+			}
+		}
+		return NrFree==0 ? NULL : "free count does not match bitmap";
+	}
+	EHdr=(struct s_emptyhdr*)BlockBuffer;
+	BlockNr=EHdr->first_eb;
+	Last=EHdr->last_eb;
+	Prev=0;
+	for (Count=0;BlockNr!=0;Count++) {
+		if (Count>=ImageBlocks || BlockNr<A_FIRSTDATA || BlockNr>=ImageBlocks) return "empty chain broken";
+		if (readblock(BlockNr)!=SDRDY || BlockBuffer[0]!=T_EMPTYBLK) return "empty chain holds a used block";
+		EBlock=(struct s_eblock*)BlockBuffer;
+		if (EBlock->prev_eb!=Prev) return "empty chain back link wrong";
+		freemap[BlockNr>>3]|=1<<(BlockNr&7);
+		Prev=BlockNr;
+		BlockNr=EBlock->next_eb;
+	}
+	return Prev==Last ? NULL : "empty chain tail wrong";
+}
+
+bool CrashIsFree(unsigned char* freemap, long blocknr)
+{
+	return (freemap[blocknr>>3]&(1<<(blocknr&7)))!=0;
+}
+
+//
+// Read-ahead benchmark
+//
+// A chained file and an extent file with the same contents are written to a
+// fresh bitmap image. Each is then read from a cold cache, once block by
+// block with readblock() as a program would without jfs_read(), and once
+// with jfs_read(). Only the reads are timed. -f makes that percentage of the
+// chain links jump over a block, so the chain is no longer consecutive.
+//
+
+int DoRaBench(char* size, long kbytes, int frag)
+{
+FILE* Report;
+long Chain, Extents, Bytes;
+unsigned long Expect;
+long Offset;
+
+	ImageBlocks=ParseSize(size);
+	Bytes=kbytes*1024;
+	if (ImageBlocks<=A_FIRSTDATA+JLBLOCKS+BMBITSPERBLK/8+4*(Bytes/SDBlockSize) || ftruncate(fileno(Image),0)!=0 ||
+	    ftruncate(fileno(Image),(off_t)ImageBlocks*SDBlockSize)!=0) {
+		fprintf(stderr,"jfsimg: can not size image\n");
+		return 1;
+	}
+	Report=fdopen(dup(fileno(stdout)),"w");	//jfs.c talks on stdout, only the report goes there
+	freopen("/dev/null","w",stdout);
+	Touched=calloc((ImageBlocks+7)/8,1);		//Read counts go through BenchTouch()
+	SDCardTotalBlocks=JDOS_erase(ImageBlocks-1,FMT_BITMAP);
+	if ((Chain=RaMakeChain("chain",Bytes,frag))==0 || (Extents=RaMakeExtents("extents",Bytes))==0) {
+		fprintf(stderr,"jfsimg: can not write the test files (%d)\n",jfcstatus);
+		fclose(Report);
+		return 1;
+	}
+	jfs_unmount();							//Everything home, the journal empty
+	Expect=0;
+	for (Offset=0;Offset<Bytes;Offset++) Expect=Expect*31+RaByte(Offset);
+
+	fprintf(Report,"# jfsimg rabench blocks=%ld bytes=%ld frag=%d window=%d cmd_us=%d xfer_us=%d cpu_factor=%.0f\n",
+		ImageBlocks,Bytes,frag,JFSRABLOCKS,SIMCMDUS,SIMXFERUS,SimCpuFactor);
+	fprintf(Report,"file,method,commands,blocks,time_ms,kbytes_s,data\n");
+	RaRead(Report,"chain",Chain,true,Expect);
+	RaRead(Report,"chain",Chain,false,Expect);
+	RaRead(Report,"extents",Extents,true,Expect);
+	RaRead(Report,"extents",Extents,false,Expect);
+	fclose(Report);
+	free(Touched);
+	return 0;
+}
+
+// Chained file of (size) bytes in c:, (frag) percent of the links skip a block.
+long RaMakeChain(char* name, long size, int frag)
+{
+struct s_fileh* Hdr;
+struct s_filex* Ext;
+long* Blocks;
+long NrBlocks, Index, Offset, Count;
+
+	NrBlocks=1;
+	if (size>FHMAXBYTES) NrBlocks+=(size-FHMAXBYTES+FEMAXBYTES-1)/FEMAXBYTES;
+	Blocks=malloc(sizeof(long)*NrBlocks);
+	for (Index=0;Index<NrBlocks;Index++) {
+		if (Index>0 && (long)(BenchRandom()%100)<frag) getblock();	//Left allocated: a hole in the chain
+		if ((Blocks[Index]=getblock())==0) {
+			free(Blocks);
+			return 0;
+		}
+	}
+	Offset=0;
+	for (Index=0;Index<NrBlocks;Index++) {
+		fill_buffer(BlockBuffer,0);
+		if (Index==0) {
+			Hdr=(struct s_fileh*)BlockBuffer;
+			Hdr->blocktype=T_FILEHDR;
+			Hdr->attributes=AT_WRITEABLE;
+			strcpy(Hdr->filename,name);
+			Hdr->filesize=size;
+			Hdr->nextblock=NrBlocks>1 ? Blocks[1] : 0;
+			for (Count=0;Count<FHMAXBYTES && Offset<size;Count++) Hdr->data[Count]=RaByte(Offset++);
+		} else {
+			Ext=(struct s_filex*)BlockBuffer;
+			Ext->blocktype=T_FILEEXT;
+			Ext->prevblock=Blocks[Index-1];
+			Ext->nextblock=Index+1<NrBlocks ? Blocks[Index+1] : 0;
+			for (Count=0;Count<FEMAXBYTES && Offset<size;Count++) Ext->data[Count]=RaByte(Offset++);
+		}
+		writeblock(Blocks[Index]);
+	}
+	Index=Blocks[0];
+	free(Blocks);
+	if (!dir_addentry(part_lookup('c'),Index,name,T_FILEHDR,AT_WRITEABLE)) return 0;
+	return Index;
+}
+
+// Extent file of (size) bytes in c:, same contents as the chained one.
+long RaMakeExtents(char* name, long size)
+{
+long FileHdr, Offset, BlockNr;
+int BlockOffset, Count;
+
+	if ((FileHdr=createFile(name,AT_WRITEABLE,size))==0) return 0;
+	for (Offset=0;Offset<size;Offset+=SDBlockSize) {
+		if ((BlockNr=file_bmap(FileHdr,Offset,&BlockOffset))==0) return 0;
+		fill_buffer(BlockBuffer,0);
+		for (Count=0;Count<SDBlockSize && Offset+Count<size;Count++) BlockBuffer[Count]=RaByte(Offset+Count);
+		writeblock(BlockNr);
+	}
+	if (!dir_addentry(part_lookup('c'),FileHdr,name,T_FILEXHDR,AT_WRITEABLE)) return 0;
+	return FileHdr;
+}
+
+// Read a whole file from a cold cache and report one CSV line.
+void RaRead(FILE* report, char* file, long fileheader, bool naive, unsigned long expect)
+{
+struct sdstats DriverStats;
+unsigned char Data[SDBlockSize];
+unsigned long Sum;
+long Size, Offset, BlockNr, Got;
+int BlockOffset, Count, Index, Handle;
+double Start;
+
+	jfs_cacheinit();						//Cold: nothing of the file cached
+	dcache_init();
+	jfs_mount();
+	readblock(fileheader);
+	Size=(BlockBuffer[0]==T_FILEHDR) ? ((struct s_fileh*)BlockBuffer)->filesize : ((struct s_filexh*)BlockBuffer)->filesize;
+	jfs_cacheinit();
+	jfs_mount();
+	SDStatsReset();
+	Sum=0;
+	Got=0;
+	Start=SimNow;
+	Benching=true;
+	SimLeave();
+	if (!naive) {
+		if ((Handle=jfs_open(fileheader))>=0) {
+			while ((Count=jfs_read(Handle,Data,SDBlockSize))>0) {
+				for (Index=0;Index<Count;Index++) Sum=Sum*31+Data[Index];
+				Got+=Count;
+			}
+			jfs_close(Handle);
+		}
+	} else if (BlockBuffer[0]==T_FILEHDR) {		//Follow the chain one readblock() at a time
+		BlockNr=fileheader;
+		Offset=SDBlockSize-FHMAXBYTES;
+		while (BlockNr!=0 && Got<Size && readblock(BlockNr)==SDRDY) {
+			for (Index=(int)Offset;Index<SDBlockSize && Got<Size;Index++,Got++) Sum=Sum*31+BlockBuffer[Index];
+			BlockNr=(BlockBuffer[0]==T_FILEHDR) ? ((struct s_fileh*)BlockBuffer)->nextblock : ((struct s_filex*)BlockBuffer)->nextblock;
+			Offset=SDBlockSize-FEMAXBYTES;
+		}
+	} else {								//file_bmap() and readblock() per block
+		for (Offset=0;Offset<Size;Offset+=SDBlockSize) {
+			if ((BlockNr=file_bmap(fileheader,Offset,&BlockOffset))==0 || readblock(BlockNr)!=SDRDY) break;
+			for (Index=0;Index<SDBlockSize && Got<Size;Index++,Got++) Sum=Sum*31+BlockBuffer[Index];
+		}
+	}
+	SimEnter();
+	Benching=false;
+	SDStatsSnapshot(&DriverStats);
+	fprintf(report,"%s,%s,%lu,%lu,%.1f,%.1f,%s\n",file,naive ? "readblock" : "jfs_read",
+		DriverStats.cmd[SDC_READ].calls+DriverStats.cmd[SDC_READMULTI].calls,
+		DriverStats.cmd[SDC_READ].blocks+DriverStats.cmd[SDC_READMULTI].blocks,
+		(SimNow-Start)/1000,Got/1.024/((SimNow-Start)/1000),
+		Got==Size && Sum==expect ? "ok" : "wrong");
+}
+
+// Contents of the test files.
+unsigned char RaByte(long offset)
+{
+	return (unsigned char)(offset*131+(offset>>9)*7);
+}
+
+//
+// Write allocation benchmark
+//
+// The same mixed workload runs twice on a freshly formatted image: files of
+// 1..64 kB written two at a time, interleaved 512 bytes at a time, and every
+// third pair loses its first file again. "eager" takes a block from
+// getblock() for every 512 bytes, as a write path built on the allocator
+// would; "delayed" uses jfs_create()/jfs_write(). Every other file tells its
+// size up front. The extents of the files left are counted at the end.
+//
+
+int DoWrBench(char* size, int files, bool bitmap)
+{
+FILE* Report;
+
+	ImageBlocks=ParseSize(size);
+	if (ImageBlocks<=A_FIRSTDATA+JLBLOCKS+BMBITSPERBLK/8+(long)files*130 || ftruncate(fileno(Image),0)!=0 ||
+	    ftruncate(fileno(Image),(off_t)ImageBlocks*SDBlockSize)!=0) {
+		fprintf(stderr,"jfsimg: can not size image\n");
+		return 1;
+	}
+	Report=fdopen(dup(fileno(stdout)),"w");	//jfs.c talks on stdout, only the report goes there
+	freopen("/dev/null","w",stdout);
+	Touched=calloc((ImageBlocks+7)/8,1);
+	fprintf(Report,"# jfsimg wrbench blocks=%ld mode=%s journal=%s files=%d window=%d\n",ImageBlocks,
+		bitmap ? "bitmap" : "chain",jfsjournal ? "yes" : "no",files,JFSRABLOCKS);
+	fprintf(Report,"alloc,files,blocks,extents,blocks_per_extent,maxextents,reads,writes,write_cmds\n");
+	WrRun(Report,false,files,bitmap);
+	WrRun(Report,true,files,bitmap);
+	fclose(Report);
+	free(Touched);
+	return 0;
+}
+
+// One run of the workload, one CSV line.
+void WrRun(FILE* report, bool delayed, int files, bool bitmap)
+{
+struct sdstats DriverStats;
+unsigned char Data[SDBlockSize];
+char Name[33];
+long Hdr[2], Size[2], Done[2];
+long Root, BlockNr, Blocks, NrBlocks, Extents, NrExtents, MaxExtents, Left;
+int Handle[2], Index, Side, Count;
+
+	SDCardTotalBlocks=JDOS_erase(ImageBlocks-1,bitmap ? FMT_BITMAP : FMT_STREAM);
+	dcache_init();
+	Root=part_lookup('c');
+	BenchSeed=1;
+	SDStatsReset();
+	BenchStart();
+	Benching=true;
+	for (Index=0;Index+1<files;Index+=2) {
+		for (Side=0;Side<2;Side++) {
+			Size[Side]=1+(long)(BenchRandom()%(64*1024));
+			Done[Side]=0;
+			sprintf(Name,"f%04d",Index+Side);
+			if (delayed) {
+				Handle[Side]=jfs_create(Root,Name,AT_WRITEABLE,Side==0 ? Size[Side] : 0);
+			} else if ((Hdr[Side]=createFile(Name,AT_WRITEABLE,0))!=0) {
+				dir_addentry(Root,Hdr[Side],Name,T_FILEXHDR,AT_WRITEABLE);
+			}
+		}
+		while (Done[0]<Size[0] || Done[1]<Size[1]) {
+			for (Side=0;Side<2;Side++) {
+				if (Done[Side]>=Size[Side]) continue;
+				Count=(Size[Side]-Done[Side]<SDBlockSize) ? (int)(Size[Side]-Done[Side]) : SDBlockSize;
+				memset(Data,0,SDBlockSize);
+				for (Left=0;Left<Count;Left++) Data[Left]=RaByte(Done[Side]+Left);
+				if (delayed) {
+					jfs_write(Handle[Side],Data,Count);
+				} else if ((BlockNr=getblock())!=0) {
+					file_addextent(Hdr[Side],BlockNr,1);
+					memcpy(BlockBuffer,Data,SDBlockSize);
+					rawwriteblock(BlockNr);
+				}
+				Done[Side]+=Count;
+			}
+		}
+		for (Side=0;Side<2;Side++) {
+			if (delayed) {
+				jfs_close(Handle[Side]);
+				sprintf(Name,"f%04d",Index+Side);
+				Hdr[Side]=jfs_lookup(Root,Name);
+			} else {
+				readblock(Hdr[Side]);
+				((struct s_filexh*)BlockBuffer)->filesize=Size[Side];
+				writeblock(Hdr[Side]);
+				jfs_flush();
+			}
+		}
+		if ((Index/2)%3==0) {			//Leave a hole
+			freefile(Hdr[0]);
+			dir_delentry(Root,Hdr[0]);
+			jfs_flush();
+		}
+	}
+	Benching=false;
+	SDStatsSnapshot(&DriverStats);
+
+	NrBlocks=NrExtents=MaxExtents=0;
+	Count=0;
+	for (Index=0;Index<files;Index++) {
+		sprintf(Name,"f%04d",Index);
+		if ((BlockNr=jfs_lookup(Root,Name))==0) continue;
+		Extents=WrExtents(BlockNr,&Blocks);
+		NrExtents+=Extents;
+		NrBlocks+=Blocks;
+		if (Extents>MaxExtents) MaxExtents=Extents;
+		Count++;
+	}
+	fprintf(report,"%s,%d,%ld,%ld,%.1f,%ld,%ld,%ld,%lu\n",delayed ? "delayed" : "eager",Count,NrBlocks,NrExtents,
+		NrExtents ? (double)NrBlocks/NrExtents : 0.0,MaxExtents,BenchReads,BenchWrites,
+		DriverStats.cmd[SDC_WRITE].calls+DriverStats.cmd[SDC_WRITEMULTI].calls);
+}
+
+// Nr of extents of an extent file, *blocks gets the nr of data blocks.
+long WrExtents(long fileheader, long* blocks)
+{
+struct s_filexh* Hdr;
+struct s_filexl* List;
+long Extents, ListBlock;
+unsigned int Index;
+
+	*blocks=0;
+	if (readblock(fileheader)!=SDRDY || BlockBuffer[0]!=T_FILEXHDR) return 0;
+	Hdr=(struct s_filexh*)BlockBuffer;
+	Extents=Hdr->nrextents;
+	for (Index=0;Index<Hdr->nrextents;Index++) *blocks+=Hdr->extent[Index].length;
+	ListBlock=Hdr->extlist;
+	while (ListBlock!=0 && readblock(ListBlock)==SDRDY) {
+		List=(struct s_filexl*)BlockBuffer;
+		Extents+=List->nrextents;
+		for (Index=0;Index<List->nrextents;Index++) *blocks+=List->extent[Index].length;
+		ListBlock=List->nextblock;
+	}
+	return Extents;
+}
+
+//
+// Boot loader
+//
+// Stage-0 in block 0 (SDboot.c) finds the boot file through the partition
+// headers and streams each extent with one CMD18 straight to its place in
+// memory. Its C model loads into a 64 kB array on the simulated card, and so
+// does the old way: a CMD17 per block into a buffer and a copy. Both loads
+// are checked against jfs_read() of the boot file. One CSV line each.
+//
+
+int DoBoot(char* path, char* load, char* exec)
+{
+FILE* Report;
+static unsigned char Memory[0x10000];
+unsigned char Data[SDBlockSize];
+struct sdstats DriverStats;
+long Parts[MAXPARTS];
+long Header, Size, Got;
+unsigned int Load=0, Exec=0, Started;
+int Method, Stat, Count, Handle, Index, NrParts, Result;
+char Drive=0;
+bool Same;
+double Start;
+
+	if (path!=0 && path[0]!=0 && path[1]==':' && path[2]==0) {	//c: clears
+		if (jfs_setboot(path[0],0,0,0)<0) {
+			fprintf(stderr,"jfsimg: no partition %s\n",path);
+			return 1;
+		}
+		printf("%s not bootable",path);
+		return 0;
+	}
+	if (path!=0 && (load==0 || jfs_setboot(path[0],path,(unsigned int)strtol(load,NULL,16),(unsigned int)strtol(exec,NULL,16))<0)) {
+		fprintf(stderr,"jfsimg: can not set boot file %s, error %d\n",path,jfcstatus);
+		return 1;
+	}
+	Header=0;								//The partition stage-0 boots from
+	NrParts=(readblock(A_PARTMAP)==SDRDY) ? ((struct s_partmap*)BlockBuffer)->no_parts : 0;
+	if (NrParts>MAXPARTS) NrParts=MAXPARTS;
+	for (Index=0;Index<NrParts;Index++) Parts[Index]=((struct s_partmap*)BlockBuffer)->parthdr[Index];
+	for (Index=0;Index<NrParts && Header==0;Index++) {
+		if (readblock(Parts[Index])!=SDRDY) continue;
+		Header=((struct s_parth*)BlockBuffer)->bootfile;
+		Load=((struct s_parth*)BlockBuffer)->bootload;
+		Exec=((struct s_parth*)BlockBuffer)->bootexec;
+		Drive=((struct s_parth*)BlockBuffer)->driveletter;
+	}
+	if (Header==0 || readblock(Header)!=SDRDY || BlockBuffer[0]!=T_FILEXHDR) {
+		fprintf(stderr,"jfsimg: no boot file\n");
+		return 1;
+	}
+	Size=((struct s_filexh*)BlockBuffer)->filesize;
+	Report=fdopen(dup(fileno(stdout)),"w");	//jfs.c talks on stdout, only the report goes there
+	freopen("/dev/null","w",stdout);
+	Touched=calloc((ImageBlocks+7)/8,1);
+	SimProgUs=SIMRAPROGUS;
+	fprintf(Report,"# jfsimg boot drive=%c partition=%d/%d load=%04x exec=%04x bytes=%ld cmd_us=%d xfer_us=%d cpu=%.0f\n",
+		Drive,Index,NrParts,Load,Exec,Size,SIMCMDUS,SIMXFERUS,SimCpuFactor);
+	fprintf(Report,"method,commands,blocks,time_ms,kbytes_s,data\n");
+	Result=0;
+	for (Method=0;Method<2;Method++) {
+		memset(Memory,0,sizeof(Memory));
+		SDStatsReset();
+		Start=SimNow;
+		Benching=true;
+		SimLeave();
+		Stat=(Method==0) ? BootLoad(Memory,&Started) : BootNaive(Memory,&Started);
+		SimEnter();
+		Benching=false;
+		SDStatsSnapshot(&DriverStats);
+		Same=(Stat==SDRDY && Started==Exec);
+		Got=0;
+		jfs_cacheinit();
+		if (Same && (Handle=jfs_open(Header))>=0) {
+			while ((Count=jfs_read(Handle,Data,SDBlockSize))>0) {
+				if (memcmp(&Memory[Load+Got],Data,Count)!=0) Same=false;
+				Got+=Count;
+			}
+			jfs_close(Handle);
+		}
+		fprintf(Report,"%s,%lu,%lu,%.1f,%.1f,%s\n",Method==0 ? "stage0" : "readblock",
+			DriverStats.cmd[SDC_READ].calls+DriverStats.cmd[SDC_READMULTI].calls,
+			DriverStats.cmd[SDC_READ].blocks+DriverStats.cmd[SDC_READMULTI].blocks,
+			(SimNow-Start)/1000,Size/1.024/((SimNow-Start)/1000),
+			Same && Got==Size ? "ok" : "wrong");
+		if (!Same || Got!=Size) Result=1;
+	}
+	fclose(Report);
+	return Result;
+}
+
+// The old way: every block of the boot file with its own CMD17 into a
+// buffer, then copied into place. Same checks as BootLoad().
+int BootNaive(unsigned char Memory[], unsigned int* Exec)
+{
+unsigned char CmdStructure[6];
+unsigned char Buffer[SDBlockSize];
+struct s_partmap* Map;
+struct s_parth* Part;
+struct s_filexh* File;
+unsigned int Dest, Index;
+long BlockNr, Last;
+int Stat;
+
+	Map=(struct s_partmap*)&Memory[BOOTMAP];
+	Part=(struct s_parth*)&Memory[BOOTHDR];
+	File=(struct s_filexh*)&Memory[BOOTHDR];
+	PrepCS(CmdStructure,SDCMDReadBlock,A_PARTMAP);
+	if ((Stat=SDReadBlock(CmdStructure,(unsigned char*)Map))!=SDRDY) return(Stat);
+	if (Map->blocktype!=T_PARTMAP) return(SDREADFAIL);
+	for (Index=0;Index<Map->no_parts && Index<MAXPARTS;Index++) {
+		PrepCS(CmdStructure,SDCMDReadBlock,Map->parthdr[Index]);
+		if ((Stat=SDReadBlock(CmdStructure,(unsigned char*)Part))!=SDRDY) return(Stat);
+		if (Part->blocktype==T_PARTHDR && Part->bootfile!=0) break;
+	}
+	if (Index>=Map->no_parts || Index>=MAXPARTS) return(SDREADFAIL);
+	Dest=Part->bootload;
+	*Exec=Part->bootexec;
+	PrepCS(CmdStructure,SDCMDReadBlock,Part->bootfile);
+	if ((Stat=SDReadBlock(CmdStructure,(unsigned char*)File))!=SDRDY) return(Stat);
+	if (File->blocktype!=T_FILEXHDR || File->extlist!=0 || File->nrextents==0) return(SDREADFAIL);
+	for (Index=0;Index<File->nrextents && Index<FXHMAXEXT;Index++) {
+		Last=File->extent[Index].start+File->extent[Index].length;
+		for (BlockNr=File->extent[Index].start;BlockNr<Last;BlockNr++) {
+			if ((long)Dest+SDBlockSize>0x10000L) return(SDREADFAIL);
+			PrepCS(CmdStructure,SDCMDReadBlock,BlockNr);
+			if ((Stat=SDReadBlock(CmdStructure,Buffer))!=SDRDY) return(Stat);
+			memcpy(&Memory[Dest],Buffer,SDBlockSize);
+			Dest+=SDBlockSize;
+		}
+	}
+	return(SDRDY);
+}
+
+//
+// Block number helpers
+//
+// The host runs the C versions of SDblocknr.c; the cases are the ones SD-mon T
+// runs on the board, where SDBLKASM swaps in the 6309 versions.
+//
+
+int DoBlk()
+{
+int Wrong;
+
+	Wrong=BlkSelfTest(false);
+	printf("check,wrong,result\n");
+	printf("blocknr helpers,%d,%s\n",Wrong,Wrong==0 ? "ok" : "wrong");
+	return Wrong!=0;
+}
+
+//
+// SD CRC kernels
+//
+// The tables of SDcrc.c against reference vectors and, on random blocks,
+// against the CRC16 a bit at a time, and the self-test SDSetCrc() and SD-mon
+// T run. Then the time per 512 byte block of
+// both CRC16s: host time, and scaled to the 6309 by SimCpuFactor as the
+// benches do. One CSV line per check and per kernel.
+//
+
+int DoCrc()
+{
+static unsigned char Cmd0[5]={0x40,0,0,0,0}, Cmd8[5]={0x48,0,0,0x01,0xAA}, Cmd17[5]={0x51,0,0,0,0};
+static unsigned char Cmd55[5]={0x77,0,0,0,0}, Acmd41[5]={0x69,0x40,0,0,0}, Cmd58[5]={0x7A,0,0,0,0};
+unsigned char Block[SDBlockSize];
+struct timespec Begin, End;
+double Ns;
+unsigned int Sum;
+long Rounds, Round;
+int Index, Kernel, Result;
+
+	SDCrcInit();
+	Result=0;
+	printf("check,expect,got,result\n");
+	Result|=CrcCheck("crc7 cmd0",0x95,SDCrc7(Cmd0,5));
+	Result|=CrcCheck("crc7 cmd8",0x87,SDCrc7(Cmd8,5));
+	Result|=CrcCheck("crc7 cmd17",0x55,SDCrc7(Cmd17,5));
+	Result|=CrcCheck("crc7 cmd55",0x65,SDCrc7(Cmd55,5));
+	Result|=CrcCheck("crc7 acmd41",0x77,SDCrc7(Acmd41,5));
+	Result|=CrcCheck("crc7 cmd58",0xFD,SDCrc7(Cmd58,5));
+	Result|=CrcCheck("crc7 123456789",0xEB,SDCrc7((unsigned char*)"123456789",9));
+	Result|=CrcCheck("crc16 123456789",0x31C3,SDCrc16((unsigned char*)"123456789",9));
+	memset(Block,0xFF,SDBlockSize);
+	Result|=CrcCheck("crc16 ff block",0x7FA1,SDCrc16(Block,SDBlockSize));
+	for (Round=0;Round<1000;Round++) {
+		for (Index=0;Index<SDBlockSize;Index++) Block[Index]=(unsigned char)BenchRandom();
+		Index=(int)(BenchRandom()%SDBlockSize)+1;	//Odd and even lengths
+		if (SDCrc16(Block,Index)!=SDCrc16Bit(Block,Index)) break;
+	}
+	Result|=CrcCheck("crc16 random blocks",1000,(unsigned int)Round);
+	Result|=CrcCheck("self-test (SD-mon T)",0,(unsigned int)SDCrcSelfTest(false));
+	printf("kernel,blocks,host_ns_per_block,sim_us_per_block,check\n");
+	Rounds=20000;
+	for (Kernel=0;Kernel<2;Kernel++) {
+		Sum=0;
+		memset(Block,0x55,SDBlockSize);
+		clock_gettime(CLOCK_MONOTONIC,&Begin);
+		for (Round=0;Round<Rounds;Round++) {
+			Block[Round&(SDBlockSize-1)]^=(unsigned char)Round;	//Not the same block twice
+			Sum+=(Kernel==0) ? SDCrc16Bit(Block,SDBlockSize) : SDCrc16(Block,SDBlockSize);
+		}
+		clock_gettime(CLOCK_MONOTONIC,&End);
+		Ns=((End.tv_sec-Begin.tv_sec)*1e9+(End.tv_nsec-Begin.tv_nsec))/Rounds;
+		printf("%s,%ld,%.0f,%.0f,%04x\n",Kernel==0 ? "bitwise" : "table",Rounds,Ns,Ns*SimCpuFactor/1000,Sum&0xFFFF);
+	}
+	return Result;
+}
+
+// One check line, 1 if wrong.
+int CrcCheck(char* name, unsigned int expect, unsigned int got)
+{
+	printf("%s,%04x,%04x,%s\n",name,expect,got,expect==got ? "ok" : "wrong");
+	return expect!=got;
+}
+
+//
+// Block cache check
+//
+// A scratch image is formatted, then blocks taken from the allocator are
+// written through the cache, more than it holds, and read back past it.
+// The LRU clock starts just below 65536, so a 16-bit stamp would wrap in the
+// middle and evict the wrong slot. Then a write-back fails: the victim must
+// stay cached and dirty, the write must report the error, and a flush after
+// the card recovers must still get every block home. Once without the
+// journal, once with it. One CSV line per check.
+//
+
+#define CACHEBLOCKS	(4*JFSCACHESLOTS)		//Blocks written per run, enough to evict every slot
+
+int DoCache(char* size)
+{
+FILE* Report;
+struct s_fsckstats Fsck;
+int Result;
+
+	ImageBlocks=ParseSize(size);
+	if (ImageBlocks<=A_FIRSTDATA+JLBLOCKS+BMBITSPERBLK/8 || ftruncate(fileno(Image),0)!=0 ||
+	    ftruncate(fileno(Image),(off_t)ImageBlocks*SDBlockSize)!=0) {
+		fprintf(stderr,"jfsimg: can not size image\n");
+		return 1;
+	}
+	Report=fdopen(dup(fileno(stdout)),"w");	//jfs.c talks on stdout, only the report goes there
+	freopen("/dev/null","w",stdout);
+	SDCardTotalBlocks=JDOS_erase(ImageBlocks-1,FMT_STREAM);
+	jfs_unmount();
+	fprintf(Report,"check,journal,result\n");
+	Result=CacheRun(Report,false);
+	Result|=CacheRun(Report,true);
+	Result|=CacheCheck(Report,"fsck",true,jfs_fsck(false,&Fsck)==0);
+	Result|=FormatRun(Report);
+	fclose(Report);
+	return Result;
+}
+
+int CacheRun(FILE* report, bool journal)
+{
+long Blocks[CACHEBLOCKS];
+long Index;
+int Result, Stat;
+long Tail;
+bool Ok;
+
+	jfs_cacheinit();					//Closes the journal
+	dcache_init();
+	if (journal) jfs_mount();
+	Result=0;
+	for (Index=0;Index<CACHEBLOCKS;Index++) Blocks[Index]=getblock();
+	Ok=true;
+	for (Index=0;Index<CACHEBLOCKS;Index++) {		//Evictions write back, or commit first
+		CacheFill(Blocks[Index]);
+		if (writeblock(Blocks[Index])!=SDRDY) Ok=false;
+	}
+	Ok=Ok && jfs_unmount()==SDRDY;
+	for (Index=0;Index<CACHEBLOCKS && Ok;Index++) {
+		CacheFill(Blocks[Index]);
+		Ok=rawreadblock(Blocks[Index])==SDRDY && memcmp(BlockBuffer+1,&Blocks[Index],sizeof(long))==0;
+	}
+	Result|=CacheCheck(report,"write back",journal,Ok);
+
+	jfs_cacheinit();					//LRU clock 0
+	if (journal) jfs_mount();
+	for (Index=0;Index<65533;Index++) readblock(Blocks[0]);
+	for (Index=0;Index<JFSCACHESLOTS;Index++) readblock(Blocks[Index]);	//Stamps 65534, 65535, then 65536 or 0
+	readblock(Blocks[1]);					//Blocks[0] is now the least recently used
+	readblock(Blocks[JFSCACHESLOTS]);
+	Result|=CacheCheck(report,"lru past 65536",journal,
+		jfs_cachefind(Blocks[0])==0 && jfs_cachefind(Blocks[2])!=0 && jfs_cachefind(Blocks[1])!=0);
+
+	for (Index=0;Index<JFSCACHESLOTS;Index++) {	//Every slot dirty
+		CacheFill(Blocks[Index]);
+		writeblock(Blocks[Index]);
+	}
+	WriteFails=true;
+	CacheFill(Blocks[JFSCACHESLOTS]);
+	Stat=writeblock(Blocks[JFSCACHESLOTS]);
+	WriteFails=false;
+	Ok=(Stat!=SDRDY && jfs_cachefind(Blocks[JFSCACHESLOTS])==0);
+	for (Index=0;Index<JFSCACHESLOTS && Ok;Index++) {
+		Ok=jfs_cachefind(Blocks[Index])!=0 && jfs_cachefind(Blocks[Index])->dirty;
+	}
+	Result|=CacheCheck(report,"failed write back keeps slot",journal,Ok);
+	Ok=jfs_unmount()==SDRDY;
+	for (Index=0;Index<JFSCACHESLOTS && Ok;Index++) {
+		Ok=rawreadblock(Blocks[Index])==SDRDY && memcmp(BlockBuffer+1,&Blocks[Index],sizeof(long))==0;
+	}
+	Result|=CacheCheck(report,"flush after failure",journal,Ok);
+
+	if (journal) {						//Committed, then the checkpoint fails
+		for (Index=0;Index<JFSCACHESLOTS;Index++) {
+			CacheFill(Blocks[Index]);
+			BlockBuffer[0]=0x5A;
+			writeblock(Blocks[Index]);
+		}
+		Ok=jfs_flush()==SDRDY;
+		Tail=JournalTail();
+		WriteFails=true;
+		Stat=jl_checkpoint();
+		WriteFails=false;
+		Ok=Ok && Stat!=SDRDY && JournalTail()==Tail;
+		jfs_cacheinit();				//Power cycle: the replay writes them home
+		Ok=Ok && jfs_mount()>0;
+		for (Index=0;Index<JFSCACHESLOTS && Ok;Index++) {
+			Ok=rawreadblock(Blocks[Index])==SDRDY && BlockBuffer[0]==0x5A;
+		}
+		Result|=CacheCheck(report,"failed checkpoint keeps tail",journal,Ok);
+	}
+
+	for (Index=0;Index<CACHEBLOCKS;Index++) freeblock(Blocks[Index]);
+	jfs_unmount();
+	return Result;
+}
+
+// The streamed format: a CMD25 that breaks must not make bad blocks, a key
+// press must leave counters that fsck agrees with.
+int FormatRun(FILE* report)
+{
+struct s_jfsusage Usage;
+struct s_fsckstats Fsck;
+long Blocks;
+int Result;
+
+	StreamFailAt=A_FIRSTDATA+5;			//In the first batch
+	jfs_cacheinit();
+	Blocks=JDOS_erase(ImageBlocks-1,FMT_STREAM);
+	jfs_unmount();
+	Result=CacheCheck(report,"format stream break",false,StreamFailAt==0 && Blocks==ImageBlocks-A_FIRSTDATA &&
+		jfs_usage(&Usage) && Usage.nrbad==0 && jfs_fsck(false,&Fsck)==0);
+	StreamFailAt=0;
+
+	KeyAfter=2;						//Stopped after the second batch
+	jfs_cacheinit();
+	Blocks=JDOS_erase(ImageBlocks-1,FMT_STREAM);
+	jfs_unmount();
+	Result|=CacheCheck(report,"format stopped",false,Blocks==2*EC_BATCH && jfs_usage(&Usage) &&
+		Usage.totalblocks==A_FIRSTDATA+2*EC_BATCH && jfs_fsck(false,&Fsck)==0);
+	KeyAfter=0;
+	return Result;
+}
+
+// One check line, 1 if wrong.
+int CacheCheck(FILE* report, char* name, bool journal, bool ok)
+{
+	fprintf(report,"%s,%s,%s\n",name,journal ? "yes" : "no",ok ? "ok" : "wrong");
+	return !ok;
+}
+
+// Tail in the journal header on the image, -1 if there is no journal.
+long JournalTail()
+{
+	if (rawreadblock(A_PARTMAP)!=SDRDY || ((struct s_partmap*)BlockBuffer)->journal==0 ||
+	    rawreadblock(((struct s_partmap*)BlockBuffer)->journal)!=SDRDY) return -1;
+	return ((struct s_jrnlhdr*)BlockBuffer)->tail;
+}
+
+// BlockBuffer with the block number after a type byte no header uses.
+void CacheFill(long blocknr)
+{
+	fill_buffer(BlockBuffer,0xA5);
+	memcpy(BlockBuffer+1,&blocknr,sizeof(long));
+}
+
+//
+// Helpers
+//
+
+// Size as a number of blocks, or bytes with a K, M or G suffix.
+long ParseSize(char* size)
+{
+char* Unit;
+long long Bytes;
+
+	Bytes=strtoll(size,&Unit,10);
+	switch (*Unit) {
+	case 'K': case 'k': Bytes<<=10; break;
+	case 'M': case 'm': Bytes<<=20; break;
+	case 'G': case 'g': Bytes<<=30; break;
+	case 0: Bytes*=SDBlockSize; break;		//Plain number: blocks
+	default: Usage();
+	}
+	return (long)(Bytes/SDBlockSize);
+}
+
+bool OpenImage(char* name, long blocks)
+{
+	if ((Image=fopen(name,"r+b"))==NULL && (blocks==0 || (Image=fopen(name,"w+b"))==NULL)) {
+		perror(name);
+		return false;
+	}
+	fseeko(Image,0,SEEK_END);
+	ImageBlocks=(long)(ftello(Image)/SDBlockSize);
+	SDCardTotalBlocks=ImageBlocks;
+	return true;
+}
+
+// Split "c:/dir/name" into "c:/dir" and "name", returns the name.
+char* SplitPath(char* path, char* parent)
+{
+char* Name;
+long Length;
+
+	if ((Name=strrchr(path,'/'))==NULL && (Name=strchr(path,':'))==NULL) {
+		Name=path;
+	} else {
+		Name++;
+	}
+	Length=Name-path;
+	if (Length>255) Length=255;
+	strncpy(parent,path,Length);
+	parent[Length]=0;
+	if (strlen(Name)>31) Name[31]=0;		//Names are stored with their terminator
+	return Name;
+}
+
+void fill_buffer(unsigned char buffer[], unsigned char value)
+{
+	memset(buffer,value,SDBlockSize);
+}
+
+char checkkey()
+{
+	return KeyAfter!=0 && --KeyAfter==0;
+}
+
+//
+// SD card driver on top of the image file, same interface as TOM6309SDcard.c
+//
+
+void PrepCS(unsigned char CmdStructure[],unsigned char Cmd, long BlockNr)
+{
+	(void)Cmd;				//The image has no command framing
+	BlkEncode(CmdStructure,BlockNr);
+	CmdStructure[4] = 0;
+	CmdStructure[5] = 0;
+}
+
+long CmdBlock(unsigned char CmdStructure[])
+{
+	return BlkDecode(CmdStructure);
+}
+
+int ImageRead(long BlockNr, unsigned char Buffer[])
+{
+int ReadStat;
+
+	SimEnter();				//Host file I/O is not card time
+	if (Benching && BlockNr<ImageBlocks) {
+		BenchReads++;
+		BenchTouch(BlockNr);
+		SimNow+=SIMXFERUS;
+	}
+	ReadStat=SDRDY;
+	if (BlockNr>=ImageBlocks || fseeko(Image,(off_t)BlockNr*SDBlockSize,SEEK_SET)!=0 ||
+	    fread(Buffer,1,SDBlockSize,Image)!=SDBlockSize) ReadStat=SDERR;
+	SimLeave();
+	return ReadStat;
+}
+
+int ImageWrite(long BlockNr, unsigned char Buffer[])
+{
+unsigned char Defect[512];
+int WriteStat;
+
+	SimEnter();
+	if (CrashAfter!=0 && ++CrashWrites>CrashAfter) {	//Power is gone, the card sees nothing
+		SimLeave();
+		return SDRDY;
+	}
+	if (WriteFails) {
+		SimLeave();
+		return SDWRTFAIL;
+	}
+	if (Benching && BlockNr<ImageBlocks) {
+		BenchWrites++;
+		BenchTouch(BlockNr);
+		SimNow+=SIMXFERUS;
+		SimBusyUntil=SimNow+SimProgUs;
+	}
+	if (NrBadBlocks!=0 && IsBadBlock(BlockNr)) {	//Stored with a flipped bit
+		memcpy(Defect,Buffer,SDBlockSize);
+		Defect[SDBlockSize/2]^=0x10;
+		Buffer=Defect;
+	}
+	WriteStat=SDRDY;
+	if (BlockNr>=ImageBlocks || fseeko(Image,(off_t)BlockNr*SDBlockSize,SEEK_SET)!=0 ||
+	    fwrite(Buffer,1,SDBlockSize,Image)!=SDBlockSize) WriteStat=SDWRTFAIL;
+	SimLeave();
+	return WriteStat;
+}
+
+int SDReadBlock(unsigned char CmdBuffer[],unsigned char BlockBuffer[])
+{
+	SimSync();
+	SimCommand();
+	SDStatBegin(SDC_READ);
+	SDStatBlock();
+	return SDStatEnd(ImageRead(CmdBlock(CmdBuffer),BlockBuffer));
+}
+
+int SDWriteBlock(unsigned char CmdBuffer[],unsigned char BlockBuffer[])
+{
+int WriteStat;
+
+	SimSync();
+	SimCommand();
+	SDStatBegin(SDC_WRITE);
+	SDStatBlock();
+	WriteStat=ImageWrite(CmdBlock(CmdBuffer),BlockBuffer);
+	if (!SimWriteBehind) SimSync();
+	return SDStatEnd(WriteStat);
+}
+
+void SDSetWriteBehind(bool On)
+{
+	SimSync();
+	SimWriteBehind=On;
+}
+
+void SDSync()
+{
+	SimSync();
+}
+
+int SDReadStart(unsigned char CmdBuffer[])
+{
+	SimSync();
+	SimCommand();
+	SDStatBegin(SDC_READMULTI);
+	StreamBlock=CmdBlock(CmdBuffer);
+	return SDStatEnd(SDRDY);
+}
+
+int SDReadNext(unsigned char BlockBuffer[])
+{
+	SDStatCharge(SDC_READMULTI);
+	SDStatBlock();
+	return SDStatEnd(ImageRead(StreamBlock++,BlockBuffer));
+}
+
+int SDReadStop()
+{
+	SimCommand();				//STOP_TRAN
+	return SDRDY;
+}
+
+int SDWriteStart(unsigned char CmdBuffer[])
+{
+	SimSync();
+	SimCommand();
+	SDStatBegin(SDC_WRITEMULTI);
+	StreamBlock=CmdBlock(CmdBuffer);
+	return SDStatEnd(SDRDY);
+}
+
+int SDWriteNext(unsigned char BlockBuffer[])
+{
+int WriteStat;
+
+	SDStatCharge(SDC_WRITEMULTI);
+	SDStatBlock();
+	if (StreamFailAt!=0 && StreamBlock==StreamFailAt) {
+		StreamFailAt=0;			//The card drops out of the stream, the block is not written
+		return SDStatEnd(SDWRTFAIL);
+	}
+	WriteStat=ImageWrite(StreamBlock++,BlockBuffer);
+	SimSync();				//Streams wait for every block
+	return SDStatEnd(WriteStat);
+}
+
+int SDWriteStop()
+{
+	return SDRDY;
+}
+
+struct scrregister SDReadSCR()
+{
+struct scrregister SCRData;
+
+	SimSync();
+	SDStatBegin(SDC_SCR);
+	memset(&SCRData,0,sizeof(SCRData));
+	SCRData.status=SDStatEnd(SDRDY);
+	SCRData.EraseFill=0x00;		//Unwritten parts of the image read as 0
+	return SCRData;
+}
+
+int SDEraseBlocks(unsigned char StartCB[],unsigned char EndCB[])
+{
+unsigned char Zero[512];
+long BlockNr;
+
+	SimSync();
+	SDStatBegin(SDC_ERASE);
+	memset(Zero,0,SDBlockSize);
+	for (BlockNr=CmdBlock(StartCB);BlockNr<=CmdBlock(EndCB);BlockNr++) {
+		if (ImageWrite(BlockNr,Zero)!=SDRDY) return SDStatEnd(SDERASEFAIL);
+	}
+	return SDStatEnd(SDRDY);
+}
+
+#include "SDstats.c"
+#include "SDblocknr.c"
+#include "SDcrc.c"
+
+#include "../../Bootstrap/JFS/jfs.c"
+#include "SDboot.c"
+
+//
+// SPI protocol check (jfsimg spi)
+//
+// SDspi.c, the protocol half of TOM6309SDcard.c, is built a second time under
+// the Wire prefix, on SPIRead()/SPIWrite() that clock bytes through a card
+// simulated at the byte level: commands with R1, start/stop tokens, data
+// responses, busy bytes, STOP_TRAN in the middle of a read stream and CRC
+// checking after CMD59. Every byte on the bus is traced. The same blocks go
+// over the wire with a CMD17/CMD24 per block and with one CMD18/CMD25 stream;
+// the data blocks and their CRCs must be the same bytes, the framing only
+// differs in the command and token bytes around them.
+//
+
+#define SDReadBlockSPI		WireReadBlockSPI
+#define SDWriteBlockSPI		WireWriteBlockSPI
+#define SDWaitReady		WireWaitReady
+#define SDSetWriteBehind	WireSetWriteBehind
+#define SDSync			WireSync
+#define SDWaitToken		WireWaitToken
+#define SDReadData		WireReadData
+#define SDWriteData		WireWriteData
+#define SDSetCrc		WireSetCrc
+#define SDGetCrc		WireGetCrc
+#define SDReadStart		WireReadStart
+#define SDReadNext		WireReadNext
+#define SDReadStop		WireReadStop
+#define SDWriteStart		WireWriteStart
+#define SDWriteNext		WireWriteNext
+#define SDWriteStop		WireWriteStop
+#define SDReadBlocks		WireReadBlocks
+#define SDWriteBlocks		WireWriteBlocks
+#define SDEraseBlocks		WireEraseBlocks
+#define SDReadSCR		WireReadSCR
+
+int SDReadBlockSPI(unsigned char CmdBuffer[],unsigned char BlockBuffer[]);
+int SDWriteBlockSPI(unsigned char CmdBuffer[],unsigned char BlockBuffer[]);
+void SDWaitReady();
+void SDSetWriteBehind(bool On);
+void SDSync();
+int SDWaitToken();
+int SDReadData(unsigned char Buffer[],int Count);
+int SDWriteData(unsigned char Token,unsigned char Buffer[]);
+int SDSetCrc(bool On);
+bool SDGetCrc();
+int SDReadStart(unsigned char CmdBuffer[]);
+int SDReadNext(unsigned char BlockBuffer[]);
+int SDReadStop();
+int SDWriteStart(unsigned char CmdBuffer[]);
+int SDWriteNext(unsigned char BlockBuffer[]);
+int SDWriteStop();
+int SDReadBlocks(unsigned char CmdBuffer[],unsigned char Buffer[],int Count);
+int SDWriteBlocks(unsigned char CmdBuffer[],unsigned char Buffer[],int Count);
+int SDEraseBlocks(unsigned char StartCB[],unsigned char EndCB[]);
+struct scrregister SDReadSCR();
+
+#define WIREBLOCKS	16			//Blocks on the simulated card
+#define WIRETRACE	65536		//Bus bytes traced
+#define WIREDATA	64			//Data block positions traced
+#define WIREBUSY	3			//Busy bytes after a written block or a stop
+#define WIRE_IDLE	0			//Waiting for a command
+#define WIRE_READING	1		//CMD18: sending blocks until CMD12
+#define WIRE_TOKEN	2			//CMD24/CMD25: waiting for a data token
+#define WIRE_DATA	3			//Taking in a data block and its CRC
+
+static bool SDWriteBehind;		//State of the Wire driver, as in TOM6309SDcard.c
+static bool SDBusyPending;
+static bool SDCrcOn;
+static bool SDCrcWanted;
+static long SDStreamBlock;
+
+static unsigned char WireCard[WIREBLOCKS][SDBlockSize];
+static unsigned char WireOut[SDBlockSize+8];	//Bytes the card sends next
+static int WireOutLen, WireOutPos, WireOutMark;	//Mark: WireOut index where a data block starts, -1 = none
+static unsigned char WireCmd[6];
+static int WireCmdLen;
+static unsigned char WireIn[SDBlockSize+2];	//Data block coming in, CRC included
+static int WireInLen;
+static int WireState;
+static bool WireMulti;			//CMD25 rather than CMD24
+static long WireBlock;			//Next block of the transfer
+static bool WireSelected;
+static bool WireCrc;			//CMD59 turned CRC checking on
+static bool WireBadRead;		//Flip a bit in the next block sent, once
+static bool WireBadWrite;		//Answer the next block with a CRC error, once
+static unsigned char WireMosi[WIRETRACE], WireMiso[WIRETRACE];
+static long WireLen;
+static long WireData[WIREDATA];	//Trace positions of the data blocks, either direction
+static int WireNrData;
+static int WireCmds[64];		//Commands seen, by number
+static int WireStops;			//Stop tokens seen
+
+// One byte each way. The card answers from WireOut and takes in Mosi.
+unsigned char WireXfer(unsigned char Mosi)
+{
+unsigned char Miso;
+
+	if (!WireSelected) return 0xFF;
+	if (WireOutPos>=WireOutLen && WireState==WIRE_READING) WireSendBlock();
+	Miso=0xFF;
+	if (WireOutPos<WireOutLen) {
+		if (WireOutPos==WireOutMark && WireNrData<WIREDATA) WireData[WireNrData++]=WireLen;
+		Miso=WireOut[WireOutPos++];
+	}
+	if (WireLen<WIRETRACE) {
+		WireMosi[WireLen]=Mosi;
+		WireMiso[WireLen]=Miso;
+		WireLen++;
+	}
+	WireTake(Mosi);
+	return Miso;
+}
+
+// Card side of a byte from the host.
+void WireTake(unsigned char Mosi)
+{
+	switch (WireState) {
+	case WIRE_DATA:
+		WireIn[WireInLen++]=Mosi;
+		if (WireInLen==SDBlockSize+2) WireWritten();
+		return;
+	case WIRE_TOKEN:
+		if (Mosi==(WireMulti ? SDTOKMULTI : SDTOKSTART)) {
+			WireState=WIRE_DATA;
+			WireInLen=0;
+			if (WireNrData<WIREDATA) WireData[WireNrData++]=WireLen;
+		} else if (Mosi==SDTOKSTOP && WireMulti) {
+			WireStops++;
+			WireQueue(0xFF,1);		//Stuff byte, then busy
+			WireQueue(0x00,WIREBUSY);
+			WireState=WIRE_IDLE;
+		}
+		return;
+	default:
+		if (WireCmdLen==0 && (Mosi&0xC0)!=0x40) return;
+		WireCmd[WireCmdLen++]=Mosi;
+		if (WireCmdLen==6) {
+			WireCmdLen=0;
+			WireCommand();
+		}
+	}
+}
+
+// A complete command frame in WireCmd.
+void WireCommand()
+{
+unsigned char Cmd;
+long Arg;
+
+	Cmd=WireCmd[0]&0x3F;
+	Arg=((long)WireCmd[1]<<24)|((long)WireCmd[2]<<16)|((long)WireCmd[3]<<8)|WireCmd[4];
+	WireCmds[Cmd]++;
+	WireOutLen=WireOutPos=0;		//A read stream ends here
+	WireOutMark=-1;
+	WireQueue(0xFF,1);				//NCR
+	if (WireCrc && WireCmd[5]!=SDCrc7(WireCmd,5)) {
+		WireQueue(R1COMCRCERR,1);
+		WireState=WIRE_IDLE;
+		return;
+	}
+	if ((Cmd==17 || Cmd==18 || Cmd==24 || Cmd==25) && (Arg<0 || Arg>=WIREBLOCKS)) {
+		WireQueue(R1ADDRERR,1);
+		return;
+	}
+	switch (Cmd) {
+	case 12:
+		WireQueue(0x00,1);
+		if (WireState==WIRE_READING) WireQueue(0x00,WIREBUSY);
+		WireState=WIRE_IDLE;
+		break;
+	case 17:
+	case 18:
+		WireQueue(0x00,1);
+		WireBlock=Arg;
+		WireState=WIRE_READING;
+		if (Cmd==17) {
+			WireSendBlock();
+			WireState=WIRE_IDLE;
+		}
+		break;
+	case 24:
+	case 25:
+		WireQueue(0x00,1);
+		WireBlock=Arg;
+		WireMulti=(Cmd==25);
+		WireState=WIRE_TOKEN;
+		break;
+	case 59:
+		WireQueue(0x00,1);
+		WireCrc=(Arg&1)!=0;
+		break;
+	default:
+		WireQueue(R1ILLEGCMD,1);
+	}
+}
+
+// Queue access time, start token, block WireBlock and its CRC.
+void WireSendBlock()
+{
+unsigned int Crc;
+
+	if (WireOutPos>=WireOutLen) WireOutLen=WireOutPos=0;
+	if (WireBlock>=WIREBLOCKS) {		//Out of range error token
+		WireQueue(0x08,1);
+		WireState=WIRE_IDLE;
+		return;
+	}
+	WireQueue(0xFF,1);
+	WireQueue(SDTOKSTART,1);
+	WireOutMark=WireOutLen;
+	memcpy(&WireOut[WireOutLen],WireCard[WireBlock],SDBlockSize);
+	Crc=SDCrc16(WireCard[WireBlock],SDBlockSize);
+	if (WireBadRead) {
+		WireOut[WireOutLen+SDBlockSize/2]^=0x01;
+		WireBadRead=false;
+	}
+	WireOutLen+=SDBlockSize;
+	WireQueue((unsigned char)(Crc>>8),1);
+	WireQueue((unsigned char)Crc,1);
+	WireBlock++;
+}
+
+// A data block and its CRC came in: store it, answer, then busy.
+void WireWritten()
+{
+unsigned int Crc;
+bool Ok;
+
+	Crc=((unsigned int)WireIn[SDBlockSize]<<8)|WireIn[SDBlockSize+1];
+	Ok=!WireCrc || Crc==SDCrc16(WireIn,SDBlockSize);
+	if (WireBadWrite) {
+		Ok=false;
+		WireBadWrite=false;
+	}
+	WireOutLen=WireOutPos=0;
+	WireOutMark=-1;
+	if (Ok) {
+		memcpy(WireCard[WireBlock++],WireIn,SDBlockSize);
+		WireQueue(0xE5,1);			//Accepted, with the undefined high bits set
+	} else {
+		WireQueue(0xEB,1);			//CRC error
+	}
+	WireQueue(0x00,WIREBUSY);
+	WireState=WireMulti ? WIRE_TOKEN : WIRE_IDLE;
+}
+
+void WireQueue(unsigned char Value, int Count)
+{
+	while (Count-->0) WireOut[WireOutLen++]=Value;
+}
+
+// Empty card state and trace, CRC checking as set by CMD59 is kept.
+void WireReset(bool clearcard)
+{
+	if (clearcard) memset(WireCard,0,sizeof(WireCard));
+	WireOutLen=WireOutPos=0;
+	WireOutMark=-1;
+	WireCmdLen=0;
+	WireState=WIRE_IDLE;
+	WireSelected=false;
+	WireLen=0;
+	WireNrData=0;
+	memset(WireCmds,0,sizeof(WireCmds));
+	WireStops=0;
+}
+
+//
+// Host stand-ins for the SPI primitives and the ROM's SD_SendCmd
+//
+
+unsigned char SPIRead()
+{
+	return WireXfer(0xFF);
+}
+
+void SPIWrite(unsigned char Value)
+{
+	WireXfer(Value);
+}
+
+void SPIReadBuf(unsigned char Buffer[],int Count)
+{
+	while (Count-->0) *Buffer++=WireXfer(0xFF);
+}
+
+void SPIWriteBuf(unsigned char Buffer[],int Count)
+{
+	while (Count-->0) WireXfer(*Buffer++);
+}
+
+unsigned char SDCommand(unsigned char Command, unsigned char CmdBuffer[])
+{
+unsigned char CmdStruct[6];
+unsigned char R1;
+unsigned char Tries;
+int Polls;
+
+	CmdStruct[0]=0x40|Command;
+	memcpy(&CmdStruct[1],CmdBuffer,4);
+	CmdStruct[5]=SDCrcOn ? SDCrc7(CmdStruct,5) : 0x01;
+	for (Tries=1;;Tries++) {
+		WireSelected=true;
+		SPIWriteBuf(CmdStruct,6);
+		for (Polls=0,R1=0xFF;Polls<8 && R1==0xFF;Polls++) R1=SPIRead();
+		if (!(R1&R1COMCRCERR) || Tries>=SDCRCTRIES) break;
+		SDStatCrcRetry();
+		SDDeselect();
+	}
+	return R1;
+}
+
+void SDDeselect()
+{
+	WireSelected=false;
+	WireCmdLen=0;
+}
+
+#include "SDspi.c"
+
+#define WIRECOUNT	8			//Blocks per transfer
+#define WIRESTART	3			//First block
+
+int DoSpi()
+{
+static unsigned char Data[WIRECOUNT*SDBlockSize], Back[WIRECOUNT*SDBlockSize];
+static unsigned char Saved[WIRETRACE];
+unsigned char CB[4];
+long SavedData[WIREDATA];
+long SavedLen;
+int Index, Result, Crc, SavedCmds;
+bool Ok;
+
+	SDCrcInit();
+	for (Index=0;Index<WIRECOUNT*SDBlockSize;Index++) Data[Index]=(unsigned char)BenchRandom();
+	Data[5]=SDTOKSTART;				//Token values inside the data
+	Data[SDBlockSize+7]=SDTOKSTOP;
+	Data[2*SDBlockSize+9]=0x4C;		//Looks like CMD12
+	Result=0;
+	printf("transfer,crc,single_cmds,single_bytes,stream_cmds,stream_bytes,result\n");
+	for (Crc=0;Crc<2;Crc++) {
+		WireReset(true);
+		WireCrc=false;
+		SDCrcOn=false;
+		if (Crc && WireSetCrc(true)!=SDRDY) {
+			printf("crc on,on,,,,,wrong\n");
+			return 1;
+		}
+
+		WireReset(true);			//Writes: a CMD24 per block
+		for (Index=0;Index<WIRECOUNT;Index++) {
+			BlkEncode(CB,WIRESTART+Index);
+			if (WireWriteBlockSPI(CB,&Data[Index*SDBlockSize])!=SDRDY) break;
+		}
+		Ok=(Index==WIRECOUNT && WireCmds[24]==WIRECOUNT && WireNrData==WIRECOUNT && memcmp(WireCard[WIRESTART],Data,sizeof(Data))==0);
+		memcpy(Saved,WireMosi,WireLen);
+		memcpy(SavedData,WireData,sizeof(SavedData));
+		SavedLen=WireLen;
+		SavedCmds=WireCmds[24];
+		WireReset(true);			//One CMD25 stream
+		BlkEncode(CB,WIRESTART);
+		Ok=Ok && WireWriteBlocks(CB,Data,WIRECOUNT)==SDRDY && WireCmds[25]==1 && WireStops==1 &&
+			WireNrData==WIRECOUNT && memcmp(WireCard[WIRESTART],Data,sizeof(Data))==0;
+		for (Index=0;Index<WIRECOUNT && Ok;Index++) {	//Data and CRC bytes as on the single block path
+			Ok=memcmp(&Saved[SavedData[Index]],&WireMosi[WireData[Index]],SDBlockSize+2)==0;
+		}
+		printf("write,%s,%d,%ld,%d,%ld,%s\n",Crc ? "on" : "off",SavedCmds,SavedLen,WireCmds[25],WireLen,Ok ? "ok" : "wrong");
+		Result|=!Ok;
+
+		WireReset(false);			//Reads: a CMD17 per block
+		memset(Back,0,sizeof(Back));
+		for (Index=0;Index<WIRECOUNT;Index++) {
+			BlkEncode(CB,WIRESTART+Index);
+			if (WireReadBlockSPI(CB,&Back[Index*SDBlockSize])!=SDRDY) break;
+		}
+		Ok=(Index==WIRECOUNT && WireCmds[17]==WIRECOUNT && WireNrData==WIRECOUNT && memcmp(Back,Data,sizeof(Data))==0);
+		memcpy(Saved,WireMiso,WireLen);
+		memcpy(SavedData,WireData,sizeof(SavedData));
+		SavedLen=WireLen;
+		SavedCmds=WireCmds[17];
+		WireReset(false);			//One CMD18 stream, STOP_TRAN while the card sends the next block
+		memset(Back,0,sizeof(Back));
+		BlkEncode(CB,WIRESTART);
+		Ok=Ok && WireReadBlocks(CB,Back,WIRECOUNT)==SDRDY && WireCmds[18]==1 && WireCmds[12]==1 &&
+			WireNrData>=WIRECOUNT && memcmp(Back,Data,sizeof(Data))==0;
+		for (Index=0;Index<WIRECOUNT && Ok;Index++) {
+			Ok=memcmp(&Saved[SavedData[Index]],&WireMiso[WireData[Index]],SDBlockSize+2)==0;
+		}
+		printf("read,%s,%d,%ld,%d,%ld,%s\n",Crc ? "on" : "off",SavedCmds,SavedLen,WireCmds[18]+WireCmds[12],WireLen,Ok ? "ok" : "wrong");
+		Result|=!Ok;
+	}
+
+	printf("check,result\n");			//CRC checking is still on
+	WireReset(false);
+	memset(Back,0,sizeof(Back));
+	WireBadRead=true;
+	BlkEncode(CB,WIRESTART);
+	Ok=WireReadBlocks(CB,Back,WIRECOUNT)==SDRDY && WireCmds[18]==2 && memcmp(Back,Data,sizeof(Data))==0;
+	printf("read crc error restarts CMD18,%s\n",Ok ? "ok" : "wrong");
+	Result|=!Ok;
+	WireReset(true);
+	WireBadWrite=true;
+	Ok=WireWriteBlocks(CB,Data,WIRECOUNT)==SDRDY && WireCmds[25]==2 && memcmp(WireCard[WIRESTART],Data,sizeof(Data))==0;
+	printf("write crc error restarts CMD25,%s\n",Ok ? "ok" : "wrong");
+	Result|=!Ok;
+	return Result;
+}